@@ -277,6 +277,8 @@ print_controller(struct nvme_controller *ctrlr, struct pci_device *pci_dev)
 	       cdata->oacs.format ? "Supported" : "Not Supported");
 	printf("Firmware Activate/Download:  %s\n",
 	       cdata->oacs.firmware ? "Supported" : "Not Supported");
+	printf("Doorbell Buffer Config:      %s\n",
+	       cdata->oacs.doorbell_buffer_config ? "Supported" : "Not Supported");
 	printf("Abort Command Limit:         %d\n", cdata->acl + 1);
 	printf("Async Event Request Limit:   %d\n", cdata->aerl + 1);
 	printf("Number of Firmware Slots:    ");
@@ -309,6 +311,12 @@ print_controller(struct nvme_controller *ctrlr, struct pci_device *pci_dev)
 	       cdata->oncs.write_unc ? "Supported" : "Not Supported");
 	printf("Dataset Management Command:  %s\n",
 	       cdata->oncs.dsm ? "Supported" : "Not Supported");
+	printf("Write Zeroes Command:        %s\n",
+	       cdata->oncs.write_zeroes ? "Supported" : "Not Supported");
+	printf("Verify Command:              %s\n",
+	       cdata->oncs.verify ? "Supported" : "Not Supported");
+	printf("Fused Compare and Write:     %s\n",
+	       cdata->fuses.compare_and_write ? "Supported" : "Not Supported");
 	printf("Volatile Write Cache:        %s\n",
 	       cdata->vwc.present ? "Present" : "Not Present");
 	printf("\n");
@@ -477,7 +485,7 @@ int main(int argc, char **argv)
 
 		pci_device_probe(pci_dev);
 
-		ctrlr = nvme_attach(pci_dev);
+		ctrlr = nvme_attach(pci_dev, NULL);
 		if (ctrlr == NULL) {
 			fprintf(stderr, "failed to attach to NVMe controller at PCI BDF %d:%d:%d\n",
 				pci_dev->bus, pci_dev->dev, pci_dev->func);
@@ -32,6 +32,7 @@
  */
 
 #include <stdio.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
@@ -90,9 +91,18 @@ struct ns_entry {
 struct ns_worker_ctx {
 	struct ns_entry		*entry;
 	uint64_t		io_completed;
+	uint64_t		total_tsc;
+	uint64_t		max_tsc;
+	uint64_t		sleep_us;
 	uint64_t		current_queue_depth;
 	uint64_t		offset_in_ios;
 	bool			is_draining;
+	bool			is_urgent;
+
+	/* I/O qpairs allocated by the worker thread, used round-robin */
+	struct nvme_qpair	**qpair;
+	int			num_qpairs;
+	int			last_qpair;
 
 #if HAVE_LIBAIO
 	struct io_event		*events;
@@ -104,6 +114,7 @@ struct ns_worker_ctx {
 struct perf_task {
 	struct ns_worker_ctx	*ns_ctx;
 	void			*buf;
+	uint64_t		submit_tsc;
 #if HAVE_LIBAIO
 	struct iocb		iocb;
 #endif
@@ -113,6 +124,7 @@ struct worker_thread {
 	struct ns_worker_ctx 	*ns_ctx;
 	struct worker_thread	*next;
 	unsigned		lcore;
+	bool			is_urgent;
 };
 
 struct rte_mempool *request_mempool;
@@ -132,6 +144,13 @@ static int g_is_random;
 static int g_queue_depth;
 static int g_time_in_sec;
 static uint32_t g_max_completions;
+static bool g_batch_doorbells;
+static bool g_batch_completions;
+static int g_num_qpairs;
+static bool g_shared_cq;
+static uint64_t g_urgent_core_mask;
+static int g_poll_latency_budget_us;
+static bool g_track_latency;
 
 static const char *g_core_mask;
 
@@ -305,14 +324,13 @@ static void io_complete(void *ctx, const struct nvme_completion *completion);
 static __thread unsigned int seed = 0;
 
 static void
-submit_single_io(struct ns_worker_ctx *ns_ctx)
+submit_single_io(struct ns_worker_ctx *ns_ctx, bool is_urgent)
 {
 	struct perf_task	*task = NULL;
 	uint64_t		offset_in_ios;
 	int			rc;
 	struct ns_entry		*entry = ns_ctx->entry;
-
-	static int queue_chooser = 0;
+	struct nvme_qpair	*qpair = NULL;
 
 	if (rte_mempool_get(task_pool, (void **)&task) != 0) {
 		fprintf(stderr, "task_pool rte_mempool_get failed\n");
@@ -320,6 +338,14 @@ submit_single_io(struct ns_worker_ctx *ns_ctx)
 	}
 
 	task->ns_ctx = ns_ctx;
+	task->submit_tsc = rte_get_timer_cycles();
+
+	if (entry->type == ENTRY_TYPE_NVME_NS) {
+		qpair = ns_ctx->qpair[ns_ctx->last_qpair];
+		if (++ns_ctx->last_qpair == ns_ctx->num_qpairs) {
+			ns_ctx->last_qpair = 0;
+		}
+	}
 
 	if (g_is_random) {
 		offset_in_ios = rand_r(&seed) % entry->size_in_ios;
@@ -330,7 +356,8 @@ submit_single_io(struct ns_worker_ctx *ns_ctx)
 		}
 	}
 
-	if ((g_rw_percentage == 100) ||
+	/* Latency-critical workers only read; the rest run the bulk workload. */
+	if (is_urgent || (g_rw_percentage == 100) ||
 	    (g_rw_percentage != 0 && ((rand_r(&seed) % 100) < g_rw_percentage))) {
 #if HAVE_LIBAIO
 		if (entry->type == ENTRY_TYPE_AIO_FILE) {
@@ -339,12 +366,9 @@ submit_single_io(struct ns_worker_ctx *ns_ctx)
 		} else
 #endif
 		{
-			//rc = nvme_ns_cmd_read(entry->u.nvme.ns, task->buf, offset_in_ios * entry->io_size_blocks,
-			//		      entry->io_size_blocks, io_complete, task);
-			// @yzy
-			rc = nvme_ns_cmd_read_by_id(entry->u.nvme.ns, task->buf, offset_in_ios * entry->io_size_blocks,
-					      entry->io_size_blocks, io_complete, task, queue_chooser);
-			queue_chooser = (queue_chooser + 1) % 2;
+			rc = nvme_ns_cmd_read(entry->u.nvme.ns, qpair, task->buf,
+					      offset_in_ios * entry->io_size_blocks,
+					      entry->io_size_blocks, io_complete, task, 0);
 		}
 	} else {
 #if HAVE_LIBAIO
@@ -354,12 +378,9 @@ submit_single_io(struct ns_worker_ctx *ns_ctx)
 		} else
 #endif
 		{
-			//rc = nvme_ns_cmd_write(entry->u.nvme.ns, task->buf, offset_in_ios * entry->io_size_blocks,
-			//		       entry->io_size_blocks, io_complete, task);
-			// @yzy
-			rc = nvme_ns_cmd_write_by_id(entry->u.nvme.ns, task->buf, offset_in_ios * entry->io_size_blocks,
-					       entry->io_size_blocks, io_complete, task, queue_chooser);
-			queue_chooser = (queue_chooser + 1) % 2;
+			rc = nvme_ns_cmd_write(entry->u.nvme.ns, qpair, task->buf,
+					       offset_in_ios * entry->io_size_blocks,
+					       entry->io_size_blocks, io_complete, task, 0);
 		}
 	}
 
@@ -374,11 +395,18 @@ static void
 task_complete(struct perf_task *task)
 {
 	struct ns_worker_ctx	*ns_ctx;
+	uint64_t		tsc_diff;
 
 	ns_ctx = task->ns_ctx;
 	ns_ctx->current_queue_depth--;
 	ns_ctx->io_completed++;
 
+	tsc_diff = rte_get_timer_cycles() - task->submit_tsc;
+	ns_ctx->total_tsc += tsc_diff;
+	if (tsc_diff > ns_ctx->max_tsc) {
+		ns_ctx->max_tsc = tsc_diff;
+	}
+
 	rte_mempool_put(task_pool, task);
 
 	/*
@@ -388,7 +416,7 @@ task_complete(struct perf_task *task)
 	 * the one just completed.
 	 */
 	if (!ns_ctx->is_draining) {
-		submit_single_io(ns_ctx);
+		submit_single_io(ns_ctx, ns_ctx->is_urgent);
 	}
 }
 
@@ -398,27 +426,81 @@ io_complete(void *ctx, const struct nvme_completion *completion)
 	task_complete((struct perf_task *)ctx);
 }
 
+static void
+io_complete_batch(void *ctx, const struct nvme_batch_cpl *cpls, uint32_t num_cpls)
+{
+	uint32_t i;
+
+	for (i = 0; i < num_cpls; i++) {
+		task_complete((struct perf_task *)cpls[i].cb_arg);
+	}
+}
+
+static void
+plug_qpairs(struct ns_worker_ctx *ns_ctx)
+{
+	int i;
+
+	for (i = 0; i < ns_ctx->num_qpairs; i++) {
+		nvme_qpair_plug(ns_ctx->qpair[i]);
+	}
+}
+
+static void
+unplug_qpairs(struct ns_worker_ctx *ns_ctx)
+{
+	int i;
+
+	for (i = 0; i < ns_ctx->num_qpairs; i++) {
+		nvme_qpair_unplug(ns_ctx->qpair[i]);
+	}
+}
+
 static void
 check_io(struct ns_worker_ctx *ns_ctx)
 {
+	int i;
+
 #if HAVE_LIBAIO
 	if (ns_ctx->entry->type == ENTRY_TYPE_AIO_FILE) {
 		aio_check_io(ns_ctx);
 	} else
 #endif
 	{
-		//nvme_ctrlr_process_io_completions(ns_ctx->entry->u.nvme.ctrlr, g_max_completions);
-		// @yzy
-		nvme_ctrlr_process_io_completions_by_id(ns_ctx->entry->u.nvme.ctrlr, g_max_completions, 0);
-		nvme_ctrlr_process_io_completions_by_id(ns_ctx->entry->u.nvme.ctrlr, g_max_completions, 1);
+		/*
+		 * Replacement I/O is submitted from the completion callbacks,
+		 *  so plugging here lets all of them share one doorbell write.
+		 */
+		if (g_batch_doorbells) {
+			plug_qpairs(ns_ctx);
+		}
+		if (g_shared_cq) {
+			/* Reaps the completions of every qpair of this namespace. */
+			nvme_qpair_poll(ns_ctx->qpair[0], g_max_completions);
+		} else {
+			for (i = 0; i < ns_ctx->num_qpairs; i++) {
+				nvme_qpair_poll(ns_ctx->qpair[i], g_max_completions);
+			}
+		}
+		if (g_batch_doorbells) {
+			unplug_qpairs(ns_ctx);
+		}
 	}
 }
 
 static void
 submit_io(struct ns_worker_ctx *ns_ctx, int queue_depth)
 {
+	bool plugged = g_batch_doorbells && ns_ctx->entry->type == ENTRY_TYPE_NVME_NS;
+
+	if (plugged) {
+		plug_qpairs(ns_ctx);
+	}
 	while (queue_depth-- > 0) {
-		submit_single_io(ns_ctx);
+		submit_single_io(ns_ctx, ns_ctx->is_urgent);
+	}
+	if (plugged) {
+		unplug_qpairs(ns_ctx);
 	}
 }
 
@@ -431,6 +513,82 @@ drain_io(struct ns_worker_ctx *ns_ctx)
 	}
 }
 
+static int
+init_ns_worker_ctx(struct ns_worker_ctx *ns_ctx)
+{
+	struct nvme_io_qpair_opts	opts;
+	struct nvme_poll_opts		poll_opts;
+	int				i;
+
+	if (ns_ctx->entry->type != ENTRY_TYPE_NVME_NS) {
+		return 0;
+	}
+
+	ns_ctx->qpair = calloc(g_num_qpairs, sizeof(struct nvme_qpair *));
+	if (ns_ctx->qpair == NULL) {
+		return -1;
+	}
+
+	nvme_io_qpair_opts_set_defaults(&opts);
+	nvme_poll_opts_set_defaults(&poll_opts);
+	if (g_poll_latency_budget_us > 0) {
+		poll_opts.mode = NVME_POLL_MODE_HYBRID;
+		poll_opts.latency_budget_us = g_poll_latency_budget_us;
+	}
+	if (g_urgent_core_mask != 0) {
+		opts.qprio = ns_ctx->is_urgent ? NVME_QPRIO_URGENT : NVME_QPRIO_LOW;
+	}
+	opts.track_latency = g_track_latency;
+
+	for (i = 0; i < g_num_qpairs; i++) {
+		if (g_shared_cq && i > 0) {
+			opts.shared_cq = ns_ctx->qpair[0];
+		}
+		ns_ctx->qpair[i] = nvme_ctrlr_alloc_io_qpair(ns_ctx->entry->u.nvme.ctrlr, &opts);
+		if (ns_ctx->qpair[i] == NULL) {
+			fprintf(stderr, "nvme_ctrlr_alloc_io_qpair() failed\n");
+			if (opts.qprio != NVME_QPRIO_MEDIUM &&
+			    !nvme_ctrlr_is_wrr_enabled(ns_ctx->entry->u.nvme.ctrlr)) {
+				fprintf(stderr, "-P requires weighted round robin arbitration\n");
+			}
+			return -1;
+		}
+		ns_ctx->num_qpairs++;
+
+		if (g_batch_completions) {
+			nvme_qpair_set_batch_callback(ns_ctx->qpair[i], io_complete_batch, NULL);
+		}
+		nvme_qpair_set_poll_opts(ns_ctx->qpair[i], &poll_opts);
+	}
+
+	return 0;
+}
+
+static void
+cleanup_ns_worker_ctx(struct ns_worker_ctx *ns_ctx)
+{
+	struct nvme_poll_stats	stats;
+	int			i;
+
+	/* Qpairs sharing a completion queue also share its polling counters. */
+	for (i = 0; i < ns_ctx->num_qpairs; i++) {
+		if (g_shared_cq && i > 0) {
+			break;
+		}
+		nvme_qpair_get_poll_stats(ns_ctx->qpair[i], &stats);
+		ns_ctx->sleep_us += stats.sleep_us;
+	}
+
+	/* Free in reverse, so qpair[0] no longer has its completion queue shared. */
+	for (i = ns_ctx->num_qpairs - 1; i >= 0; i--) {
+		nvme_ctrlr_free_io_qpair(ns_ctx->qpair[i]);
+	}
+	ns_ctx->num_qpairs = 0;
+
+	free(ns_ctx->qpair);
+	ns_ctx->qpair = NULL;
+}
+
 static int
 work_fn(void *arg)
 {
@@ -438,11 +596,23 @@ work_fn(void *arg)
 	struct worker_thread *worker = (struct worker_thread *)arg;
 	struct ns_worker_ctx *ns_ctx = NULL;
 
-	printf("Starting thread on core %u\n", worker->lcore);
+	printf("Starting thread on core %u%s\n", worker->lcore,
+	       worker->is_urgent ? " (urgent priority)" : "");
 
-	if (nvme_register_io_thread() != 0) {
-		fprintf(stderr, "nvme_register_io_thread() failed on core %u\n", worker->lcore);
-		return -1;
+	/* Allocate queue pairs for each namespace. */
+	ns_ctx = worker->ns_ctx;
+	while (ns_ctx != NULL) {
+		ns_ctx->is_urgent = worker->is_urgent;
+		if (init_ns_worker_ctx(ns_ctx) != 0) {
+			fprintf(stderr, "init_ns_worker_ctx() failed on core %u\n", worker->lcore);
+			ns_ctx = worker->ns_ctx;
+			while (ns_ctx != NULL) {
+				cleanup_ns_worker_ctx(ns_ctx);
+				ns_ctx = ns_ctx->next;
+			}
+			return -1;
+		}
+		ns_ctx = ns_ctx->next;
 	}
 
 	/* Submit initial I/O for each namespace. */
@@ -472,10 +642,11 @@ work_fn(void *arg)
 	ns_ctx = worker->ns_ctx;
 	while (ns_ctx != NULL) {
 		drain_io(ns_ctx);
+		cleanup_ns_worker_ctx(ns_ctx);
 		ns_ctx = ns_ctx->next;
 	}
 
-	nvme_unregister_io_thread();
+	nvme_request_cache_flush();
 
 	return 0;
 }
@@ -497,12 +668,112 @@ static void usage(char *program_name)
 	printf("\t\t(default: 1)]\n");
 	printf("\t[-m max completions per poll]\n");
 	printf("\t\t(default: 0 - unlimited)\n");
+	printf("\t[-b batch submission queue doorbell writes]\n");
+	printf("\t[-B deliver completions through a batch callback]\n");
+	printf("\t[-Q number of I/O qpairs per namespace per core]\n");
+	printf("\t\t(default: 1)\n");
+	printf("\t[-S share one completion queue among the qpairs of each namespace]\n");
+	printf("\t[-H hybrid polling latency budget in microseconds]\n");
+	printf("\t\t(default: 0 - busy polling)\n");
+	printf("\t[-P core mask for urgent priority reads, other cores use low priority]\n");
+	printf("\t\t(requires weighted round robin arbitration)\n");
+	printf("\t[-L print read and write latency percentiles]\n");
+}
+
+static void
+print_io_qpair_stats(void)
+{
+	struct ctrlr_entry	*ctrlr_entry;
+	struct nvme_qpair_stats	stats;
+
+	printf("\n");
+	ctrlr_entry = g_controllers;
+	while (ctrlr_entry) {
+		nvme_ctrlr_get_io_qpair_stats(ctrlr_entry->ctrlr, &stats);
+		printf("%-43.43s: SQ %" PRIu64 " cmds / %" PRIu64 " doorbells,"
+		       " CQ %" PRIu64 " cpls / %" PRIu64 " doorbells\n",
+		       ctrlr_entry->name, stats.submitted, stats.sq_doorbell_writes,
+		       stats.completed, stats.cq_doorbell_writes);
+		printf("%-43.43s  %" PRIu64 " retries, %" PRIu64 " queued, max %" PRIu64
+		       " outstanding, %" PRIu64 " empty polls\n",
+		       "", stats.retries, stats.queued_reqs, stats.max_outstanding,
+		       stats.empty_polls);
+		ctrlr_entry = ctrlr_entry->next;
+	}
+}
+
+static void
+print_latency_percentile(const char *name, const char *io_type, const struct histogram *hist)
+{
+	static const double percentiles[] = { 50.0, 99.0, 99.99 };
+	unsigned i;
+
+	if (histogram_count(hist) == 0) {
+		return;
+	}
+
+	printf("%-36.36s %-6s:", name, io_type);
+	for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+		printf(" %10.2f us p%g", (float)histogram_percentile(hist, percentiles[i]) *
+		       1000 * 1000 / g_tsc_rate, percentiles[i]);
+	}
+	printf("\n");
+}
+
+static void
+print_latency_percentiles(void)
+{
+	struct ctrlr_entry	*ctrlr_entry;
+	struct histogram	*hist;
+
+	hist = malloc(sizeof(*hist));
+	if (hist == NULL) {
+		return;
+	}
+
+	printf("\n");
+	ctrlr_entry = g_controllers;
+	while (ctrlr_entry) {
+		histogram_reset(hist);
+		nvme_ctrlr_merge_io_latency_histogram(ctrlr_entry->ctrlr, NVME_OPC_READ, hist);
+		print_latency_percentile(ctrlr_entry->name, "reads", hist);
+
+		histogram_reset(hist);
+		nvme_ctrlr_merge_io_latency_histogram(ctrlr_entry->ctrlr, NVME_OPC_WRITE, hist);
+		print_latency_percentile(ctrlr_entry->name, "writes", hist);
+
+		ctrlr_entry = ctrlr_entry->next;
+	}
+
+	free(hist);
+}
+
+static void
+print_cpu_usage(void)
+{
+	struct worker_thread	*worker;
+	struct ns_worker_ctx	*ns_ctx;
+	uint64_t		sleep_us;
+
+	printf("\n");
+	worker = g_workers;
+	while (worker) {
+		sleep_us = 0;
+		ns_ctx = worker->ns_ctx;
+		while (ns_ctx) {
+			sleep_us += ns_ctx->sleep_us;
+			ns_ctx = ns_ctx->next;
+		}
+		printf("Core %u: %6.2f%% busy polling\n", worker->lcore,
+		       100.0 - (float)sleep_us * 100 / ((uint64_t)g_time_in_sec * 1000 * 1000));
+		worker = worker->next;
+	}
 }
 
 static void
 print_stats(void)
 {
-	float io_per_second, mb_per_second;
+	float io_per_second, mb_per_second, average_latency, max_latency;
 	float total_io_per_second, total_mb_per_second;
 	struct worker_thread	*worker;
 	struct ns_worker_ctx	*ns_ctx;
@@ -516,9 +787,18 @@ print_stats(void)
 		while (ns_ctx) {
 			io_per_second = (float)ns_ctx->io_completed / g_time_in_sec;
 			mb_per_second = io_per_second * g_io_size_bytes / (1024 * 1024);
-			printf("%-43.43s from core %u: %10.2f IO/s %10.2f MB/s\n",
+			average_latency = 0;
+			if (ns_ctx->io_completed != 0) {
+				average_latency = (float)ns_ctx->total_tsc / ns_ctx->io_completed *
+						  1000 * 1000 / g_tsc_rate;
+			}
+			max_latency = (float)ns_ctx->max_tsc * 1000 * 1000 / g_tsc_rate;
+			printf("%-43.43s from core %u%c: %10.2f IO/s %10.2f MB/s"
+			       " %10.2f us avg %10.2f us max\n",
 			       ns_ctx->entry->name, worker->lcore,
-			       io_per_second, mb_per_second);
+			       worker->is_urgent ? '*' : ' ',
+			       io_per_second, mb_per_second,
+			       average_latency, max_latency);
 			total_io_per_second += io_per_second;
 			total_mb_per_second += mb_per_second;
 			ns_ctx = ns_ctx->next;
@@ -526,8 +806,21 @@ print_stats(void)
 		worker = worker->next;
 	}
 	printf("========================================================\n");
-	printf("%-55s: %10.2f IO/s %10.2f MB/s\n",
+	printf("%-56s: %10.2f IO/s %10.2f MB/s\n",
 	       "Total", total_io_per_second, total_mb_per_second);
+	if (g_urgent_core_mask != 0) {
+		printf("(* urgent priority)\n");
+	}
+
+	if (g_poll_latency_budget_us > 0) {
+		print_cpu_usage();
+	}
+
+	if (g_track_latency) {
+		print_latency_percentiles();
+	}
+
+	print_io_qpair_stats();
 }
 
 static int
@@ -545,9 +838,22 @@ parse_args(int argc, char **argv)
 	g_rw_percentage = -1;
 	g_core_mask = NULL;
 	g_max_completions = 0;
-
-	while ((op = getopt(argc, argv, "c:m:q:s:t:w:M:")) != -1) {
+	g_batch_doorbells = false;
+	g_batch_completions = false;
+	g_num_qpairs = 1;
+	g_shared_cq = false;
+	g_urgent_core_mask = 0;
+	g_poll_latency_budget_us = 0;
+	g_track_latency = false;
+
+	while ((op = getopt(argc, argv, "bBc:m:q:s:t:w:H:LM:P:Q:S")) != -1) {
 		switch (op) {
+		case 'b':
+			g_batch_doorbells = true;
+			break;
+		case 'B':
+			g_batch_completions = true;
+			break;
 		case 'c':
 			g_core_mask = optarg;
 			break;
@@ -566,10 +872,25 @@ parse_args(int argc, char **argv)
 		case 'w':
 			workload_type = optarg;
 			break;
+		case 'L':
+			g_track_latency = true;
+			break;
 		case 'M':
 			g_rw_percentage = atoi(optarg);
 			mix_specified = true;
 			break;
+		case 'H':
+			g_poll_latency_budget_us = atoi(optarg);
+			break;
+		case 'P':
+			g_urgent_core_mask = strtoull(optarg, NULL, 16);
+			break;
+		case 'Q':
+			g_num_qpairs = atoi(optarg);
+			break;
+		case 'S':
+			g_shared_cq = true;
+			break;
 		default:
 			usage(argv[0]);
 			return 1;
@@ -592,6 +913,10 @@ parse_args(int argc, char **argv)
 		usage(argv[0]);
 		return 1;
 	}
+	if (g_num_qpairs < 1) {
+		usage(argv[0]);
+		return 1;
+	}
 
 	if (strcmp(workload_type, "read") &&
 	    strcmp(workload_type, "write") &&
@@ -663,6 +988,7 @@ register_workers(void)
 
 	memset(worker, 0, sizeof(struct worker_thread));
 	worker->lcore = rte_get_master_lcore();
+	worker->is_urgent = worker->lcore < 64 && (g_urgent_core_mask & (1ULL << worker->lcore));
 
 	g_workers = worker;
 	g_num_workers = 1;
@@ -677,6 +1003,7 @@ register_workers(void)
 
 		memset(worker, 0, sizeof(struct worker_thread));
 		worker->lcore = lcore;
+		worker->is_urgent = lcore < 64 && (g_urgent_core_mask & (1ULL << lcore));
 		prev_worker->next = worker;
 		g_num_workers++;
 	}
@@ -690,6 +1017,7 @@ register_controllers(void)
 	struct pci_device_iterator	*pci_dev_iter;
 	struct pci_device		*pci_dev;
 	struct pci_id_match		match;
+	struct nvme_ctrlr_opts		opts;
 	int				rc;
 
 	printf("Initializing NVMe Controllers\n");
@@ -705,6 +1033,15 @@ register_controllers(void)
 
 	pci_dev_iter = pci_id_match_iterator_create(&match);
 
+	/* Make room for the whole queue depth in each I/O queue. */
+	nvme_ctrlr_opts_set_defaults(&opts);
+	if ((uint32_t)g_queue_depth > opts.io_queue_requests) {
+		opts.io_queue_requests = g_queue_depth;
+		if (opts.io_queue_size <= opts.io_queue_requests) {
+			opts.io_queue_size = opts.io_queue_requests + 1;
+		}
+	}
+
 	rc = 0;
 	while ((pci_dev = pci_device_next(pci_dev_iter))) {
 		struct nvme_controller *ctrlr;
@@ -719,7 +1056,7 @@ register_controllers(void)
 
 		pci_device_probe(pci_dev);
 
-		ctrlr = nvme_attach(pci_dev);
+		ctrlr = nvme_attach(pci_dev, &opts);
 		if (ctrlr == NULL) {
 			fprintf(stderr, "nvme_attach failed for controller at pci bdf %d:%d:%d\n",
 				pci_dev->bus, pci_dev->dev, pci_dev->func);
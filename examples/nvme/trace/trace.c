@@ -0,0 +1,413 @@
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright(c) 2010-2015 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Offline decoder for the NVMe driver's trace buffer (see nvme_trace_enable()).
+ *
+ * Merges the events of all rings in time order and prints them, with the
+ *  latency of each command on its completion and the number of commands
+ *  outstanding on its queue after each event, followed by a summary per
+ *  queue.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "spdk/nvme_trace.h"
+
+struct trace_event {
+	struct nvme_trace_entry	entry;
+	uint32_t		ring;
+	/** Position in the ring, to keep events with equal timestamps in order */
+	uint32_t		seq;
+};
+
+#define TSC_UNKNOWN	UINT64_MAX
+
+struct queue_info {
+	uint16_t		ctrlr_id;
+	uint16_t		qid;
+	/**
+	 * Submission timestamp of each outstanding command by cid, 0 if none,
+	 *  or TSC_UNKNOWN if its submission was overwritten before it was retried.
+	 */
+	uint64_t		*submit_tsc;
+	uint32_t		outstanding;
+	uint32_t		max_outstanding;
+	uint64_t		num_completed;
+	/** Completions whose submission was still in the trace */
+	uint64_t		num_timed;
+	uint64_t		num_queued;
+	uint64_t		num_retries;
+	uint64_t		total_latency_tsc;
+	uint64_t		max_latency_tsc;
+};
+
+static struct queue_info	*g_queues;
+static uint32_t			g_num_queues;
+static uint64_t			g_tsc_hz;
+static bool			g_summary_only;
+
+static const char *
+event_type_str(uint8_t type)
+{
+	switch (type) {
+	case NVME_TRACE_SUBMIT:
+		return "submit";
+	case NVME_TRACE_COMPLETE:
+		return "complete";
+	case NVME_TRACE_QUEUE:
+		return "queue";
+	case NVME_TRACE_RETRY:
+		return "retry";
+	case NVME_TRACE_DELAY:
+		return "delay";
+	default:
+		return "unknown";
+	}
+}
+
+static double
+tsc_to_us(uint64_t tsc)
+{
+	return (double)tsc * 1000 * 1000 / g_tsc_hz;
+}
+
+static struct queue_info *
+get_queue(uint16_t ctrlr_id, uint16_t qid)
+{
+	struct queue_info	*queues, *queue;
+	uint32_t		i;
+
+	for (i = 0; i < g_num_queues; i++) {
+		if (g_queues[i].ctrlr_id == ctrlr_id && g_queues[i].qid == qid) {
+			return &g_queues[i];
+		}
+	}
+
+	queues = realloc(g_queues, (g_num_queues + 1) * sizeof(*queues));
+	if (queues == NULL) {
+		return NULL;
+	}
+	g_queues = queues;
+
+	queue = &g_queues[g_num_queues];
+	memset(queue, 0, sizeof(*queue));
+	queue->ctrlr_id = ctrlr_id;
+	queue->qid = qid;
+	queue->submit_tsc = calloc(UINT16_MAX + 1, sizeof(uint64_t));
+	if (queue->submit_tsc == NULL) {
+		return NULL;
+	}
+	g_num_queues++;
+
+	return queue;
+}
+
+static int
+event_cmp(const void *a, const void *b)
+{
+	const struct trace_event *ea = a, *eb = b;
+
+	if (ea->entry.tsc != eb->entry.tsc) {
+		return ea->entry.tsc < eb->entry.tsc ? -1 : 1;
+	}
+	if (ea->ring != eb->ring) {
+		return ea->ring < eb->ring ? -1 : 1;
+	}
+	return ea->seq < eb->seq ? -1 : (ea->seq > eb->seq);
+}
+
+/*
+ * Copy the valid events out of every ring.  Rings that filled up have
+ *  overwritten their oldest events, so only the last num_entries remain.
+ */
+static struct trace_event *
+load_events(const struct nvme_trace_header *trace, uint64_t *num_events)
+{
+	const struct nvme_trace_ring	*ring;
+	struct trace_event		*events;
+	uint32_t			num_rings, i;
+	uint64_t			head, first, j, n = 0;
+
+	num_rings = trace->num_rings_used < trace->num_rings ?
+		    trace->num_rings_used : trace->num_rings;
+
+	events = calloc((size_t)num_rings * trace->num_entries + 1, sizeof(*events));
+	if (events == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < num_rings; i++) {
+		ring = nvme_trace_get_ring(trace, i);
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		first = head > trace->num_entries ? head - trace->num_entries : 0;
+		for (j = first; j < head; j++) {
+			events[n].entry = ring->entries[j & (trace->num_entries - 1)];
+			events[n].ring = i;
+			events[n].seq = (uint32_t)(j - first);
+			n++;
+		}
+		printf("Ring %u: thread %u, %" PRIu64 " events, %" PRIu64 " overwritten\n",
+		       i, ring->thread_id, head, first);
+	}
+	if (trace->num_rings_used > trace->num_rings) {
+		printf("%u threads were not traced, all rings were in use\n",
+		       trace->num_rings_used - trace->num_rings);
+	}
+
+	qsort(events, n, sizeof(*events), event_cmp);
+	*num_events = n;
+	return events;
+}
+
+static void
+decode_event(const struct trace_event *event, uint64_t start_tsc)
+{
+	const struct nvme_trace_entry	*entry = &event->entry;
+	struct queue_info		*queue;
+	uint64_t			latency_tsc = 0;
+	bool				has_latency = false;
+
+	queue = get_queue(entry->ctrlr_id, entry->qid);
+	if (queue == NULL) {
+		return;
+	}
+
+	/*
+	 * Commands whose submission was overwritten before the trace was read
+	 *  are not counted as outstanding, and their latency is unknown.
+	 */
+	switch (entry->type) {
+	case NVME_TRACE_SUBMIT:
+		/* Resubmission after a retry keeps the original submission time. */
+		if (queue->submit_tsc[entry->cid] == 0) {
+			queue->submit_tsc[entry->cid] = entry->tsc;
+			queue->outstanding++;
+		}
+		break;
+	case NVME_TRACE_COMPLETE:
+		if (queue->submit_tsc[entry->cid] != 0) {
+			if (queue->submit_tsc[entry->cid] != TSC_UNKNOWN) {
+				latency_tsc = entry->tsc - queue->submit_tsc[entry->cid];
+				has_latency = true;
+				queue->num_timed++;
+				queue->total_latency_tsc += latency_tsc;
+				if (latency_tsc > queue->max_latency_tsc) {
+					queue->max_latency_tsc = latency_tsc;
+				}
+			}
+			queue->submit_tsc[entry->cid] = 0;
+			queue->outstanding--;
+		}
+		queue->num_completed++;
+		break;
+	case NVME_TRACE_QUEUE:
+		queue->num_queued++;
+		break;
+	case NVME_TRACE_RETRY:
+		if (queue->submit_tsc[entry->cid] == 0) {
+			queue->submit_tsc[entry->cid] = TSC_UNKNOWN;
+			queue->outstanding++;
+		}
+		queue->num_retries++;
+		break;
+	case NVME_TRACE_DELAY:
+		/* The command ID is released; the resubmission gets a new one. */
+		if (queue->submit_tsc[entry->cid] != 0) {
+			queue->submit_tsc[entry->cid] = 0;
+			queue->outstanding--;
+		}
+		queue->num_retries++;
+		break;
+	}
+
+	if (queue->outstanding > queue->max_outstanding) {
+		queue->max_outstanding = queue->outstanding;
+	}
+
+	if (g_summary_only) {
+		return;
+	}
+
+	printf("%14.3f %2u %5u %5u %-8s 0x%02x", tsc_to_us(entry->tsc - start_tsc), event->ring,
+	       entry->ctrlr_id, entry->qid, event_type_str(entry->type), entry->opc);
+	if (entry->cid != 0xFFFF) {
+		printf(" %5u", entry->cid);
+	} else {
+		printf(" %5s", "-");
+	}
+	if (entry->num_blocks != 0) {
+		printf(" %14" PRIu64 " %6u", entry->lba, entry->num_blocks);
+	} else {
+		printf(" %14s %6s", "-", "-");
+	}
+	if (has_latency) {
+		printf(" %12.3f", tsc_to_us(latency_tsc));
+	} else {
+		printf(" %12s", "-");
+	}
+	printf(" %5u", queue->outstanding);
+	if (entry->type == NVME_TRACE_COMPLETE || entry->type == NVME_TRACE_RETRY ||
+	    entry->type == NVME_TRACE_DELAY) {
+		printf(" sct 0x%x sc 0x%02x", entry->status >> 8, entry->status & 0xFF);
+	}
+	printf("\n");
+}
+
+static void
+print_summary(void)
+{
+	struct queue_info	*queue;
+	uint32_t		i;
+
+	printf("\n%5s %5s %12s %12s %12s %8s %8s %8s\n", "ctrlr", "qid", "completed",
+	       "avg lat us", "max lat us", "max qd", "queued", "retries");
+	for (i = 0; i < g_num_queues; i++) {
+		queue = &g_queues[i];
+		printf("%5u %5u %12" PRIu64 " %12.3f %12.3f %8u %8" PRIu64 " %8" PRIu64 "\n",
+		       queue->ctrlr_id, queue->qid, queue->num_completed,
+		       queue->num_timed ? tsc_to_us(queue->total_latency_tsc) / queue->num_timed : 0.0,
+		       tsc_to_us(queue->max_latency_tsc), queue->max_outstanding,
+		       queue->num_queued, queue->num_retries);
+	}
+}
+
+static void
+usage(char *program_name)
+{
+	printf("%s options\n", program_name);
+	printf("\t[-s shared memory object name passed to nvme_trace_enable()]\n");
+	printf("\t[-f trace file, such as a copy of /dev/shm/<name>]\n");
+	printf("\t[-S print only the per-queue summary]\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char			*shm_name = NULL, *file_name = NULL;
+	struct nvme_trace_header	*trace;
+	struct trace_event		*events;
+	struct stat			st;
+	uint64_t			num_events, i;
+	int				op, fd;
+
+	while ((op = getopt(argc, argv, "f:s:S")) != -1) {
+		switch (op) {
+		case 'f':
+			file_name = optarg;
+			break;
+		case 's':
+			shm_name = optarg;
+			break;
+		case 'S':
+			g_summary_only = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if ((shm_name == NULL) == (file_name == NULL)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (shm_name != NULL) {
+		fd = shm_open(shm_name, O_RDONLY, 0);
+	} else {
+		fd = open(file_name, O_RDONLY);
+	}
+	if (fd < 0) {
+		fprintf(stderr, "could not open %s: %s\n", shm_name ? shm_name : file_name,
+			strerror(errno));
+		return 1;
+	}
+
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*trace)) {
+		fprintf(stderr, "trace is truncated\n");
+		close(fd);
+		return 1;
+	}
+
+	trace = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (trace == MAP_FAILED) {
+		fprintf(stderr, "could not map trace: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (trace->magic != NVME_TRACE_MAGIC || trace->version != NVME_TRACE_VERSION ||
+	    trace->num_entries == 0 || (trace->num_entries & (trace->num_entries - 1)) != 0 ||
+	    (size_t)st.st_size < nvme_trace_size(trace->num_rings, trace->num_entries)) {
+		fprintf(stderr, "not an NVMe trace, or of an unsupported version\n");
+		munmap(trace, st.st_size);
+		return 1;
+	}
+
+	g_tsc_hz = trace->tsc_hz;
+	events = load_events(trace, &num_events);
+	if (events == NULL) {
+		fprintf(stderr, "could not allocate events\n");
+		munmap(trace, st.st_size);
+		return 1;
+	}
+
+	if (!g_summary_only) {
+		printf("\n%14s %2s %5s %5s %-8s %4s %5s %14s %6s %12s %5s\n", "time us", "rg",
+		       "ctrlr", "qid", "event", "opc", "cid", "lba", "blocks", "latency us", "qd");
+	}
+	for (i = 0; i < num_events; i++) {
+		decode_event(&events[i], events[0].entry.tsc);
+	}
+
+	print_summary();
+
+	for (i = 0; i < g_num_queues; i++) {
+		free(g_queues[i].submit_tsc);
+	}
+	free(g_queues);
+	free(events);
+	munmap(trace, st.st_size);
+
+	return 0;
+}
@@ -0,0 +1,206 @@
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright(c) 2015 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/** \file
+ * Log-linear histogram of 64-bit values, such as command latencies.
+ *
+ * Values are grouped into ranges by their most significant bit, and
+ *  each range is split into HISTOGRAM_BUCKETS_PER_RANGE equal buckets,
+ *  so any value is counted in a bucket no wider than 1/32 of the value.
+ *  Tallying a value is a few instructions and never allocates memory,
+ *  so it is suitable for the I/O path.
+ */
+
+#ifndef SPDK_HISTOGRAM_H
+#define SPDK_HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define HISTOGRAM_BUCKET_SHIFT		5
+#define HISTOGRAM_BUCKETS_PER_RANGE	(1ULL << HISTOGRAM_BUCKET_SHIFT)
+#define HISTOGRAM_BUCKET_MASK		(HISTOGRAM_BUCKETS_PER_RANGE - 1)
+
+/*
+ * Range 0 holds values below HISTOGRAM_BUCKETS_PER_RANGE one per bucket.
+ *  Range r > 0 holds values whose most significant bit is
+ *  HISTOGRAM_BUCKET_SHIFT + r - 1.
+ */
+#define HISTOGRAM_NUM_RANGES		(64 - HISTOGRAM_BUCKET_SHIFT + 1)
+
+struct histogram {
+	uint64_t	bucket[HISTOGRAM_NUM_RANGES][HISTOGRAM_BUCKETS_PER_RANGE];
+};
+
+static inline void
+histogram_reset(struct histogram *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+static inline uint32_t
+_histogram_get_range(uint64_t value)
+{
+	uint32_t msb;
+
+	if (value < HISTOGRAM_BUCKETS_PER_RANGE) {
+		return 0;
+	}
+
+	msb = 63 - __builtin_clzll(value);
+	return msb - HISTOGRAM_BUCKET_SHIFT + 1;
+}
+
+static inline uint32_t
+_histogram_get_index(uint32_t range, uint64_t value)
+{
+	if (range == 0) {
+		return (uint32_t)value;
+	}
+
+	return (uint32_t)(value >> (range - 1)) & HISTOGRAM_BUCKET_MASK;
+}
+
+/**
+ * \brief Return the smallest value counted in the given bucket.
+ */
+static inline uint64_t
+histogram_bucket_start(uint32_t range, uint32_t index)
+{
+	if (range == 0) {
+		return index;
+	}
+
+	return (HISTOGRAM_BUCKETS_PER_RANGE + index) << (range - 1);
+}
+
+/**
+ * \brief Return the largest value counted in the given bucket.
+ */
+static inline uint64_t
+histogram_bucket_end(uint32_t range, uint32_t index)
+{
+	if (range == 0) {
+		return index;
+	}
+
+	return histogram_bucket_start(range, index) + (1ULL << (range - 1)) - 1;
+}
+
+/**
+ * \brief Count one occurrence of value.
+ */
+static inline void
+histogram_tally(struct histogram *h, uint64_t value)
+{
+	uint32_t range = _histogram_get_range(value);
+
+	h->bucket[range][_histogram_get_index(range, value)]++;
+}
+
+/**
+ * \brief Add all values counted in src to dst.
+ */
+static inline void
+histogram_merge(struct histogram *dst, const struct histogram *src)
+{
+	uint32_t i, j;
+
+	for (i = 0; i < HISTOGRAM_NUM_RANGES; i++) {
+		for (j = 0; j < HISTOGRAM_BUCKETS_PER_RANGE; j++) {
+			dst->bucket[i][j] += src->bucket[i][j];
+		}
+	}
+}
+
+/**
+ * \brief Return the number of values counted.
+ */
+static inline uint64_t
+histogram_count(const struct histogram *h)
+{
+	uint64_t count = 0;
+	uint32_t i, j;
+
+	for (i = 0; i < HISTOGRAM_NUM_RANGES; i++) {
+		for (j = 0; j < HISTOGRAM_BUCKETS_PER_RANGE; j++) {
+			count += h->bucket[i][j];
+		}
+	}
+
+	return count;
+}
+
+/**
+ * \brief Return the value at the given percentile (0.0 to 100.0).
+ *
+ * The result is the largest value of the bucket holding the value at that
+ *  rank, so it overestimates by less than 1/32 of the true value.  Returns
+ *  0 if no values have been counted.
+ */
+static inline uint64_t
+histogram_percentile(const struct histogram *h, double percentile)
+{
+	uint64_t count = histogram_count(h);
+	uint64_t rank, so_far = 0;
+	uint32_t i, j;
+
+	if (count == 0) {
+		return 0;
+	}
+
+	if (percentile >= 100.0) {
+		rank = count;
+	} else if (percentile <= 0.0) {
+		rank = 1;
+	} else {
+		/* Round up, so p50 of two values is the first one. */
+		rank = (uint64_t)(count * percentile / 100.0);
+		if ((double)rank < count * percentile / 100.0 || rank == 0) {
+			rank++;
+		}
+	}
+
+	for (i = 0; i < HISTOGRAM_NUM_RANGES; i++) {
+		for (j = 0; j < HISTOGRAM_BUCKETS_PER_RANGE; j++) {
+			so_far += h->bucket[i][j];
+			if (so_far >= rank) {
+				return histogram_bucket_end(i, j);
+			}
+		}
+	}
+
+	return histogram_bucket_end(HISTOGRAM_NUM_RANGES - 1, HISTOGRAM_BUCKET_MASK);
+}
+
+#endif
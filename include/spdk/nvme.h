@@ -34,7 +34,9 @@
 #ifndef SPDK_NVME_H
 #define SPDK_NVME_H
 
+#include <stdbool.h>
 #include <stddef.h>
+#include "histogram.h"
 #include "nvme_spec.h"
 
 /** \file
@@ -44,6 +46,30 @@
 #define NVME_DEFAULT_RETRY_COUNT	(4)
 extern int32_t		nvme_retry_count;
 
+/**
+ * Number of completions reaped between completion queue head doorbell writes.
+ *  0 means the doorbell is written only once, at the end of each call to
+ *  process completions.
+ */
+#define NVME_DEFAULT_CQ_DOORBELL_THRESHOLD	(0)
+extern uint32_t		nvme_cq_doorbell_threshold;
+
+/**
+ * Number of free nvme_request objects each thread keeps for reuse, instead of
+ *  returning them to the nvme_alloc_request() pool.  At most
+ *  NVME_REQUEST_CACHE_MAX_SIZE; 0 disables the cache.
+ */
+#define NVME_DEFAULT_REQUEST_CACHE_SIZE		(128)
+#define NVME_REQUEST_CACHE_MAX_SIZE		(512)
+extern uint32_t		nvme_request_cache_size;
+
+/**
+ * Number of requests moved between a thread's cache and the pool at once, when
+ *  the cache runs empty or full.  Clamped to [1, nvme_request_cache_size].
+ */
+#define NVME_DEFAULT_REQUEST_CACHE_BATCH	(32)
+extern uint32_t		nvme_request_cache_batch;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -51,6 +77,119 @@ extern "C" {
 /** \brief Opaque handle to a controller. Obtained by calling nvme_attach(). */
 struct nvme_controller;
 
+/**
+ * \brief Interrupt backend, routing interrupt vectors of a controller to eventfds.
+ *
+ * Routing an MSI-X vector to an eventfd depends on how the device is bound, e.g.
+ * VFIO_DEVICE_SET_IRQS for a device bound to vfio-pci, so it is supplied by the
+ * environment through nvme_ctrlr_opts::intr_ops.  A simulated device can instead
+ * write to the eventfd itself after posting a completion.
+ */
+struct nvme_intr_ops {
+	/**
+	 * Signal efd each time the device raises interrupt vector number vector.
+	 *
+	 * \return 0 on success, or a positive errno value.
+	 */
+	int	(*bind_vector)(void *ctx, void *devhandle, uint16_t vector, int efd);
+
+	/**
+	 * Stop signaling the eventfd bound to vector.  The driver closes the eventfd
+	 * after this returns.
+	 */
+	void	(*unbind_vector)(void *ctx, void *devhandle, uint16_t vector);
+};
+
+/**
+ * Classes of retryable completion status, each with its own retry backoff (see
+ * nvme_ctrlr_opts::retry_backoff_us).
+ */
+enum nvme_retry_class {
+	/** Aborted by Request, such as commands aborted after a timeout or by a reset */
+	NVME_RETRY_CLASS_ABORTED = 0,
+	/** Namespace Not Ready, while the namespace is becoming available */
+	NVME_RETRY_CLASS_NAMESPACE_NOT_READY,
+	NVME_RETRY_CLASS_COUNT,
+};
+
+/**
+ * \brief Controller options, passed to nvme_attach().
+ *
+ * Initialize with nvme_ctrlr_opts_set_defaults() before changing individual fields,
+ * so that fields added in the future get sensible values.
+ */
+struct nvme_ctrlr_opts {
+	/**
+	 * Number of entries in each I/O submission and completion queue.
+	 *
+	 * Clamped to the controller's maximum queue size (CAP.MQES + 1), and to at
+	 * least 5 where the controller allows it.
+	 */
+	uint32_t	io_queue_size;
+
+	/**
+	 * Maximum number of commands outstanding on each I/O queue at once.
+	 *
+	 * Each outstanding command needs a tracker with its own PRP list, so this
+	 * determines the per-queue memory footprint.  Clamped to io_queue_size - 1,
+	 * since a queue of N entries can hold at most N - 1 commands, and to at least
+	 * 4, so that a fused pair always fits.  Requests submitted beyond this limit
+	 * are queued in software until a command completes.
+	 */
+	uint32_t	io_queue_requests;
+
+	/**
+	 * Select weighted round robin arbitration with urgent priority class if the
+	 * controller supports it (CAP.AMS), so that I/O queue pairs can be given a
+	 * priority with nvme_io_qpair_opts::qprio.  Otherwise, and on controllers
+	 * without weighted round robin, all submission queues are serviced round robin.
+	 */
+	bool		enable_wrr;
+
+	/**
+	 * Weighted round robin weights of the high, medium and low priority classes,
+	 * from 1 to 256.  A class with weight N may have up to N commands fetched per
+	 * arbitration round.  Urgent queues are always serviced first and have no weight.
+	 */
+	uint32_t	high_priority_weight;
+	uint32_t	medium_priority_weight;
+	uint32_t	low_priority_weight;
+
+	/**
+	 * Interrupt backend used by I/O queue pairs allocated with
+	 * nvme_io_qpair_opts::enable_interrupts, or NULL (the default) if interrupts
+	 * are not available.  intr_ctx is passed to each of its callbacks.
+	 */
+	const struct nvme_intr_ops	*intr_ops;
+	void				*intr_ctx;
+
+	/**
+	 * Seconds an I/O command may be outstanding before it is aborted, from 5 to
+	 * 120, or 0 to never time out commands.  If an aborted command is still
+	 * outstanding one timeout period later, the callback registered with
+	 * nvme_ctrlr_register_timeout_callback() is invoked so that the application
+	 * can reset the controller.  Timeouts have a resolution of a quarter second
+	 * and are checked by nvme_qpair_process_completions().
+	 */
+	uint32_t			timeout_sec;
+
+	/**
+	 * Microseconds to wait before resubmitting a command that completed with a
+	 * retryable status, indexed by enum nvme_retry_class.  Doubled for each further
+	 * retry of the same command, up to one second.  A waiting command gives up its
+	 * queue slot to other I/O, and is resubmitted by
+	 * nvme_qpair_process_completions() once due.  0 resubmits the command at once
+	 * in the same queue slot.  Defaults to 0 for aborted commands and 1 ms for a
+	 * namespace that is not ready.
+	 */
+	uint32_t			retry_backoff_us[NVME_RETRY_CLASS_COUNT];
+};
+
+/**
+ * \brief Fill in opts with the default controller options.
+ */
+void nvme_ctrlr_opts_set_defaults(struct nvme_ctrlr_opts *opts);
+
 /**
  * \brief Attaches specified device to the NVMe driver.
  *
@@ -62,8 +201,11 @@ struct nvme_controller;
  *
  * To stop using the the controller and release its associated resources,
  * call \ref nvme_detach with the nvme_controller instance returned by this function.
+ *
+ * \param opts Controller options, or NULL to use the defaults.  The values actually
+ * used may be clamped to the controller's capabilities.
  */
-struct nvme_controller *nvme_attach(void *devhandle);
+struct nvme_controller *nvme_attach(void *devhandle, const struct nvme_ctrlr_opts *opts);
 
 /**
  * \brief Detaches specified device returned by \ref nvme_attach() from the NVMe driver.
@@ -130,6 +272,135 @@ void nvme_ctrlr_register_aer_callback(struct nvme_controller *ctrlr,
 				      nvme_aer_cb_fn_t aer_cb_fn,
 				      void *aer_cb_arg);
 
+/**
+ * Signature for callback function invoked when an aborted I/O command is still
+ *  outstanding one timeout period later (see nvme_ctrlr_opts::timeout_sec).
+ *
+ * The timeout_cb_arg parameter is set to the context specified by
+ *  nvme_ctrlr_register_timeout_callback().
+ */
+typedef void (*nvme_timeout_cb_fn_t)(void *timeout_cb_arg,
+				     struct nvme_controller *ctrlr);
+
+/**
+ * \brief Register a callback to be notified when a timed out command could not be aborted.
+ *
+ * I/O threads only record the timeout.  The callback is invoked from the next
+ *  nvme_ctrlr_process_admin_completions(), at most once per call, so that the
+ *  application can call nvme_ctrlr_reset() from its management thread once no
+ *  other threads are using the controller.  If no callback is registered, the
+ *  timeout is only logged.
+ */
+void nvme_ctrlr_register_timeout_callback(struct nvme_controller *ctrlr,
+					  nvme_timeout_cb_fn_t timeout_cb_fn,
+					  void *timeout_cb_arg);
+
+/** \brief Opaque handle to an I/O queue pair. Obtained by calling nvme_ctrlr_alloc_io_qpair(). */
+struct nvme_qpair;
+
+/**
+ * \brief I/O queue pair options, passed to nvme_ctrlr_alloc_io_qpair().
+ *
+ * Initialize with nvme_io_qpair_opts_set_defaults() before changing individual
+ * fields, so that fields added in the future get sensible values.
+ */
+struct nvme_io_qpair_opts {
+	/**
+	 * Queue pair whose completion queue the new submission queue should post its
+	 * completions to, or NULL to create a new completion queue.
+	 *
+	 * All queue pairs sharing a completion queue must be used by a single thread.
+	 * Calling nvme_qpair_process_completions() on any of them reaps completions for
+	 * all of them.  The queue pair that owns the completion queue cannot be freed
+	 * while other queue pairs still share it.  Must not be a proxy returned by
+	 * nvme_qpair_alloc_proxy().
+	 */
+	struct nvme_qpair	*shared_cq;
+
+	/**
+	 * Priority class of the submission queue.
+	 *
+	 * Only NVME_QPRIO_MEDIUM (the default) is accepted unless weighted round robin
+	 * arbitration is in use (see nvme_ctrlr_opts::enable_wrr and
+	 * nvme_ctrlr_is_wrr_enabled()).
+	 */
+	enum nvme_qprio		qprio;
+
+	/**
+	 * Have the completion queue raise an interrupt, signaled through the eventfd
+	 * returned by nvme_qpair_get_interrupt_fd(), when completions are posted.
+	 * Requires nvme_ctrlr_opts::intr_ops.  Must be false when shared_cq is set,
+	 * since queue pairs sharing a completion queue share its interrupt.
+	 */
+	bool			enable_interrupts;
+
+	/**
+	 * Number of requests that proxies of this queue pair can have waiting to be
+	 * submitted (see nvme_qpair_alloc_proxy()), or 0 (the default) if the queue
+	 * pair will not have proxies.  Rounded up to a power of two.  Must be 0 when
+	 * shared_cq is set.
+	 */
+	uint32_t		proxy_ring_size;
+
+	/**
+	 * Record the latency of every command completed on the queue pair in a
+	 * histogram per opcode (see nvme_qpair_merge_latency_histogram()).  Costs a
+	 * timestamp counter read at submission and at completion of each command.
+	 */
+	bool			track_latency;
+};
+
+/**
+ * \brief Return true if the controller is using weighted round robin arbitration,
+ *  so that I/O queue pairs may be allocated with any priority.
+ *
+ * This function is thread safe and can be called at any point after nvme_attach().
+ */
+bool nvme_ctrlr_is_wrr_enabled(struct nvme_controller *ctrlr);
+
+/**
+ * \brief Fill in opts with the default I/O queue pair options.
+ */
+void nvme_io_qpair_opts_set_defaults(struct nvme_io_qpair_opts *opts);
+
+/**
+ * \brief Allocate an I/O queue pair (submission and completion queue).
+ *
+ * The submission and completion queues are created on the controller with the
+ * Create I/O Completion Queue and Create I/O Submission Queue admin commands when
+ * this function is called, so it blocks until the controller has processed them.
+ * Allocate queue pairs during thread setup, not on the I/O path.
+ *
+ * Each queue pair should be used by only one thread at a time; the driver does no
+ * locking on the I/O path. A thread may allocate as many queue pairs as it needs,
+ * up to the number of I/O queues the controller provides.
+ *
+ * \param opts Queue pair options, or NULL to use the defaults.
+ *
+ * \return a queue pair, or NULL if all of the controller's I/O queues are in use,
+ * the controller has failed, or queue creation failed.
+ *
+ * This function is thread safe and can be called at any point after nvme_attach().
+ */
+struct nvme_qpair *nvme_ctrlr_alloc_io_qpair(struct nvme_controller *ctrlr,
+		const struct nvme_io_qpair_opts *opts);
+
+/**
+ * \brief Delete an I/O queue pair and return its queue ID to the controller.
+ *
+ * All commands submitted on the queue pair must have completed. The submission and
+ * completion queues are deleted on the controller with the Delete I/O Submission
+ * Queue and Delete I/O Completion Queue admin commands, and the queue pair's memory
+ * is released, so the handle must not be used after this returns 0.
+ *
+ * \return 0 on success, EBUSY if commands are still outstanding or other queue pairs
+ * share this queue pair's completion queue or submit through its proxies, EINVAL
+ * if qpair is a proxy, or ENXIO if the controller failed to delete the queues.
+ *
+ * This function is thread safe and can be called at any point after nvme_attach().
+ */
+int nvme_ctrlr_free_io_qpair(struct nvme_qpair *qpair);
+
 /**
  * \brief Send the given NVM I/O command to the NVMe controller.
  *
@@ -140,39 +411,364 @@ void nvme_ctrlr_register_aer_callback(struct nvme_controller *ctrlr,
  * When constructing the nvme_command it is not necessary to fill out the PRP
  * list/SGL or the CID. The driver will handle both of those for you.
  *
- * This function is thread safe and can be called at any point after
- * nvme_register_io_thread().
- *
+ * The command is submitted on qpair, which must have been allocated from ctrlr.
+ * The user must ensure that only one thread submits I/O on a given qpair at any
+ * given time.
  */
 int nvme_ctrlr_cmd_io_raw(struct nvme_controller *ctrlr,
+			  struct nvme_qpair *qpair,
 			  struct nvme_command *cmd,
 			  void *buf, uint32_t len,
 			  nvme_cb_fn_t cb_fn, void *cb_arg);
-// @yzy
-// new wrap function
-int nvme_ctrlr_cmd_io_raw_by_id(struct nvme_controller *ctrlr,
-			  struct nvme_command *cmd,
-			  void *buf, uint32_t len,
-			  nvme_cb_fn_t cb_fn, void *cb_arg, int ioq_index);
 
 /**
- * \brief Process any outstanding completions for I/O submitted on the current thread.
+ * \brief Process any outstanding completions for I/O submitted on a queue pair.
  *
- * This will only process completions for I/O that were submitted on the same thread
- * that this function is called from. This call is also non-blocking, i.e. it only
- * processes completions that are ready at the time of this function call. It does not
- * wait for outstanding commands to finish.
+ * This call is non-blocking, i.e. it only processes completions that are ready at
+ * the time of this function call. It does not wait for outstanding commands to
+ * finish.
  *
  * \param max_completions Limit the number of completions to be processed in one call, or 0
  * for unlimited.
  *
- * This function is thread safe and can be called at any point after nvme_attach().
+ * \return number of completions processed (may be 0).
+ *
+ * If qpair shares its completion queue with other queue pairs (see
+ * nvme_io_qpair_opts::shared_cq), completions for commands submitted on any of them
+ * are processed, and each is reported through the queue pair it was submitted on.
+ *
+ * The user must ensure that only one thread uses a given qpair at any given time.
+ */
+int32_t nvme_qpair_process_completions(struct nvme_qpair *qpair, uint32_t max_completions);
+
+/**
+ * \brief How nvme_qpair_poll() waits for completions.
+ */
+enum nvme_poll_mode {
+	/**
+	 * Every call returns immediately.  Lowest latency, but a polling thread keeps
+	 * its core fully busy regardless of load.
+	 */
+	NVME_POLL_MODE_BUSY	= 0,
+
+	/**
+	 * Busy poll while completions keep arriving.  Once the queue pair goes idle,
+	 * back off by pausing and then by sleeping, never for longer than the latency
+	 * budget at a time.  While commands are outstanding, sleep once for about half
+	 * of the estimated device latency before polling again, as Linux hybrid
+	 * polling does.
+	 */
+	NVME_POLL_MODE_HYBRID	= 1,
+};
+
+/**
+ * \brief Completion polling options, see nvme_qpair_set_poll_opts().
+ *
+ * Initialize with nvme_poll_opts_set_defaults() before changing individual
+ * fields, so that fields added in the future get sensible values.
+ */
+struct nvme_poll_opts {
+	enum nvme_poll_mode	mode;
+
+	/**
+	 * Longest single pause or sleep in hybrid mode, in microseconds.  This bounds
+	 * the latency hybrid polling adds to a completion, plus the scheduler's wakeup
+	 * latency for sleeps.
+	 */
+	uint32_t		latency_budget_us;
+
+	/**
+	 * Number of consecutive polls that find no completions before hybrid mode
+	 * starts to back off.
+	 */
+	uint32_t		idle_poll_threshold;
+};
+
+/**
+ * \brief Fill in opts with the default polling options (busy polling).
+ */
+void nvme_poll_opts_set_defaults(struct nvme_poll_opts *opts);
+
+/**
+ * \brief Set how nvme_qpair_poll() waits for completions on a queue pair.
+ *
+ * Queue pairs sharing a completion queue share one polling policy, so setting it
+ * on any of them applies to all of them.
+ *
+ * \return 0 on success, or EINVAL if opts is invalid.
+ */
+int nvme_qpair_set_poll_opts(struct nvme_qpair *qpair, const struct nvme_poll_opts *opts);
+
+/**
+ * \brief Process completions like nvme_qpair_process_completions(), following the
+ *  queue pair's polling policy.
+ *
+ * In hybrid mode (see \ref NVME_POLL_MODE_HYBRID) an idle call may pause or sleep
+ * before returning, so the calling thread gives up its core at low load and
+ * returns to busy polling as soon as completions arrive again.
+ *
+ * \return number of completions processed (may be 0).
+ */
+int32_t nvme_qpair_poll(struct nvme_qpair *qpair, uint32_t max_completions);
+
+/**
+ * \brief Polling counters of a queue pair, see nvme_qpair_get_poll_stats().
+ *
+ * The share of a polling thread's time spent off the CPU is sleep_us divided by
+ * the wall clock time it has been polling.
+ */
+struct nvme_poll_stats {
+	/** Calls to nvme_qpair_poll() */
+	uint64_t	polls;
+	/** Calls that found no completions */
+	uint64_t	idle_polls;
+	/** Time spent pausing (spinning without polling the device), in microseconds */
+	uint64_t	pause_us;
+	/** Number of sleeps */
+	uint64_t	sleeps;
+	/** Time spent sleeping, in microseconds */
+	uint64_t	sleep_us;
+	/** Completions per second, measured over the last hybrid polling window */
+	uint64_t	completion_rate;
+	/** Estimated mean device latency in microseconds, 0 until measured */
+	uint32_t	est_latency_us;
+};
+
+/**
+ * \brief Get the polling counters of a queue pair.
+ *
+ * Queue pairs sharing a completion queue share one set of counters.  Only calls
+ * to nvme_qpair_poll() are counted, and the completion rate and latency
+ * estimate are only measured in hybrid mode.
+ */
+void nvme_qpair_get_poll_stats(struct nvme_qpair *qpair, struct nvme_poll_stats *stats);
+
+/**
+ * \brief Allocate a proxy of a queue pair, so that another thread can submit I/O to it.
+ *
+ * A queue pair allocated with nvme_io_qpair_opts::proxy_ring_size can be shared by
+ * any number of submitting threads, each using its own proxy.  The proxy is passed
+ * to the nvme_ns_cmd_*() functions and to nvme_qpair_process_completions() like a
+ * regular queue pair.  Requests submitted on it are placed in a lock-free ring,
+ * from which the thread that owns qpair moves them to the submission queue each
+ * time it calls nvme_qpair_process_completions() on qpair.  Completions are handed
+ * back and their callbacks run when the proxy's thread calls
+ * nvme_qpair_process_completions() on the proxy.  Both threads must keep polling.
+ *
+ * Like any queue pair, each proxy must be used by only one thread at a time.
+ * Proxies always deliver per-command callbacks.
+ *
+ * \param depth Maximum number of requests the proxy hands to qpair at once.
+ * Further requests are queued in the proxy until earlier ones complete.
+ *
+ * \return the proxy, or NULL if qpair was allocated without proxy_ring_size or
+ * memory could not be allocated.
+ *
+ * This function is thread safe.
+ */
+struct nvme_qpair *nvme_qpair_alloc_proxy(struct nvme_qpair *qpair, uint32_t depth);
+
+/**
+ * \brief Free a proxy allocated by nvme_qpair_alloc_proxy().
+ *
+ * \return 0 on success, EBUSY if the proxy still has outstanding I/O, or EINVAL
+ * if qpair is not a proxy.
+ */
+int nvme_qpair_free_proxy(struct nvme_qpair *qpair);
+
+/**
+ * \brief Get the eventfd signaled when completions are posted for a queue pair.
+ *
+ * The fd becomes readable when the queue pair's completion queue raises its
+ * interrupt.  Add it to an epoll set (EPOLLIN) to block until completions arrive,
+ * then call nvme_qpair_process_interrupt().  Do not read or close it.
+ *
+ * \return the eventfd, or -1 if the queue pair was allocated without
+ * nvme_io_qpair_opts::enable_interrupts.
+ */
+int nvme_qpair_get_interrupt_fd(struct nvme_qpair *qpair);
+
+/**
+ * \brief Acknowledge the queue pair's interrupt and process its completions.
+ *
+ * Equivalent to nvme_qpair_process_completions() after clearing the eventfd
+ * returned by nvme_qpair_get_interrupt_fd().  If max_completions is non-zero
+ * and is reached, completions may remain without the eventfd being signaled
+ * again, so keep calling nvme_qpair_process_completions() until it returns
+ * fewer than max_completions before blocking on the eventfd again.
+ *
+ * \return number of completions processed (may be 0).
+ */
+int32_t nvme_qpair_process_interrupt(struct nvme_qpair *qpair, uint32_t max_completions);
+
+/**
+ * \brief Defer submission queue doorbell writes for I/O submitted on a queue pair.
+ *
+ * While plugged, commands submitted on qpair are placed in the submission queue but
+ * the controller is not notified until nvme_qpair_unplug() is called. This lets a
+ * caller submitting a batch of commands pay for a single doorbell write instead of
+ * one per command.
+ *
+ * Commands submitted while plugged will not be started by the controller, so every
+ * call to this function must be paired with a call to nvme_qpair_unplug().
+ */
+void nvme_qpair_plug(struct nvme_qpair *qpair);
+
+/**
+ * \brief Ring the submission queue doorbell deferred by nvme_qpair_plug().
+ *
+ * If no commands were submitted since the matching nvme_qpair_plug() call, the
+ * doorbell is left untouched.
+ */
+void nvme_qpair_unplug(struct nvme_qpair *qpair);
+
+/**
+ * \brief One completed command, as delivered to a batch completion callback.
+ */
+struct nvme_batch_cpl {
+	/** cb_arg passed when the command was submitted */
+	void			*cb_arg;
+	/** Completion status of the command */
+	struct nvme_status	status;
+};
+
+/**
+ * Signature for callback function invoked with a batch of completed commands.
+ *
+ * The ctx parameter is set to the context specified by
+ *  nvme_qpair_set_batch_callback().
+ */
+typedef void (*nvme_batch_cb_fn_t)(void *ctx, const struct nvme_batch_cpl *cpls,
+				   uint32_t num_cpls);
+
+/**
+ * \brief Deliver completions for I/O submitted on a queue pair in batches.
+ *
+ * While a batch callback is set, the per-command nvme_cb_fn_t passed at submission
+ * time is not called. Instead, the cb_arg and status of each completed command are
+ * collected and handed to batch_cb_fn once at the end of each call to
+ * nvme_qpair_process_completions(), or earlier if NVME_BATCH_CPL_ENTRIES
+ * completions are pending. Commands submitted with a NULL cb_fn are not reported.
+ * Split commands are reported once, when their last child completes.
+ *
+ * Passing a NULL batch_cb_fn delivers any pending completions and returns the
+ * queue pair to per-command callbacks.
+ */
+void nvme_qpair_set_batch_callback(struct nvme_qpair *qpair,
+				   nvme_batch_cb_fn_t batch_cb_fn, void *ctx);
+
+/** Maximum number of completions passed to a batch callback in one call. */
+#define NVME_BATCH_CPL_ENTRIES	(64)
+
+/**
+ * \brief I/O queue pair statistics.
+ *
+ * Only counted when the driver is built with CONFIG_NVME_STATS.  Otherwise all
+ * counters read as 0.
+ */
+struct nvme_qpair_stats {
+	/** Commands placed in the submission queue, including retries */
+	uint64_t	submitted;
+	/** Completions reaped from the completion queue */
+	uint64_t	completed;
+	/** Commands resubmitted after completing with a retryable error */
+	uint64_t	retries;
+	/**
+	 * Requests queued in software instead of submitted, because no tracker was
+	 * free or the queue pair was disabled by a controller reset
+	 */
+	uint64_t	queued_reqs;
+	/** Most commands outstanding on the submission queue at once */
+	uint64_t	max_outstanding;
+	/** Calls to nvme_qpair_process_completions() that found no completions */
+	uint64_t	empty_polls;
+	/** Submission queue tail doorbell writes */
+	uint64_t	sq_doorbell_writes;
+	/** Completion queue head doorbell writes */
+	uint64_t	cq_doorbell_writes;
+};
+
+/**
+ * \brief Get the statistics of an I/O queue pair.
  *
+ * Completions and polls are counted on the queue pair that owns the completion
+ * queue.  The counters are plain increments by the thread using the queue pair,
+ * so values read while it is doing I/O on another thread are approximate.
  */
-void nvme_ctrlr_process_io_completions(struct nvme_controller *ctrlr, uint32_t max_completions);
-// @yzy
-// new function for completion
-int nvme_ctrlr_process_io_completions_by_id(struct nvme_controller *ctrlr, uint32_t max_completions, int ioq_index);
+void nvme_qpair_get_stats(struct nvme_qpair *qpair, struct nvme_qpair_stats *stats);
+
+/**
+ * \brief Get the statistics of all I/O queue pairs of a controller.
+ *
+ * Counters are summed over the controller's I/O queue pairs, including ones that
+ * have since been freed, except max_outstanding, which is the highest of any.
+ *
+ * The difference between submitted and sq_doorbell_writes, and between completed
+ * and cq_doorbell_writes, is the number of MMIO writes avoided by
+ * nvme_qpair_plug() and by completion doorbell coalescing (see
+ * \ref nvme_cq_doorbell_threshold).
+ */
+void nvme_ctrlr_get_io_qpair_stats(struct nvme_controller *ctrlr,
+				   struct nvme_qpair_stats *stats);
+
+/**
+ * \brief Add the latencies of commands with opcode opc completed on an I/O queue
+ *  pair to hist.
+ *
+ * Latencies are only recorded on queue pairs allocated with
+ * nvme_io_qpair_opts::track_latency.  Each runs from the first submission of the
+ * command, including time spent queued in software and any retries, until just
+ * before its completion callback is called.  Values are in ticks of the driver's
+ * timestamp counter, nvme_get_tsc() in nvme_impl.h, which is
+ * rte_get_timer_cycles() in the default DPDK environment; divide by
+ * rte_get_timer_hz() to convert to seconds.
+ *
+ * Histograms are updated without atomics by the thread using the queue pair, so
+ * those read while it is doing I/O are approximate.  hist is not reset first,
+ * so histograms of several queue pairs or opcodes can be merged into one.
+ */
+void nvme_qpair_merge_latency_histogram(struct nvme_qpair *qpair, uint8_t opc,
+					struct histogram *hist);
+
+/**
+ * \brief Add the latencies of commands with opcode opc completed on all I/O queue
+ *  pairs of a controller, including ones that have since been freed, to hist.
+ *
+ * See nvme_qpair_merge_latency_histogram().
+ */
+void nvme_ctrlr_merge_io_latency_histogram(struct nvme_controller *ctrlr, uint8_t opc,
+					   struct histogram *hist);
+
+/**
+ * \brief Start recording I/O events into a trace buffer in shared memory.
+ *
+ * \param shm_name Name of the POSIX shared memory object to create, such as
+ * "/nvme_trace".  An existing object of that name is replaced.
+ * \param num_rings Number of threads that can be traced.
+ * \param num_entries Events kept per thread, rounded up to a power of two.
+ *
+ * Submission, completion, software queueing and retry of commands on all
+ * controllers are recorded, with the layout described in spdk/nvme_trace.h.  Each
+ * thread doing I/O claims a ring on its first event and then records into it
+ * without atomics, overwriting its oldest events once the ring is full.  Threads
+ * beyond num_rings are not traced.
+ *
+ * The shared memory object outlives the process, so the trace can be decoded while
+ * or after the application runs (see examples/nvme/trace).  Remove it with
+ * shm_unlink() once no longer needed.
+ *
+ * Returns 0 on success, EBUSY if tracing is already on, ENOTSUP if the driver was
+ * built without CONFIG_NVME_TRACE, or another errno value on failure.
+ */
+int nvme_trace_enable(const char *shm_name, uint32_t num_rings, uint32_t num_entries);
+
+/**
+ * \brief Stop recording I/O events and unmap the trace buffer.
+ *
+ * The shared memory object is kept.  No other thread may submit or complete I/O
+ * during this call.
+ */
+void nvme_trace_disable(void);
 
 /**
  * \brief Send the given admin command to the NVMe controller.
@@ -275,8 +871,39 @@ uint64_t nvme_ns_get_size(struct nvme_namespace *ns);
 enum nvme_namespace_flags {
 	NVME_NS_DEALLOCATE_SUPPORTED	= 0x1,
 	NVME_NS_FLUSH_SUPPORTED		= 0x2,
+	NVME_NS_WRITE_ZEROES_SUPPORTED	= 0x4,
+	NVME_NS_VERIFY_SUPPORTED	= 0x8,
+	NVME_NS_COMPARE_SUPPORTED	= 0x10,
+	NVME_NS_COMPARE_AND_WRITE_SUPPORTED = 0x20,
 };
 
+/**
+ * \name I/O flags
+ *
+ * Flags for the io_flags argument of nvme_ns_cmd_read() and nvme_ns_cmd_write().
+ * The upper 16 bits are the command's dword 12 flags and the lowest byte is its
+ * dataset management field (dword 13), which hints at how the blocks will be
+ * accessed.  The remaining bits are reserved and must be 0.
+ */
+/**@{*/
+/** Complete the I/O only once the data is on non-volatile media */
+#define NVME_IO_FLAGS_FORCE_UNIT_ACCESS		NVME_RW_FORCE_UNIT_ACCESS
+/** Let the controller give up on recovering the data sooner */
+#define NVME_IO_FLAGS_LIMITED_RETRY		NVME_RW_LIMITED_RETRY
+/** Access frequency hint, an enum nvme_dsm_access_frequency */
+#define NVME_IO_FLAGS_ACCESS_FREQUENCY(freq)	((uint32_t)(freq) & 0xFu)
+/** Access latency hint, an enum nvme_dsm_access_latency */
+#define NVME_IO_FLAGS_ACCESS_LATENCY(latency)	(((uint32_t)(latency) & 0x3u) << 4)
+/** The I/O is part of a sequential read or write */
+#define NVME_IO_FLAGS_SEQUENTIAL		NVME_DSM_SEQUENTIAL_REQUEST
+/** The data is not compressible */
+#define NVME_IO_FLAGS_INCOMPRESSIBLE		NVME_DSM_INCOMPRESSIBLE
+
+#define NVME_IO_FLAGS_CDW12_MASK		(NVME_IO_FLAGS_FORCE_UNIT_ACCESS | \
+						 NVME_IO_FLAGS_LIMITED_RETRY)
+#define NVME_IO_FLAGS_DSM_MASK			(0xFFu)
+/**@}*/
+
 /**
  * \brief Get the flags for the given namespace.
  *
@@ -291,96 +918,339 @@ uint32_t nvme_ns_get_flags(struct nvme_namespace *ns);
  * \brief Submits a write I/O to the specified NVMe namespace.
  *
  * \param ns NVMe namespace to submit the write I/O
+ * \param qpair I/O queue pair to submit the request
  * \param payload virtual address pointer to the data payload
  * \param lba starting LBA to write the data
  * \param lba_count length (in sectors) for the write operation
  * \param cb_fn callback function to invoke when the I/O is completed
  * \param cb_arg argument to pass to the callback function
+ * \param io_flags NVME_IO_FLAGS_* flags, applied to every command the I/O is
+ *                 split into
  *
  * \return 0 if successfully submitted, ENOMEM if an nvme_request
- *	     structure cannot be allocated for the I/O request
+ *	     structure cannot be allocated for the I/O request, EINVAL if
+ *	     lba_count is too large to submit as one request or io_flags has
+ *	     reserved bits set
  *
- * This function is thread safe and can be called at any point after
- * nvme_register_io_thread().
+ * The user must ensure that only one thread submits I/O on a given qpair at any
+ * given time.
  */
-int nvme_ns_cmd_write(struct nvme_namespace *ns, void *payload,
+int nvme_ns_cmd_write(struct nvme_namespace *ns, struct nvme_qpair *qpair, void *payload,
 		      uint64_t lba, uint32_t lba_count, nvme_cb_fn_t cb_fn,
-		      void *cb_arg);
-// @yzy
-// new wrap function
-int nvme_ns_cmd_write_by_id(struct nvme_namespace *ns, void *payload,
-		      uint64_t lba, uint32_t lba_count, nvme_cb_fn_t cb_fn,
-		      void *cb_arg, int ioq_index);
+		      void *cb_arg, uint32_t io_flags);
+
+/**
+ * \brief Submits a write zeroes I/O to the specified NVMe namespace.
+ *
+ * \param ns NVMe namespace to submit the write zeroes I/O
+ * \param qpair I/O queue pair to submit the request
+ * \param lba starting LBA for this command
+ * \param lba_count length (in sectors) for the write zeroes operation
+ * \param cb_fn callback function to invoke when the I/O is completed
+ * \param cb_arg argument to pass to the callback function
+ *
+ * \return 0 if successfully submitted, ENOMEM if an nvme_request
+ *	     structure cannot be allocated for the I/O request, EINVAL if
+ *	     lba_count is 0 or too large to submit as one request
+ *
+ * Without NVME_NS_WRITE_ZEROES_SUPPORTED, the blocks are written from a buffer
+ * of zeroes kept by the driver, so no data buffer is needed either way.
+ *
+ * The user must ensure that only one thread submits I/O on a given qpair at any
+ * given time.
+ */
+int nvme_ns_cmd_write_zeroes(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+			     uint64_t lba, uint32_t lba_count, nvme_cb_fn_t cb_fn,
+			     void *cb_arg);
+
+/**
+ * \brief Submits a verify I/O to the specified NVMe namespace.
+ *
+ * The controller checks that the blocks can be read, including any end-to-end
+ * protection information, without transferring them.
+ *
+ * \param ns NVMe namespace to submit the verify I/O
+ * \param qpair I/O queue pair to submit the request
+ * \param lba starting LBA to verify
+ * \param lba_count length (in sectors) for the verify operation
+ * \param cb_fn callback function to invoke when the I/O is completed
+ * \param cb_arg argument to pass to the callback function
+ *
+ * \return 0 if successfully submitted, ENOMEM if an nvme_request
+ *	     structure cannot be allocated for the I/O request, EINVAL if
+ *	     lba_count is 0 or too large to submit as one request
+ *
+ * Without NVME_NS_VERIFY_SUPPORTED, the blocks are read into a buffer kept by
+ * the driver and the data is discarded.
+ *
+ * The user must ensure that only one thread submits I/O on a given qpair at any
+ * given time.
+ */
+int nvme_ns_cmd_verify(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+		       uint64_t lba, uint32_t lba_count, nvme_cb_fn_t cb_fn,
+		       void *cb_arg);
+
+/**
+ * \brief Submits a compare I/O to the specified NVMe namespace.
+ *
+ * The controller compares the blocks with the payload.  If they differ, the
+ * command completes with NVME_SCT_MEDIA_ERROR / NVME_SC_COMPARE_FAILURE.
+ *
+ * \param ns NVMe namespace to submit the compare I/O
+ * \param qpair I/O queue pair to submit the request
+ * \param payload virtual address pointer to the data to compare against
+ * \param lba starting LBA to compare
+ * \param lba_count length (in sectors) for the compare operation
+ * \param cb_fn callback function to invoke when the I/O is completed
+ * \param cb_arg argument to pass to the callback function
+ *
+ * \return 0 if successfully submitted, ENOMEM if an nvme_request
+ *	     structure cannot be allocated for the I/O request, EINVAL if
+ *	     lba_count is too large to submit as one request
+ *
+ * The user must ensure that only one thread submits I/O on a given qpair at any
+ * given time.
+ */
+int nvme_ns_cmd_compare(struct nvme_namespace *ns, struct nvme_qpair *qpair, void *payload,
+			uint64_t lba, uint32_t lba_count, nvme_cb_fn_t cb_fn,
+			void *cb_arg);
+
+/**
+ * \brief Submits a fused compare and write I/O to the specified NVMe namespace.
+ *
+ * The controller compares the blocks with cmp_payload and, only if they match,
+ * writes write_payload to them, with no other command touching the blocks in
+ * between.  The two commands are submitted back-to-back as a fused pair and
+ * cb_fn is called once, when both have completed.  On a miscompare the status
+ * is NVME_SC_COMPARE_FAILURE and the blocks are left unchanged.
+ *
+ * A fused pair is never split, so the range must fit in one command and must
+ * not cross a stripe boundary.  Fused commands are not retried by the driver.
+ *
+ * \param ns NVMe namespace to submit the compare and write I/O
+ * \param qpair I/O queue pair to submit the request
+ * \param cmp_payload virtual address pointer to the data to compare against
+ * \param write_payload virtual address pointer to the data to write
+ * \param lba starting LBA of the range
+ * \param lba_count length (in sectors) of the range
+ * \param cb_fn callback function to invoke when the I/O is completed
+ * \param cb_arg argument to pass to the callback function
+ *
+ * \return 0 if successfully submitted, ENOMEM if an nvme_request
+ *	     structure cannot be allocated for the I/O request, EINVAL if
+ *	     lba_count is 0 or the range would have to be split
+ *
+ * Requires NVME_NS_COMPARE_AND_WRITE_SUPPORTED.
+ *
+ * The user must ensure that only one thread submits I/O on a given qpair at any
+ * given time.
+ */
+int nvme_ns_cmd_compare_and_write(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+				  void *cmp_payload, void *write_payload,
+				  uint64_t lba, uint32_t lba_count,
+				  nvme_cb_fn_t cb_fn, void *cb_arg);
 
 /**
  * \brief Submits a read I/O to the specified NVMe namespace.
  *
  * \param ns NVMe namespace to submit the read I/O
+ * \param qpair I/O queue pair to submit the request
  * \param payload virtual address pointer to the data payload
  * \param lba starting LBA to read the data
  * \param lba_count length (in sectors) for the read operation
  * \param cb_fn callback function to invoke when the I/O is completed
  * \param cb_arg argument to pass to the callback function
+ * \param io_flags NVME_IO_FLAGS_* flags, applied to every command the I/O is
+ *                 split into
  *
  * \return 0 if successfully submitted, ENOMEM if an nvme_request
- *	     structure cannot be allocated for the I/O request
+ *	     structure cannot be allocated for the I/O request, EINVAL if
+ *	     lba_count is too large to submit as one request or io_flags has
+ *	     reserved bits set
  *
- * This function is thread safe and can be called at any point after
- * nvme_register_io_thread().
+ * The user must ensure that only one thread submits I/O on a given qpair at any
+ * given time.
  */
-int nvme_ns_cmd_read(struct nvme_namespace *ns, void *payload,
+int nvme_ns_cmd_read(struct nvme_namespace *ns, struct nvme_qpair *qpair, void *payload,
 		     uint64_t lba, uint32_t lba_count, nvme_cb_fn_t cb_fn,
-		     void *cb_arg);
-// @yzy
-// new wrap function
-int nvme_ns_cmd_read_by_id(struct nvme_namespace *ns, void *payload,
-		     uint64_t lba, uint32_t lba_count, nvme_cb_fn_t cb_fn,
-		     void *cb_arg, int ioq_index);
+		     void *cb_arg, uint32_t io_flags);
 
 /**
  * \brief Submits a deallocation request to the specified NVMe namespace.
  *
  * \param ns NVMe namespace to submit the deallocation request
+ * \param qpair I/O queue pair to submit the request
  * \param payload virtual address pointer to the list of LBA ranges to
  *                deallocate
- * \param num_ranges number of ranges in the list pointed to by payload
+ * \param num_ranges number of ranges in the list pointed to by payload, at
+ *                   most NVME_DATASET_MANAGEMENT_MAX_RANGES
  * \param cb_fn callback function to invoke when the I/O is completed
  * \param cb_arg argument to pass to the callback function
  *
  * \return 0 if successfully submitted, ENOMEM if an nvme_request
- *	     structure cannot be allocated for the I/O request
+ *	     structure cannot be allocated for the I/O request, EINVAL if
+ *	     num_ranges is 0 or too large
  *
- * This function is thread safe and can be called at any point after
- * nvme_register_io_thread().
+ * The user must ensure that only one thread submits I/O on a given qpair at any
+ * given time.
  */
-int nvme_ns_cmd_deallocate(struct nvme_namespace *ns, void *payload,
-			   uint8_t num_ranges, nvme_cb_fn_t cb_fn,
+int nvme_ns_cmd_deallocate(struct nvme_namespace *ns, struct nvme_qpair *qpair, void *payload,
+			   uint16_t num_ranges, nvme_cb_fn_t cb_fn,
 			   void *cb_arg);
-// @yzy
-// new wrap function
-int nvme_ns_cmd_deallocate_by_id(struct nvme_namespace *ns, void *payload,
-			   uint8_t num_ranges, nvme_cb_fn_t cb_fn,
-			   void *cb_arg, int ioq_index);
 
 /**
  * \brief Submits a flush request to the specified NVMe namespace.
  *
  * \param ns NVMe namespace to submit the flush request
+ * \param qpair I/O queue pair to submit the request
  * \param cb_fn callback function to invoke when the I/O is completed
  * \param cb_arg argument to pass to the callback function
  *
  * \return 0 if successfully submitted, ENOMEM if an nvme_request
  *	     structure cannot be allocated for the I/O request
  *
- * This function is thread safe and can be called at any point after
- * nvme_register_io_thread().
+ * The user must ensure that only one thread submits I/O on a given qpair at any
+ * given time.
  */
-int nvme_ns_cmd_flush(struct nvme_namespace *ns, nvme_cb_fn_t cb_fn,
-		      void *cb_arg);
-// @yzy
-// new wrap function
-int nvme_ns_cmd_flush_by_id(struct nvme_namespace *ns, nvme_cb_fn_t cb_fn,
-		      void *cb_arg, int ioq_index);
+int nvme_ns_cmd_flush(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+		      nvme_cb_fn_t cb_fn, void *cb_arg);
+
+struct nvme_deallocator;
+
+/**
+ * \brief Deallocator options, see nvme_ns_alloc_deallocator().
+ *
+ * Initialize with nvme_deallocator_opts_set_defaults() before changing individual
+ * fields, so that fields added in the future get sensible values.
+ */
+struct nvme_deallocator_opts {
+	/**
+	 * Ranges packed into one Dataset Management command, at most
+	 * NVME_DATASET_MANAGEMENT_MAX_RANGES.  A command is sent as soon as this
+	 * many ranges are pending.
+	 */
+	uint32_t	max_ranges_per_cmd;
+
+	/** Also send a command once this many blocks are pending.  0 disables this. */
+	uint64_t	flush_blocks;
+
+	/**
+	 * Send pending ranges once the oldest of them has waited this long, in
+	 * microseconds.  0 sends every range as soon as the rate limit allows.
+	 */
+	uint32_t	max_age_us;
+
+	/**
+	 * Blocks deallocated per second, at most.  Ranges are held back while the
+	 * limit is exceeded, so deallocation does not crowd out other I/O.  0 for
+	 * no limit.
+	 */
+	uint64_t	max_blocks_per_sec;
+
+	/** Dataset Management commands outstanding at once */
+	uint32_t	queue_depth;
+
+	/** Merged ranges held pending, at least max_ranges_per_cmd */
+	uint32_t	max_pending_ranges;
+};
+
+/**
+ * \brief Fill in opts with the default deallocator options.
+ */
+void nvme_deallocator_opts_set_defaults(struct nvme_deallocator_opts *opts);
+
+/**
+ * \brief Allocate a deallocator, which batches deallocation of a namespace's blocks.
+ *
+ * Ranges passed to nvme_deallocator_add() are merged with adjacent and overlapping
+ * pending ranges and packed into Dataset Management commands, instead of each
+ * taking a command of its own.  Commands are sent on qpair when enough ranges are
+ * pending, when the oldest has waited max_age_us, or on nvme_deallocator_sync(),
+ * within the rate limit in opts.
+ *
+ * Like the queue pair, the deallocator must be used by only one thread at a time.
+ * That thread must call nvme_deallocator_poll() periodically, as well as process
+ * completions on qpair.
+ *
+ * \param opts Deallocator options, or NULL to use the defaults.
+ *
+ * \return the deallocator, or NULL if the namespace does not support
+ * deallocation, opts is invalid, or memory could not be allocated.
+ */
+struct nvme_deallocator *nvme_ns_alloc_deallocator(struct nvme_namespace *ns,
+		struct nvme_qpair *qpair,
+		const struct nvme_deallocator_opts *opts);
+
+/**
+ * \brief Free a deallocator allocated by nvme_ns_alloc_deallocator().
+ *
+ * Ranges that are still pending are dropped.  Call nvme_deallocator_sync() first
+ * to deallocate them.
+ *
+ * \return 0 on success, or EBUSY if the deallocator has commands to send or
+ * outstanding.
+ */
+int nvme_ns_free_deallocator(struct nvme_deallocator *dealloc);
+
+/**
+ * \brief Add blocks to deallocate.
+ *
+ * The range is sent to the controller later, possibly merged with others.  It is
+ * not sent at all if the deallocator is freed before it is synced.
+ *
+ * \return 0 on success, EINVAL if lba_count is 0, or ENOMEM if max_pending_ranges
+ * ranges are already pending and none can be merged with this one.
+ */
+int nvme_deallocator_add(struct nvme_deallocator *dealloc, uint64_t lba, uint64_t lba_count);
+
+/**
+ * \brief Deallocate all pending ranges now.
+ *
+ * The ranges pending at the time of the call are packed into commands and sent
+ * without waiting for the rate limit, though they still count against it.
+ * cb_fn is called once all of them have completed, with the status of the first
+ * command that failed, or success.  It may be called before this function
+ * returns, if nothing was pending or outstanding.
+ *
+ * \return 0 on success, or ENOMEM if memory could not be allocated.
+ */
+int nvme_deallocator_sync(struct nvme_deallocator *dealloc, nvme_cb_fn_t cb_fn, void *cb_arg);
+
+/**
+ * \brief Send the commands that have come due since the last call.
+ *
+ * Pending ranges that have reached max_age_us, and ranges held back by the rate
+ * limit, are only sent from here.
+ *
+ * \return number of Dataset Management commands sent.
+ */
+uint32_t nvme_deallocator_poll(struct nvme_deallocator *dealloc);
+
+/**
+ * \brief Deallocator counters, see nvme_deallocator_get_stats().
+ */
+struct nvme_deallocator_stats {
+	/** Calls to nvme_deallocator_add() that succeeded */
+	uint64_t	ranges_added;
+	/** Added ranges merged into pending ones */
+	uint64_t	ranges_merged;
+	/** Dataset Management commands sent */
+	uint64_t	cmds;
+	/** Ranges sent in those commands */
+	uint64_t	cmd_ranges;
+	/** Blocks sent in those commands */
+	uint64_t	cmd_blocks;
+	/** Times a command that was due was held back by the rate limit */
+	uint64_t	throttled;
+	/** Commands that completed with an error */
+	uint64_t	errors;
+};
+
+/**
+ * \brief Get the counters of a deallocator.
+ */
+void nvme_deallocator_get_stats(struct nvme_deallocator *dealloc,
+				struct nvme_deallocator_stats *stats);
 
 /**
  * \brief Get the size, in bytes, of an nvme_request.
@@ -393,8 +1263,39 @@ int nvme_ns_cmd_flush_by_id(struct nvme_namespace *ns, nvme_cb_fn_t cb_fn,
  */
 size_t nvme_request_size(void);
 
-int nvme_register_io_thread(void);
-void nvme_unregister_io_thread(void);
+/**
+ * \brief Return the calling thread's cached nvme_request objects to the pool.
+ *
+ * Call before a thread that submitted or completed I/O exits, or its cached
+ * requests are not returned to the pool (see \ref nvme_request_cache_size).
+ */
+void nvme_request_cache_flush(void);
+
+/**
+ * \brief Per-thread nvme_request cache statistics.
+ *
+ * Only counted when the driver is built with CONFIG_NVME_STATS.  Otherwise all
+ * counters except cached read as 0.
+ */
+struct nvme_request_cache_stats {
+	/** Requests allocated by the thread */
+	uint64_t	allocs;
+	/** Requests freed by the thread */
+	uint64_t	frees;
+	/** Calls into the pool to allocate, each for one request or a batch */
+	uint64_t	pool_gets;
+	/** Calls into the pool to free, each for one request or a batch */
+	uint64_t	pool_puts;
+	/** Requests currently in the thread's cache */
+	uint64_t	cached;
+};
+
+/**
+ * \brief Get the calling thread's nvme_request cache statistics.
+ *
+ * In steady state, pool_gets and pool_puts stay flat while allocs and frees grow.
+ */
+void nvme_request_cache_get_stats(struct nvme_request_cache_stats *stats);
 
 #ifdef __cplusplus
 }
@@ -79,6 +79,14 @@ union nvme_cap_lo_register {
 };
 _Static_assert(sizeof(union nvme_cap_lo_register) == 4, "Incorrect size");
 
+/**
+ * Optional arbitration mechanisms, as bits of the CAP.AMS field.
+ */
+enum nvme_cap_ams {
+	NVME_CAP_AMS_WRR	= 0x1,	/**< weighted round robin with urgent priority class */
+	NVME_CAP_AMS_VS		= 0x2,	/**< vendor specific */
+};
+
 union nvme_cap_hi_register {
 	uint32_t	raw;
 	struct {
@@ -135,6 +143,15 @@ union nvme_cc_register {
 };
 _Static_assert(sizeof(union nvme_cc_register) == 4, "Incorrect size");
 
+/**
+ * Arbitration mechanism values for CC.AMS.
+ */
+enum nvme_cc_ams {
+	NVME_CC_AMS_RR		= 0x0,	/**< round robin */
+	NVME_CC_AMS_WRR		= 0x1,	/**< weighted round robin with urgent priority class */
+	NVME_CC_AMS_VS		= 0x7,	/**< vendor specific */
+};
+
 enum nvme_shn_value {
 	NVME_SHN_NORMAL		= 0x1,
 	NVME_SHN_ABRUPT		= 0x2,
@@ -242,6 +259,13 @@ struct __attribute__((packed)) nvme_sgl_descriptor {
 };
 _Static_assert(sizeof(struct nvme_sgl_descriptor) == 16, "Incorrect size");
 
+enum nvme_fuse_value {
+	NVME_FUSE_NORMAL		= 0x0,
+	NVME_FUSE_FIRST			= 0x1,
+	NVME_FUSE_SECOND		= 0x2,
+	NVME_FUSE_RESERVED		= 0x3
+};
+
 enum nvme_psdt_value {
 	NVME_PSDT_PRP			= 0x0,
 	NVME_PSDT_SGL_MPTR_CONTIG	= 0x1,
@@ -321,6 +345,9 @@ struct nvme_dsm_range {
 };
 _Static_assert(sizeof(struct nvme_dsm_range) == 16, "Incorrect size");
 
+/** Maximum number of ranges in one Dataset Management command */
+#define NVME_DATASET_MANAGEMENT_MAX_RANGES	256
+
 /* status code types */
 enum nvme_status_code_type {
 	NVME_SCT_GENERIC		= 0x0,
@@ -404,6 +431,8 @@ enum nvme_admin_opcode {
 
 	NVME_OPC_NAMESPACE_ATTACHMENT		= 0x15,
 
+	NVME_OPC_DOORBELL_BUFFER_CONFIG		= 0x7c,
+
 	NVME_OPC_FORMAT_NVM			= 0x80,
 	NVME_OPC_SECURITY_SEND			= 0x81,
 	NVME_OPC_SECURITY_RECEIVE		= 0x82,
@@ -420,6 +449,8 @@ enum nvme_nvm_opcode {
 	/* 0x06-0x07 - reserved */
 	NVME_OPC_WRITE_ZEROES			= 0x08,
 	NVME_OPC_DATASET_MANAGEMENT		= 0x09,
+	/* 0x0a-0x0b - reserved */
+	NVME_OPC_VERIFY				= 0x0c,
 
 	NVME_OPC_RESERVATION_REGISTER		= 0x0d,
 	NVME_OPC_RESERVATION_REPORT		= 0x0e,
@@ -447,12 +478,77 @@ enum nvme_feature {
 	/* 0xC0-0xFF - vendor specific */
 };
 
+/**
+ * Submission queue priority, used by the weighted round robin arbitration
+ *  mechanism (Create I/O Submission Queue CDW11 bits 2:1).
+ */
+enum nvme_qprio {
+	NVME_QPRIO_URGENT	= 0x0,
+	NVME_QPRIO_HIGH		= 0x1,
+	NVME_QPRIO_MEDIUM	= 0x2,
+	NVME_QPRIO_LOW		= 0x3,
+};
+
+/** Arbitration Burst value meaning the controller has no limit */
+#define NVME_ARBITRATION_BURST_UNLIMITED	(0x7)
+
+/**
+ * Arbitration feature (NVME_FEAT_ARBITRATION) value.  All weights are 0's based.
+ */
+union nvme_feat_arbitration {
+	uint32_t	raw;
+	struct {
+		/** arbitration burst, as a power of two */
+		uint32_t ab		: 3;
+
+		uint32_t reserved	: 5;
+
+		/** low priority weight */
+		uint32_t lpw		: 8;
+
+		/** medium priority weight */
+		uint32_t mpw		: 8;
+
+		/** high priority weight */
+		uint32_t hpw		: 8;
+	} bits;
+};
+_Static_assert(sizeof(union nvme_feat_arbitration) == 4, "Incorrect size");
+
 enum nvme_dsm_attribute {
 	NVME_DSM_ATTR_INTEGRAL_READ		= 0x1,
 	NVME_DSM_ATTR_INTEGRAL_WRITE		= 0x2,
 	NVME_DSM_ATTR_DEALLOCATE		= 0x4,
 };
 
+/* Read and write command dword 12 flags */
+#define NVME_RW_FORCE_UNIT_ACCESS		(1u << 30)
+#define NVME_RW_LIMITED_RETRY			(1u << 31)
+
+/* Access frequency hint of the read and write dataset management field (dword 13 bits 3:0) */
+enum nvme_dsm_access_frequency {
+	NVME_DSM_FREQ_NONE			= 0x0,
+	NVME_DSM_FREQ_TYPICAL			= 0x1,
+	NVME_DSM_FREQ_INFREQ_READ_INFREQ_WRITE	= 0x2,
+	NVME_DSM_FREQ_INFREQ_READ_FREQ_WRITE	= 0x3,
+	NVME_DSM_FREQ_FREQ_READ_INFREQ_WRITE	= 0x4,
+	NVME_DSM_FREQ_FREQ_READ_FREQ_WRITE	= 0x5,
+	NVME_DSM_FREQ_ONE_TIME_READ		= 0x6,
+	NVME_DSM_FREQ_SPECULATIVE_READ		= 0x7,
+	NVME_DSM_FREQ_OVERWRITTEN		= 0x8,
+};
+
+/* Access latency hint of the read and write dataset management field (dword 13 bits 5:4) */
+enum nvme_dsm_access_latency {
+	NVME_DSM_LATENCY_NONE			= 0x0,
+	NVME_DSM_LATENCY_IDLE			= 0x1,
+	NVME_DSM_LATENCY_NORMAL			= 0x2,
+	NVME_DSM_LATENCY_LOW			= 0x3,
+};
+
+#define NVME_DSM_SEQUENTIAL_REQUEST		(1u << 6)
+#define NVME_DSM_INCOMPRESSIBLE			(1u << 7)
+
 struct nvme_power_state {
 	uint16_t mp;				/* bits 15:00: maximum power */
 
@@ -541,7 +637,15 @@ struct __attribute__((packed)) nvme_controller_data {
 		/* supports firmware activate/download commands */
 		uint16_t	firmware  : 1;
 
-		uint16_t	oacs_rsvd : 13;
+		/* supports namespace management commands */
+		uint16_t	ns_manage : 1;
+
+		uint16_t	oacs_rsvd1 : 4;
+
+		/* supports doorbell buffer config command */
+		uint16_t	doorbell_buffer_config : 1;
+
+		uint16_t	oacs_rsvd2 : 7;
 	} oacs;
 
 	/** abort command limit */
@@ -650,11 +754,19 @@ struct __attribute__((packed)) nvme_controller_data {
 		uint16_t	compare : 1;
 		uint16_t	write_unc : 1;
 		uint16_t	dsm: 1;
-		uint16_t	reserved: 13;
+		uint16_t	write_zeroes: 1;
+		uint16_t	set_features_save: 1;
+		uint16_t	reservations: 1;
+		uint16_t	timestamp: 1;
+		uint16_t	verify: 1;
+		uint16_t	reserved: 8;
 	} oncs;
 
 	/** fused operation support */
-	uint16_t		fuses;
+	struct {
+		uint16_t	compare_and_write : 1;
+		uint16_t	reserved : 15;
+	} fuses;
 
 	/** format nvm attributes */
 	uint8_t			fna;
@@ -0,0 +1,141 @@
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright(c) 2015 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/** \file
+ * Layout of the NVMe driver's binary trace buffer.
+ *
+ * The driver records I/O events into a POSIX shared memory object (see
+ *  nvme_trace_enable()).  The object starts with a struct nvme_trace_header,
+ *  followed by num_rings rings, each a struct nvme_trace_ring followed by
+ *  num_entries events.  Each ring is written by a single thread, which
+ *  overwrites its oldest events once the ring is full.
+ */
+
+#ifndef SPDK_NVME_TRACE_H
+#define SPDK_NVME_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NVME_TRACE_MAGIC	0x45435254454d564eULL	/* "NVMETRCE" */
+#define NVME_TRACE_VERSION	1
+
+enum nvme_trace_event_type {
+	/** Command written to the submission queue, including resubmission after a retry */
+	NVME_TRACE_SUBMIT	= 1,
+	/** Command completed, and its callback is about to be called */
+	NVME_TRACE_COMPLETE	= 2,
+	/** Request queued in software, because no tracker was free or the qpair was disabled */
+	NVME_TRACE_QUEUE	= 3,
+	/** Command completed with a retryable error, and is resubmitted */
+	NVME_TRACE_RETRY	= 4,
+	/** Command completed with a retryable error, and waits off the queue to be resubmitted */
+	NVME_TRACE_DELAY	= 5,
+};
+
+struct nvme_trace_entry {
+	/** Timestamp counter value, see nvme_trace_header::tsc_hz */
+	uint64_t	tsc;
+	/** Starting LBA, for commands that take one */
+	uint64_t	lba;
+	/** Number of logical blocks, for commands that take an LBA; 0 otherwise */
+	uint32_t	num_blocks;
+	/** Identifies the controller, in the order controllers were attached */
+	uint16_t	ctrlr_id;
+	/** Queue ID, 0 for the admin queue */
+	uint16_t	qid;
+	/** Command ID, or 0xFFFF for NVME_TRACE_QUEUE events */
+	uint16_t	cid;
+	/** Status code type << 8 | status code, for completion events: COMPLETE, RETRY and DELAY */
+	uint16_t	status;
+	/** enum nvme_trace_event_type */
+	uint8_t		type;
+	uint8_t		opc;
+	uint16_t	reserved;
+};
+
+struct nvme_trace_header {
+	uint64_t	magic;
+	uint32_t	version;
+	uint32_t	num_rings;
+	/** Entries per ring, a power of two */
+	uint32_t	num_entries;
+	/**
+	 * Rings claimed by threads.  Larger than num_rings if more threads
+	 *  did I/O than there are rings; those threads were not traced.
+	 */
+	uint32_t	num_rings_used;
+	/** Timestamp counter ticks per second */
+	uint64_t	tsc_hz;
+	uint8_t		reserved[32];
+};
+
+struct nvme_trace_ring {
+	/**
+	 * Number of events ever written to the ring.  Event i is at
+	 *  entries[i % num_entries], so the last min(head, num_entries)
+	 *  events are valid.
+	 */
+	uint64_t		head;
+	/** Kernel thread ID of the thread that claimed the ring */
+	uint32_t		thread_id;
+	uint8_t			reserved[52];
+	struct nvme_trace_entry	entries[];
+};
+
+static inline size_t
+nvme_trace_ring_size(uint32_t num_entries)
+{
+	return sizeof(struct nvme_trace_ring) + (size_t)num_entries * sizeof(struct nvme_trace_entry);
+}
+
+/**
+ * \brief Return the size of a trace buffer with the given geometry.
+ */
+static inline size_t
+nvme_trace_size(uint32_t num_rings, uint32_t num_entries)
+{
+	return sizeof(struct nvme_trace_header) + num_rings * nvme_trace_ring_size(num_entries);
+}
+
+/**
+ * \brief Return ring i of a trace buffer.
+ */
+static inline struct nvme_trace_ring *
+nvme_trace_get_ring(const struct nvme_trace_header *trace, uint32_t i)
+{
+	return (struct nvme_trace_ring *)((uintptr_t)(trace + 1) +
+					  i * nvme_trace_ring_size(trace->num_entries));
+}
+
+#endif
@@ -43,10 +43,30 @@ struct nvme_driver g_nvme_driver = {
 };
 
 int32_t		nvme_retry_count;
-__thread int	nvme_thread_ioq_index = -1;
-// @yzy
-// add some more available queue id's
-__thread int	nvme_thread_ioq_index_array[MAX_QUEUE_PER_THREAD];
+uint32_t	nvme_cq_doorbell_threshold = NVME_DEFAULT_CQ_DOORBELL_THRESHOLD;
+uint32_t	nvme_request_cache_size = NVME_DEFAULT_REQUEST_CACHE_SIZE;
+uint32_t	nvme_request_cache_batch = NVME_DEFAULT_REQUEST_CACHE_BATCH;
+
+/*
+ * Free nvme_request objects kept by each thread, so that allocating and
+ *  freeing a request does not go to the nvme_alloc_request() pool.  The
+ *  pool is only used, in batches, when the cache runs empty or full.
+ */
+struct nvme_request_cache {
+	uint32_t			count;
+	struct nvme_request		*reqs[NVME_REQUEST_CACHE_MAX_SIZE];
+#ifdef NVME_STATS
+	struct nvme_request_cache_stats	stats;
+#endif
+};
+
+static __thread struct nvme_request_cache t_request_cache;
+
+#ifdef NVME_STATS
+#define nvme_request_cache_stat_inc(cache, counter)	((cache)->stats.counter++)
+#else
+#define nvme_request_cache_stat_inc(cache, counter)	do { } while (0)
+#endif
 
 /**
  * \page nvme_initialization NVMe Initialization
@@ -54,7 +74,7 @@ __thread int	nvme_thread_ioq_index_array[MAX_QUEUE_PER_THREAD];
 \msc
 
 	app [label="Application"], nvme [label="NVMe Driver"];
-	app=>nvme [label="nvme_attach(devhandle)"];
+	app=>nvme [label="nvme_attach(devhandle, opts)"];
 	app<<nvme [label="nvme_controller ptr"];
 	app=>nvme [label="nvme_ctrlr_start(nvme_controller ptr)"];
 	nvme=>nvme [label="identify controller"];
@@ -66,13 +86,36 @@ __thread int	nvme_thread_ioq_index_array[MAX_QUEUE_PER_THREAD];
 
  */
 
+void
+nvme_ctrlr_opts_set_defaults(struct nvme_ctrlr_opts *opts)
+{
+	opts->io_queue_size = NVME_IO_ENTRIES;
+	opts->io_queue_requests = NVME_IO_TRACKERS;
+	opts->enable_wrr = true;
+	opts->high_priority_weight = NVME_DEFAULT_HIGH_PRIORITY_WEIGHT;
+	opts->medium_priority_weight = NVME_DEFAULT_MEDIUM_PRIORITY_WEIGHT;
+	opts->low_priority_weight = NVME_DEFAULT_LOW_PRIORITY_WEIGHT;
+	opts->intr_ops = NULL;
+	opts->intr_ctx = NULL;
+	opts->timeout_sec = NVME_DEFAULT_TIMEOUT_PERIOD;
+	opts->retry_backoff_us[NVME_RETRY_CLASS_ABORTED] = 0;
+	opts->retry_backoff_us[NVME_RETRY_CLASS_NAMESPACE_NOT_READY] =
+		NVME_DEFAULT_NS_NOT_READY_BACKOFF_US;
+}
+
 struct nvme_controller *
-nvme_attach(void *devhandle)
+nvme_attach(void *devhandle, const struct nvme_ctrlr_opts *opts)
 {
 	struct nvme_controller	*ctrlr;
+	struct nvme_ctrlr_opts	default_opts;
 	int			status;
 	uint64_t		phys_addr = 0;
 
+	if (opts == NULL) {
+		nvme_ctrlr_opts_set_defaults(&default_opts);
+		opts = &default_opts;
+	}
+
 	ctrlr = nvme_malloc("nvme_ctrlr", sizeof(struct nvme_controller),
 			    64, &phys_addr);
 	if (ctrlr == NULL) {
@@ -80,12 +123,14 @@ nvme_attach(void *devhandle)
 		return NULL;
 	}
 
-	status = nvme_ctrlr_construct(ctrlr, devhandle);
+	status = nvme_ctrlr_construct(ctrlr, opts, devhandle);
 	if (status != 0) {
 		nvme_free(ctrlr);
 		return NULL;
 	}
 
+	ctrlr->trace_id = __atomic_fetch_add(&g_nvme_driver.next_trace_id, 1, __ATOMIC_RELAXED);
+
 	if (nvme_ctrlr_start(ctrlr) != 0) {
 		nvme_ctrlr_destruct(ctrlr);
 		nvme_free(ctrlr);
@@ -123,13 +168,127 @@ nvme_request_size(void)
 	return sizeof(struct nvme_request);
 }
 
+static uint32_t
+nvme_request_cache_max(void)
+{
+	return nvme_min(nvme_request_cache_size, NVME_REQUEST_CACHE_MAX_SIZE);
+}
+
+static uint32_t
+nvme_request_cache_batch_size(uint32_t max)
+{
+	return nvme_min(nvme_max(nvme_request_cache_batch, 1), max);
+}
+
+/*
+ * Return cached requests to the pool until at most count are left.
+ */
+static void
+nvme_request_cache_trim(struct nvme_request_cache *cache, uint32_t count)
+{
+	uint32_t num_reqs;
+
+	if (cache->count <= count) {
+		return;
+	}
+
+	num_reqs = cache->count - count;
+	cache->count = count;
+	nvme_dealloc_request_bulk((void **)&cache->reqs[count], num_reqs);
+	nvme_request_cache_stat_inc(cache, pool_puts);
+}
+
+static struct nvme_request *
+nvme_request_cache_refill(struct nvme_request_cache *cache)
+{
+	struct nvme_request	*req = NULL;
+	uint32_t		max, batch;
+
+	max = nvme_request_cache_max();
+	if (max != 0) {
+		batch = nvme_request_cache_batch_size(max);
+		if (nvme_alloc_request_bulk((void **)cache->reqs, batch) == 0) {
+			nvme_request_cache_stat_inc(cache, pool_gets);
+			cache->count = batch - 1;
+			return cache->reqs[batch - 1];
+		}
+	}
+
+	/* The cache is disabled, or the pool has fewer than a batch left. */
+	nvme_request_cache_stat_inc(cache, pool_gets);
+	nvme_alloc_request(&req);
+	return req;
+}
+
+static inline struct nvme_request *
+nvme_request_cache_get(void)
+{
+	struct nvme_request_cache *cache = &t_request_cache;
+
+	nvme_request_cache_stat_inc(cache, allocs);
+	if (cache->count == 0) {
+		return nvme_request_cache_refill(cache);
+	}
+
+	return cache->reqs[--cache->count];
+}
+
+static void
+nvme_request_cache_overflow(struct nvme_request_cache *cache, struct nvme_request *req)
+{
+	uint32_t max;
+
+	max = nvme_request_cache_max();
+	if (max == 0) {
+		nvme_request_cache_trim(cache, 0);
+		nvme_request_cache_stat_inc(cache, pool_puts);
+		nvme_dealloc_request(req);
+		return;
+	}
+
+	/* Leave room for a batch of frees before the pool is used again. */
+	nvme_request_cache_trim(cache, max - nvme_request_cache_batch_size(max));
+	cache->reqs[cache->count++] = req;
+}
+
+static inline void
+nvme_request_cache_put(struct nvme_request *req)
+{
+	struct nvme_request_cache *cache = &t_request_cache;
+
+	nvme_request_cache_stat_inc(cache, frees);
+	if (cache->count >= nvme_request_cache_max()) {
+		nvme_request_cache_overflow(cache, req);
+		return;
+	}
+
+	cache->reqs[cache->count++] = req;
+}
+
+void
+nvme_request_cache_flush(void)
+{
+	nvme_request_cache_trim(&t_request_cache, 0);
+}
+
+void
+nvme_request_cache_get_stats(struct nvme_request_cache_stats *stats)
+{
+#ifdef NVME_STATS
+	*stats = t_request_cache.stats;
+#else
+	memset(stats, 0, sizeof(*stats));
+#endif
+	stats->cached = t_request_cache.count;
+}
+
 struct nvme_request *
 nvme_allocate_request(void *payload, uint32_t payload_size,
 		      nvme_cb_fn_t cb_fn, void *cb_arg)
 {
-	struct nvme_request *req = NULL;
+	struct nvme_request *req;
 
-	nvme_alloc_request(&req);
+	req = nvme_request_cache_get();
 
 	if (req == NULL) {
 		return req;
@@ -137,7 +296,7 @@ nvme_allocate_request(void *payload, uint32_t payload_size,
 
 	/*
 	 * Only memset up to (but not including) the children
-	 *  TAILQ_ENTRY.  children, and following members, are
+	 *  STAILQ_HEAD.  children, and following members, are
 	 *  only used as part of I/O splitting so we avoid
 	 *  memsetting them until it is actually needed.
 	 *  They will be initialized in nvme_request_add_child()
@@ -165,104 +324,5 @@ void
 nvme_free_request(struct nvme_request *req)
 {
 	nvme_assert(req != NULL, ("nvme_free_request(NULL)\n"));
-	nvme_dealloc_request(req);
+	nvme_request_cache_put(req);
 }
-
-static int
-nvme_allocate_ioq_index(void)
-{
-	struct nvme_driver	*driver = &g_nvme_driver;
-	uint32_t		i;
-
-	nvme_mutex_lock(&driver->lock);
-	if (driver->ioq_index_pool == NULL) {
-		driver->ioq_index_pool =
-			calloc(driver->max_io_queues, sizeof(*driver->ioq_index_pool));
-		if (driver->ioq_index_pool) {
-			for (i = 0; i < driver->max_io_queues; i++) {
-				driver->ioq_index_pool[i] = i;
-			}
-		} else {
-			nvme_mutex_unlock(&driver->lock);
-			return -1;
-		}
-		driver->ioq_index_pool_next = 0;
-	}
-
-	if (driver->ioq_index_pool_next < driver->max_io_queues) {
-		nvme_thread_ioq_index = driver->ioq_index_pool[driver->ioq_index_pool_next];
-		driver->ioq_index_pool[driver->ioq_index_pool_next] = -1;
-		driver->ioq_index_pool_next++;
-	} else {
-		nvme_thread_ioq_index = -1;
-	}
-
-	// @yzy
-	// first clear id's to -1
-	for (i = 0; i < MAX_QUEUE_PER_THREAD; i++)
-		nvme_thread_ioq_index_array[i] = -1;
-	// copy origin index to _0
-	nvme_thread_ioq_index_array[0] = nvme_thread_ioq_index;
-	// try to allocate MAX_QUEUE_PER_THREAD - 1 more queue to _1
-	for (i = 1; i < MAX_QUEUE_PER_THREAD; i++){
-		if (driver->ioq_index_pool_next < driver->max_io_queues) {
-			nvme_thread_ioq_index_array[i] = driver->ioq_index_pool[driver->ioq_index_pool_next];
-			driver->ioq_index_pool[driver->ioq_index_pool_next] = -1;
-			driver->ioq_index_pool_next++;
-		} else {
-			nvme_thread_ioq_index_array[i] = -1;
-		}
-	}
-
-	nvme_mutex_unlock(&driver->lock);
-	return 0;
-}
-
-static void
-nvme_free_ioq_index(void)
-{
-	struct nvme_driver	*driver = &g_nvme_driver;
-
-	nvme_mutex_lock(&driver->lock);
-	if (nvme_thread_ioq_index >= 0) {
-		driver->ioq_index_pool_next--;
-		driver->ioq_index_pool[driver->ioq_index_pool_next] = nvme_thread_ioq_index;
-		nvme_thread_ioq_index = -1;
-	}
-	// @yzy
-	// _0 has been freed, try to free _1
-	uint32_t i;
-	for (i = 1; i < MAX_QUEUE_PER_THREAD; i++){
-		if (nvme_thread_ioq_index_array[i] >= 0) {
-			driver->ioq_index_pool_next--;
-			driver->ioq_index_pool[driver->ioq_index_pool_next] = nvme_thread_ioq_index_array[i];
-			nvme_thread_ioq_index_array[i] = -1;
-		}
-	}
-	nvme_mutex_unlock(&driver->lock);
-}
-
-int
-nvme_register_io_thread(void)
-{
-	int rc = 0;
-
-	if (nvme_thread_ioq_index >= 0) {
-		nvme_printf(NULL, "thread already registered\n");
-		return -1;
-	}
-
-	rc = nvme_allocate_ioq_index();
-	if (rc) {
-		nvme_printf(NULL, "ioq_index_pool alloc failed\n");
-		return rc;
-	}
-	return (nvme_thread_ioq_index >= 0) ? 0 : -1;
-}
-
-void
-nvme_unregister_io_thread(void)
-{
-	nvme_free_ioq_index();
-}
-
@@ -48,77 +48,82 @@ nvme_ctrlr_construct_admin_qpair(struct nvme_controller *ctrlr)
 				    0, /* qpair ID */
 				    NVME_ADMIN_ENTRIES,
 				    NVME_ADMIN_TRACKERS,
-				    ctrlr);
+				    ctrlr, NULL);
 }
 
-static int
-nvme_ctrlr_construct_io_qpairs(struct nvme_controller *ctrlr)
+static void
+nvme_ctrlr_init_io_queue_opts(struct nvme_controller *ctrlr)
 {
-	struct nvme_qpair		*qpair;
 	union nvme_cap_lo_register	cap_lo;
-	uint32_t			i, num_entries, num_trackers;
-	int				rc;
-
-	if (ctrlr->ioq != NULL) {
-		/*
-		 * io_qpairs were already constructed, so just return.
-		 *  This typically happens when the controller is
-		 *  initialized a second (or subsequent) time after a
-		 *  controller reset.
-		 */
-		return 0;
-	}
+	uint32_t			num_entries, num_trackers;
 
 	/*
 	 * NVMe spec sets a hard limit of 64K max entries, but
 	 *  devices may specify a smaller limit, so we need to check
-	 *  the MQES field in the capabilities register.
+	 *  the MQES field in the capabilities register.  num_entries
+	 *  is tracked in 16 bits, so cap it one short of 64K.  Leave room
+	 *  for NVME_MIN_IO_TRACKERS where the controller allows it.
 	 */
 	cap_lo.raw = nvme_mmio_read_4(ctrlr, cap_lo.raw);
-	num_entries = nvme_min(NVME_IO_ENTRIES, cap_lo.bits.mqes + 1);
+	num_entries = nvme_max(ctrlr->opts.io_queue_size, NVME_MIN_IO_TRACKERS + 1u);
+	num_entries = nvme_min(num_entries, cap_lo.bits.mqes + 1u);
+	num_entries = nvme_min(num_entries, UINT16_MAX);
+	num_entries = nvme_max(num_entries, 2u);
 
 	/*
 	 * No need to have more trackers than entries in the submit queue.
 	 *  Note also that for a queue size of N, we can only have (N-1)
-	 *  commands outstanding, hence the "-1" here.
+	 *  commands outstanding, hence the "-1" here.  A fused pair needs
+	 *  two trackers at once, so do not go below NVME_MIN_IO_TRACKERS
+	 *  unless the queue is too small.
 	 */
-	num_trackers = nvme_min(NVME_IO_TRACKERS, (num_entries - 1));
+	num_trackers = nvme_max(ctrlr->opts.io_queue_requests, NVME_MIN_IO_TRACKERS);
+	num_trackers = nvme_min(num_trackers, (num_entries - 1));
 
-	ctrlr->max_xfer_size = NVME_MAX_XFER_SIZE;
+	ctrlr->opts.io_queue_size = num_entries;
+	ctrlr->opts.io_queue_requests = num_trackers;
 
-	ctrlr->ioq = calloc(ctrlr->num_io_queues, sizeof(struct nvme_qpair));
-
-	if (ctrlr->ioq == NULL)
-		return -1;
-
-	for (i = 0; i < ctrlr->num_io_queues; i++) {
-		qpair = &ctrlr->ioq[i];
+	if (ctrlr->opts.timeout_sec != 0) {
+		ctrlr->opts.timeout_sec = nvme_max(ctrlr->opts.timeout_sec, NVME_MIN_TIMEOUT_PERIOD);
+		ctrlr->opts.timeout_sec = nvme_min(ctrlr->opts.timeout_sec, NVME_MAX_TIMEOUT_PERIOD);
+	}
+}
 
-		/*
-		 * Admin queue has ID=0. IO queues start at ID=1 -
-		 *  hence the 'i+1' here.
-		 */
-		rc = nvme_qpair_construct(qpair,
-					  i + 1, /* qpair ID */
-					  num_entries,
-					  num_trackers,
-					  ctrlr);
-		if (rc)
-			return -1;
+/*
+ * Grab the lowest free I/O queue ID, or return 0 if all are in use.
+ */
+static uint16_t
+nvme_ctrlr_get_free_io_qid(struct nvme_controller *ctrlr)
+{
+	uint32_t i, bit;
+
+	for (i = 0; i < (ctrlr->num_io_queues + 63) / 64; i++) {
+		if (ctrlr->free_io_qids[i] != 0) {
+			bit = __builtin_ctzll(ctrlr->free_io_qids[i]);
+			ctrlr->free_io_qids[i] &= ~(1ULL << bit);
+			/* Admin queue has ID=0, so I/O queue IDs start at 1. */
+			return i * 64 + bit + 1;
+		}
 	}
 
 	return 0;
 }
 
+static void
+nvme_ctrlr_put_free_io_qid(struct nvme_controller *ctrlr, uint16_t qid)
+{
+	ctrlr->free_io_qids[(qid - 1) / 64] |= 1ULL << ((qid - 1) % 64);
+}
+
 static void
 nvme_ctrlr_fail(struct nvme_controller *ctrlr)
 {
-	uint32_t i;
+	struct nvme_qpair *qpair;
 
 	ctrlr->is_failed = true;
 	nvme_qpair_fail(&ctrlr->adminq);
-	for (i = 0; i < ctrlr->num_io_queues; i++) {
-		nvme_qpair_fail(&ctrlr->ioq[i]);
+	TAILQ_FOREACH(qpair, &ctrlr->active_io_qpairs, tailq) {
+		nvme_qpair_fail(qpair);
 	}
 }
 
@@ -216,6 +221,7 @@ nvme_ctrlr_shutdown(struct nvme_controller *ctrlr)
 static int
 nvme_ctrlr_enable(struct nvme_controller *ctrlr)
 {
+	union nvme_cap_lo_register	cap_lo;
 	union nvme_cc_register		cc;
 	union nvme_csts_register	csts;
 	union nvme_aqa_register		aqa;
@@ -243,9 +249,17 @@ nvme_ctrlr_enable(struct nvme_controller *ctrlr)
 	nvme_mmio_write_4(ctrlr, aqa.raw, aqa.raw);
 	nvme_delay(5000);
 
+	/*
+	 * Weighted round robin is what gives I/O submission queue
+	 *  priorities any meaning, so select it whenever allowed.
+	 */
+	cap_lo.raw = nvme_mmio_read_4(ctrlr, cap_lo.raw);
+	ctrlr->is_wrr_enabled = ctrlr->opts.enable_wrr &&
+				(cap_lo.bits.ams & NVME_CAP_AMS_WRR);
+
 	cc.bits.en = 1;
 	cc.bits.css = 0;
-	cc.bits.ams = 0;
+	cc.bits.ams = ctrlr->is_wrr_enabled ? NVME_CC_AMS_WRR : NVME_CC_AMS_RR;
 	cc.bits.shn = 0;
 	cc.bits.iosqes = 6; /* SQ entry size == 64 == 2^6 */
 	cc.bits.iocqes = 4; /* CQ entry size == 16 == 2^4 */
@@ -262,15 +276,15 @@ nvme_ctrlr_enable(struct nvme_controller *ctrlr)
 int
 nvme_ctrlr_hw_reset(struct nvme_controller *ctrlr)
 {
-	uint32_t i;
+	struct nvme_qpair *qpair;
 	int rc;
 	union nvme_cc_register cc;
 
 	cc.raw = nvme_mmio_read_4(ctrlr, cc.raw);
 	if (cc.bits.en) {
 		nvme_qpair_disable(&ctrlr->adminq);
-		for (i = 0; i < ctrlr->num_io_queues; i++) {
-			nvme_qpair_disable(&ctrlr->ioq[i]);
+		TAILQ_FOREACH(qpair, &ctrlr->active_io_qpairs, tailq) {
+			nvme_qpair_disable(qpair);
 		}
 
 		nvme_delay(100 * 1000);
@@ -358,7 +372,7 @@ nvme_ctrlr_set_num_qpairs(struct nvme_controller *ctrlr)
 	struct nvme_driver			*driver = &g_nvme_driver;
 	struct nvme_completion_poll_status	status;
 	int					cq_allocated, sq_allocated;
-	uint32_t				max_io_queues;
+	uint32_t				max_io_queues, num_io_queues, i;
 
 	status.done = false;
 
@@ -384,7 +398,35 @@ nvme_ctrlr_set_num_qpairs(struct nvme_controller *ctrlr)
 	sq_allocated = (status.cpl.cdw0 & 0xFFFF) + 1;
 	cq_allocated = (status.cpl.cdw0 >> 16) + 1;
 
-	ctrlr->num_io_queues = nvme_min(sq_allocated, cq_allocated);
+	num_io_queues = nvme_min(sq_allocated, cq_allocated);
+
+	if (ctrlr->free_io_qids != NULL) {
+		/*
+		 * Re-initialization after a reset.  Queue IDs already handed
+		 *  out must remain valid, so the controller has to grant at
+		 *  least as many queues as it did the first time.
+		 */
+		if (num_io_queues < ctrlr->num_io_queues) {
+			nvme_printf(ctrlr, "only %u of %u I/O queues granted after reset\n",
+				    num_io_queues, ctrlr->num_io_queues);
+			return ENXIO;
+		}
+		return 0;
+	}
+
+	ctrlr->num_io_queues = num_io_queues;
+	ctrlr->free_io_qids = calloc((num_io_queues + 63) / 64, sizeof(uint64_t));
+	ctrlr->io_qpair_by_qid = calloc(num_io_queues + 1, sizeof(struct nvme_qpair *));
+	if (ctrlr->free_io_qids == NULL || ctrlr->io_qpair_by_qid == NULL) {
+		free(ctrlr->free_io_qids);
+		free(ctrlr->io_qpair_by_qid);
+		ctrlr->free_io_qids = NULL;
+		ctrlr->io_qpair_by_qid = NULL;
+		return ENOMEM;
+	}
+	for (i = 0; i < num_io_queues; i++) {
+		nvme_ctrlr_put_free_io_qid(ctrlr, i + 1);
+	}
 
 	nvme_mutex_lock(&driver->lock);
 	driver->max_io_queues = nvme_min(driver->max_io_queues, ctrlr->num_io_queues);
@@ -393,21 +435,141 @@ nvme_ctrlr_set_num_qpairs(struct nvme_controller *ctrlr)
 	return 0;
 }
 
-static int
-nvme_ctrlr_create_qpairs(struct nvme_controller *ctrlr)
+/* Convert a weight from the controller options to the 0's based feature value. */
+static uint32_t
+nvme_ctrlr_arbitration_weight(uint32_t weight)
+{
+	return nvme_min(nvme_max(weight, 1u), 256u) - 1;
+}
+
+/*
+ * Program the weighted round robin weights.  The arbitration burst is left
+ *  as the controller reports it.  Failure is not fatal - the controller keeps
+ *  its default weights.
+ */
+static void
+nvme_ctrlr_set_arbitration(struct nvme_controller *ctrlr)
 {
 	struct nvme_completion_poll_status	status;
-	struct nvme_qpair			*qpair;
-	uint32_t				i;
+	union nvme_feat_arbitration		arb;
 
-	if (nvme_ctrlr_construct_io_qpairs(ctrlr)) {
-		nvme_printf(ctrlr, "nvme_ctrlr_construct_io_qpairs failed!\n");
-		return ENXIO;
+	if (!ctrlr->is_wrr_enabled) {
+		return;
+	}
+
+	status.done = false;
+	nvme_ctrlr_cmd_get_feature(ctrlr, NVME_FEAT_ARBITRATION, 0, NULL, 0,
+				   nvme_completion_poll_cb, &status);
+	while (status.done == false) {
+		nvme_qpair_process_completions(&ctrlr->adminq, 0);
+	}
+	if (nvme_completion_is_error(&status.cpl)) {
+		nvme_printf(ctrlr, "get arbitration feature failed!\n");
+		return;
+	}
+
+	arb.raw = status.cpl.cdw0;
+	arb.bits.hpw = nvme_ctrlr_arbitration_weight(ctrlr->opts.high_priority_weight);
+	arb.bits.mpw = nvme_ctrlr_arbitration_weight(ctrlr->opts.medium_priority_weight);
+	arb.bits.lpw = nvme_ctrlr_arbitration_weight(ctrlr->opts.low_priority_weight);
+
+	status.done = false;
+	nvme_ctrlr_cmd_set_arbitration(ctrlr, arb, nvme_completion_poll_cb, &status);
+	while (status.done == false) {
+		nvme_qpair_process_completions(&ctrlr->adminq, 0);
+	}
+	if (nvme_completion_is_error(&status.cpl)) {
+		nvme_printf(ctrlr, "set arbitration feature failed!\n");
+	}
+}
+
+/*
+ * Register shadow doorbell and EventIdx buffers with controllers that
+ *  support Doorbell Buffer Config (typically emulated controllers, where
+ *  each doorbell MMIO write traps to the hypervisor).  Failure is not
+ *  fatal - the I/O queues simply keep using MMIO doorbells.
+ */
+static void
+nvme_ctrlr_setup_doorbell_buffer(struct nvme_controller *ctrlr)
+{
+	struct nvme_completion_poll_status	status;
+
+	if (!ctrlr->cdata.oacs.doorbell_buffer_config) {
+		return;
+	}
+
+	if (ctrlr->shadow_doorbell == NULL) {
+		ctrlr->shadow_doorbell = nvme_malloc("nvme_shadow_doorbell", PAGE_SIZE, PAGE_SIZE,
+						     &ctrlr->shadow_doorbell_bus_addr);
+		if (ctrlr->shadow_doorbell == NULL) {
+			nvme_printf(ctrlr, "alloc shadow doorbell buffer failed\n");
+			return;
+		}
+		ctrlr->eventidx = nvme_malloc("nvme_eventidx", PAGE_SIZE, PAGE_SIZE,
+					      &ctrlr->eventidx_bus_addr);
+		if (ctrlr->eventidx == NULL) {
+			nvme_printf(ctrlr, "alloc eventidx buffer failed\n");
+			nvme_free(ctrlr->shadow_doorbell);
+			ctrlr->shadow_doorbell = NULL;
+			return;
+		}
+	}
+
+	/*
+	 * Queues are recreated with head and tail at 0 after a reset, so the
+	 *  buffers must not carry values over from before the reset.
+	 */
+	memset(ctrlr->shadow_doorbell, 0, PAGE_SIZE);
+	memset(ctrlr->eventidx, 0, PAGE_SIZE);
+
+	status.done = false;
+	nvme_ctrlr_cmd_doorbell_buffer_config(ctrlr, ctrlr->shadow_doorbell_bus_addr,
+					      ctrlr->eventidx_bus_addr,
+					      nvme_completion_poll_cb, &status);
+	while (status.done == false) {
+		nvme_qpair_process_completions(&ctrlr->adminq, 0);
+	}
+	if (nvme_completion_is_error(&status.cpl)) {
+		nvme_printf(ctrlr, "nvme_doorbell_buffer_config failed!\n");
+		nvme_free(ctrlr->shadow_doorbell);
+		nvme_free(ctrlr->eventidx);
+		ctrlr->shadow_doorbell = NULL;
+		ctrlr->eventidx = NULL;
 	}
+}
 
-	for (i = 0; i < ctrlr->num_io_queues; i++) {
-		qpair = &ctrlr->ioq[i];
+static void
+nvme_ctrlr_init_shadow_doorbells(struct nvme_controller *ctrlr, struct nvme_qpair *qpair)
+{
+	uint32_t sq_index = (2 * qpair->id + 0) * ctrlr->doorbell_stride_u32;
+	uint32_t cq_index = (2 * qpair->id + 1) * ctrlr->doorbell_stride_u32;
+
+	/* Doorbells for queue IDs past the end of the page have no shadow. */
+	if (ctrlr->shadow_doorbell == NULL || cq_index >= PAGE_SIZE / sizeof(uint32_t)) {
+		qpair->sq_shadow_tdbl = NULL;
+		qpair->cq_shadow_hdbl = NULL;
+		qpair->sq_eventidx = NULL;
+		qpair->cq_eventidx = NULL;
+		return;
+	}
 
+	qpair->sq_shadow_tdbl = &ctrlr->shadow_doorbell[sq_index];
+	qpair->cq_shadow_hdbl = &ctrlr->shadow_doorbell[cq_index];
+	qpair->sq_eventidx = &ctrlr->eventidx[sq_index];
+	qpair->cq_eventidx = &ctrlr->eventidx[cq_index];
+}
+
+/*
+ * Create the submission and completion queues for an already constructed
+ *  I/O qpair on the controller.  Called with ctrlr_lock held.
+ */
+static int
+nvme_ctrlr_create_io_qpair(struct nvme_controller *ctrlr, struct nvme_qpair *qpair)
+{
+	struct nvme_completion_poll_status	status;
+	bool					owns_cq = (qpair->cq_qpair == qpair);
+
+	if (owns_cq) {
 		status.done = false;
 		nvme_ctrlr_cmd_create_io_cq(ctrlr, qpair,
 					    nvme_completion_poll_cb, &status);
@@ -418,19 +580,136 @@ nvme_ctrlr_create_qpairs(struct nvme_controller *ctrlr)
 			nvme_printf(ctrlr, "nvme_create_io_cq failed!\n");
 			return ENXIO;
 		}
+	}
 
-		status.done = false;
-		nvme_ctrlr_cmd_create_io_sq(qpair->ctrlr, qpair,
-					    nvme_completion_poll_cb, &status);
-		while (status.done == false) {
-			nvme_qpair_process_completions(&ctrlr->adminq, 0);
+	status.done = false;
+	nvme_ctrlr_cmd_create_io_sq(ctrlr, qpair,
+				    nvme_completion_poll_cb, &status);
+	while (status.done == false) {
+		nvme_qpair_process_completions(&ctrlr->adminq, 0);
+	}
+	if (nvme_completion_is_error(&status.cpl)) {
+		nvme_printf(ctrlr, "nvme_create_io_sq failed!\n");
+		/* Don't leak the completion queue on the controller. */
+		if (owns_cq) {
+			status.done = false;
+			nvme_ctrlr_cmd_delete_io_cq(ctrlr, qpair,
+						    nvme_completion_poll_cb, &status);
+			while (status.done == false) {
+				nvme_qpair_process_completions(&ctrlr->adminq, 0);
+			}
 		}
-		if (nvme_completion_is_error(&status.cpl)) {
-			nvme_printf(ctrlr, "nvme_create_io_sq failed!\n");
+		return ENXIO;
+	}
+
+	nvme_qpair_reset(qpair);
+	nvme_ctrlr_init_shadow_doorbells(ctrlr, qpair);
+
+	return 0;
+}
+
+/*
+ * Route the interrupt vector of the qpair's completion queue (vector number ==
+ *  qid) to a new eventfd through the controller's interrupt backend.  Must be
+ *  called before the completion queue is created.
+ */
+static int
+nvme_ctrlr_bind_io_qpair_interrupt(struct nvme_controller *ctrlr, struct nvme_qpair *qpair)
+{
+	const struct nvme_intr_ops	*ops = ctrlr->opts.intr_ops;
+	int				efd, rc;
+
+	efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd < 0) {
+		nvme_printf(ctrlr, "eventfd creation failed\n");
+		return errno;
+	}
+
+	rc = ops->bind_vector(ctrlr->opts.intr_ctx, ctrlr->devhandle, qpair->id, efd);
+	if (rc != 0) {
+		nvme_printf(ctrlr, "could not bind interrupt vector %u\n", qpair->id);
+		close(efd);
+		return rc;
+	}
+
+	qpair->intr_fd = efd;
+	return 0;
+}
+
+static void
+nvme_ctrlr_unbind_io_qpair_interrupt(struct nvme_controller *ctrlr, struct nvme_qpair *qpair)
+{
+	if (qpair->intr_fd < 0) {
+		return;
+	}
+
+	ctrlr->opts.intr_ops->unbind_vector(ctrlr->opts.intr_ctx, ctrlr->devhandle, qpair->id);
+	close(qpair->intr_fd);
+	qpair->intr_fd = -1;
+}
+
+/*
+ * Delete the submission and completion queues of an I/O qpair.  A qpair
+ *  sharing another qpair's completion queue only has its submission queue
+ *  deleted.  The submission queue must go first - the spec does not allow
+ *  deleting a completion queue that still has a submission queue mapped to
+ *  it.  Called with ctrlr_lock held.
+ */
+static int
+nvme_ctrlr_delete_io_qpair(struct nvme_controller *ctrlr, struct nvme_qpair *qpair)
+{
+	struct nvme_completion_poll_status	status;
+
+	status.done = false;
+	nvme_ctrlr_cmd_delete_io_sq(ctrlr, qpair,
+				    nvme_completion_poll_cb, &status);
+	while (status.done == false) {
+		nvme_qpair_process_completions(&ctrlr->adminq, 0);
+	}
+	if (nvme_completion_is_error(&status.cpl)) {
+		nvme_printf(ctrlr, "nvme_delete_io_sq failed!\n");
+		return ENXIO;
+	}
+
+	if (qpair->cq_qpair != qpair) {
+		/* The completion queue belongs to another qpair. */
+		return 0;
+	}
+
+	status.done = false;
+	nvme_ctrlr_cmd_delete_io_cq(ctrlr, qpair,
+				    nvme_completion_poll_cb, &status);
+	while (status.done == false) {
+		nvme_qpair_process_completions(&ctrlr->adminq, 0);
+	}
+	if (nvme_completion_is_error(&status.cpl)) {
+		nvme_printf(ctrlr, "nvme_delete_io_cq failed!\n");
+		return ENXIO;
+	}
+
+	return 0;
+}
+
+static int
+nvme_ctrlr_create_qpairs(struct nvme_controller *ctrlr)
+{
+	struct nvme_qpair	*qpair;
+
+	nvme_ctrlr_init_io_queue_opts(ctrlr);
+
+	ctrlr->max_xfer_size = NVME_MAX_XFER_SIZE;
+
+	/*
+	 * I/O qpairs are created on demand by nvme_ctrlr_alloc_io_qpair().
+	 *  After a reset, only the qpairs that are still allocated need to
+	 *  be re-created.  A qpair sharing a completion queue is always
+	 *  after the queue's owner in the list, so the completion queue
+	 *  exists by the time its submission queues are created.
+	 */
+	TAILQ_FOREACH(qpair, &ctrlr->active_io_qpairs, tailq) {
+		if (nvme_ctrlr_create_io_qpair(ctrlr, qpair) != 0) {
 			return ENXIO;
 		}
-
-		nvme_qpair_reset(qpair);
 	}
 
 	return 0;
@@ -457,6 +736,34 @@ nvme_ctrlr_destruct_namespaces(struct nvme_controller *ctrlr)
 	}
 }
 
+/*
+ * Allocate the buffers for emulating optional commands the controller lacks.
+ *  A failed allocation is not fatal; the command then fails with ENOMEM.
+ */
+static void
+nvme_ctrlr_alloc_fallback_bufs(struct nvme_controller *ctrlr)
+{
+	uint64_t phys_addr;
+
+	if (!ctrlr->cdata.oncs.write_zeroes && ctrlr->zero_buf == NULL) {
+		ctrlr->zero_buf = nvme_malloc("nvme_zero_buf", ctrlr->max_xfer_size,
+					      PAGE_SIZE, &phys_addr);
+		if (ctrlr->zero_buf == NULL) {
+			nvme_printf(ctrlr, "alloc write zeroes fallback buffer failed\n");
+		} else {
+			memset(ctrlr->zero_buf, 0, ctrlr->max_xfer_size);
+		}
+	}
+
+	if (!ctrlr->cdata.oncs.verify && ctrlr->discard_buf == NULL) {
+		ctrlr->discard_buf = nvme_malloc("nvme_discard_buf", ctrlr->max_xfer_size,
+						 PAGE_SIZE, &phys_addr);
+		if (ctrlr->discard_buf == NULL) {
+			nvme_printf(ctrlr, "alloc verify fallback buffer failed\n");
+		}
+	}
+}
+
 static int
 nvme_ctrlr_construct_namespaces(struct nvme_controller *ctrlr)
 {
@@ -603,10 +910,16 @@ nvme_ctrlr_start(struct nvme_controller *ctrlr)
 		return -1;
 	}
 
+	nvme_ctrlr_set_arbitration(ctrlr);
+
+	nvme_ctrlr_setup_doorbell_buffer(ctrlr);
+
 	if (nvme_ctrlr_create_qpairs(ctrlr) != 0) {
 		return -1;
 	}
 
+	nvme_ctrlr_alloc_fallback_bufs(ctrlr);
+
 	if (nvme_ctrlr_construct_namespaces(ctrlr) != 0) {
 		return -1;
 	}
@@ -647,7 +960,8 @@ nvme_ctrlr_free_bars(struct nvme_controller *ctrlr)
 }
 
 int
-nvme_ctrlr_construct(struct nvme_controller *ctrlr, void *devhandle)
+nvme_ctrlr_construct(struct nvme_controller *ctrlr,
+		     const struct nvme_ctrlr_opts *opts, void *devhandle)
 {
 	union nvme_cap_hi_register	cap_hi;
 	uint32_t			cmd_reg;
@@ -655,6 +969,7 @@ nvme_ctrlr_construct(struct nvme_controller *ctrlr, void *devhandle)
 	int				rc;
 
 	ctrlr->devhandle = devhandle;
+	ctrlr->opts = *opts;
 
 	status = nvme_ctrlr_allocate_bars(ctrlr);
 	if (status != 0) {
@@ -681,6 +996,8 @@ nvme_ctrlr_construct(struct nvme_controller *ctrlr, void *devhandle)
 	ctrlr->is_resetting = false;
 	ctrlr->is_failed = false;
 
+	TAILQ_INIT(&ctrlr->active_io_qpairs);
+
 	nvme_mutex_init_recursive(&ctrlr->ctrlr_lock);
 
 	return 0;
@@ -689,21 +1006,47 @@ nvme_ctrlr_construct(struct nvme_controller *ctrlr, void *devhandle)
 void
 nvme_ctrlr_destruct(struct nvme_controller *ctrlr)
 {
-	uint32_t	i;
+	struct nvme_qpair	*qpair;
+	uint32_t		i;
 
 	nvme_ctrlr_disable(ctrlr);
 	nvme_ctrlr_shutdown(ctrlr);
 
 	nvme_ctrlr_destruct_namespaces(ctrlr);
 
-	for (i = 0; i < ctrlr->num_io_queues; i++) {
-		nvme_qpair_destroy(&ctrlr->ioq[i]);
+	while (!TAILQ_EMPTY(&ctrlr->active_io_qpairs)) {
+		qpair = TAILQ_FIRST(&ctrlr->active_io_qpairs);
+		TAILQ_REMOVE(&ctrlr->active_io_qpairs, qpair, tailq);
+		nvme_ctrlr_unbind_io_qpair_interrupt(ctrlr, qpair);
+		nvme_qpair_destroy(qpair);
+		free(qpair);
 	}
 
-	free(ctrlr->ioq);
+	free(ctrlr->free_io_qids);
+	free(ctrlr->io_qpair_by_qid);
+
+	if (ctrlr->freed_io_qpair_latency_hist) {
+		for (i = 0; i < NVME_LATENCY_HIST_OPCODES; i++) {
+			free(ctrlr->freed_io_qpair_latency_hist[i]);
+		}
+		free(ctrlr->freed_io_qpair_latency_hist);
+	}
 
 	nvme_qpair_destroy(&ctrlr->adminq);
 
+	if (ctrlr->shadow_doorbell) {
+		nvme_free(ctrlr->shadow_doorbell);
+	}
+	if (ctrlr->eventidx) {
+		nvme_free(ctrlr->eventidx);
+	}
+	if (ctrlr->zero_buf) {
+		nvme_free(ctrlr->zero_buf);
+	}
+	if (ctrlr->discard_buf) {
+		nvme_free(ctrlr->discard_buf);
+	}
+
 	nvme_ctrlr_free_bars(ctrlr);
 	nvme_mutex_destroy(&ctrlr->ctrlr_lock);
 }
@@ -716,58 +1059,292 @@ nvme_ctrlr_submit_admin_request(struct nvme_controller *ctrlr,
 }
 
 void
-nvme_ctrlr_submit_io_request(struct nvme_controller *ctrlr,
-			     struct nvme_request *req)
+nvme_io_qpair_opts_set_defaults(struct nvme_io_qpair_opts *opts)
+{
+	opts->shared_cq = NULL;
+	opts->qprio = NVME_QPRIO_MEDIUM;
+	opts->enable_interrupts = false;
+	opts->proxy_ring_size = 0;
+	opts->track_latency = false;
+}
+
+bool
+nvme_ctrlr_is_wrr_enabled(struct nvme_controller *ctrlr)
+{
+	return ctrlr->is_wrr_enabled;
+}
+
+struct nvme_qpair *
+nvme_ctrlr_alloc_io_qpair(struct nvme_controller *ctrlr,
+			  const struct nvme_io_qpair_opts *opts)
 {
-	struct nvme_qpair       *qpair;
+	struct nvme_io_qpair_opts	default_opts;
+	struct nvme_qpair		*qpair, *cq_qpair = NULL;
+	uint16_t			qid;
 
-	nvme_assert(nvme_thread_ioq_index >= 0, ("no ioq_index assigned for thread\n"));
-	qpair = &ctrlr->ioq[nvme_thread_ioq_index];
+	if (opts == NULL) {
+		nvme_io_qpair_opts_set_defaults(&default_opts);
+		opts = &default_opts;
+	}
+
+	if (opts->shared_cq != NULL) {
+		if (opts->shared_cq->ctrlr != ctrlr) {
+			nvme_printf(ctrlr, "shared_cq belongs to another controller\n");
+			return NULL;
+		}
+		/* A proxy has no completion queue of its own, and is used from other threads. */
+		if (opts->shared_cq->mpsc_owner != NULL) {
+			nvme_printf(ctrlr, "shared_cq cannot be a proxy\n");
+			return NULL;
+		}
+		/* Sharing with a qpair that itself shares a CQ means sharing its owner's. */
+		cq_qpair = opts->shared_cq->cq_qpair;
+	}
+
+	nvme_mutex_lock(&ctrlr->ctrlr_lock);
+
+	if (ctrlr->is_failed) {
+		nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+		return NULL;
+	}
+
+	/* Queue priorities are only honored under weighted round robin arbitration. */
+	if (opts->qprio > NVME_QPRIO_LOW ||
+	    (!ctrlr->is_wrr_enabled && opts->qprio != NVME_QPRIO_MEDIUM)) {
+		nvme_printf(ctrlr, "invalid queue priority %d\n", opts->qprio);
+		nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+		return NULL;
+	}
+
+	/* Proxied I/O is drained when the qpair polls its own completion queue. */
+	if (opts->proxy_ring_size != 0 && cq_qpair != NULL) {
+		nvme_printf(ctrlr, "a qpair with proxies must own its completion queue\n");
+		nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+		return NULL;
+	}
+
+	if (opts->enable_interrupts &&
+	    (ctrlr->opts.intr_ops == NULL || cq_qpair != NULL)) {
+		nvme_printf(ctrlr, "interrupts %s\n", cq_qpair != NULL ?
+			    "belong to the shared completion queue" : "are not available");
+		nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+		return NULL;
+	}
+
+	qid = nvme_ctrlr_get_free_io_qid(ctrlr);
+	if (qid == 0) {
+		nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+		return NULL;
+	}
+
+	qpair = calloc(1, sizeof(*qpair));
+	if (qpair == NULL) {
+		nvme_ctrlr_put_free_io_qid(ctrlr, qid);
+		nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+		return NULL;
+	}
+
+	if (nvme_qpair_construct(qpair, qid,
+				 ctrlr->opts.io_queue_size,
+				 ctrlr->opts.io_queue_requests,
+				 ctrlr, cq_qpair) != 0) {
+		/* Construct frees its own partial state on failure. */
+		goto fail_construct;
+	}
+
+	qpair->qprio = opts->qprio;
+
+	if (opts->proxy_ring_size != 0 &&
+	    nvme_qpair_init_mpsc(qpair, opts->proxy_ring_size) != 0) {
+		goto fail;
+	}
+
+	if (ctrlr->opts.timeout_sec != 0 &&
+	    nvme_qpair_init_timeouts(qpair, ctrlr->opts.timeout_sec) != 0) {
+		goto fail;
+	}
+
+	if (opts->track_latency &&
+	    nvme_qpair_init_latency_tracking(qpair) != 0) {
+		goto fail;
+	}
 
-	nvme_qpair_submit_request(qpair, req);
+	if (opts->enable_interrupts &&
+	    nvme_ctrlr_bind_io_qpair_interrupt(ctrlr, qpair) != 0) {
+		goto fail;
+	}
+
+	if (nvme_ctrlr_create_io_qpair(ctrlr, qpair) != 0) {
+		goto fail;
+	}
+
+	TAILQ_INSERT_TAIL(&ctrlr->active_io_qpairs, qpair, tailq);
+	if (cq_qpair != NULL) {
+		TAILQ_INSERT_TAIL(&cq_qpair->shared_cq_sqs, qpair, shared_cq_tailq);
+	}
+	ctrlr->io_qpair_by_qid[qid] = qpair;
+
+	nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+
+	return qpair;
+
+fail:
+	nvme_ctrlr_unbind_io_qpair_interrupt(ctrlr, qpair);
+	nvme_qpair_destroy(qpair);
+fail_construct:
+	free(qpair);
+	nvme_ctrlr_put_free_io_qid(ctrlr, qid);
+	nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+	return NULL;
+}
+
+static void
+nvme_io_qpair_stats_add(struct nvme_qpair_stats *sum, const struct nvme_qpair_stats *stats)
+{
+	sum->submitted += stats->submitted;
+	sum->completed += stats->completed;
+	sum->retries += stats->retries;
+	sum->queued_reqs += stats->queued_reqs;
+	sum->max_outstanding = nvme_max(sum->max_outstanding, stats->max_outstanding);
+	sum->empty_polls += stats->empty_polls;
+	sum->sq_doorbell_writes += stats->sq_doorbell_writes;
+	sum->cq_doorbell_writes += stats->cq_doorbell_writes;
+}
+
+/*
+ * Keep the latency histograms of an I/O qpair being freed, taking over each
+ *  one the controller does not yet have for its opcode rather than copying it.
+ */
+static void
+nvme_ctrlr_save_io_qpair_latency(struct nvme_controller *ctrlr, struct nvme_qpair *qpair)
+{
+	struct histogram	**saved;
+	uint32_t		i;
+
+	if (qpair->latency_hist == NULL) {
+		return;
+	}
+
+	if (ctrlr->freed_io_qpair_latency_hist == NULL) {
+		ctrlr->freed_io_qpair_latency_hist = calloc(NVME_LATENCY_HIST_OPCODES,
+						     sizeof(struct histogram *));
+		if (ctrlr->freed_io_qpair_latency_hist == NULL) {
+			return;
+		}
+	}
+
+	saved = ctrlr->freed_io_qpair_latency_hist;
+	for (i = 0; i < NVME_LATENCY_HIST_OPCODES; i++) {
+		if (qpair->latency_hist[i] == NULL) {
+			continue;
+		}
+
+		if (saved[i] == NULL) {
+			saved[i] = qpair->latency_hist[i];
+			qpair->latency_hist[i] = NULL;
+		} else {
+			histogram_merge(saved[i], qpair->latency_hist[i]);
+		}
+	}
 }
 
-// @yzy
-// provide a new submit function (submit by id)
-// return < 0 if invalid arg error
-// return 0 if ok
 int
-nvme_ctrlr_submit_io_request_by_id(struct nvme_controller *ctrlr,
-			     struct nvme_request *req, int ioq_index)
+nvme_ctrlr_free_io_qpair(struct nvme_qpair *qpair)
 {
-	struct nvme_qpair       *qpair;
+	struct nvme_controller	*ctrlr;
+	struct nvme_qpair_stats	stats;
 
-	if (ioq_index + 1 > MAX_QUEUE_PER_THREAD)
-		return -1;
-	if (nvme_thread_ioq_index_array[ioq_index] < 0)
-		return -2;
+	if (qpair == NULL) {
+		return 0;
+	}
+
+	if (qpair->mpsc_owner != NULL) {
+		return EINVAL;
+	}
+
+	if (__atomic_load_n(&qpair->num_proxies, __ATOMIC_RELAXED) != 0) {
+		nvme_printf(qpair->ctrlr, "cannot free qpair that still has proxies\n");
+		return EBUSY;
+	}
+
+	if (qpair->num_free_tr != qpair->num_trackers ||
+	    !STAILQ_EMPTY(&qpair->queued_req) ||
+	    qpair->num_delayed_reqs != 0) {
+		nvme_printf(qpair->ctrlr, "cannot free qpair with outstanding i/o\n");
+		return EBUSY;
+	}
+
+	ctrlr = qpair->ctrlr;
+
+	nvme_mutex_lock(&ctrlr->ctrlr_lock);
+
+	if (!TAILQ_EMPTY(&qpair->shared_cq_sqs)) {
+		nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+		nvme_printf(ctrlr, "cannot free qpair whose completion queue is still shared\n");
+		return EBUSY;
+	}
+
+	/*
+	 * A failed controller cannot process admin commands, so there is
+	 *  nothing to delete on the device side in that case.
+	 */
+	if (!ctrlr->is_failed && nvme_ctrlr_delete_io_qpair(ctrlr, qpair) != 0) {
+		nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+		return ENXIO;
+	}
+
+	TAILQ_REMOVE(&ctrlr->active_io_qpairs, qpair, tailq);
+	if (qpair->cq_qpair != qpair) {
+		TAILQ_REMOVE(&qpair->cq_qpair->shared_cq_sqs, qpair, shared_cq_tailq);
+	}
+	ctrlr->io_qpair_by_qid[qpair->id] = NULL;
+	nvme_ctrlr_put_free_io_qid(ctrlr, qpair->id);
+
+	nvme_qpair_get_stats(qpair, &stats);
+	nvme_io_qpair_stats_add(&ctrlr->freed_io_qpair_stats, &stats);
+	nvme_ctrlr_save_io_qpair_latency(ctrlr, qpair);
+
+	nvme_ctrlr_unbind_io_qpair_interrupt(ctrlr, qpair);
+
+	nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+
+	nvme_qpair_destroy(qpair);
+	free(qpair);
 
-	qpair = &ctrlr->ioq[nvme_thread_ioq_index_array[ioq_index]];
-	nvme_qpair_submit_request(qpair, req);
 	return 0;
 }
 
 void
-nvme_ctrlr_process_io_completions(struct nvme_controller *ctrlr, uint32_t max_completions)
+nvme_ctrlr_get_io_qpair_stats(struct nvme_controller *ctrlr,
+			      struct nvme_qpair_stats *stats)
 {
-	nvme_assert(nvme_thread_ioq_index >= 0, ("no ioq_index assigned for thread\n"));
-	nvme_qpair_process_completions(&ctrlr->ioq[nvme_thread_ioq_index], max_completions);
+	struct nvme_qpair	*qpair;
+	struct nvme_qpair_stats	qpair_stats;
+
+	nvme_mutex_lock(&ctrlr->ctrlr_lock);
+	*stats = ctrlr->freed_io_qpair_stats;
+	TAILQ_FOREACH(qpair, &ctrlr->active_io_qpairs, tailq) {
+		nvme_qpair_get_stats(qpair, &qpair_stats);
+		nvme_io_qpair_stats_add(stats, &qpair_stats);
+	}
+	nvme_mutex_unlock(&ctrlr->ctrlr_lock);
 }
 
-// @yzy
-// provide a new submit function (submit by id)
-// return < 0 if error
-// return 0 if ok
-int
-nvme_ctrlr_process_io_completions_by_id(struct nvme_controller *ctrlr, uint32_t max_completions, int ioq_index)
+void
+nvme_ctrlr_merge_io_latency_histogram(struct nvme_controller *ctrlr, uint8_t opc,
+				      struct histogram *hist)
 {
-	if (ioq_index + 1 > MAX_QUEUE_PER_THREAD)
-		return -1;
-	if (nvme_thread_ioq_index_array[ioq_index] < 0)
-		return -2;
+	struct nvme_qpair	*qpair;
 
-	nvme_qpair_process_completions(&ctrlr->ioq[nvme_thread_ioq_index_array[ioq_index]], max_completions);
-	return 0;
+	nvme_mutex_lock(&ctrlr->ctrlr_lock);
+	if (ctrlr->freed_io_qpair_latency_hist != NULL &&
+	    ctrlr->freed_io_qpair_latency_hist[opc] != NULL) {
+		histogram_merge(hist, ctrlr->freed_io_qpair_latency_hist[opc]);
+	}
+	TAILQ_FOREACH(qpair, &ctrlr->active_io_qpairs, tailq) {
+		nvme_qpair_merge_latency_histogram(qpair, opc, hist);
+	}
+	nvme_mutex_unlock(&ctrlr->ctrlr_lock);
 }
 
 void
@@ -776,6 +1353,15 @@ nvme_ctrlr_process_admin_completions(struct nvme_controller *ctrlr)
 	nvme_mutex_lock(&ctrlr->ctrlr_lock);
 	nvme_qpair_process_completions(&ctrlr->adminq, 0);
 	nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+
+	/*
+	 * Report timeouts escalated by I/O threads outside the lock, so that the
+	 *  callback may reset the controller.
+	 */
+	if (__atomic_exchange_n(&ctrlr->timeout_escalated, false, __ATOMIC_ACQ_REL) &&
+	    ctrlr->timeout_cb_fn != NULL) {
+		ctrlr->timeout_cb_fn(ctrlr->timeout_cb_arg, ctrlr);
+	}
 }
 
 const struct nvme_controller_data *
@@ -809,3 +1395,12 @@ nvme_ctrlr_register_aer_callback(struct nvme_controller *ctrlr,
 	ctrlr->aer_cb_fn = aer_cb_fn;
 	ctrlr->aer_cb_arg = aer_cb_arg;
 }
+
+void
+nvme_ctrlr_register_timeout_callback(struct nvme_controller *ctrlr,
+				     nvme_timeout_cb_fn_t timeout_cb_fn,
+				     void *timeout_cb_arg)
+{
+	ctrlr->timeout_cb_fn = timeout_cb_fn;
+	ctrlr->timeout_cb_arg = timeout_cb_arg;
+}
@@ -35,6 +35,7 @@
 
 int
 nvme_ctrlr_cmd_io_raw(struct nvme_controller *ctrlr,
+		      struct nvme_qpair *qpair,
 		      struct nvme_command *cmd,
 		      void *buf, uint32_t len,
 		      nvme_cb_fn_t cb_fn, void *cb_arg)
@@ -49,31 +50,10 @@ nvme_ctrlr_cmd_io_raw(struct nvme_controller *ctrlr,
 
 	memcpy(&req->cmd, cmd, sizeof(req->cmd));
 
-	nvme_ctrlr_submit_io_request(ctrlr, req);
+	nvme_qpair_submit_request(qpair, req);
 	return 0;
 }
 
-// @yzy
-// new wrap function
-int
-nvme_ctrlr_cmd_io_raw_by_id(struct nvme_controller *ctrlr,
-		      struct nvme_command *cmd,
-		      void *buf, uint32_t len,
-		      nvme_cb_fn_t cb_fn, void *cb_arg, int ioq_index)
-{
-	struct nvme_request	*req;
-
-	req = nvme_allocate_request(buf, len, cb_fn, cb_arg);
-
-	if (req == NULL) {
-		return ENOMEM;
-	}
-
-	memcpy(&req->cmd, cmd, sizeof(req->cmd));
-
-	return nvme_ctrlr_submit_io_request_by_id(ctrlr, req, ioq_index);
-}
-
 int
 nvme_ctrlr_cmd_admin_raw(struct nvme_controller *ctrlr,
 			 struct nvme_command *cmd,
@@ -161,10 +141,11 @@ nvme_ctrlr_cmd_create_io_cq(struct nvme_controller *ctrlr,
 	 */
 	cmd->cdw10 = ((io_que->num_entries - 1) << 16) | io_que->id;
 	/*
+	 * Interrupt vector == qid
 	 * 0x2 = interrupts enabled
 	 * 0x1 = physically contiguous
 	 */
-	cmd->cdw11 = (io_que->id << 16) | 0x1;
+	cmd->cdw11 = (io_que->id << 16) | (io_que->intr_fd >= 0 ? 0x2 : 0) | 0x1;
 	cmd->dptr.prp.prp1 = io_que->cpl_bus_addr;
 
 	nvme_ctrlr_submit_admin_request(ctrlr, req);
@@ -187,13 +168,48 @@ nvme_ctrlr_cmd_create_io_sq(struct nvme_controller *ctrlr,
 	 *  structure.
 	 */
 	cmd->cdw10 = ((io_que->num_entries - 1) << 16) | io_que->id;
-	/* 0x1 = physically contiguous */
-	cmd->cdw11 = (io_que->id << 16) | 0x1;
+	/*
+	 * CQID in the upper 16 bits, queue priority in bits 2:1,
+	 *  0x1 = physically contiguous
+	 */
+	cmd->cdw11 = (io_que->cq_qpair->id << 16) | (io_que->qprio << 1) | 0x1;
 	cmd->dptr.prp.prp1 = io_que->cmd_bus_addr;
 
 	nvme_ctrlr_submit_admin_request(ctrlr, req);
 }
 
+void
+nvme_ctrlr_cmd_delete_io_cq(struct nvme_controller *ctrlr,
+			    struct nvme_qpair *io_que, nvme_cb_fn_t cb_fn, void *cb_arg)
+{
+	struct nvme_request *req;
+	struct nvme_command *cmd;
+
+	req = nvme_allocate_request(NULL, 0, cb_fn, cb_arg);
+
+	cmd = &req->cmd;
+	cmd->opc = NVME_OPC_DELETE_IO_CQ;
+	cmd->cdw10 = io_que->id;
+
+	nvme_ctrlr_submit_admin_request(ctrlr, req);
+}
+
+void
+nvme_ctrlr_cmd_delete_io_sq(struct nvme_controller *ctrlr,
+			    struct nvme_qpair *io_que, nvme_cb_fn_t cb_fn, void *cb_arg)
+{
+	struct nvme_request *req;
+	struct nvme_command *cmd;
+
+	req = nvme_allocate_request(NULL, 0, cb_fn, cb_arg);
+
+	cmd = &req->cmd;
+	cmd->opc = NVME_OPC_DELETE_IO_SQ;
+	cmd->cdw10 = io_que->id;
+
+	nvme_ctrlr_submit_admin_request(ctrlr, req);
+}
+
 void
 nvme_ctrlr_cmd_set_feature(struct nvme_controller *ctrlr, uint8_t feature,
 			   uint32_t cdw11, void *payload, uint32_t payload_size,
@@ -254,6 +270,15 @@ nvme_ctrlr_cmd_set_async_event_config(struct nvme_controller *ctrlr,
 				   cb_arg);
 }
 
+void
+nvme_ctrlr_cmd_set_arbitration(struct nvme_controller *ctrlr,
+			       union nvme_feat_arbitration arb, nvme_cb_fn_t cb_fn,
+			       void *cb_arg)
+{
+	nvme_ctrlr_cmd_set_feature(ctrlr, NVME_FEAT_ARBITRATION, arb.raw,
+				   NULL, 0, cb_fn, cb_arg);
+}
+
 void
 nvme_ctrlr_cmd_get_log_page(struct nvme_controller *ctrlr, uint8_t log_page,
 			    uint32_t nsid, void *payload, uint32_t payload_size, nvme_cb_fn_t cb_fn,
@@ -314,6 +339,24 @@ nvme_ctrlr_cmd_get_firmware_page(struct nvme_controller *ctrlr,
 				    cb_arg);
 }
 
+void
+nvme_ctrlr_cmd_doorbell_buffer_config(struct nvme_controller *ctrlr,
+				      uint64_t shadow_doorbell_bus_addr, uint64_t eventidx_bus_addr,
+				      nvme_cb_fn_t cb_fn, void *cb_arg)
+{
+	struct nvme_request *req;
+	struct nvme_command *cmd;
+
+	req = nvme_allocate_request(NULL, 0, cb_fn, cb_arg);
+
+	cmd = &req->cmd;
+	cmd->opc = NVME_OPC_DOORBELL_BUFFER_CONFIG;
+	cmd->dptr.prp.prp1 = shadow_doorbell_bus_addr;
+	cmd->dptr.prp.prp2 = eventidx_bus_addr;
+
+	nvme_ctrlr_submit_admin_request(ctrlr, req);
+}
+
 void
 nvme_ctrlr_cmd_abort(struct nvme_controller *ctrlr, uint16_t cid,
 		     uint16_t sqid, nvme_cb_fn_t cb_fn, void *cb_arg)
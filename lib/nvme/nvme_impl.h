@@ -39,6 +39,7 @@
 #include <pciaccess.h>
 #include <rte_malloc.h>
 #include <rte_config.h>
+#include <rte_cycles.h>
 #include <rte_mempool.h>
 #include <rte_memcpy.h>
 
@@ -114,6 +115,19 @@ extern struct rte_mempool *request_mempool;
  */
 #define nvme_dealloc_request(buf)	rte_mempool_put(request_mempool, buf)
 
+/**
+ * Fill bufs with count buffers for nvme_request objects.  Returns 0 on
+ *  success, or nonzero without allocating any if fewer than count are
+ *  available.
+ */
+#define nvme_alloc_request_bulk(bufs, count)	rte_mempool_get_bulk(request_mempool, bufs, count)
+
+/**
+ * Free count buffers previously allocated with nvme_alloc_request() or
+ *  nvme_alloc_request_bulk().
+ */
+#define nvme_dealloc_request_bulk(bufs, count)	rte_mempool_put_bulk(request_mempool, bufs, count)
+
 /**
  *
  */
@@ -163,6 +177,17 @@ nvme_mutex_init_recursive(nvme_mutex_t *mtx)
 	return rc;
 }
 
+/**
+ * Return the value of a free-running timestamp counter, used to time
+ *  individual commands.  Called on the I/O path, so it must be cheap.
+ */
+#define nvme_get_tsc()			rte_get_timer_cycles()
+
+/**
+ * Return the number of nvme_get_tsc() ticks per second.
+ */
+#define nvme_get_tsc_hz()		rte_get_timer_hz()
+
 /**
  * Copy a struct nvme_command from one memory location to another.
  */
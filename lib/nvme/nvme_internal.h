@@ -45,9 +45,11 @@
 #include <unistd.h>
 #include <x86intrin.h>
 
+#include <sys/eventfd.h>
 #include <sys/user.h>
 
 #include "spdk/nvme.h"
+#include "spdk/nvme_trace.h"
 
 #include "spdk/queue.h"
 #include "spdk/barrier.h"
@@ -63,6 +65,12 @@
  */
 #define NVME_MAX_XFER_SIZE	NVME_MAX_PRP_LIST_ENTRIES * PAGE_SIZE
 
+/*
+ * Commands without data, such as Write Zeroes and Verify, are only limited
+ *  by their 16-bit, 0's based Number of Logical Blocks field.
+ */
+#define NVME_MAX_LBA_COUNT	(65536)
+
 #define NVME_ADMIN_TRACKERS	(16)
 #define NVME_ADMIN_ENTRIES	(128)
 /* min and max are defined in admin queue attributes section of spec */
@@ -82,6 +90,29 @@
 #define NVME_MIN_IO_TRACKERS	(4)
 #define NVME_MAX_IO_TRACKERS	(1024)
 
+/*
+ * Default weighted round robin weights.  Each priority class gets twice the
+ *  command fetches of the class below it.
+ */
+#define NVME_DEFAULT_HIGH_PRIORITY_WEIGHT	(16)
+#define NVME_DEFAULT_MEDIUM_PRIORITY_WEIGHT	(8)
+#define NVME_DEFAULT_LOW_PRIORITY_WEIGHT	(4)
+
+/*
+ * Hybrid polling defaults.  The latency budget is small enough to stay well
+ *  below the latency of a flash read.
+ */
+#define NVME_DEFAULT_POLL_LATENCY_BUDGET_US	(50)
+#define NVME_DEFAULT_IDLE_POLL_THRESHOLD	(64)
+
+/*
+ * Hybrid polling re-estimates the completion rate and device latency of a
+ *  qpair once per window.  Backoffs shorter than NVME_POLL_MIN_SLEEP_US pause
+ *  instead of sleeping, since a sleep costs about that much by itself.
+ */
+#define NVME_POLL_WINDOW_US		(1000)
+#define NVME_POLL_MIN_SLEEP_US		(10)
+
 /*
  * NVME_MAX_IO_ENTRIES is not defined, since it is specified in CC.MQES
  *  for each controller.
@@ -91,6 +122,22 @@
 
 #define NVME_MIN_TIMEOUT_PERIOD		(5)
 #define NVME_MAX_TIMEOUT_PERIOD		(120)
+#define NVME_DEFAULT_TIMEOUT_PERIOD	(30)
+
+/*
+ * I/O command timeouts are tracked in ticks of NVME_TIMEOUT_TICK_US, on a
+ *  wheel that must have more slots than NVME_MAX_TIMEOUT_PERIOD has ticks.
+ *  The slot count must also divide 64K, since trackers keep 16-bit ticks.
+ */
+#define NVME_TIMEOUT_TICK_US		(250 * 1000)
+#define NVME_TIMEOUT_WHEEL_SLOTS	(512)
+
+/* Retry backoff, in microseconds, see nvme_ctrlr_opts::retry_backoff_us. */
+#define NVME_DEFAULT_NS_NOT_READY_BACKOFF_US	(1000)
+#define NVME_MAX_RETRY_BACKOFF_US		(1000 * 1000)
+
+/* Size of per-opcode latency histogram tables, indexed by the 8-bit opcode. */
+#define NVME_LATENCY_HIST_OPCODES	(256)
 
 /* Maximum log page size to fetch for AERs. */
 #define NVME_MAX_AER_LOG_SIZE		(4096)
@@ -102,6 +149,8 @@
  */
 #define DEFAULT_MAX_IO_QUEUES		(1024)
 
+struct nvme_qpair_proxy;
+
 struct nvme_request {
 	struct nvme_command		cmd;
 
@@ -121,12 +170,19 @@ struct nvme_request {
 	 * Number of children requests still outstanding for this
 	 *  request which was split into multiple child requests.
 	 */
-	uint8_t				num_children;
+	uint16_t			num_children;
 	uint32_t			payload_size;
 	nvme_cb_fn_t			cb_fn;
 	void				*cb_arg;
 	STAILQ_ENTRY(nvme_request)	stailq;
 
+	/**
+	 * nvme_get_tsc() when the request was first submitted to a qpair
+	 *  that tracks latency, and 0 otherwise.  Kept across retries and
+	 *  requeueing, so the recorded latency covers both.
+	 */
+	uint64_t			submit_tsc;
+
 	/**
 	 * The following members should not be reordered with members
 	 *  above.  These members are only needed when splitting
@@ -136,16 +192,18 @@ struct nvme_request {
 	 */
 
 	/**
-	 * Points to the outstanding child requests for a parent request.
-	 *  Only valid if a request was split into multiple children
-	 *  requests, and is not initialized for non-split requests.
+	 * The child requests of a parent request, to be submitted in
+	 *  order.  Only valid if a request was split into multiple
+	 *  children requests, and only until the parent is submitted.
+	 *  Children that complete are only counted off num_children, so
+	 *  completions do not touch the list.
 	 */
-	TAILQ_HEAD(, nvme_request)	children;
+	STAILQ_HEAD(, nvme_request)	children;
 
 	/**
-	 * Linked-list pointers for a child request in its parent's list.
+	 * Linked-list pointer for a child request in its parent's list.
 	 */
-	TAILQ_ENTRY(nvme_request)	child_tailq;
+	STAILQ_ENTRY(nvme_request)	child_stailq;
 
 	/**
 	 * Completion status for a parent request.  Initialized to all 0's
@@ -155,6 +213,21 @@ struct nvme_request {
 	 *  status once all child requests are completed.
 	 */
 	struct nvme_completion		parent_status;
+
+	/**
+	 * For requests submitted through a proxy qpair: the proxy that the
+	 *  completion is handed back to, and the submitter's callback.  Set
+	 *  when the proxy takes the request, so not initialized otherwise.
+	 */
+	struct nvme_qpair_proxy		*proxy;
+	nvme_cb_fn_t			proxy_cb_fn;
+	void				*proxy_cb_arg;
+
+	/**
+	 * nvme_get_time_us() at which a request parked for a delayed retry
+	 *  is due.  Set when the request is parked.
+	 */
+	uint64_t			retry_due_us;
 };
 
 struct nvme_completion_poll_status {
@@ -168,14 +241,28 @@ struct nvme_async_event_request {
 	struct nvme_completion		cpl;
 };
 
-struct nvme_tracker {
-	LIST_ENTRY(nvme_tracker)	list;
+/*
+ * Trackers live in a contiguous array indexed by cid.  The PRP list for
+ *  each tracker is kept in a separate, parallel DMA buffer so that the
+ *  tracker itself stays small; a tracker is outstanding while req is
+ *  non-NULL.
+ */
+enum nvme_tracker_timeout_state {
+	NVME_TIMEOUT_NONE = 0,
+	NVME_TIMEOUT_ARMED,
+	/** Timed out once and an abort was sent; the next expiry resets the controller */
+	NVME_TIMEOUT_ABORTED,
+};
 
+struct nvme_tracker {
 	struct nvme_request		*req;
-	uint16_t			cid;
-
+	uint64_t			*prp;
 	uint64_t			prp_bus_addr;
-	uint64_t			prp[NVME_MAX_PRP_LIST_ENTRIES];
+	uint16_t			cid;
+	/** Low bits of the timeout wheel tick the command was armed in */
+	uint16_t			timeout_tick;
+	/** enum nvme_tracker_timeout_state */
+	uint8_t				timeout_state;
 };
 
 struct nvme_qpair {
@@ -192,16 +279,24 @@ struct nvme_qpair {
 	 */
 	struct nvme_completion		*cpl;
 
-	LIST_HEAD(, nvme_tracker)	free_tr;
-	LIST_HEAD(, nvme_tracker)	outstanding_tr;
+	/**
+	 * Trackers, indexed by cid
+	 */
+	struct nvme_tracker		*tr;
 
-	STAILQ_HEAD(, nvme_request)	queued_req;
+	/**
+	 * LIFO stack of free cids, so recently completed (cache-hot)
+	 *  trackers are reused first
+	 */
+	uint16_t			*free_cid;
 
-	struct nvme_tracker		**act_tr;
+	STAILQ_HEAD(, nvme_request)	queued_req;
 
 	uint16_t			id;
 
 	uint16_t			num_entries;
+	uint16_t			num_trackers;
+	uint16_t			num_free_tr;
 	uint16_t			sq_tail;
 	uint16_t			cq_head;
 
@@ -209,15 +304,270 @@ struct nvme_qpair {
 
 	bool				is_enabled;
 
+	/**
+	 * When set, submission queue tail doorbell writes are deferred
+	 *  until nvme_qpair_unplug() is called, so that a batch of
+	 *  commands costs a single MMIO write.
+	 */
+	bool				is_plugged;
+	bool				sq_tdbl_pending;
+
+	/**
+	 * Shadow doorbell and EventIdx entries in the controller's
+	 *  doorbell buffers, or NULL when Doorbell Buffer Config is
+	 *  not in use for this queue.
+	 */
+	volatile uint32_t		*sq_shadow_tdbl;
+	volatile uint32_t		*cq_shadow_hdbl;
+	volatile uint32_t		*sq_eventidx;
+	volatile uint32_t		*cq_eventidx;
+
+	/**
+	 * When non-NULL, completions are collected in batch_cpl and
+	 *  delivered through this callback instead of each request's
+	 *  cb_fn.
+	 */
+	nvme_batch_cb_fn_t		batch_cb_fn;
+
+	/**
+	 * Qpair that owns the completion queue this qpair's submission
+	 *  queue posts to - the qpair itself unless the completion queue
+	 *  is shared.
+	 */
+	struct nvme_qpair		*cq_qpair;
+
 	/*
 	 * Fields below this point should not be touched on the normal I/O happy path.
 	 */
 	struct nvme_controller		*ctrlr;
 
+	/** Entry in the controller's list of active I/O qpairs */
+	TAILQ_ENTRY(nvme_qpair)		tailq;
+
+	/** Other qpairs whose submission queues post to this qpair's completion queue */
+	TAILQ_HEAD(, nvme_qpair)	shared_cq_sqs;
+	TAILQ_ENTRY(nvme_qpair)		shared_cq_tailq;
+
+	/** Submission queue priority class (enum nvme_qprio) */
+	uint8_t				qprio;
+
+	/** Eventfd signaled by the completion queue's interrupt, or -1 when polled */
+	int				intr_fd;
+
+	/**
+	 * Completion polling policy and state, used by nvme_qpair_poll().
+	 *  Only meaningful on qpairs that own their completion queue.
+	 */
+	struct nvme_poll_opts		poll_opts;
+	struct nvme_poll_stats		poll_stats;
+	uint32_t			idle_polls;
+	uint32_t			backoff_us;
+	bool				hybrid_slept;
+	uint64_t			last_poll_us;
+	uint64_t			window_start_us;
+	uint64_t			window_completions;
+	/** Sum of outstanding commands * elapsed microseconds over the window */
+	uint64_t			window_outstanding_us;
+
 	uint64_t			cmd_bus_addr;
 	uint64_t			cpl_bus_addr;
+
+	/**
+	 * PRP lists for all trackers, NVME_MAX_PRP_LIST_ENTRIES per cid
+	 */
+	uint64_t			*prp_list;
+
+#ifdef NVME_STATS
+	/** Updated without atomics by the thread using the qpair */
+	struct nvme_qpair_stats		stats;
+#endif
+
+	/**
+	 * Latency histograms of completed commands indexed by opcode, each
+	 *  allocated on the first completion with its opcode, or NULL if
+	 *  the qpair does not track latency.
+	 */
+	struct histogram		**latency_hist;
+
+	/**
+	 * Command timeouts.  timeout_wheel counts the armed trackers by the
+	 *  tick they were armed in, so the trackers only need to be scanned
+	 *  once a slot holding armed commands is timeout_ticks old.
+	 *  timeout_ticks is 0 when commands on this qpair are not timed.
+	 *  timeout_tick is refreshed by polls with armed commands.
+	 */
+	uint16_t			*timeout_wheel;
+	uint32_t			num_timeouts_armed;
+	uint32_t			timeout_ticks;
+	uint32_t			timeout_tick;
+	/** Oldest tick not yet checked for expired commands */
+	uint32_t			timeout_check_tick;
+
+	/**
+	 * Requests submitted through proxies of this qpair (see
+	 *  nvme_qpair_alloc_proxy()), drained into the submission queue by
+	 *  nvme_qpair_process_completions(), or NULL.  Kept next to the
+	 *  timeout counters, which are read on every poll anyway.
+	 */
+	struct nvme_mpsc_ring		*mpsc_ring;
+	uint32_t			num_proxies;
+
+	/**
+	 * Requests parked for a delayed retry, ordered by retry_due_us and
+	 *  resubmitted by polls once due.  Polls only read the count.
+	 */
+	uint32_t			num_delayed_reqs;
+
+	/** On a proxy, the shared qpair it submits to; NULL otherwise */
+	struct nvme_qpair		*mpsc_owner;
+
+	STAILQ_HEAD(, nvme_request)	delayed_req;
+
+	void				*batch_cb_ctx;
+	uint32_t			num_batch_cpl;
+	struct nvme_batch_cpl		batch_cpl[NVME_BATCH_CPL_ENTRIES];
 };
 
+/*
+ * Statistics counters compile away unless the driver is built with
+ *  CONFIG_NVME_STATS.
+ */
+#ifdef NVME_STATS
+#define nvme_qpair_stat_inc(qpair, counter)	((qpair)->stats.counter++)
+#define nvme_qpair_stat_add(qpair, counter, n)	((qpair)->stats.counter += (n))
+#else
+#define nvme_qpair_stat_inc(qpair, counter)	do { } while (0)
+#define nvme_qpair_stat_add(qpair, counter, n)	do { } while (0)
+#endif
+
+static inline void
+nvme_qpair_stat_outstanding(struct nvme_qpair *qpair)
+{
+#ifdef NVME_STATS
+	uint64_t outstanding = qpair->num_trackers - qpair->num_free_tr;
+
+	if (outstanding > qpair->stats.max_outstanding) {
+		qpair->stats.max_outstanding = outstanding;
+	}
+#endif
+}
+
+/*
+ * Trace events compile away unless the driver is built with
+ *  CONFIG_NVME_TRACE, and cost a single branch while tracing is off.
+ */
+#ifdef NVME_TRACE
+extern struct nvme_trace_header	*g_nvme_trace;
+
+#define nvme_trace(qpair, req, type, cid, status)				\
+	do {									\
+		if (g_nvme_trace != NULL) {					\
+			nvme_trace_record((qpair), (req), (type), (cid), (status));	\
+		}								\
+	} while (0)
+#else
+#define nvme_trace(qpair, req, type, cid, status)	do { } while (0)
+#endif
+
+static inline uint16_t
+nvme_trace_status(const struct nvme_completion *cpl)
+{
+	return (uint16_t)(cpl->status.sct << 8 | cpl->status.sc);
+}
+
+/*
+ * Completion of a proxied request, handed from the shared qpair's thread
+ *  back to the proxy's.
+ */
+struct nvme_proxy_cpl {
+	nvme_cb_fn_t			cb_fn;
+	void				*cb_arg;
+	struct nvme_completion		cpl;
+};
+
+struct nvme_qpair_proxy {
+	/** Handed out as the proxy's qpair handle, so must be first */
+	struct nvme_qpair		qpair;
+
+	/* Fields below are only touched by the proxy's thread. */
+	uint32_t			depth;
+	/** Requests handed to the shared qpair and not yet reaped */
+	uint32_t			num_outstanding;
+	uint32_t			cpl_head;
+	uint32_t			cpl_mask;
+	struct nvme_proxy_cpl		*cpl_ring;
+
+	/** Advanced by the shared qpair's thread */
+	uint32_t			cpl_tail __attribute__((aligned(64)));
+};
+
+/*
+ * Bounded lock-free multi-producer, single-consumer ring of pointers.  Each
+ *  slot's sequence number tells a producer at position pos whether the slot
+ *  is free (seq == pos), and the consumer whether it has been filled
+ *  (seq == pos + 1).  Producers claim positions with a CAS on tail.
+ */
+struct nvme_mpsc_slot {
+	uint64_t			seq;
+	void				*item;
+};
+
+struct nvme_mpsc_ring {
+	uint32_t			mask;
+	/* Producer and consumer positions, each on its own cache line */
+	uint64_t			tail __attribute__((aligned(64)));
+	uint64_t			head __attribute__((aligned(64)));
+	struct nvme_mpsc_slot		slots[] __attribute__((aligned(64)));
+};
+
+struct nvme_mpsc_ring *nvme_mpsc_ring_create(uint32_t size);
+
+static inline bool
+nvme_mpsc_ring_enqueue(struct nvme_mpsc_ring *ring, void *item)
+{
+	struct nvme_mpsc_slot	*slot;
+	uint64_t		pos, seq;
+	int64_t			diff;
+
+	pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	while (1) {
+		slot = &ring->slots[pos & ring->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (int64_t)seq - (int64_t)pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			/* Full */
+			return false;
+		} else {
+			pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->item = item;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static inline void *
+nvme_mpsc_ring_dequeue(struct nvme_mpsc_ring *ring)
+{
+	struct nvme_mpsc_slot	*slot = &ring->slots[ring->head & ring->mask];
+	void			*item;
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ring->head + 1) {
+		return NULL;
+	}
+
+	item = slot->item;
+	__atomic_store_n(&slot->seq, ring->head + ring->mask + 1, __ATOMIC_RELEASE);
+	ring->head++;
+	return item;
+}
+
 struct nvme_namespace {
 	struct nvme_controller		*ctrlr;
 	uint32_t			stripe_size;
@@ -228,6 +578,96 @@ struct nvme_namespace {
 	uint16_t			flags;
 };
 
+/*
+ * Deallocator defaults.  One command at a time keeps deallocation in the
+ *  background of other I/O.
+ */
+#define NVME_DEFAULT_DEALLOC_MAX_AGE_US		(100 * 1000)
+#define NVME_DEFAULT_DEALLOC_QUEUE_DEPTH	(1)
+#define NVME_DEFAULT_DEALLOC_MAX_PENDING_RANGES	(16 * NVME_DATASET_MANAGEMENT_MAX_RANGES)
+
+/*
+ * Longest burst the deallocator's rate limit lets through at once, as a
+ *  fraction of a second.
+ */
+#define NVME_DEALLOC_BURST_DIVISOR		(10)
+
+/* A pending range of the deallocator, [lba, lba + lba_count). */
+struct nvme_dealloc_range {
+	uint64_t			lba;
+	uint64_t			lba_count;
+};
+
+/*
+ * One Dataset Management command of a deallocator.  Commands are kept and
+ *  reused with their range buffers, which the controller reads by DMA.
+ */
+struct nvme_dealloc_cmd {
+	struct nvme_deallocator		*dealloc;
+	struct nvme_dsm_range		*ranges;
+	uint16_t			num_ranges;
+	bool				done;
+	struct nvme_completion		cpl;
+	/* Commands are numbered in the order they are built, from 1. */
+	uint64_t			seq;
+	uint64_t			num_blocks;
+	STAILQ_ENTRY(nvme_dealloc_cmd)	stailq;
+};
+
+/* A caller of nvme_deallocator_sync() waiting for commands up to seq to complete. */
+struct nvme_dealloc_sync {
+	uint64_t			seq;
+	struct nvme_completion		cpl;
+	nvme_cb_fn_t			cb_fn;
+	void				*cb_arg;
+	STAILQ_ENTRY(nvme_dealloc_sync)	stailq;
+};
+
+struct nvme_deallocator {
+	struct nvme_namespace		*ns;
+	struct nvme_qpair		*qpair;
+	struct nvme_deallocator_opts	opts;
+
+	/* Disjoint, non-adjacent ranges sorted by LBA */
+	struct nvme_dealloc_range	*pending;
+	uint32_t			num_pending;
+	uint64_t			pending_blocks;
+	/* nvme_get_tsc() when the oldest pending range was added */
+	uint64_t			pending_tsc;
+
+	/* Commands built by a sync, sent ahead of pending ranges and regardless of the rate limit */
+	STAILQ_HEAD(, nvme_dealloc_cmd)	ready;
+	/* Sent commands, in the order they were built */
+	STAILQ_HEAD(, nvme_dealloc_cmd)	outstanding;
+	STAILQ_HEAD(, nvme_dealloc_cmd)	free_cmds;
+	uint32_t			num_outstanding;
+	/* seq of the last command built, and of the last one retired in order */
+	uint64_t			last_seq;
+	uint64_t			done_seq;
+
+	STAILQ_HEAD(, nvme_dealloc_sync) syncs;
+
+	uint64_t			max_age_tsc;
+
+	/*
+	 * Rate limit, as the time at which the blocks sent so far are paid
+	 *  for.  A command may be sent once it is no later than now, and then
+	 *  moves it ahead by the time its blocks take at the limit.  It never
+	 *  lags now by more than burst_tsc, which bounds the burst after an
+	 *  idle period.
+	 */
+	uint64_t			rate_tsc;
+	uint64_t			burst_tsc;
+
+	/*
+	 * Set while commands are being sent, so a completion that arrives
+	 *  during a submission does not send commands as well.
+	 */
+	bool				in_pump;
+
+	struct nvme_deallocator_stats	stats;
+};
+
 /*
  * One of these per allocated PCI device.
  */
@@ -237,8 +677,12 @@ struct nvme_controller {
 	/** NVMe MMIO register space */
 	volatile struct nvme_registers	*regs;
 
-	/** I/O queue pairs */
-	struct nvme_qpair		*ioq;
+	/**
+	 * I/O qpairs indexed by queue ID, used to route entries of shared
+	 *  completion queues to the qpair whose submission queue they
+	 *  belong to.
+	 */
+	struct nvme_qpair		**io_qpair_by_qid;
 
 	/** Array of namespaces indexed by nsid - 1 */
 	struct nvme_namespace		*ns;
@@ -251,11 +695,32 @@ struct nvme_controller {
 
 	/* Cold data (not accessed in normal I/O path) is after this point. */
 
+	/** Weighted round robin arbitration was selected in CC.AMS */
+	bool				is_wrr_enabled;
+
+	/** Identifies the controller in trace events */
+	uint16_t			trace_id;
+
 	/* Opaque handle to associated PCI device. */
 	void				*devhandle;
 
 	uint32_t			num_io_queues;
 
+	/** Bitmap of unused I/O queue IDs - bit (qid - 1) is set when qid is free */
+	uint64_t			*free_io_qids;
+
+	/** I/O qpairs created by nvme_ctrlr_alloc_io_qpair() and not yet freed */
+	TAILQ_HEAD(, nvme_qpair)	active_io_qpairs;
+
+	/** Statistics accumulated from I/O qpairs that have been freed */
+	struct nvme_qpair_stats		freed_io_qpair_stats;
+
+	/**
+	 * Latency histograms taken over from I/O qpairs that have been freed,
+	 *  indexed by opcode, or NULL if no freed qpair tracked latency
+	 */
+	struct histogram		**freed_io_qpair_latency_hist;
+
 	/** maximum i/o size in bytes */
 	uint32_t			max_xfer_size;
 
@@ -270,6 +735,36 @@ struct nvme_controller {
 	nvme_aer_cb_fn_t		aer_cb_fn;
 	void				*aer_cb_arg;
 
+	/**
+	 * Set by I/O threads when an aborted command did not complete, and
+	 *  reported through timeout_cb_fn by nvme_ctrlr_process_admin_completions()
+	 */
+	bool				timeout_escalated;
+	nvme_timeout_cb_fn_t		timeout_cb_fn;
+	void				*timeout_cb_arg;
+
+	/**
+	 * Shadow doorbell and EventIdx buffers registered with the controller
+	 *  through Doorbell Buffer Config, one page each.  NULL when the
+	 *  controller does not support the command.
+	 */
+	uint32_t			*shadow_doorbell;
+	uint32_t			*eventidx;
+	uint64_t			shadow_doorbell_bus_addr;
+	uint64_t			eventidx_bus_addr;
+
+	/**
+	 * Buffers of max_xfer_size bytes for emulating commands the
+	 *  controller lacks: Write Zeroes writes from zero_buf, which is
+	 *  never written to, and Verify reads into discard_buf, whose
+	 *  contents are never used.  NULL when the command is supported.
+	 */
+	void				*zero_buf;
+	void				*discard_buf;
+
+	/** Options passed to nvme_attach(), clamped to controller limits */
+	struct nvme_ctrlr_opts		opts;
+
 	/** guards access to the controller itself, including admin queues */
 	nvme_mutex_t			ctrlr_lock;
 
@@ -289,23 +784,17 @@ struct nvme_controller {
 	struct nvme_namespace_data	*nsdata;
 };
 
-extern __thread int nvme_thread_ioq_index;
-
-// @yzy
-// new ioq_index variables
-#define MAX_QUEUE_PER_THREAD 31
-extern __thread int nvme_thread_ioq_index_array[];
-
 struct nvme_driver {
 	nvme_mutex_t	lock;
-	uint16_t	*ioq_index_pool;
 	uint32_t	max_io_queues;
-	uint16_t	ioq_index_pool_next;
+	/** Trace ID of the next attached controller */
+	uint16_t	next_trace_id;
 };
 
 extern struct nvme_driver g_nvme_driver;
 
 #define nvme_min(a,b) (((a)<(b))?(a):(b))
+#define nvme_max(a,b) (((a)>(b))?(a):(b))
 
 #define INTEL_DC_P3X00_DEVID	0x09538086
 
@@ -338,6 +827,15 @@ _nvme_mmio_write_8(volatile uint64_t *addr, uint64_t val)
 
 #define nvme_delay		usleep
 
+static inline uint64_t
+nvme_get_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static inline uint32_t
 nvme_u32log2(uint32_t x)
 {
@@ -354,6 +852,50 @@ nvme_align32pow2(uint32_t x)
 	return 1u << (1 + nvme_u32log2(x - 1));
 }
 
+/*
+ * Whether req is the parent of a fused pair, which the qpair must place in
+ *  the submission queue as two adjacent commands.
+ */
+static inline bool
+nvme_request_is_fused(struct nvme_request *req)
+{
+	return req->num_children != 0 &&
+	       STAILQ_FIRST(&req->children)->cmd.fuse == NVME_FUSE_FIRST;
+}
+
+static inline bool
+nvme_completion_is_failed_fused(const struct nvme_completion *cpl)
+{
+	return cpl->status.sct == NVME_SCT_GENERIC &&
+	       cpl->status.sc == NVME_SC_ABORTED_FAILED_FUSED;
+}
+
+/*
+ * Account for the completion of one child of a split request.  Returns the
+ *  parent once its last child has completed, with parent_status holding the
+ *  status to report for the whole request, or NULL while children remain.
+ *
+ * When one command of a fused pair fails, the controller aborts the other
+ *  with ABORTED_FAILED_FUSED.  The failure that caused it is the status to
+ *  report, in whichever order the two complete.
+ */
+static inline struct nvme_request *
+nvme_request_complete_child(struct nvme_request *child,
+			    const struct nvme_completion *cpl)
+{
+	struct nvme_request *parent = child->parent;
+
+	parent->num_children--;
+
+	if (nvme_completion_is_error(cpl) &&
+	    !(nvme_completion_is_failed_fused(cpl) &&
+	      nvme_completion_is_error(&parent->parent_status))) {
+		memcpy(&parent->parent_status, cpl, sizeof(*cpl));
+	}
+
+	return parent->num_children == 0 ? parent : NULL;
+}
+
 /* Admin functions */
 void	nvme_ctrlr_cmd_set_feature(struct nvme_controller *ctrlr,
 				   uint8_t feature, uint32_t cdw11,
@@ -394,31 +936,37 @@ void	nvme_ctrlr_cmd_create_io_cq(struct nvme_controller *ctrlr,
 void	nvme_ctrlr_cmd_create_io_sq(struct nvme_controller *ctrlr,
 				    struct nvme_qpair *io_que,
 				    nvme_cb_fn_t cb_fn, void *cb_arg);
+void	nvme_ctrlr_cmd_delete_io_cq(struct nvme_controller *ctrlr,
+				    struct nvme_qpair *io_que,
+				    nvme_cb_fn_t cb_fn, void *cb_arg);
+void	nvme_ctrlr_cmd_delete_io_sq(struct nvme_controller *ctrlr,
+				    struct nvme_qpair *io_que,
+				    nvme_cb_fn_t cb_fn, void *cb_arg);
 void	nvme_ctrlr_cmd_set_num_queues(struct nvme_controller *ctrlr,
 				      uint32_t num_queues, nvme_cb_fn_t cb_fn,
 				      void *cb_arg);
 void	nvme_ctrlr_cmd_set_async_event_config(struct nvme_controller *ctrlr,
 		union nvme_critical_warning_state state,
 		nvme_cb_fn_t cb_fn, void *cb_arg);
+void	nvme_ctrlr_cmd_set_arbitration(struct nvme_controller *ctrlr,
+				       union nvme_feat_arbitration arb,
+				       nvme_cb_fn_t cb_fn, void *cb_arg);
+void	nvme_ctrlr_cmd_doorbell_buffer_config(struct nvme_controller *ctrlr,
+		uint64_t shadow_doorbell_bus_addr, uint64_t eventidx_bus_addr,
+		nvme_cb_fn_t cb_fn, void *cb_arg);
 void	nvme_ctrlr_cmd_abort(struct nvme_controller *ctrlr, uint16_t cid,
 			     uint16_t sqid, nvme_cb_fn_t cb_fn, void *cb_arg);
 
 void	nvme_completion_poll_cb(void *arg, const struct nvme_completion *cpl);
 
-int	nvme_ctrlr_construct(struct nvme_controller *ctrlr, void *devhandle);
+int	nvme_ctrlr_construct(struct nvme_controller *ctrlr,
+			     const struct nvme_ctrlr_opts *opts, void *devhandle);
 void	nvme_ctrlr_destruct(struct nvme_controller *ctrlr);
 int	nvme_ctrlr_start(struct nvme_controller *ctrlr);
 int	nvme_ctrlr_hw_reset(struct nvme_controller *ctrlr);
 
 void	nvme_ctrlr_submit_admin_request(struct nvme_controller *ctrlr,
 					struct nvme_request *req);
-void	nvme_ctrlr_submit_io_request(struct nvme_controller *ctrlr,
-				     struct nvme_request *req);
-
-// @yzy
-// new functions
-int	nvme_ctrlr_submit_io_request_by_id(struct nvme_controller *ctrlr,
-				     struct nvme_request *req, int ioq_index);
 
 void	nvme_ctrlr_post_failed_request(struct nvme_controller *ctrlr,
 				       struct nvme_request *req);
@@ -426,16 +974,22 @@ void	nvme_ctrlr_post_failed_request(struct nvme_controller *ctrlr,
 int	nvme_qpair_construct(struct nvme_qpair *qpair, uint16_t id,
 			     uint16_t num_entries,
 			     uint16_t num_trackers,
-			     struct nvme_controller *ctrlr);
+			     struct nvme_controller *ctrlr,
+			     struct nvme_qpair *cq_qpair);
 void	nvme_qpair_destroy(struct nvme_qpair *qpair);
 void	nvme_qpair_enable(struct nvme_qpair *qpair);
 void	nvme_qpair_disable(struct nvme_qpair *qpair);
 void	nvme_qpair_submit_tracker(struct nvme_qpair *qpair,
 				  struct nvme_tracker *tr);
-void	nvme_qpair_process_completions(struct nvme_qpair *qpair, uint32_t max_completions);
 void	nvme_qpair_submit_request(struct nvme_qpair *qpair,
 				  struct nvme_request *req);
 void	nvme_qpair_reset(struct nvme_qpair *qpair);
+int	nvme_qpair_init_mpsc(struct nvme_qpair *qpair, uint32_t ring_size);
+int	nvme_qpair_init_timeouts(struct nvme_qpair *qpair, uint32_t timeout_sec);
+int	nvme_qpair_init_latency_tracking(struct nvme_qpair *qpair);
+
+void	nvme_trace_record(struct nvme_qpair *qpair, const struct nvme_request *req,
+			  uint8_t type, uint16_t cid, uint16_t status);
 void	nvme_qpair_fail(struct nvme_qpair *qpair);
 void	nvme_qpair_manual_complete_request(struct nvme_qpair *qpair,
 		struct nvme_request *req,
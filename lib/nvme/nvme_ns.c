@@ -126,6 +126,21 @@ nvme_ns_construct(struct nvme_namespace *ns, uint16_t id,
 		ns->flags |= NVME_NS_FLUSH_SUPPORTED;
 	}
 
+	if (ctrlr->cdata.oncs.write_zeroes) {
+		ns->flags |= NVME_NS_WRITE_ZEROES_SUPPORTED;
+	}
+
+	if (ctrlr->cdata.oncs.verify) {
+		ns->flags |= NVME_NS_VERIFY_SUPPORTED;
+	}
+
+	if (ctrlr->cdata.oncs.compare) {
+		ns->flags |= NVME_NS_COMPARE_SUPPORTED;
+		if (ctrlr->cdata.fuses.compare_and_write) {
+			ns->flags |= NVME_NS_COMPARE_AND_WRITE_SUPPORTED;
+		}
+	}
+
 	return 0;
 }
 
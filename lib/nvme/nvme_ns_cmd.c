@@ -38,25 +38,14 @@
  *
  */
 
-static struct nvme_request *
-_nvme_ns_cmd_rw(struct nvme_namespace *ns, void *payload, uint64_t lba,
-		uint32_t lba_count, nvme_cb_fn_t cb_fn, void *cb_arg,
-		uint32_t opc);
-
 static void
 nvme_cb_complete_child(void *child_arg, const struct nvme_completion *cpl)
 {
 	struct nvme_request *child = child_arg;
-	struct nvme_request *parent = child->parent;
-
-	parent->num_children--;
-	TAILQ_REMOVE(&parent->children, child, child_tailq);
+	struct nvme_request *parent;
 
-	if (nvme_completion_is_error(cpl)) {
-		memcpy(&parent->parent_status, cpl, sizeof(*cpl));
-	}
-
-	if (parent->num_children == 0) {
+	parent = nvme_request_complete_child(child, cpl);
+	if (parent != NULL) {
 		if (parent->cb_fn) {
 			parent->cb_fn(parent->cb_arg, &parent->parent_status);
 		}
@@ -69,205 +58,334 @@ nvme_request_add_child(struct nvme_request *parent, struct nvme_request *child)
 {
 	if (parent->num_children == 0) {
 		/*
-		 * Defer initialization of the children TAILQ since it falls
+		 * Defer initialization of the children list since it falls
 		 *  on a separate cacheline.  This ensures we do not touch this
 		 *  cacheline except on request splitting cases, which are
 		 *  relatively rare.
 		 */
-		TAILQ_INIT(&parent->children);
+		STAILQ_INIT(&parent->children);
 		memset(&parent->parent_status, 0, sizeof(struct nvme_completion));
 	}
 
 	parent->num_children++;
-	TAILQ_INSERT_TAIL(&parent->children, child, child_tailq);
+	STAILQ_INSERT_TAIL(&parent->children, child, child_stailq);
 	child->parent = parent;
 	child->cb_fn = nvme_cb_complete_child;
 	child->cb_arg = child;
 }
 
+static void
+_nvme_ns_cmd_setup_rw(struct nvme_namespace *ns, struct nvme_request *req,
+		      uint64_t lba, uint32_t lba_count, uint32_t opc, uint32_t io_flags)
+{
+	struct nvme_command	*cmd;
+	uint64_t		*tmp_lba;
+
+	cmd = &req->cmd;
+	cmd->opc = opc;
+	cmd->nsid = ns->id;
+
+	tmp_lba = (uint64_t *)&cmd->cdw10;
+	*tmp_lba = lba;
+	cmd->cdw12 = (lba_count - 1) | (io_flags & NVME_IO_FLAGS_CDW12_MASK);
+	cmd->cdw13 = io_flags & NVME_IO_FLAGS_DSM_MASK;
+}
+
 static struct nvme_request *
 _nvme_ns_cmd_split_request(struct nvme_namespace *ns, void *payload,
-			   uint64_t lba, uint32_t lba_count,
-			   nvme_cb_fn_t cb_fn, void *cb_arg, uint32_t opc,
+			   uint64_t lba, uint32_t lba_count, uint32_t opc, uint32_t io_flags,
 			   struct nvme_request *req,
-			   uint32_t sectors_per_max_io, uint32_t sector_mask)
+			   uint32_t sectors_per_max_io, uint32_t sector_mask,
+			   uint32_t sectors_per_cmd, bool fixed_payload)
 {
 	uint32_t		sector_size = ns->sector_size;
 	uint32_t		remaining_lba_count = lba_count;
 	struct nvme_request	*child;
 
+	/*
+	 * Each child is cut to fit both within a stripe and within
+	 *  sectors_per_cmd, so it is set up directly rather than through
+	 *  _nvme_ns_cmd_rw(), and is never split again.
+	 */
 	while (remaining_lba_count > 0) {
 		lba_count = sectors_per_max_io - (lba & sector_mask);
+		lba_count = nvme_min(lba_count, sectors_per_cmd);
 		lba_count = nvme_min(remaining_lba_count, lba_count);
 
-		child = _nvme_ns_cmd_rw(ns, payload, lba, lba_count, cb_fn,
-					cb_arg, opc);
+		child = nvme_allocate_request(payload, payload ? lba_count * sector_size : 0,
+					      NULL, NULL);
 		if (child == NULL) {
+			while (req->num_children != 0) {
+				child = STAILQ_FIRST(&req->children);
+				STAILQ_REMOVE_HEAD(&req->children, child_stailq);
+				req->num_children--;
+				nvme_free_request(child);
+			}
 			nvme_free_request(req);
 			return NULL;
 		}
+		_nvme_ns_cmd_setup_rw(ns, child, lba, lba_count, opc, io_flags);
 		nvme_request_add_child(req, child);
 		remaining_lba_count -= lba_count;
 		lba += lba_count;
-		payload = (void *)((uintptr_t)payload + (lba_count * sector_size));
+		if (payload != NULL && !fixed_payload) {
+			payload = (void *)((uintptr_t)payload + (lba_count * sector_size));
+		}
 	}
 
 	return req;
 }
 
+static inline bool
+_nvme_ns_cmd_spans_stripe(struct nvme_namespace *ns, uint64_t lba, uint32_t lba_count)
+{
+	uint32_t sectors_per_stripe = ns->sectors_per_stripe;
+
+	return sectors_per_stripe > 0 &&
+	       ((lba & (sectors_per_stripe - 1)) + lba_count) > sectors_per_stripe;
+}
+
+/*
+ * Build a request for opc on lba_count blocks starting at lba, split at stripe
+ *  boundaries and into commands of at most sectors_per_cmd blocks.  payload is
+ *  NULL for commands that transfer no data.  With fixed_payload, every command
+ *  transfers from the start of payload rather than from its offset in the range.
+ */
 static struct nvme_request *
 _nvme_ns_cmd_rw(struct nvme_namespace *ns, void *payload, uint64_t lba,
 		uint32_t lba_count, nvme_cb_fn_t cb_fn, void *cb_arg,
-		uint32_t opc)
+		uint32_t opc, uint32_t io_flags, uint32_t sectors_per_cmd, bool fixed_payload)
 {
 	struct nvme_request	*req;
-	struct nvme_command	*cmd;
-	uint64_t		*tmp_lba;
-	uint32_t		sector_size;
-	uint32_t		sectors_per_max_io;
 	uint32_t		sectors_per_stripe;
 
-	sector_size = ns->sector_size;
-	sectors_per_max_io = ns->sectors_per_max_io;
 	sectors_per_stripe = ns->sectors_per_stripe;
 
-	req = nvme_allocate_request(payload, lba_count * sector_size, cb_fn, cb_arg);
-	if (req == NULL) {
-		return NULL;
-	}
-
 	/*
 	 * Intel DC P3*00 NVMe controllers benefit from driver-assisted striping.
 	 * If this controller defines a stripe boundary and this I/O spans a stripe
 	 *  boundary, split the request into multiple requests and submit each
-	 *  separately to hardware.
+	 *  separately to hardware.  The parent of a split request transfers no
+	 *  data itself, so it is allocated without the payload.
 	 */
-	if (sectors_per_stripe > 0 &&
-	    (((lba & (sectors_per_stripe - 1)) + lba_count) > sectors_per_stripe)) {
-
-		return _nvme_ns_cmd_split_request(ns, payload, lba, lba_count, cb_fn, cb_arg, opc,
-						  req, sectors_per_stripe, sectors_per_stripe - 1);
-	} else if (lba_count > sectors_per_max_io) {
-		return _nvme_ns_cmd_split_request(ns, payload, lba, lba_count, cb_fn, cb_arg, opc,
-						  req, sectors_per_max_io, 0);
-	} else {
-		cmd = &req->cmd;
-		cmd->opc = opc;
-		cmd->nsid = ns->id;
+	if (_nvme_ns_cmd_spans_stripe(ns, lba, lba_count)) {
+		req = nvme_allocate_request(NULL, 0, cb_fn, cb_arg);
+		if (req == NULL) {
+			return NULL;
+		}
+		return _nvme_ns_cmd_split_request(ns, payload, lba, lba_count, opc, io_flags, req,
+						  sectors_per_stripe, sectors_per_stripe - 1,
+						  sectors_per_cmd, fixed_payload);
+	} else if (lba_count > sectors_per_cmd) {
+		req = nvme_allocate_request(NULL, 0, cb_fn, cb_arg);
+		if (req == NULL) {
+			return NULL;
+		}
+		return _nvme_ns_cmd_split_request(ns, payload, lba, lba_count, opc, io_flags, req,
+						  sectors_per_cmd, 0,
+						  sectors_per_cmd, fixed_payload);
+	}
 
-		tmp_lba = (uint64_t *)&cmd->cdw10;
-		*tmp_lba = lba;
-		cmd->cdw12 = lba_count - 1;
+	req = nvme_allocate_request(payload, payload ? lba_count * ns->sector_size : 0,
+				    cb_fn, cb_arg);
+	if (req == NULL) {
+		return NULL;
 	}
+	_nvme_ns_cmd_setup_rw(ns, req, lba, lba_count, opc, io_flags);
 
 	return req;
 }
 
-int
-nvme_ns_cmd_read(struct nvme_namespace *ns, void *payload, uint64_t lba,
-		 uint32_t lba_count, nvme_cb_fn_t cb_fn, void *cb_arg)
+/*
+ * Whether lba_count blocks would be split into more children than a request
+ *  can count.  The bound allows for a partial command on each side of every
+ *  stripe boundary.
+ */
+static bool
+_nvme_ns_cmd_too_many_children(struct nvme_namespace *ns, uint32_t lba_count,
+			       uint32_t sectors_per_cmd)
+{
+	uint64_t max_children;
+
+	max_children = lba_count / sectors_per_cmd + 2;
+	if (ns->sectors_per_stripe > 0) {
+		max_children += lba_count / ns->sectors_per_stripe;
+	}
+
+	return max_children > UINT16_MAX;
+}
+
+static int
+_nvme_ns_cmd_submit_rw(struct nvme_namespace *ns, struct nvme_qpair *qpair, void *payload,
+		       uint64_t lba, uint32_t lba_count, nvme_cb_fn_t cb_fn, void *cb_arg,
+		       uint32_t opc, uint32_t io_flags, uint32_t sectors_per_cmd,
+		       bool fixed_payload)
 {
 	struct nvme_request *req;
 
-	req = _nvme_ns_cmd_rw(ns, payload, lba, lba_count, cb_fn, cb_arg, NVME_OPC_READ);
+	if (_nvme_ns_cmd_too_many_children(ns, lba_count, sectors_per_cmd)) {
+		return EINVAL;
+	}
+
+	req = _nvme_ns_cmd_rw(ns, payload, lba, lba_count, cb_fn, cb_arg, opc, io_flags,
+			      sectors_per_cmd, fixed_payload);
 	if (req != NULL) {
-		nvme_ctrlr_submit_io_request(ns->ctrlr, req);
+		nvme_qpair_submit_request(qpair, req);
 		return 0;
 	} else {
 		return ENOMEM;
 	}
 }
 
-// @yzy
-// new wrap function
+static inline bool
+_nvme_ns_cmd_io_flags_valid(uint32_t io_flags)
+{
+	return (io_flags & ~(NVME_IO_FLAGS_CDW12_MASK | NVME_IO_FLAGS_DSM_MASK)) == 0;
+}
+
 int
-nvme_ns_cmd_read_by_id(struct nvme_namespace *ns, void *payload, uint64_t lba,
-		 uint32_t lba_count, nvme_cb_fn_t cb_fn, void *cb_arg, int ioq_index)
+nvme_ns_cmd_read(struct nvme_namespace *ns, struct nvme_qpair *qpair, void *payload,
+		 uint64_t lba, uint32_t lba_count, nvme_cb_fn_t cb_fn, void *cb_arg,
+		 uint32_t io_flags)
 {
-	struct nvme_request *req;
+	if (!_nvme_ns_cmd_io_flags_valid(io_flags)) {
+		return EINVAL;
+	}
 
-	req = _nvme_ns_cmd_rw(ns, payload, lba, lba_count, cb_fn, cb_arg, NVME_OPC_READ);
-	if (req != NULL) {
-		nvme_ctrlr_submit_io_request_by_id(ns->ctrlr, req, ioq_index);
-		return 0;
-	} else {
-		return ENOMEM;
+	return _nvme_ns_cmd_submit_rw(ns, qpair, payload, lba, lba_count, cb_fn, cb_arg,
+				      NVME_OPC_READ, io_flags, ns->sectors_per_max_io, false);
+}
+
+int
+nvme_ns_cmd_write(struct nvme_namespace *ns, struct nvme_qpair *qpair, void *payload,
+		  uint64_t lba, uint32_t lba_count, nvme_cb_fn_t cb_fn, void *cb_arg,
+		  uint32_t io_flags)
+{
+	if (!_nvme_ns_cmd_io_flags_valid(io_flags)) {
+		return EINVAL;
 	}
+
+	return _nvme_ns_cmd_submit_rw(ns, qpair, payload, lba, lba_count, cb_fn, cb_arg,
+				      NVME_OPC_WRITE, io_flags, ns->sectors_per_max_io, false);
 }
 
 int
-nvme_ns_cmd_write(struct nvme_namespace *ns, void *payload, uint64_t lba,
-		  uint32_t lba_count, nvme_cb_fn_t cb_fn, void *cb_arg)
+nvme_ns_cmd_write_zeroes(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+			 uint64_t lba, uint32_t lba_count, nvme_cb_fn_t cb_fn, void *cb_arg)
 {
-	struct nvme_request *req;
+	if (lba_count == 0) {
+		return EINVAL;
+	}
 
-	req = _nvme_ns_cmd_rw(ns, payload, lba, lba_count, cb_fn, cb_arg, NVME_OPC_WRITE);
-	if (req != NULL) {
-		nvme_ctrlr_submit_io_request(ns->ctrlr, req);
-		return 0;
-	} else {
+	if (ns->flags & NVME_NS_WRITE_ZEROES_SUPPORTED) {
+		return _nvme_ns_cmd_submit_rw(ns, qpair, NULL, lba, lba_count, cb_fn, cb_arg,
+					      NVME_OPC_WRITE_ZEROES, 0, NVME_MAX_LBA_COUNT, false);
+	}
+
+	/* Write every command's blocks from the controller's shared buffer of zeroes. */
+	if (ns->ctrlr->zero_buf == NULL) {
 		return ENOMEM;
 	}
+	return _nvme_ns_cmd_submit_rw(ns, qpair, ns->ctrlr->zero_buf, lba, lba_count, cb_fn, cb_arg,
+				      NVME_OPC_WRITE, 0, ns->sectors_per_max_io, true);
 }
 
-// @yzy
-// new wrap function
 int
-nvme_ns_cmd_write_by_id(struct nvme_namespace *ns, void *payload, uint64_t lba,
-		  uint32_t lba_count, nvme_cb_fn_t cb_fn, void *cb_arg, int ioq_index)
+nvme_ns_cmd_verify(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+		   uint64_t lba, uint32_t lba_count, nvme_cb_fn_t cb_fn, void *cb_arg)
 {
-	struct nvme_request *req;
+	if (lba_count == 0) {
+		return EINVAL;
+	}
 
-	req = _nvme_ns_cmd_rw(ns, payload, lba, lba_count, cb_fn, cb_arg, NVME_OPC_WRITE);
-	if (req != NULL) {
-		nvme_ctrlr_submit_io_request_by_id(ns->ctrlr, req, ioq_index);
-		return 0;
-	} else {
+	if (ns->flags & NVME_NS_VERIFY_SUPPORTED) {
+		return _nvme_ns_cmd_submit_rw(ns, qpair, NULL, lba, lba_count, cb_fn, cb_arg,
+					      NVME_OPC_VERIFY, 0, NVME_MAX_LBA_COUNT, false);
+	}
+
+	/*
+	 * Reading the blocks checks them the same way, at the cost of the
+	 *  transfer.  The data lands in a shared buffer and is ignored.
+	 */
+	if (ns->ctrlr->discard_buf == NULL) {
 		return ENOMEM;
 	}
+	return _nvme_ns_cmd_submit_rw(ns, qpair, ns->ctrlr->discard_buf, lba, lba_count, cb_fn,
+				      cb_arg, NVME_OPC_READ, 0, ns->sectors_per_max_io, true);
 }
 
 int
-nvme_ns_cmd_deallocate(struct nvme_namespace *ns, void *payload,
-		       uint8_t num_ranges, nvme_cb_fn_t cb_fn, void *cb_arg)
+nvme_ns_cmd_compare(struct nvme_namespace *ns, struct nvme_qpair *qpair, void *payload,
+		    uint64_t lba, uint32_t lba_count, nvme_cb_fn_t cb_fn, void *cb_arg)
 {
-	struct nvme_request	*req;
-	struct nvme_command	*cmd;
+	return _nvme_ns_cmd_submit_rw(ns, qpair, payload, lba, lba_count, cb_fn, cb_arg,
+				      NVME_OPC_COMPARE, 0, ns->sectors_per_max_io, false);
+}
+
+int
+nvme_ns_cmd_compare_and_write(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+			      void *cmp_payload, void *write_payload,
+			      uint64_t lba, uint32_t lba_count,
+			      nvme_cb_fn_t cb_fn, void *cb_arg)
+{
+	struct nvme_request	*req, *cmp, *write;
+	uint32_t		payload_size;
 
-	if (num_ranges == 0) {
+	/* Splitting would break the pair's atomicity, so the range must fit one command. */
+	if (lba_count == 0 || lba_count > ns->sectors_per_max_io ||
+	    _nvme_ns_cmd_spans_stripe(ns, lba, lba_count)) {
 		return EINVAL;
 	}
 
-	req = nvme_allocate_request(payload,
-				    num_ranges * sizeof(struct nvme_dsm_range),
-				    cb_fn, cb_arg);
+	/* Both commands hold a tracker at once, which a tiny queue cannot provide. */
+	if (ns->ctrlr->opts.io_queue_requests < 2) {
+		return EINVAL;
+	}
+
+	/*
+	 * The pair is built as a parent with two children, like a split
+	 *  request, so the caller sees a single completion.  The qpair
+	 *  recognizes it by the fuse bits of its first child.
+	 */
+	req = nvme_allocate_request(NULL, 0, cb_fn, cb_arg);
 	if (req == NULL) {
 		return ENOMEM;
 	}
 
-	cmd = &req->cmd;
-	cmd->opc = NVME_OPC_DATASET_MANAGEMENT;
-	cmd->nsid = ns->id;
+	payload_size = lba_count * ns->sector_size;
+	cmp = nvme_allocate_request(cmp_payload, payload_size, NULL, NULL);
+	if (cmp == NULL) {
+		nvme_free_request(req);
+		return ENOMEM;
+	}
+	write = nvme_allocate_request(write_payload, payload_size, NULL, NULL);
+	if (write == NULL) {
+		nvme_free_request(cmp);
+		nvme_free_request(req);
+		return ENOMEM;
+	}
 
-	/* TODO: create a delete command data structure */
-	cmd->cdw10 = num_ranges - 1;
-	cmd->cdw11 = NVME_DSM_ATTR_DEALLOCATE;
+	_nvme_ns_cmd_setup_rw(ns, cmp, lba, lba_count, NVME_OPC_COMPARE, 0);
+	cmp->cmd.fuse = NVME_FUSE_FIRST;
+	nvme_request_add_child(req, cmp);
+
+	_nvme_ns_cmd_setup_rw(ns, write, lba, lba_count, NVME_OPC_WRITE, 0);
+	write->cmd.fuse = NVME_FUSE_SECOND;
+	nvme_request_add_child(req, write);
 
-	nvme_ctrlr_submit_io_request(ns->ctrlr, req);
+	nvme_qpair_submit_request(qpair, req);
 
 	return 0;
 }
 
-// @yzy
-// new wrap function
 int
-nvme_ns_cmd_deallocate_by_id(struct nvme_namespace *ns, void *payload,
-		       uint8_t num_ranges, nvme_cb_fn_t cb_fn, void *cb_arg, int ioq_index)
+nvme_ns_cmd_deallocate(struct nvme_namespace *ns, struct nvme_qpair *qpair, void *payload,
+		       uint16_t num_ranges, nvme_cb_fn_t cb_fn, void *cb_arg)
 {
 	struct nvme_request	*req;
 	struct nvme_command	*cmd;
 
-	if (num_ranges == 0) {
+	if (num_ranges == 0 || num_ranges > NVME_DATASET_MANAGEMENT_MAX_RANGES) {
 		return EINVAL;
 	}
 
@@ -286,35 +404,14 @@ nvme_ns_cmd_deallocate_by_id(struct nvme_namespace *ns, void *payload,
 	cmd->cdw10 = num_ranges - 1;
 	cmd->cdw11 = NVME_DSM_ATTR_DEALLOCATE;
 
-	nvme_ctrlr_submit_io_request_by_id(ns->ctrlr, req, ioq_index);
-
-	return 0;
-}
-
-int
-nvme_ns_cmd_flush(struct nvme_namespace *ns, nvme_cb_fn_t cb_fn, void *cb_arg)
-{
-	struct nvme_request	*req;
-	struct nvme_command	*cmd;
-
-	req = nvme_allocate_request(NULL, 0, cb_fn, cb_arg);
-	if (req == NULL) {
-		return ENOMEM;
-	}
-
-	cmd = &req->cmd;
-	cmd->opc = NVME_OPC_FLUSH;
-	cmd->nsid = ns->id;
-
-	nvme_ctrlr_submit_io_request(ns->ctrlr, req);
+	nvme_qpair_submit_request(qpair, req);
 
 	return 0;
 }
 
-// @yzy
-// new wrap function
 int
-nvme_ns_cmd_flush_by_id(struct nvme_namespace *ns, nvme_cb_fn_t cb_fn, void *cb_arg, int ioq_index)
+nvme_ns_cmd_flush(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+		  nvme_cb_fn_t cb_fn, void *cb_arg)
 {
 	struct nvme_request	*req;
 	struct nvme_command	*cmd;
@@ -328,7 +425,7 @@ nvme_ns_cmd_flush_by_id(struct nvme_namespace *ns, nvme_cb_fn_t cb_fn, void *cb_
 	cmd->opc = NVME_OPC_FLUSH;
 	cmd->nsid = ns->id;
 
-	nvme_ctrlr_submit_io_request_by_id(ns->ctrlr, req, ioq_index);
+	nvme_qpair_submit_request(qpair, req);
 
 	return 0;
 }
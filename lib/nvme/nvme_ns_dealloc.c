@@ -0,0 +1,476 @@
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright(c) 2015 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "nvme_internal.h"
+
+/** \file
+ * Deallocation of namespace blocks, merged and batched into Dataset
+ *  Management commands under a rate limit.
+ */
+
+void
+nvme_deallocator_opts_set_defaults(struct nvme_deallocator_opts *opts)
+{
+	opts->max_ranges_per_cmd = NVME_DATASET_MANAGEMENT_MAX_RANGES;
+	opts->flush_blocks = 0;
+	opts->max_age_us = NVME_DEFAULT_DEALLOC_MAX_AGE_US;
+	opts->max_blocks_per_sec = 0;
+	opts->queue_depth = NVME_DEFAULT_DEALLOC_QUEUE_DEPTH;
+	opts->max_pending_ranges = NVME_DEFAULT_DEALLOC_MAX_PENDING_RANGES;
+}
+
+struct nvme_deallocator *
+nvme_ns_alloc_deallocator(struct nvme_namespace *ns, struct nvme_qpair *qpair,
+			  const struct nvme_deallocator_opts *opts)
+{
+	struct nvme_deallocator		*dealloc;
+	struct nvme_deallocator_opts	default_opts;
+	uint64_t			hz = nvme_get_tsc_hz();
+
+	if (opts == NULL) {
+		nvme_deallocator_opts_set_defaults(&default_opts);
+		opts = &default_opts;
+	}
+
+	if (!(ns->flags & NVME_NS_DEALLOCATE_SUPPORTED) ||
+	    opts->max_ranges_per_cmd == 0 ||
+	    opts->max_ranges_per_cmd > NVME_DATASET_MANAGEMENT_MAX_RANGES ||
+	    opts->queue_depth == 0 ||
+	    opts->max_pending_ranges < opts->max_ranges_per_cmd) {
+		return NULL;
+	}
+
+	dealloc = calloc(1, sizeof(*dealloc));
+	if (dealloc == NULL) {
+		return NULL;
+	}
+
+	dealloc->pending = calloc(opts->max_pending_ranges, sizeof(struct nvme_dealloc_range));
+	if (dealloc->pending == NULL) {
+		free(dealloc);
+		return NULL;
+	}
+
+	dealloc->ns = ns;
+	dealloc->qpair = qpair;
+	dealloc->opts = *opts;
+	dealloc->max_age_tsc = (uint64_t)opts->max_age_us * hz / 1000000;
+	dealloc->burst_tsc = hz / NVME_DEALLOC_BURST_DIVISOR;
+	dealloc->rate_tsc = nvme_get_tsc();
+	STAILQ_INIT(&dealloc->ready);
+	STAILQ_INIT(&dealloc->outstanding);
+	STAILQ_INIT(&dealloc->free_cmds);
+	STAILQ_INIT(&dealloc->syncs);
+
+	return dealloc;
+}
+
+int
+nvme_ns_free_deallocator(struct nvme_deallocator *dealloc)
+{
+	struct nvme_dealloc_cmd *cmd;
+
+	if (dealloc == NULL) {
+		return 0;
+	}
+
+	if (dealloc->in_pump || !STAILQ_EMPTY(&dealloc->ready) ||
+	    !STAILQ_EMPTY(&dealloc->outstanding)) {
+		return EBUSY;
+	}
+
+	while ((cmd = STAILQ_FIRST(&dealloc->free_cmds)) != NULL) {
+		STAILQ_REMOVE_HEAD(&dealloc->free_cmds, stailq);
+		nvme_free(cmd->ranges);
+		free(cmd);
+	}
+	free(dealloc->pending);
+	free(dealloc);
+
+	return 0;
+}
+
+static struct nvme_dealloc_cmd *
+nvme_dealloc_get_cmd(struct nvme_deallocator *dealloc)
+{
+	struct nvme_dealloc_cmd	*cmd;
+	uint64_t		phys_addr;
+
+	cmd = STAILQ_FIRST(&dealloc->free_cmds);
+	if (cmd != NULL) {
+		STAILQ_REMOVE_HEAD(&dealloc->free_cmds, stailq);
+		return cmd;
+	}
+
+	cmd = calloc(1, sizeof(*cmd));
+	if (cmd == NULL) {
+		return NULL;
+	}
+
+	/* A full range list is one page, so keep it within one for the PRP. */
+	cmd->ranges = nvme_malloc("nvme_dsm_ranges",
+				  dealloc->opts.max_ranges_per_cmd * sizeof(struct nvme_dsm_range),
+				  PAGE_SIZE, &phys_addr);
+	if (cmd->ranges == NULL) {
+		free(cmd);
+		return NULL;
+	}
+	cmd->dealloc = dealloc;
+
+	return cmd;
+}
+
+/*
+ * Move the pending ranges with the lowest LBAs into a command.  A range
+ *  longer than a DSM range can describe is sent in pieces.
+ */
+static struct nvme_dealloc_cmd *
+nvme_dealloc_build_cmd(struct nvme_deallocator *dealloc)
+{
+	struct nvme_dealloc_cmd		*cmd;
+	struct nvme_dealloc_range	*range;
+	uint32_t			i = 0, length;
+	uint16_t			n = 0;
+	uint64_t			num_blocks = 0;
+
+	cmd = nvme_dealloc_get_cmd(dealloc);
+	if (cmd == NULL) {
+		return NULL;
+	}
+
+	while (i < dealloc->num_pending && n < dealloc->opts.max_ranges_per_cmd) {
+		range = &dealloc->pending[i];
+		length = range->lba_count > UINT32_MAX ? UINT32_MAX : range->lba_count;
+
+		cmd->ranges[n].attributes = 0;
+		cmd->ranges[n].length = length;
+		cmd->ranges[n].starting_lba = range->lba;
+		n++;
+		num_blocks += length;
+
+		if (length < range->lba_count) {
+			range->lba += length;
+			range->lba_count -= length;
+		} else {
+			i++;
+		}
+	}
+
+	memmove(dealloc->pending, &dealloc->pending[i],
+		(dealloc->num_pending - i) * sizeof(struct nvme_dealloc_range));
+	dealloc->num_pending -= i;
+	dealloc->pending_blocks -= num_blocks;
+
+	cmd->num_ranges = n;
+	cmd->num_blocks = num_blocks;
+	cmd->done = false;
+	cmd->seq = ++dealloc->last_seq;
+
+	return cmd;
+}
+
+static bool
+nvme_dealloc_is_due(struct nvme_deallocator *dealloc, uint64_t now)
+{
+	if (dealloc->num_pending == 0) {
+		return false;
+	}
+
+	if (dealloc->num_pending >= dealloc->opts.max_ranges_per_cmd ||
+	    (dealloc->opts.flush_blocks != 0 &&
+	     dealloc->pending_blocks >= dealloc->opts.flush_blocks)) {
+		return true;
+	}
+
+	return now - dealloc->pending_tsc >= dealloc->max_age_tsc;
+}
+
+/* Charge num_blocks against the rate limit. */
+static void
+nvme_dealloc_charge(struct nvme_deallocator *dealloc, uint64_t num_blocks, uint64_t now)
+{
+	uint64_t rate = dealloc->opts.max_blocks_per_sec;
+	uint64_t hz = nvme_get_tsc_hz();
+
+	if (rate == 0) {
+		return;
+	}
+
+	if (dealloc->rate_tsc + dealloc->burst_tsc < now) {
+		dealloc->rate_tsc = now - dealloc->burst_tsc;
+	}
+	dealloc->rate_tsc += num_blocks / rate * hz + num_blocks % rate * hz / rate;
+}
+
+static void nvme_dealloc_cmd_done(void *arg, const struct nvme_completion *cpl);
+
+static int
+nvme_dealloc_submit_cmd(struct nvme_deallocator *dealloc, struct nvme_dealloc_cmd *cmd)
+{
+	int rc;
+
+	/* The command can complete during submission, if the controller has failed. */
+	STAILQ_INSERT_TAIL(&dealloc->outstanding, cmd, stailq);
+	dealloc->num_outstanding++;
+
+	rc = nvme_ns_cmd_deallocate(dealloc->ns, dealloc->qpair, cmd->ranges, cmd->num_ranges,
+				    nvme_dealloc_cmd_done, cmd);
+	if (rc != 0) {
+		STAILQ_REMOVE(&dealloc->outstanding, cmd, nvme_dealloc_cmd, stailq);
+		dealloc->num_outstanding--;
+		return rc;
+	}
+
+	dealloc->stats.cmds++;
+	dealloc->stats.cmd_ranges += cmd->num_ranges;
+	dealloc->stats.cmd_blocks += cmd->num_blocks;
+	nvme_dealloc_charge(dealloc, cmd->num_blocks, nvme_get_tsc());
+
+	return 0;
+}
+
+/*
+ * Send commands built by syncs, then pending ranges that are due and
+ *  within the rate limit, up to the queue depth.
+ */
+static uint32_t
+nvme_dealloc_pump(struct nvme_deallocator *dealloc)
+{
+	struct nvme_dealloc_cmd	*cmd;
+	uint32_t		num_sent = 0;
+	uint64_t		now;
+
+	if (dealloc->in_pump) {
+		return 0;
+	}
+	dealloc->in_pump = true;
+
+	while (dealloc->num_outstanding < dealloc->opts.queue_depth) {
+		cmd = STAILQ_FIRST(&dealloc->ready);
+		if (cmd != NULL) {
+			STAILQ_REMOVE_HEAD(&dealloc->ready, stailq);
+		} else {
+			if (dealloc->num_pending == 0) {
+				break;
+			}
+			now = nvme_get_tsc();
+			if (!nvme_dealloc_is_due(dealloc, now)) {
+				break;
+			}
+			if (dealloc->opts.max_blocks_per_sec != 0 && dealloc->rate_tsc > now) {
+				dealloc->stats.throttled++;
+				break;
+			}
+			cmd = nvme_dealloc_build_cmd(dealloc);
+			if (cmd == NULL) {
+				break;
+			}
+		}
+
+		/* Out of requests.  Try again on the next poll or completion. */
+		if (nvme_dealloc_submit_cmd(dealloc, cmd) != 0) {
+			STAILQ_INSERT_HEAD(&dealloc->ready, cmd, stailq);
+			break;
+		}
+		num_sent++;
+	}
+
+	dealloc->in_pump = false;
+
+	return num_sent;
+}
+
+static void
+nvme_dealloc_cmd_done(void *arg, const struct nvme_completion *cpl)
+{
+	struct nvme_dealloc_cmd			*cmd = arg;
+	struct nvme_deallocator			*dealloc = cmd->dealloc;
+	struct nvme_dealloc_sync		*sync;
+	STAILQ_HEAD(, nvme_dealloc_sync)	done_syncs;
+
+	cmd->done = true;
+	memcpy(&cmd->cpl, cpl, sizeof(*cpl));
+	dealloc->num_outstanding--;
+	if (nvme_completion_is_error(cpl)) {
+		dealloc->stats.errors++;
+	}
+
+	/*
+	 * Retire commands in the order they were built, so done_seq covers
+	 *  every command up to it.  A failure is reported only to the syncs
+	 *  that cover the failed command, since commands can complete out of
+	 *  order and retire several syncs at once.
+	 */
+	while ((cmd = STAILQ_FIRST(&dealloc->outstanding)) != NULL && cmd->done) {
+		STAILQ_REMOVE_HEAD(&dealloc->outstanding, stailq);
+		dealloc->done_seq = cmd->seq;
+		if (nvme_completion_is_error(&cmd->cpl)) {
+			STAILQ_FOREACH(sync, &dealloc->syncs, stailq) {
+				if (sync->seq >= cmd->seq &&
+				    !nvme_completion_is_error(&sync->cpl)) {
+					memcpy(&sync->cpl, &cmd->cpl, sizeof(cmd->cpl));
+				}
+			}
+		}
+		STAILQ_INSERT_HEAD(&dealloc->free_cmds, cmd, stailq);
+	}
+
+	STAILQ_INIT(&done_syncs);
+	while ((sync = STAILQ_FIRST(&dealloc->syncs)) != NULL &&
+	       sync->seq <= dealloc->done_seq) {
+		STAILQ_REMOVE_HEAD(&dealloc->syncs, stailq);
+		STAILQ_INSERT_TAIL(&done_syncs, sync, stailq);
+	}
+
+	nvme_dealloc_pump(dealloc);
+
+	/* Last, since a callback may free the deallocator. */
+	while ((sync = STAILQ_FIRST(&done_syncs)) != NULL) {
+		STAILQ_REMOVE_HEAD(&done_syncs, stailq);
+		sync->cb_fn(sync->cb_arg, &sync->cpl);
+		free(sync);
+	}
+}
+
+int
+nvme_deallocator_add(struct nvme_deallocator *dealloc, uint64_t lba, uint64_t lba_count)
+{
+	struct nvme_dealloc_range	*pending = dealloc->pending;
+	uint64_t			end;
+	uint32_t			lo, hi, mid, i, j;
+
+	if (lba_count == 0 || lba_count > UINT64_MAX - lba) {
+		return EINVAL;
+	}
+	end = lba + lba_count;
+
+	/* Find the first pending range that ends at or after lba, so it overlaps or adjoins. */
+	lo = 0;
+	hi = dealloc->num_pending;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (pending[mid].lba + pending[mid].lba_count < lba) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	i = lo;
+
+	/* Absorb every range from there that starts at or before end. */
+	for (j = i; j < dealloc->num_pending && pending[j].lba <= end; j++) {
+		if (pending[j].lba < lba) {
+			lba = pending[j].lba;
+		}
+		if (pending[j].lba + pending[j].lba_count > end) {
+			end = pending[j].lba + pending[j].lba_count;
+		}
+		dealloc->pending_blocks -= pending[j].lba_count;
+	}
+
+	if (j == i) {
+		if (dealloc->num_pending == dealloc->opts.max_pending_ranges) {
+			return ENOMEM;
+		}
+		if (dealloc->num_pending == 0) {
+			dealloc->pending_tsc = nvme_get_tsc();
+		}
+		memmove(&pending[i + 1], &pending[i],
+			(dealloc->num_pending - i) * sizeof(struct nvme_dealloc_range));
+		dealloc->num_pending++;
+	} else {
+		memmove(&pending[i + 1], &pending[j],
+			(dealloc->num_pending - j) * sizeof(struct nvme_dealloc_range));
+		dealloc->num_pending -= j - i - 1;
+		dealloc->stats.ranges_merged++;
+	}
+
+	pending[i].lba = lba;
+	pending[i].lba_count = end - lba;
+	dealloc->pending_blocks += end - lba;
+	dealloc->stats.ranges_added++;
+
+	nvme_dealloc_pump(dealloc);
+
+	return 0;
+}
+
+int
+nvme_deallocator_sync(struct nvme_deallocator *dealloc, nvme_cb_fn_t cb_fn, void *cb_arg)
+{
+	struct nvme_dealloc_sync	*sync;
+	struct nvme_dealloc_cmd		*cmd;
+
+	sync = calloc(1, sizeof(*sync));
+	if (sync == NULL) {
+		return ENOMEM;
+	}
+
+	while (dealloc->num_pending != 0) {
+		cmd = nvme_dealloc_build_cmd(dealloc);
+		if (cmd == NULL) {
+			free(sync);
+			return ENOMEM;
+		}
+		STAILQ_INSERT_TAIL(&dealloc->ready, cmd, stailq);
+	}
+
+	if (dealloc->done_seq == dealloc->last_seq) {
+		cb_fn(cb_arg, &sync->cpl);
+		free(sync);
+		return 0;
+	}
+
+	sync->seq = dealloc->last_seq;
+	sync->cb_fn = cb_fn;
+	sync->cb_arg = cb_arg;
+	STAILQ_INSERT_TAIL(&dealloc->syncs, sync, stailq);
+
+	nvme_dealloc_pump(dealloc);
+
+	return 0;
+}
+
+uint32_t
+nvme_deallocator_poll(struct nvme_deallocator *dealloc)
+{
+	return nvme_dealloc_pump(dealloc);
+}
+
+void
+nvme_deallocator_get_stats(struct nvme_deallocator *dealloc,
+			   struct nvme_deallocator_stats *stats)
+{
+	memcpy(stats, &dealloc->stats, sizeof(*stats));
+}
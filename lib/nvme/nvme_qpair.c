@@ -33,6 +33,14 @@
 
 #include "nvme_internal.h"
 
+#if defined(NVME_SQE_NT_STORE)
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#endif
+
 /**
  * \file
  *
@@ -48,6 +56,9 @@ static inline bool nvme_qpair_is_io_queue(struct nvme_qpair *qpair)
 	return qpair->id != 0;
 }
 
+static void _nvme_qpair_submit_request(struct nvme_qpair *qpair, struct nvme_request *req,
+				       bool from_queue);
+
 struct nvme_string {
 	uint16_t	value;
 	const char 	*str;
@@ -68,6 +79,7 @@ static const struct nvme_string admin_opcode[] = {
 	{ NVME_OPC_FIRMWARE_COMMIT, "FIRMWARE COMMIT" },
 	{ NVME_OPC_FIRMWARE_IMAGE_DOWNLOAD, "FIRMWARE IMAGE DOWNLOAD" },
 	{ NVME_OPC_NAMESPACE_ATTACHMENT, "NAMESPACE ATTACHMENT" },
+	{ NVME_OPC_DOORBELL_BUFFER_CONFIG, "DOORBELL BUFFER CONFIG" },
 	{ NVME_OPC_FORMAT_NVM, "FORMAT NVM" },
 	{ NVME_OPC_SECURITY_SEND, "SECURITY SEND" },
 	{ NVME_OPC_SECURITY_RECEIVE, "SECURITY RECEIVE" },
@@ -287,10 +299,249 @@ nvme_completion_is_retry(const struct nvme_completion *cpl)
 }
 
 static void
-nvme_qpair_construct_tracker(struct nvme_tracker *tr, uint16_t cid, uint64_t phys_addr)
+nvme_qpair_construct_tracker(struct nvme_tracker *tr, uint16_t cid, uint64_t *prp,
+			     uint64_t prp_bus_addr)
 {
-	tr->prp_bus_addr = phys_addr + offsetof(struct nvme_tracker, prp);
+	tr->req = NULL;
+	tr->prp = prp;
+	tr->prp_bus_addr = prp_bus_addr;
 	tr->cid = cid;
+	tr->timeout_state = NVME_TIMEOUT_NONE;
+}
+
+static inline uint32_t
+nvme_timeout_get_tick(void)
+{
+	return nvme_get_time_us() / NVME_TIMEOUT_TICK_US;
+}
+
+static inline void
+nvme_qpair_arm_timeout(struct nvme_qpair *qpair, struct nvme_tracker *tr)
+{
+	if (qpair->num_timeouts_armed++ == 0) {
+		/* Nothing was being timed, so the cached tick may be stale. */
+		qpair->timeout_tick = nvme_timeout_get_tick();
+		qpair->timeout_check_tick = qpair->timeout_tick;
+	}
+
+	tr->timeout_tick = (uint16_t)qpair->timeout_tick;
+	tr->timeout_state = NVME_TIMEOUT_ARMED;
+	qpair->timeout_wheel[tr->timeout_tick % NVME_TIMEOUT_WHEEL_SLOTS]++;
+}
+
+static inline void
+nvme_qpair_disarm_timeout(struct nvme_qpair *qpair, struct nvme_tracker *tr)
+{
+	qpair->timeout_wheel[tr->timeout_tick % NVME_TIMEOUT_WHEEL_SLOTS]--;
+	qpair->num_timeouts_armed--;
+	tr->timeout_state = NVME_TIMEOUT_NONE;
+}
+
+static void
+nvme_qpair_flush_batch(struct nvme_qpair *qpair)
+{
+	uint32_t num_cpls = qpair->num_batch_cpl;
+
+	if (num_cpls > 0) {
+		/*
+		 * Reset the count before the callback, which may submit
+		 *  I/O that completes (and is batched) immediately.
+		 */
+		qpair->num_batch_cpl = 0;
+		qpair->batch_cb_fn(qpair->batch_cb_ctx, qpair->batch_cpl, num_cpls);
+	}
+}
+
+/*
+ * Completion callback of proxied requests, called on the shared qpair's
+ *  thread.  Hands the completion to the proxy's completion ring, which has
+ *  room since the proxy never has more than its depth outstanding.
+ */
+static void
+nvme_qpair_proxy_complete(void *arg, const struct nvme_completion *cpl)
+{
+	struct nvme_request	*req = arg;
+	struct nvme_qpair_proxy	*proxy = req->proxy;
+	struct nvme_proxy_cpl	*entry;
+	uint32_t		tail = proxy->cpl_tail;
+
+	entry = &proxy->cpl_ring[tail & proxy->cpl_mask];
+	entry->cb_fn = req->proxy_cb_fn;
+	entry->cb_arg = req->proxy_cb_arg;
+	entry->cpl = *cpl;
+
+	__atomic_store_n(&proxy->cpl_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void
+nvme_qpair_batch_request(struct nvme_qpair *qpair, struct nvme_request *req,
+			 const struct nvme_completion *cpl)
+{
+	struct nvme_batch_cpl *entry;
+
+	if (req->cb_fn == NULL) {
+		return;
+	}
+
+	/* Proxied requests are reported on the proxy's thread, not batched here. */
+	if (req->cb_fn == nvme_qpair_proxy_complete) {
+		nvme_qpair_proxy_complete(req->cb_arg, cpl);
+		return;
+	}
+
+	entry = &qpair->batch_cpl[qpair->num_batch_cpl];
+	entry->cb_arg = req->cb_arg;
+	entry->status = cpl->status;
+
+	if (++qpair->num_batch_cpl == NVME_BATCH_CPL_ENTRIES) {
+		nvme_qpair_flush_batch(qpair);
+	}
+}
+
+/*
+ * Report the completion of req, either by calling its callback or, in batch
+ *  mode, by adding it to the qpair's pending batch.  The caller frees req.
+ */
+static inline void
+nvme_qpair_complete_request(struct nvme_qpair *qpair, struct nvme_request *req,
+			    const struct nvme_completion *cpl)
+{
+	struct nvme_request *parent;
+
+	if (qpair->batch_cb_fn == NULL) {
+		if (req->cb_fn) {
+			req->cb_fn(req->cb_arg, cpl);
+		}
+		return;
+	}
+
+	if (req->parent == NULL) {
+		nvme_qpair_batch_request(qpair, req, cpl);
+		return;
+	}
+
+	/*
+	 * Children complete through an internal callback; only the parent
+	 *  is reported to the application.
+	 */
+	parent = nvme_request_complete_child(req, cpl);
+	if (parent != NULL) {
+		nvme_qpair_batch_request(qpair, parent, &parent->parent_status);
+		nvme_free_request(parent);
+	}
+}
+
+static void
+nvme_qpair_record_latency(struct nvme_qpair *qpair, struct nvme_request *req)
+{
+	struct histogram	*h = qpair->latency_hist[req->cmd.opc];
+
+	if (h == NULL) {
+		h = calloc(1, sizeof(*h));
+		if (h == NULL) {
+			return;
+		}
+		/* Pairs with the load in nvme_qpair_merge_latency_histogram(). */
+		__atomic_store_n(&qpair->latency_hist[req->cmd.opc], h, __ATOMIC_RELEASE);
+	}
+
+	histogram_tally(h, nvme_get_tsc() - req->submit_tsc);
+}
+
+static inline void
+nvme_qpair_free_tracker(struct nvme_qpair *qpair, struct nvme_tracker *tr)
+{
+	struct nvme_request	*req;
+
+	tr->req = NULL;
+	qpair->free_cid[qpair->num_free_tr++] = tr->cid;
+
+	/*
+	 * If the controller is in the middle of resetting, don't
+	 *  try to submit queued requests here - let the reset logic
+	 *  handle that instead.
+	 */
+	if (!STAILQ_EMPTY(&qpair->queued_req) &&
+	    !qpair->ctrlr->is_resetting) {
+		req = STAILQ_FIRST(&qpair->queued_req);
+		/* A fused pair stays at the head until both of its trackers are free. */
+		if (nvme_request_is_fused(req) && qpair->num_free_tr < 2) {
+			return;
+		}
+		STAILQ_REMOVE_HEAD(&qpair->queued_req, stailq);
+		_nvme_qpair_submit_request(qpair, req, true);
+	}
+}
+
+/*
+ * Return how long to wait before resubmitting req, which just completed
+ *  with retryable status cpl for the req->retries'th time.
+ */
+static uint64_t
+nvme_qpair_retry_delay_us(struct nvme_qpair *qpair, struct nvme_request *req,
+			  const struct nvme_completion *cpl)
+{
+	enum nvme_retry_class	retry_class = NVME_RETRY_CLASS_ABORTED;
+	uint64_t		backoff_us;
+
+	if (cpl->status.sct == NVME_SCT_GENERIC &&
+	    cpl->status.sc == NVME_SC_NAMESPACE_NOT_READY) {
+		retry_class = NVME_RETRY_CLASS_NAMESPACE_NOT_READY;
+	}
+
+	backoff_us = qpair->ctrlr->opts.retry_backoff_us[retry_class];
+	backoff_us <<= nvme_min(req->retries - 1, 20);
+
+	return nvme_min(backoff_us, NVME_MAX_RETRY_BACKOFF_US);
+}
+
+/*
+ * Park req until delay_us from now.  Retries are rare, so the queue is
+ *  kept ordered by a linear insertion.
+ */
+static void
+nvme_qpair_delay_request(struct nvme_qpair *qpair, struct nvme_request *req, uint64_t delay_us)
+{
+	struct nvme_request	*prev = NULL, *next;
+
+	req->retry_due_us = nvme_get_time_us() + delay_us;
+
+	STAILQ_FOREACH(next, &qpair->delayed_req, stailq) {
+		if (next->retry_due_us > req->retry_due_us) {
+			break;
+		}
+		prev = next;
+	}
+
+	if (prev == NULL) {
+		STAILQ_INSERT_HEAD(&qpair->delayed_req, req, stailq);
+	} else {
+		STAILQ_INSERT_AFTER(&qpair->delayed_req, prev, req, stailq);
+	}
+	qpair->num_delayed_reqs++;
+}
+
+static void
+nvme_qpair_resubmit_delayed(struct nvme_qpair *qpair)
+{
+	struct nvme_request	*req;
+	uint64_t		now = nvme_get_time_us();
+
+	while ((req = STAILQ_FIRST(&qpair->delayed_req)) != NULL &&
+	       req->retry_due_us <= now) {
+		STAILQ_REMOVE_HEAD(&qpair->delayed_req, stailq);
+		qpair->num_delayed_reqs--;
+		nvme_qpair_submit_request(qpair, req);
+	}
+}
+
+static inline void
+nvme_qpair_check_delayed(struct nvme_qpair *qpair)
+{
+	/* Polls without parked retries do not read the clock. */
+	if (qpair->num_delayed_reqs != 0) {
+		nvme_qpair_resubmit_delayed(qpair);
+	}
 }
 
 static void
@@ -298,50 +549,54 @@ nvme_qpair_complete_tracker(struct nvme_qpair *qpair, struct nvme_tracker *tr,
 			    struct nvme_completion *cpl, bool print_on_error)
 {
 	struct nvme_request	*req;
+	uint64_t		delay_us;
 	bool			retry, error;
 
 	req = tr->req;
 
 	nvme_assert(req != NULL, ("tr has NULL req\n"));
 
+	if (tr->timeout_state != NVME_TIMEOUT_NONE) {
+		nvme_qpair_disarm_timeout(qpair, tr);
+	}
+
+	/*
+	 * Half of a fused pair cannot be resubmitted on its own, so fused
+	 *  commands report their failure instead of being retried.
+	 */
 	error = nvme_completion_is_error(cpl);
 	retry = error && nvme_completion_is_retry(cpl) &&
-		req->retries < nvme_retry_count;
+		req->retries < nvme_retry_count && req->cmd.fuse == NVME_FUSE_NORMAL;
 
 	if (error && print_on_error) {
 		nvme_qpair_print_command(qpair, &req->cmd);
 		nvme_qpair_print_completion(qpair, cpl);
 	}
 
-	qpair->act_tr[cpl->cid] = NULL;
-
 	nvme_assert(cpl->cid == req->cmd.cid, ("cpl cid does not match cmd cid\n"));
 
 	if (retry) {
 		req->retries++;
-		nvme_qpair_submit_tracker(qpair, tr);
+		nvme_qpair_stat_inc(qpair, retries);
+		delay_us = nvme_qpair_retry_delay_us(qpair, req, cpl);
+		if (delay_us == 0) {
+			nvme_trace(qpair, req, NVME_TRACE_RETRY, tr->cid, nvme_trace_status(cpl));
+			nvme_qpair_submit_tracker(qpair, tr);
+		} else {
+			nvme_trace(qpair, req, NVME_TRACE_DELAY, tr->cid, nvme_trace_status(cpl));
+			nvme_qpair_delay_request(qpair, req, delay_us);
+			nvme_qpair_free_tracker(qpair, tr);
+		}
 	} else {
-		if (req->cb_fn) {
-			req->cb_fn(req->cb_arg, cpl);
+		if (qpair->latency_hist != NULL) {
+			nvme_qpair_record_latency(qpair, req);
 		}
+		nvme_trace(qpair, req, NVME_TRACE_COMPLETE, tr->cid, nvme_trace_status(cpl));
 
-		nvme_free_request(req);
-		tr->req = NULL;
-
-		LIST_REMOVE(tr, list);
-		LIST_INSERT_HEAD(&qpair->free_tr, tr, list);
+		nvme_qpair_complete_request(qpair, req, cpl);
 
-		/*
-		 * If the controller is in the middle of resetting, don't
-		 *  try to submit queued requests here - let the reset logic
-		 *  handle that instead.
-		 */
-		if (!STAILQ_EMPTY(&qpair->queued_req) &&
-		    !qpair->ctrlr->is_resetting) {
-			req = STAILQ_FIRST(&qpair->queued_req);
-			STAILQ_REMOVE_HEAD(&qpair->queued_req, stailq);
-			nvme_qpair_submit_request(qpair, req);
-		}
+		nvme_free_request(req);
+		nvme_qpair_free_tracker(qpair, tr);
 	}
 }
 
@@ -359,6 +614,7 @@ nvme_qpair_manual_complete_tracker(struct nvme_qpair *qpair,
 	cpl.status.sc = sc;
 	cpl.status.dnr = dnr;
 	nvme_qpair_complete_tracker(qpair, tr, &cpl, print_on_error);
+	nvme_qpair_flush_batch(qpair);
 }
 
 void
@@ -367,8 +623,23 @@ nvme_qpair_manual_complete_request(struct nvme_qpair *qpair,
 				   bool print_on_error)
 {
 	struct nvme_completion	cpl;
+	struct nvme_request	*child_req, *next_req;
 	bool			error;
 
+	if (req->num_children) {
+		/*
+		 * A fused pair waiting for trackers.  Completing both of its
+		 *  commands completes, and frees, the pair.
+		 */
+		child_req = STAILQ_FIRST(&req->children);
+		while (child_req != NULL) {
+			next_req = STAILQ_NEXT(child_req, child_stailq);
+			nvme_qpair_manual_complete_request(qpair, child_req, sct, sc, print_on_error);
+			child_req = next_req;
+		}
+		return;
+	}
+
 	memset(&cpl, 0, sizeof(cpl));
 	cpl.sqid = qpair->id;
 	cpl.status.sct = sct;
@@ -381,11 +652,10 @@ nvme_qpair_manual_complete_request(struct nvme_qpair *qpair,
 		nvme_qpair_print_completion(qpair, &cpl);
 	}
 
-	if (req->cb_fn) {
-		req->cb_fn(req->cb_arg, &cpl);
-	}
+	nvme_qpair_complete_request(qpair, req, &cpl);
 
 	nvme_free_request(req);
+	nvme_qpair_flush_batch(qpair);
 }
 
 static inline bool
@@ -406,14 +676,19 @@ nvme_qpair_check_enabled(struct nvme_qpair *qpair)
  *
  * \section async_io I/O commands
  *
- * The application may submit I/O from one or more threads
- * and must call nvme_ctrlr_process_io_completions()
- * from each thread that submitted I/O.
+ * The application may submit I/O from one or more threads on one or more
+ * qpairs and must call nvme_qpair_process_completions() for each qpair that
+ * submitted I/O.
  *
- * When the application calls nvme_ctrlr_process_io_completions(),
- * if the NVMe driver detects completed I/Os that were submitted on that thread,
+ * When the application calls nvme_qpair_process_completions(),
+ * if the NVMe driver detects completed I/Os that were submitted on that qpair,
  * it will invoke the registered callback function
- * for each I/O within the context of nvme_ctrlr_process_io_completions().
+ * for each I/O within the context of nvme_qpair_process_completions().
+ *
+ * Several qpairs may share one completion queue (see
+ * nvme_io_qpair_opts::shared_cq).  Polling any one of them then reaps the
+ * completions of all of them, so a thread driving many qpairs touches a
+ * single completion ring per poll.
  *
  * \section async_admin Admin commands
  *
@@ -434,176 +709,706 @@ nvme_qpair_check_enabled(struct nvme_qpair *qpair)
  * using its own synchronization method.
  */
 
-/**
- * \brief Checks for and processes completions on the specified qpair.
- *
- * For each completed command, the request's callback function will
- *  be called if specified as non-NULL when the request was submitted.
- *
- * \sa nvme_cb_fn_t
+/*
+ * Returns true if moving a doorbell from old to new_idx passes the
+ *  controller's EventIdx, i.e. the controller asked to be notified
+ *  about this update.  All arithmetic is modulo 2^16, as in the spec.
  */
-void
-nvme_qpair_process_completions(struct nvme_qpair *qpair, uint32_t max_completions)
+static inline bool
+nvme_qpair_need_event(uint16_t event_idx, uint16_t new_idx, uint16_t old)
 {
-	struct nvme_tracker	*tr;
-	struct nvme_completion	*cpl;
+	return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old);
+}
 
-	if (!nvme_qpair_check_enabled(qpair)) {
-		/*
-		 * qpair is not enabled, likely because a controller reset is
-		 *  is in progress.  Ignore the interrupt - any I/O that was
-		 *  associated with this interrupt will get retried when the
-		 *  reset is complete.
-		 */
-		return;
-	}
+/*
+ * Publish a new doorbell value to the shadow doorbell buffer.  Returns
+ *  false if the MMIO doorbell write may be skipped.
+ */
+static inline bool
+nvme_qpair_update_shadow_doorbell(volatile uint32_t *shadow_db,
+				  volatile uint32_t *eventidx, uint16_t value)
+{
+	uint16_t old;
 
-	while (1) {
-		cpl = &qpair->cpl[qpair->cq_head];
+	if (shadow_db == NULL) {
+		return true;
+	}
 
-		if (cpl->status.p != qpair->phase)
-			break;
+	old = *shadow_db;
+	*shadow_db = value;
 
-		tr = qpair->act_tr[cpl->cid];
+	/* Shadow update must be visible before EventIdx is read. */
+	mb();
 
-		if (tr != NULL) {
-			nvme_qpair_complete_tracker(qpair, tr, cpl, true);
-		} else {
-			nvme_printf(qpair->ctrlr,
-				    "cpl does not map to outstanding cmd\n");
-			nvme_qpair_print_completion(qpair, cpl);
-			nvme_assert(0, ("received completion for unknown cmd\n"));
-		}
+	return nvme_qpair_need_event(*eventidx, value, old);
+}
 
-		if (++qpair->cq_head == qpair->num_entries) {
-			qpair->cq_head = 0;
-			qpair->phase = !qpair->phase;
-		}
+static inline void
+nvme_qpair_ring_sq_doorbell(struct nvme_qpair *qpair)
+{
+	wmb();
+	qpair->sq_tdbl_pending = false;
+	if (nvme_qpair_update_shadow_doorbell(qpair->sq_shadow_tdbl, qpair->sq_eventidx,
+					      qpair->sq_tail)) {
+		_nvme_mmio_write_4(qpair->sq_tdbl, qpair->sq_tail);
+		nvme_qpair_stat_inc(qpair, sq_doorbell_writes);
+	}
+}
 
+static inline void
+nvme_qpair_ring_cq_doorbell(struct nvme_qpair *qpair)
+{
+	if (nvme_qpair_update_shadow_doorbell(qpair->cq_shadow_hdbl, qpair->cq_eventidx,
+					      qpair->cq_head)) {
 		_nvme_mmio_write_4(qpair->cq_hdbl, qpair->cq_head);
-
-		if (max_completions > 0 && --max_completions == 0) {
-			break;
-		}
+		nvme_qpair_stat_inc(qpair, cq_doorbell_writes);
 	}
 }
 
-int
-nvme_qpair_construct(struct nvme_qpair *qpair, uint16_t id,
-		     uint16_t num_entries, uint16_t num_trackers,
-		     struct nvme_controller *ctrlr)
+/*
+ * Find the qpair that owns submission queue sqid, for an entry reaped from
+ *  qpair's shared completion queue.  Returns NULL if sqid is not one of the
+ *  submission queues posting to this completion queue.
+ */
+static struct nvme_qpair *
+nvme_qpair_get_shared_sq(struct nvme_qpair *qpair, uint16_t sqid)
 {
-	struct nvme_tracker	*tr;
-	uint16_t		i;
-	volatile uint32_t	*doorbell_base;
-	uint64_t		phys_addr = 0;
+	struct nvme_controller	*ctrlr = qpair->ctrlr;
+	struct nvme_qpair	*sq;
 
-	nvme_assert(num_entries != 0, ("invalid num_entries\n"));
-	nvme_assert(num_trackers != 0, ("invalid num_trackers\n"));
+	if (sqid == 0 || sqid > ctrlr->num_io_queues) {
+		return NULL;
+	}
 
-	qpair->id = id;
-	qpair->num_entries = num_entries;
+	sq = ctrlr->io_qpair_by_qid[sqid];
+	if (sq == NULL || sq->cq_qpair != qpair) {
+		return NULL;
+	}
 
-	qpair->ctrlr = ctrlr;
+	return sq;
+}
 
-	/* cmd and cpl rings must be aligned on 4KB boundaries. */
-	qpair->cmd = nvme_malloc("qpair_cmd",
-				 qpair->num_entries * sizeof(struct nvme_command),
-				 0x1000,
-				 &qpair->cmd_bus_addr);
-	if (qpair->cmd == NULL) {
-		nvme_printf(ctrlr, "alloc qpair_cmd failed\n");
-		goto fail;
-	}
-	qpair->cpl = nvme_malloc("qpair_cpl",
-				 qpair->num_entries * sizeof(struct nvme_completion),
-				 0x1000,
-				 &qpair->cpl_bus_addr);
-	if (qpair->cpl == NULL) {
-		nvme_printf(ctrlr, "alloc qpair_cpl failed\n");
-		goto fail;
+/*
+ * Hand the proxy's locally queued requests to the shared qpair, as long as
+ *  the proxy is below its depth and the shared qpair's ring has room.
+ */
+static void
+nvme_qpair_proxy_submit_queued(struct nvme_qpair_proxy *proxy)
+{
+	struct nvme_qpair	*qpair = &proxy->qpair;
+	struct nvme_request	*req;
+
+	while ((req = STAILQ_FIRST(&qpair->queued_req)) != NULL &&
+	       proxy->num_outstanding < proxy->depth) {
+		/* Unlink first: once enqueued, req belongs to the shared qpair's thread. */
+		STAILQ_REMOVE_HEAD(&qpair->queued_req, stailq);
+		if (!nvme_mpsc_ring_enqueue(qpair->mpsc_owner->mpsc_ring, req)) {
+			STAILQ_INSERT_HEAD(&qpair->queued_req, req, stailq);
+			break;
+		}
+		proxy->num_outstanding++;
 	}
+}
 
-	doorbell_base = &ctrlr->regs->doorbell[0].sq_tdbl;
-	qpair->sq_tdbl = doorbell_base + (2 * id + 0) * ctrlr->doorbell_stride_u32;
-	qpair->cq_hdbl = doorbell_base + (2 * id + 1) * ctrlr->doorbell_stride_u32;
+static void
+nvme_qpair_proxy_submit_request(struct nvme_qpair_proxy *proxy, struct nvme_request *req)
+{
+	req->proxy = proxy;
+	req->proxy_cb_fn = req->cb_fn;
+	req->proxy_cb_arg = req->cb_arg;
+	req->cb_fn = nvme_qpair_proxy_complete;
+	req->cb_arg = req;
+
+	STAILQ_INSERT_TAIL(&proxy->qpair.queued_req, req, stailq);
+	nvme_qpair_proxy_submit_queued(proxy);
+}
 
-	LIST_INIT(&qpair->free_tr);
-	LIST_INIT(&qpair->outstanding_tr);
-	STAILQ_INIT(&qpair->queued_req);
+static int32_t
+nvme_qpair_proxy_process_completions(struct nvme_qpair_proxy *proxy, uint32_t max_completions)
+{
+	struct nvme_proxy_cpl	entry;
+	uint32_t		tail, num_completions = 0;
 
-	for (i = 0; i < num_trackers; i++) {
+	tail = __atomic_load_n(&proxy->cpl_tail, __ATOMIC_ACQUIRE);
+	while (proxy->cpl_head != tail) {
 		/*
-		 * Round alignment up to next power of 2.  This ensures the PRP
-		 *  list embedded in the nvme_tracker object will not span a
-		 *  4KB boundary.
+		 * Copy the entry out first: once the callback submits more I/O,
+		 *  its slot may be reused by the shared qpair's thread.
 		 */
-		tr = nvme_malloc("nvme_tr", sizeof(*tr), nvme_align32pow2(sizeof(*tr)), &phys_addr);
-		if (tr == NULL) {
-			nvme_printf(ctrlr, "nvme_tr failed\n");
-			goto fail;
+		entry = proxy->cpl_ring[proxy->cpl_head & proxy->cpl_mask];
+		proxy->cpl_head++;
+		proxy->num_outstanding--;
+
+		if (entry.cb_fn) {
+			entry.cb_fn(entry.cb_arg, &entry.cpl);
 		}
-		nvme_qpair_construct_tracker(tr, i, phys_addr);
-		LIST_INSERT_HEAD(&qpair->free_tr, tr, list);
-	}
 
-	qpair->act_tr = calloc(num_trackers, sizeof(struct nvme_tracker *));
-	if (qpair->act_tr == NULL) {
-		nvme_printf(ctrlr, "alloc nvme_act_tr failed\n");
-		goto fail;
+		if (++num_completions == max_completions) {
+			break;
+		}
 	}
-	nvme_qpair_reset(qpair);
-	return 0;
-fail:
-	nvme_qpair_destroy(qpair);
-	return -1;
+
+	nvme_qpair_proxy_submit_queued(proxy);
+
+	return num_completions;
 }
 
+/*
+ * Submit the requests that proxies have placed in qpair's ring, with a single
+ *  submission queue doorbell write for all of them.
+ */
 static void
-nvme_admin_qpair_abort_aers(struct nvme_qpair *qpair)
+nvme_qpair_drain_mpsc_ring(struct nvme_qpair *qpair)
 {
-	struct nvme_tracker	*tr;
+	struct nvme_request	*req;
+	uint32_t		max_requests = qpair->mpsc_ring->mask + 1;
+	bool			was_plugged = qpair->is_plugged;
 
-	tr = LIST_FIRST(&qpair->outstanding_tr);
-	while (tr != NULL) {
-		if (tr->req->cmd.opc == NVME_OPC_ASYNC_EVENT_REQUEST) {
-			nvme_qpair_manual_complete_tracker(qpair, tr,
-							   NVME_SCT_GENERIC, NVME_SC_ABORTED_SQ_DELETION, 0,
-							   false);
-			tr = LIST_FIRST(&qpair->outstanding_tr);
-		} else {
-			tr = LIST_NEXT(tr, list);
-		}
+	qpair->is_plugged = true;
+	while (max_requests-- > 0 &&
+	       (req = nvme_mpsc_ring_dequeue(qpair->mpsc_ring)) != NULL) {
+		nvme_qpair_submit_request(qpair, req);
+	}
+	if (!was_plugged) {
+		nvme_qpair_unplug(qpair);
 	}
 }
 
 static void
-_nvme_admin_qpair_destroy(struct nvme_qpair *qpair)
+nvme_qpair_abort_cb(void *arg, const struct nvme_completion *cpl)
 {
-	nvme_admin_qpair_abort_aers(qpair);
+	if (nvme_completion_is_error(cpl)) {
+		nvme_printf((struct nvme_controller *)arg, "abort of timed out command failed\n");
+	}
 }
 
-
+static void
+nvme_qpair_abort_tracker(struct nvme_qpair *qpair, struct nvme_tracker *tr)
+{
+	struct nvme_controller *ctrlr = qpair->ctrlr;
+
+	nvme_printf(ctrlr, "command timed out, aborting\n");
+	nvme_qpair_print_command(qpair, &tr->req->cmd);
+
+	/* The admin queue is shared with other threads. */
+	nvme_mutex_lock(&ctrlr->ctrlr_lock);
+	nvme_ctrlr_cmd_abort(ctrlr, tr->cid, qpair->id, nvme_qpair_abort_cb, ctrlr);
+	nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+}
+
+/*
+ * Handle the commands whose timeout has expired as of tick now.  The first
+ *  expiry aborts a command.  If it is still outstanding one timeout period
+ *  later, the abort did not help either.  Resetting is not safe from the I/O
+ *  path, so the controller is only marked for the application's timeout
+ *  callback, which nvme_ctrlr_process_admin_completions() invokes.
+ */
+static void
+nvme_qpair_expire_timeouts(struct nvme_qpair *qpair, uint32_t now)
+{
+	struct nvme_tracker	*tr;
+	uint32_t		expired, tick;
+	uint16_t		i;
+	bool			found = false, escalate = false;
+
+	qpair->timeout_tick = now;
+
+	/* Commands armed in this tick or earlier have waited a whole period. */
+	expired = now - qpair->timeout_ticks;
+	if ((int32_t)(expired - qpair->timeout_check_tick) < 0) {
+		return;
+	}
+
+	/* After a long gap between polls, each slot still only needs one look. */
+	if (expired - qpair->timeout_check_tick >= NVME_TIMEOUT_WHEEL_SLOTS) {
+		qpair->timeout_check_tick = expired - NVME_TIMEOUT_WHEEL_SLOTS + 1;
+	}
+	for (tick = qpair->timeout_check_tick; tick != expired + 1; tick++) {
+		if (qpair->timeout_wheel[tick % NVME_TIMEOUT_WHEEL_SLOTS] != 0) {
+			found = true;
+			break;
+		}
+	}
+	qpair->timeout_check_tick = expired + 1;
+
+	if (!found) {
+		return;
+	}
+
+	for (i = 0; i < qpair->num_trackers; i++) {
+		tr = &qpair->tr[i];
+		if (tr->timeout_state == NVME_TIMEOUT_NONE ||
+		    (int16_t)((uint16_t)expired - tr->timeout_tick) < 0) {
+			continue;
+		}
+
+		/* Give the abort, or the escalation, a whole period of its own. */
+		qpair->timeout_wheel[tr->timeout_tick % NVME_TIMEOUT_WHEEL_SLOTS]--;
+		tr->timeout_tick = (uint16_t)now;
+		qpair->timeout_wheel[tr->timeout_tick % NVME_TIMEOUT_WHEEL_SLOTS]++;
+
+		if (tr->timeout_state == NVME_TIMEOUT_ARMED) {
+			tr->timeout_state = NVME_TIMEOUT_ABORTED;
+			nvme_qpair_abort_tracker(qpair, tr);
+		} else {
+			nvme_printf(qpair->ctrlr, "aborted command did not complete\n");
+			escalate = true;
+		}
+	}
+
+	if (escalate) {
+		__atomic_store_n(&qpair->ctrlr->timeout_escalated, true, __ATOMIC_RELEASE);
+	}
+}
+
+static inline void
+nvme_qpair_check_timeouts(struct nvme_qpair *qpair)
+{
+	/* Idle and untimed qpairs do not even read the clock. */
+	if (qpair->num_timeouts_armed != 0) {
+		nvme_qpair_expire_timeouts(qpair, nvme_timeout_get_tick());
+	}
+}
+
+/**
+ * \brief Checks for and processes completions on the specified qpair.
+ *
+ * For each completed command, the request's callback function will
+ *  be called if specified as non-NULL when the request was submitted.
+ *
+ * \sa nvme_cb_fn_t
+ */
+int32_t
+nvme_qpair_process_completions(struct nvme_qpair *qpair, uint32_t max_completions)
+{
+	struct nvme_qpair	*sq;
+	struct nvme_tracker	*tr;
+	struct nvme_completion	*cpl;
+	uint32_t		threshold = nvme_cq_doorbell_threshold;
+	uint32_t		num_completions = 0;
+	uint32_t		num_unacked = 0;
+	bool			shared = false;
+
+	/* Completions for all qpairs sharing a completion queue are reaped by its owner. */
+	qpair = qpair->cq_qpair;
+
+	if (!qpair->is_enabled) {
+		/* Proxies are never enabled; their completions come from the shared qpair. */
+		if (qpair->mpsc_owner != NULL) {
+			return nvme_qpair_proxy_process_completions((struct nvme_qpair_proxy *)qpair,
+					max_completions);
+		}
+
+		if (!nvme_qpair_check_enabled(qpair)) {
+			/*
+			 * qpair is not enabled, likely because a controller reset is
+			 *  is in progress.  Ignore the interrupt - any I/O that was
+			 *  associated with this interrupt will get retried when the
+			 *  reset is complete.
+			 */
+			return 0;
+		}
+	}
+
+	while (1) {
+		cpl = &qpair->cpl[qpair->cq_head];
+
+		if (cpl->status.p != qpair->phase)
+			break;
+
+		if (cpl->sqid == qpair->id || TAILQ_EMPTY(&qpair->shared_cq_sqs)) {
+			sq = qpair;
+		} else {
+			sq = nvme_qpair_get_shared_sq(qpair, cpl->sqid);
+			shared = true;
+		}
+
+		tr = sq ? &sq->tr[cpl->cid] : NULL;
+
+		if (tr != NULL && cpl->cid < sq->num_trackers && tr->req != NULL) {
+			nvme_qpair_complete_tracker(sq, tr, cpl, true);
+		} else {
+			nvme_printf(qpair->ctrlr,
+				    "cpl does not map to outstanding cmd\n");
+			nvme_qpair_print_completion(qpair, cpl);
+			nvme_assert(0, ("received completion for unknown cmd\n"));
+		}
+
+		if (++qpair->cq_head == qpair->num_entries) {
+			qpair->cq_head = 0;
+			qpair->phase = !qpair->phase;
+		}
+
+		num_completions++;
+
+		/*
+		 * The head doorbell is normally written once after the whole
+		 *  batch has been reaped.  A non-zero threshold also hands
+		 *  entries back to the controller periodically during long
+		 *  batches.
+		 */
+		if (++num_unacked == threshold) {
+			nvme_qpair_ring_cq_doorbell(qpair);
+			num_unacked = 0;
+		}
+
+		if (max_completions > 0 && --max_completions == 0) {
+			break;
+		}
+	}
+
+	if (num_unacked > 0) {
+		nvme_qpair_ring_cq_doorbell(qpair);
+	}
+	nvme_qpair_stat_add(qpair, completed, num_completions);
+	if (num_completions == 0) {
+		nvme_qpair_stat_inc(qpair, empty_polls);
+	}
+
+	/* Trackers were just freed, so this is the best time to take in proxied I/O. */
+	if (qpair->mpsc_ring != NULL) {
+		nvme_qpair_drain_mpsc_ring(qpair);
+	}
+
+	nvme_qpair_check_delayed(qpair);
+	TAILQ_FOREACH(sq, &qpair->shared_cq_sqs, shared_cq_tailq) {
+		nvme_qpair_check_delayed(sq);
+	}
+
+	nvme_qpair_flush_batch(qpair);
+	if (shared) {
+		TAILQ_FOREACH(sq, &qpair->shared_cq_sqs, shared_cq_tailq) {
+			nvme_qpair_flush_batch(sq);
+		}
+	}
+
+	/* Checked last, since an expired command may reset the controller. */
+	nvme_qpair_check_timeouts(qpair);
+	TAILQ_FOREACH(sq, &qpair->shared_cq_sqs, shared_cq_tailq) {
+		nvme_qpair_check_timeouts(sq);
+	}
+
+	return num_completions;
+}
+
+int
+nvme_qpair_construct(struct nvme_qpair *qpair, uint16_t id,
+		     uint16_t num_entries, uint16_t num_trackers,
+		     struct nvme_controller *ctrlr, struct nvme_qpair *cq_qpair)
+{
+	uint16_t		i;
+	volatile uint32_t	*doorbell_base;
+	uint64_t		phys_addr = 0;
+	uint64_t		prp_bus_addr = 0;
+
+	nvme_assert(num_entries != 0, ("invalid num_entries\n"));
+	nvme_assert(num_trackers != 0, ("invalid num_trackers\n"));
+
+	qpair->id = id;
+	qpair->num_entries = num_entries;
+	qpair->num_trackers = num_trackers;
+	qpair->is_plugged = false;
+	qpair->sq_shadow_tdbl = NULL;
+	qpair->cq_shadow_hdbl = NULL;
+	qpair->sq_eventidx = NULL;
+	qpair->cq_eventidx = NULL;
+	qpair->batch_cb_fn = NULL;
+	qpair->batch_cb_ctx = NULL;
+	qpair->num_batch_cpl = 0;
+	qpair->cq_qpair = cq_qpair ? cq_qpair : qpair;
+	TAILQ_INIT(&qpair->shared_cq_sqs);
+	qpair->intr_fd = -1;
+	qpair->mpsc_ring = NULL;
+	qpair->num_proxies = 0;
+	qpair->mpsc_owner = NULL;
+	qpair->timeout_wheel = NULL;
+	qpair->num_timeouts_armed = 0;
+	qpair->timeout_ticks = 0;
+
+#ifdef NVME_STATS
+	memset(&qpair->stats, 0, sizeof(qpair->stats));
+#endif
+
+	nvme_poll_opts_set_defaults(&qpair->poll_opts);
+	memset(&qpair->poll_stats, 0, sizeof(qpair->poll_stats));
+	qpair->idle_polls = 0;
+	qpair->backoff_us = 0;
+	qpair->hybrid_slept = false;
+	qpair->last_poll_us = 0;
+	qpair->window_start_us = 0;
+	qpair->window_completions = 0;
+	qpair->window_outstanding_us = 0;
+
+	qpair->ctrlr = ctrlr;
+
+	/* cmd and cpl rings must be aligned on 4KB boundaries. */
+	qpair->cmd = nvme_malloc("qpair_cmd",
+				 qpair->num_entries * sizeof(struct nvme_command),
+				 0x1000,
+				 &qpair->cmd_bus_addr);
+	if (qpair->cmd == NULL) {
+		nvme_printf(ctrlr, "alloc qpair_cmd failed\n");
+		goto fail;
+	}
+	/* A qpair posting to another qpair's completion queue has no ring of its own. */
+	if (qpair->cq_qpair == qpair) {
+		qpair->cpl = nvme_malloc("qpair_cpl",
+					 qpair->num_entries * sizeof(struct nvme_completion),
+					 0x1000,
+					 &qpair->cpl_bus_addr);
+		if (qpair->cpl == NULL) {
+			nvme_printf(ctrlr, "alloc qpair_cpl failed\n");
+			goto fail;
+		}
+	}
+
+	doorbell_base = &ctrlr->regs->doorbell[0].sq_tdbl;
+	qpair->sq_tdbl = doorbell_base + (2 * id + 0) * ctrlr->doorbell_stride_u32;
+	qpair->cq_hdbl = doorbell_base + (2 * id + 1) * ctrlr->doorbell_stride_u32;
+
+	STAILQ_INIT(&qpair->queued_req);
+	STAILQ_INIT(&qpair->delayed_req);
+
+	qpair->tr = nvme_malloc("nvme_tr", num_trackers * sizeof(struct nvme_tracker),
+				64, &phys_addr);
+	if (qpair->tr == NULL) {
+		nvme_printf(ctrlr, "alloc nvme_tr failed\n");
+		goto fail;
+	}
+
+	/*
+	 * Each PRP list is NVME_MAX_PRP_LIST_ENTRIES * 8 = 256 bytes, so with
+	 *  a 4KB aligned buffer no PRP list will span a 4KB boundary.
+	 */
+	qpair->prp_list = nvme_malloc("nvme_prp_list",
+				      num_trackers * NVME_MAX_PRP_LIST_ENTRIES * sizeof(uint64_t),
+				      0x1000, &prp_bus_addr);
+	if (qpair->prp_list == NULL) {
+		nvme_printf(ctrlr, "alloc nvme_prp_list failed\n");
+		goto fail;
+	}
+
+	qpair->free_cid = calloc(num_trackers, sizeof(uint16_t));
+	if (qpair->free_cid == NULL) {
+		nvme_printf(ctrlr, "alloc nvme_free_cid failed\n");
+		goto fail;
+	}
+
+	/* Push cids in reverse so that cid 0 is handed out first. */
+	for (i = 0; i < num_trackers; i++) {
+		nvme_qpair_construct_tracker(&qpair->tr[i], i,
+					     &qpair->prp_list[i * NVME_MAX_PRP_LIST_ENTRIES],
+					     prp_bus_addr + i * NVME_MAX_PRP_LIST_ENTRIES * sizeof(uint64_t));
+		qpair->free_cid[num_trackers - i - 1] = i;
+	}
+	qpair->num_free_tr = num_trackers;
+
+	nvme_qpair_reset(qpair);
+	return 0;
+fail:
+	nvme_qpair_destroy(qpair);
+	return -1;
+}
+
+static void
+nvme_admin_qpair_abort_aers(struct nvme_qpair *qpair)
+{
+	struct nvme_tracker	*tr;
+	uint16_t		i;
+
+	for (i = 0; i < qpair->num_trackers; i++) {
+		tr = &qpair->tr[i];
+		if (tr->req != NULL && tr->req->cmd.opc == NVME_OPC_ASYNC_EVENT_REQUEST) {
+			nvme_qpair_manual_complete_tracker(qpair, tr,
+							   NVME_SCT_GENERIC, NVME_SC_ABORTED_SQ_DELETION, 0,
+							   false);
+		}
+	}
+}
+
+static void
+_nvme_admin_qpair_destroy(struct nvme_qpair *qpair)
+{
+	nvme_admin_qpair_abort_aers(qpair);
+}
+
+
 void
 nvme_qpair_destroy(struct nvme_qpair *qpair)
 {
-	struct nvme_tracker	*tr;
+	uint32_t	i;
 
-	if (nvme_qpair_is_admin_queue(qpair)) {
+	if (nvme_qpair_is_admin_queue(qpair) && qpair->tr) {
 		_nvme_admin_qpair_destroy(qpair);
 	}
 	if (qpair->cmd)
 		nvme_free(qpair->cmd);
 	if (qpair->cpl)
 		nvme_free(qpair->cpl);
-	if (qpair->act_tr)
-		free(qpair->act_tr);
+	if (qpair->tr)
+		nvme_free(qpair->tr);
+	if (qpair->prp_list)
+		nvme_free(qpair->prp_list);
+	if (qpair->free_cid)
+		free(qpair->free_cid);
+	if (qpair->mpsc_ring)
+		free(qpair->mpsc_ring);
+	if (qpair->timeout_wheel)
+		free(qpair->timeout_wheel);
+	if (qpair->latency_hist) {
+		for (i = 0; i < NVME_LATENCY_HIST_OPCODES; i++) {
+			free(qpair->latency_hist[i]);
+		}
+		free(qpair->latency_hist);
+	}
+}
+
+struct nvme_mpsc_ring *
+nvme_mpsc_ring_create(uint32_t size)
+{
+	struct nvme_mpsc_ring	*ring;
+	uint32_t		i;
 
-	while (!LIST_EMPTY(&qpair->free_tr)) {
-		tr = LIST_FIRST(&qpair->free_tr);
-		LIST_REMOVE(tr, list);
-		nvme_free(tr);
+	if (size < 2) {
+		size = 2;
 	}
+	size = nvme_align32pow2(size);
+
+	if (posix_memalign((void **)&ring, 64,
+			   sizeof(*ring) + size * sizeof(struct nvme_mpsc_slot)) != 0) {
+		return NULL;
+	}
+
+	ring->mask = size - 1;
+	ring->tail = 0;
+	ring->head = 0;
+	for (i = 0; i < size; i++) {
+		ring->slots[i].seq = i;
+		ring->slots[i].item = NULL;
+	}
+
+	return ring;
+}
+
+int
+nvme_qpair_init_mpsc(struct nvme_qpair *qpair, uint32_t ring_size)
+{
+	qpair->mpsc_ring = nvme_mpsc_ring_create(ring_size);
+	if (qpair->mpsc_ring == NULL) {
+		return ENOMEM;
+	}
+
+	return 0;
+}
+
+int
+nvme_qpair_init_timeouts(struct nvme_qpair *qpair, uint32_t timeout_sec)
+{
+	qpair->timeout_wheel = calloc(NVME_TIMEOUT_WHEEL_SLOTS, sizeof(uint16_t));
+	if (qpair->timeout_wheel == NULL) {
+		return ENOMEM;
+	}
+
+	qpair->timeout_ticks = timeout_sec * (1000 * 1000 / NVME_TIMEOUT_TICK_US);
+	nvme_assert(qpair->timeout_ticks < NVME_TIMEOUT_WHEEL_SLOTS,
+		    ("timeout does not fit the timeout wheel\n"));
+
+	return 0;
+}
+
+int
+nvme_qpair_init_latency_tracking(struct nvme_qpair *qpair)
+{
+	qpair->latency_hist = calloc(NVME_LATENCY_HIST_OPCODES, sizeof(struct histogram *));
+	if (qpair->latency_hist == NULL) {
+		return ENOMEM;
+	}
+
+	return 0;
+}
+
+void
+nvme_qpair_merge_latency_histogram(struct nvme_qpair *qpair, uint8_t opc,
+				   struct histogram *hist)
+{
+	struct histogram	*h;
+
+	if (qpair->latency_hist == NULL) {
+		return;
+	}
+
+	h = __atomic_load_n(&qpair->latency_hist[opc], __ATOMIC_ACQUIRE);
+	if (h != NULL) {
+		histogram_merge(hist, h);
+	}
+}
+
+struct nvme_qpair *
+nvme_qpair_alloc_proxy(struct nvme_qpair *qpair, uint32_t depth)
+{
+	struct nvme_qpair_proxy	*proxy;
+	uint32_t		cpl_ring_size;
+
+	if (qpair->mpsc_ring == NULL || depth == 0) {
+		return NULL;
+	}
+
+	if (posix_memalign((void **)&proxy, 64, sizeof(*proxy)) != 0) {
+		return NULL;
+	}
+	memset(proxy, 0, sizeof(*proxy));
+
+	cpl_ring_size = nvme_align32pow2(depth);
+	proxy->cpl_ring = calloc(cpl_ring_size, sizeof(struct nvme_proxy_cpl));
+	if (proxy->cpl_ring == NULL) {
+		free(proxy);
+		return NULL;
+	}
+	proxy->cpl_mask = cpl_ring_size - 1;
+	proxy->depth = depth;
+
+	/*
+	 * The proxy has no rings or trackers of its own and is never enabled,
+	 *  which diverts it from the regular submission and completion paths.
+	 */
+	proxy->qpair.id = qpair->id;
+	proxy->qpair.ctrlr = qpair->ctrlr;
+	proxy->qpair.cq_qpair = &proxy->qpair;
+	proxy->qpair.is_enabled = false;
+	proxy->qpair.intr_fd = -1;
+	proxy->qpair.mpsc_owner = qpair;
+	STAILQ_INIT(&proxy->qpair.queued_req);
+	TAILQ_INIT(&proxy->qpair.shared_cq_sqs);
+	nvme_poll_opts_set_defaults(&proxy->qpair.poll_opts);
+
+	__atomic_fetch_add(&qpair->num_proxies, 1, __ATOMIC_RELAXED);
+
+	return &proxy->qpair;
+}
+
+int
+nvme_qpair_free_proxy(struct nvme_qpair *qpair)
+{
+	struct nvme_qpair_proxy *proxy = (struct nvme_qpair_proxy *)qpair;
+
+	if (qpair == NULL) {
+		return 0;
+	}
+
+	if (qpair->mpsc_owner == NULL) {
+		return EINVAL;
+	}
+
+	if (proxy->num_outstanding != 0 || !STAILQ_EMPTY(&qpair->queued_req)) {
+		return EBUSY;
+	}
+
+	__atomic_fetch_sub(&qpair->mpsc_owner->num_proxies, 1, __ATOMIC_RELAXED);
+
+	free(proxy->cpl_ring);
+	free(proxy);
+
+	return 0;
 }
 
 /**
@@ -611,13 +1416,43 @@ nvme_qpair_destroy(struct nvme_qpair *qpair)
  *
  * I/O is submitted to an NVMe namespace using nvme_ns_cmd_xxx functions
  * defined in nvme_ns_cmd.c.  The NVMe driver submits the I/O request
- * as an NVMe submission queue entry on the nvme_qpair associated with
- * the logical core that submits the I/O.
+ * as an NVMe submission queue entry on the nvme_qpair passed by the
+ * caller, which was obtained from nvme_ctrlr_alloc_io_qpair().
  *
  * \sa nvme_ns_cmd_read, nvme_ns_cmd_write, nvme_ns_cmd_deallocate,
- *     nvme_ns_cmd_flush, nvme_get_ioq_idx
+ *     nvme_ns_cmd_flush, nvme_ctrlr_alloc_io_qpair
  */
 
+/*
+ * Copy a command into its submission queue slot.  With NVME_SQE_NT_STORE,
+ *  non-temporal stores are used: only the controller reads the slot after
+ *  this point, so there is no reason to pull its cache line into the CPU
+ *  cache first.  The wmb() issued before the doorbell write orders these
+ *  stores.
+ *
+ * req->cmd is left intact, so a retry simply copies it again.
+ */
+static inline void
+nvme_qpair_copy_command(struct nvme_command *dst, const struct nvme_command *src)
+{
+#if defined(NVME_SQE_NT_STORE) && defined(__AVX__)
+	__m256i		*d = (__m256i *)dst;
+	const __m256i	*s = (const __m256i *)src;
+
+	_mm256_stream_si256(&d[0], _mm256_loadu_si256(&s[0]));
+	_mm256_stream_si256(&d[1], _mm256_loadu_si256(&s[1]));
+#elif defined(NVME_SQE_NT_STORE) && defined(__SSE2__)
+	__m128i		*d = (__m128i *)dst;
+	const __m128i	*s = (const __m128i *)src;
+
+	_mm_stream_si128(&d[0], _mm_loadu_si128(&s[0]));
+	_mm_stream_si128(&d[1], _mm_loadu_si128(&s[1]));
+	_mm_stream_si128(&d[2], _mm_loadu_si128(&s[2]));
+	_mm_stream_si128(&d[3], _mm_loadu_si128(&s[3]));
+#else
+	nvme_copy_command(dst, src);
+#endif
+}
 
 void
 nvme_qpair_submit_tracker(struct nvme_qpair *qpair, struct nvme_tracker *tr)
@@ -625,17 +1460,268 @@ nvme_qpair_submit_tracker(struct nvme_qpair *qpair, struct nvme_tracker *tr)
 	struct nvme_request	*req;
 
 	req = tr->req;
-	qpair->act_tr[tr->cid] = tr;
 
-	/* Copy the command from the tracker to the submission queue. */
-	nvme_copy_command(&qpair->cmd[qpair->sq_tail], &req->cmd);
+	/* Copy the command from the request to the submission queue. */
+	nvme_qpair_copy_command(&qpair->cmd[qpair->sq_tail], &req->cmd);
 
 	if (++qpair->sq_tail == qpair->num_entries) {
 		qpair->sq_tail = 0;
 	}
+	nvme_qpair_stat_inc(qpair, submitted);
+	nvme_trace(qpair, req, NVME_TRACE_SUBMIT, tr->cid, 0);
 
-	wmb();
-	_nvme_mmio_write_4(qpair->sq_tdbl, qpair->sq_tail);
+	if (req->timeout && qpair->timeout_ticks != 0) {
+		nvme_qpair_arm_timeout(qpair, tr);
+	}
+
+	if (qpair->is_plugged) {
+		qpair->sq_tdbl_pending = true;
+	} else {
+		nvme_qpair_ring_sq_doorbell(qpair);
+	}
+}
+
+void
+nvme_qpair_plug(struct nvme_qpair *qpair)
+{
+	qpair->is_plugged = true;
+}
+
+void
+nvme_qpair_unplug(struct nvme_qpair *qpair)
+{
+	qpair->is_plugged = false;
+
+	if (qpair->sq_tdbl_pending) {
+		nvme_qpair_ring_sq_doorbell(qpair);
+	}
+}
+
+void
+nvme_qpair_set_batch_callback(struct nvme_qpair *qpair,
+			      nvme_batch_cb_fn_t batch_cb_fn, void *ctx)
+{
+	if (qpair->batch_cb_fn != NULL) {
+		nvme_qpair_flush_batch(qpair);
+	}
+
+	qpair->batch_cb_fn = batch_cb_fn;
+	qpair->batch_cb_ctx = ctx;
+}
+
+void
+nvme_qpair_get_stats(struct nvme_qpair *qpair, struct nvme_qpair_stats *stats)
+{
+#ifdef NVME_STATS
+	*stats = qpair->stats;
+#else
+	memset(stats, 0, sizeof(*stats));
+#endif
+}
+
+void
+nvme_poll_opts_set_defaults(struct nvme_poll_opts *opts)
+{
+	opts->mode = NVME_POLL_MODE_BUSY;
+	opts->latency_budget_us = NVME_DEFAULT_POLL_LATENCY_BUDGET_US;
+	opts->idle_poll_threshold = NVME_DEFAULT_IDLE_POLL_THRESHOLD;
+}
+
+int
+nvme_qpair_set_poll_opts(struct nvme_qpair *qpair, const struct nvme_poll_opts *opts)
+{
+	if (opts->mode != NVME_POLL_MODE_BUSY && opts->mode != NVME_POLL_MODE_HYBRID) {
+		return EINVAL;
+	}
+
+	qpair = qpair->cq_qpair;
+	qpair->poll_opts = *opts;
+	qpair->idle_polls = 0;
+	qpair->backoff_us = 0;
+	qpair->hybrid_slept = false;
+	qpair->last_poll_us = 0;
+
+	return 0;
+}
+
+void
+nvme_qpair_get_poll_stats(struct nvme_qpair *qpair, struct nvme_poll_stats *stats)
+{
+	*stats = qpair->cq_qpair->poll_stats;
+}
+
+/*
+ * Number of commands outstanding on the device for the completion queue owned
+ *  by qpair, across all submission queues that post to it.
+ */
+static uint32_t
+nvme_qpair_num_outstanding(struct nvme_qpair *qpair)
+{
+	struct nvme_qpair	*sq;
+	uint32_t		num_outstanding;
+
+	num_outstanding = qpair->num_trackers - qpair->num_free_tr;
+	TAILQ_FOREACH(sq, &qpair->shared_cq_sqs, shared_cq_tailq) {
+		num_outstanding += sq->num_trackers - sq->num_free_tr;
+	}
+
+	return num_outstanding;
+}
+
+/*
+ * Track the completion rate and, by Little's law, the mean device latency:
+ *  the time integral of the number of outstanding commands divided by the
+ *  number of completions over the same window.
+ */
+static void
+nvme_qpair_update_poll_window(struct nvme_qpair *qpair, uint64_t now,
+			      uint32_t num_completions, uint32_t num_outstanding)
+{
+	struct nvme_poll_stats	*stats = &qpair->poll_stats;
+	uint64_t		window_us, latency_us;
+
+	if (qpair->last_poll_us == 0) {
+		qpair->last_poll_us = now;
+		qpair->window_start_us = now;
+		qpair->window_completions = 0;
+		qpair->window_outstanding_us = 0;
+		return;
+	}
+
+	/* Commands reaped by this poll were outstanding since the previous one. */
+	qpair->window_outstanding_us += (uint64_t)(num_outstanding + num_completions) *
+					(now - qpair->last_poll_us);
+	qpair->window_completions += num_completions;
+	qpair->last_poll_us = now;
+
+	window_us = now - qpair->window_start_us;
+	if (window_us < NVME_POLL_WINDOW_US) {
+		return;
+	}
+
+	stats->completion_rate = qpair->window_completions * 1000000 / window_us;
+	if (qpair->window_completions > 0) {
+		latency_us = qpair->window_outstanding_us / qpair->window_completions;
+		if (stats->est_latency_us == 0) {
+			stats->est_latency_us = latency_us;
+		} else {
+			stats->est_latency_us = (stats->est_latency_us * 7 + latency_us) / 8;
+		}
+	}
+
+	qpair->window_start_us = now;
+	qpair->window_completions = 0;
+	qpair->window_outstanding_us = 0;
+}
+
+static void
+nvme_qpair_poll_wait(struct nvme_qpair *qpair, uint32_t wait_us)
+{
+	uint64_t start, end;
+
+	start = nvme_get_time_us();
+	if (wait_us < NVME_POLL_MIN_SLEEP_US) {
+		do {
+			_mm_pause();
+			end = nvme_get_time_us();
+		} while (end - start < wait_us);
+		qpair->poll_stats.pause_us += end - start;
+	} else {
+		nvme_delay(wait_us);
+		end = nvme_get_time_us();
+		qpair->poll_stats.sleeps++;
+		qpair->poll_stats.sleep_us += end - start;
+	}
+}
+
+static void
+nvme_qpair_hybrid_poll(struct nvme_qpair *qpair, uint32_t num_completions)
+{
+	uint32_t	budget_us = qpair->poll_opts.latency_budget_us;
+	uint32_t	num_outstanding = nvme_qpair_num_outstanding(qpair);
+	uint32_t	wait_us;
+
+	nvme_qpair_update_poll_window(qpair, nvme_get_time_us(), num_completions,
+				      num_outstanding);
+
+	if (num_completions > 0) {
+		/* Under load: keep busy polling. */
+		qpair->idle_polls = 0;
+		qpair->backoff_us = 0;
+		qpair->hybrid_slept = false;
+		return;
+	}
+
+	if (++qpair->idle_polls < qpair->poll_opts.idle_poll_threshold) {
+		return;
+	}
+
+	if (num_outstanding > 0) {
+		/*
+		 * Sleep through the first half of the expected device latency,
+		 *  then busy poll for the completion so that it is not
+		 *  overslept.
+		 */
+		if (qpair->hybrid_slept) {
+			return;
+		}
+		qpair->hybrid_slept = true;
+		wait_us = nvme_min(qpair->poll_stats.est_latency_us / 2, budget_us);
+	} else {
+		/* Nothing to wait for: back off exponentially up to the budget. */
+		qpair->hybrid_slept = false;
+		qpair->backoff_us = nvme_min(qpair->backoff_us ? qpair->backoff_us * 2 : 1,
+					     budget_us);
+		wait_us = qpair->backoff_us;
+	}
+
+	if (wait_us > 0) {
+		nvme_qpair_poll_wait(qpair, wait_us);
+	}
+}
+
+int32_t
+nvme_qpair_poll(struct nvme_qpair *qpair, uint32_t max_completions)
+{
+	struct nvme_qpair	*cq_qpair = qpair->cq_qpair;
+	int32_t			num_completions;
+
+	num_completions = nvme_qpair_process_completions(cq_qpair, max_completions);
+
+	cq_qpair->poll_stats.polls++;
+	if (num_completions == 0) {
+		cq_qpair->poll_stats.idle_polls++;
+	}
+
+	if (cq_qpair->poll_opts.mode == NVME_POLL_MODE_HYBRID) {
+		nvme_qpair_hybrid_poll(cq_qpair, num_completions);
+	}
+
+	return num_completions;
+}
+
+int
+nvme_qpair_get_interrupt_fd(struct nvme_qpair *qpair)
+{
+	return qpair->cq_qpair->intr_fd;
+}
+
+int32_t
+nvme_qpair_process_interrupt(struct nvme_qpair *qpair, uint32_t max_completions)
+{
+	uint64_t	count;
+	int		fd = qpair->cq_qpair->intr_fd;
+
+	/*
+	 * Clear the eventfd before reaping, so that a completion posted while
+	 *  reaping signals it again instead of being missed.  The eventfd is
+	 *  non-blocking, so this fails with EAGAIN if it was not signaled.
+	 */
+	if (fd >= 0 && read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		nvme_printf(qpair->ctrlr, "interrupt eventfd read failed\n");
+	}
+
+	return nvme_qpair_process_completions(qpair, max_completions);
 }
 
 static void
@@ -657,92 +1743,206 @@ _nvme_fail_request_ctrlr_failed(struct nvme_qpair *qpair, struct nvme_request *r
 					   NVME_SC_ABORTED_BY_REQUEST, true);
 }
 
-void
-nvme_qpair_submit_request(struct nvme_qpair *qpair, struct nvme_request *req)
+/*
+ * Take a free tracker for req.  The caller has checked that one is free.
+ */
+static inline struct nvme_tracker *
+nvme_qpair_alloc_tracker(struct nvme_qpair *qpair, struct nvme_request *req)
 {
 	struct nvme_tracker	*tr;
-	struct nvme_request	*child_req;
+
+	tr = &qpair->tr[qpair->free_cid[--qpair->num_free_tr]];
+	tr->req = req;
+	req->cmd.cid = tr->cid;
+	nvme_qpair_stat_outstanding(qpair);
+
+	return tr;
+}
+
+/*
+ * Build the PRP list describing the payload buffer of tr's request.  Returns
+ *  -1 if part of the buffer has no physical address.
+ */
+static int
+nvme_qpair_build_prps(struct nvme_tracker *tr)
+{
+	struct nvme_request	*req = tr->req;
 	uint64_t phys_addr;
 	void *seg_addr;
 	uint32_t nseg, cur_nseg, modulo, unaligned;
 
+	if (req->payload_size == 0) {
+		return 0;
+	}
+
+	phys_addr = nvme_vtophys(req->u.payload);
+	if (phys_addr == NVME_VTOPHYS_ERROR) {
+		return -1;
+	}
+	nseg = req->payload_size >> nvme_u32log2(PAGE_SIZE);
+	modulo = req->payload_size & (PAGE_SIZE - 1);
+	unaligned = phys_addr & (PAGE_SIZE - 1);
+	if (modulo || unaligned) {
+		nseg += 1 + ((modulo + unaligned - 1) >> nvme_u32log2(PAGE_SIZE));
+	}
+
+	req->cmd.psdt = NVME_PSDT_PRP;
+	req->cmd.dptr.prp.prp1 = phys_addr;
+	if (nseg == 2) {
+		seg_addr = req->u.payload + PAGE_SIZE - unaligned;
+		req->cmd.dptr.prp.prp2 = nvme_vtophys(seg_addr);
+	} else if (nseg > 2) {
+		cur_nseg = 1;
+		req->cmd.dptr.prp.prp2 = (uint64_t)tr->prp_bus_addr;
+		while (cur_nseg < nseg) {
+			seg_addr = req->u.payload + cur_nseg * PAGE_SIZE - unaligned;
+			phys_addr = nvme_vtophys(seg_addr);
+			if (phys_addr == NVME_VTOPHYS_ERROR) {
+				return -1;
+			}
+			tr->prp[cur_nseg - 1] = phys_addr;
+			cur_nseg++;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Hold a request that cannot be submitted yet, or fail it if the controller
+ *  has failed.
+ */
+static void
+nvme_qpair_queue_request(struct nvme_qpair *qpair, struct nvme_request *req)
+{
+	if (qpair->ctrlr->is_failed) {
+		_nvme_fail_request_ctrlr_failed(qpair, req);
+	} else {
+		/*
+		 * Put the request on the qpair's request queue to be
+		 *  processed when a tracker frees up via a command
+		 *  completion or when the controller reset is
+		 *  completed.
+		 */
+		STAILQ_INSERT_TAIL(&qpair->queued_req, req, stailq);
+		nvme_qpair_stat_inc(qpair, queued_reqs);
+		nvme_trace(qpair, req, NVME_TRACE_QUEUE, 0xFFFF, 0);
+	}
+}
+
+/*
+ * Submit both commands of a fused pair, or neither.  The controller only
+ *  fuses commands that are adjacent in the submission queue, so the pair
+ *  waits on queued_req as a unit until two trackers are free, both PRP lists
+ *  are built before either command is copied into the queue, and both
+ *  commands are copied before the doorbell moves past them.
+ */
+static void
+nvme_qpair_submit_fused(struct nvme_qpair *qpair, struct nvme_request *req,
+			bool from_queue)
+{
+	struct nvme_request	*first, *second;
+	struct nvme_tracker	*first_tr, *second_tr;
+	bool			was_plugged = qpair->is_plugged;
+
+	if (qpair->num_free_tr < 2 || !qpair->is_enabled ||
+	    (!from_queue && !STAILQ_EMPTY(&qpair->queued_req))) {
+		nvme_qpair_queue_request(qpair, req);
+		return;
+	}
+
+	/* The second command's completion can free req. */
+	first = STAILQ_FIRST(&req->children);
+	second = STAILQ_NEXT(first, child_stailq);
+
+	if (qpair->latency_hist != NULL && first->submit_tsc == 0) {
+		first->submit_tsc = second->submit_tsc = nvme_get_tsc();
+	}
+
+	first_tr = nvme_qpair_alloc_tracker(qpair, first);
+	second_tr = nvme_qpair_alloc_tracker(qpair, second);
+	if (nvme_qpair_build_prps(first_tr) != 0 ||
+	    nvme_qpair_build_prps(second_tr) != 0) {
+		/* Neither command reached the queue, so the pair fails as a unit. */
+		_nvme_fail_request_bad_vtophys(qpair, first_tr);
+		_nvme_fail_request_bad_vtophys(qpair, second_tr);
+		return;
+	}
+
+	qpair->is_plugged = true;
+	nvme_qpair_submit_tracker(qpair, first_tr);
+	nvme_qpair_submit_tracker(qpair, second_tr);
+	if (!was_plugged) {
+		nvme_qpair_unplug(qpair);
+	}
+}
+
+void
+nvme_qpair_submit_request(struct nvme_qpair *qpair, struct nvme_request *req)
+{
+	_nvme_qpair_submit_request(qpair, req, false);
+}
+
+/*
+ * from_queue is set for requests taken from the head of queued_req.  Any other
+ *  request waits behind those already queued, so that a fused pair at the head
+ *  is not starved of the two trackers it needs.
+ */
+static void
+_nvme_qpair_submit_request(struct nvme_qpair *qpair, struct nvme_request *req,
+			   bool from_queue)
+{
+	struct nvme_tracker	*tr;
+	struct nvme_request	*child_req, *next_req;
+
+	if (!qpair->is_enabled && qpair->mpsc_owner != NULL) {
+		/* The shared qpair's thread submits I/O from its proxies. */
+		nvme_qpair_proxy_submit_request((struct nvme_qpair_proxy *)qpair, req);
+		return;
+	}
+
 	nvme_qpair_check_enabled(qpair);
 
 	if (req->num_children) {
+		if (nvme_request_is_fused(req)) {
+			nvme_qpair_submit_fused(qpair, req, from_queue);
+			return;
+		}
+
 		/*
 		 * This is a split (parent) request. Submit all of the children but not the parent
-		 * request itself, since the parent is the original unsplit request.
+		 * request itself, since the parent is the original unsplit request.  A child can
+		 * complete while it is submitted, and the last one frees the parent, so read the
+		 * next child before submitting each one.
 		 */
-		TAILQ_FOREACH(child_req, &req->children, child_tailq) {
+		child_req = STAILQ_FIRST(&req->children);
+		while (child_req != NULL) {
+			next_req = STAILQ_NEXT(child_req, child_stailq);
 			nvme_qpair_submit_request(qpair, child_req);
+			child_req = next_req;
 		}
 		return;
 	}
 
-	tr = LIST_FIRST(&qpair->free_tr);
+	if (qpair->latency_hist != NULL && req->submit_tsc == 0) {
+		req->submit_tsc = nvme_get_tsc();
+	}
 
-	if (tr == NULL || !qpair->is_enabled) {
+	if (qpair->num_free_tr == 0 || !qpair->is_enabled ||
+	    (!from_queue && !STAILQ_EMPTY(&qpair->queued_req))) {
 		/*
-		 * No tracker is available, or the qpair is disabled due to
+		 * No tracker is available, the qpair is disabled due to
 		 *  an in-progress controller-level reset or controller
-		 *  failure.
+		 *  failure, or earlier requests are still waiting.
 		 */
-
-		if (qpair->ctrlr->is_failed) {
-			_nvme_fail_request_ctrlr_failed(qpair, req);
-		} else {
-			/*
-			 * Put the request on the qpair's request queue to be
-			 *  processed when a tracker frees up via a command
-			 *  completion or when the controller reset is
-			 *  completed.
-			 */
-			STAILQ_INSERT_TAIL(&qpair->queued_req, req, stailq);
-		}
+		nvme_qpair_queue_request(qpair, req);
 		return;
 	}
 
-	LIST_REMOVE(tr, list); /* remove tr from free_tr */
-	LIST_INSERT_HEAD(&qpair->outstanding_tr, tr, list);
-	tr->req = req;
-	req->cmd.cid = tr->cid;
-
-	if (req->payload_size) {
-		/*
-		 * Build PRP list describing payload buffer.
-		 */
-
-		phys_addr = nvme_vtophys(req->u.payload);
-		if (phys_addr == NVME_VTOPHYS_ERROR) {
-			_nvme_fail_request_bad_vtophys(qpair, tr);
-			return;
-		}
-		nseg = req->payload_size >> nvme_u32log2(PAGE_SIZE);
-		modulo = req->payload_size & (PAGE_SIZE - 1);
-		unaligned = phys_addr & (PAGE_SIZE - 1);
-		if (modulo || unaligned) {
-			nseg += 1 + ((modulo + unaligned - 1) >> nvme_u32log2(PAGE_SIZE));
-		}
-
-		tr->req->cmd.psdt = NVME_PSDT_PRP;
-		tr->req->cmd.dptr.prp.prp1 = phys_addr;
-		if (nseg == 2) {
-			seg_addr = req->u.payload + PAGE_SIZE - unaligned;
-			tr->req->cmd.dptr.prp.prp2 = nvme_vtophys(seg_addr);
-		} else if (nseg > 2) {
-			cur_nseg = 1;
-			tr->req->cmd.dptr.prp.prp2 = (uint64_t)tr->prp_bus_addr;
-			while (cur_nseg < nseg) {
-				seg_addr = req->u.payload + cur_nseg * PAGE_SIZE - unaligned;
-				phys_addr = nvme_vtophys(seg_addr);
-				if (phys_addr == NVME_VTOPHYS_ERROR) {
-					_nvme_fail_request_bad_vtophys(qpair, tr);
-					return;
-				}
-				tr->prp[cur_nseg - 1] = phys_addr;
-				cur_nseg++;
-			}
-		}
+	tr = nvme_qpair_alloc_tracker(qpair, req);
+	if (nvme_qpair_build_prps(tr) != 0) {
+		_nvme_fail_request_bad_vtophys(qpair, tr);
+		return;
 	}
 
 	nvme_qpair_submit_tracker(qpair, tr);
@@ -752,6 +1952,7 @@ void
 nvme_qpair_reset(struct nvme_qpair *qpair)
 {
 	qpair->sq_tail = qpair->cq_head = 0;
+	qpair->sq_tdbl_pending = false;
 
 	/*
 	 * First time through the completion queue, HW will set phase
@@ -764,15 +1965,17 @@ nvme_qpair_reset(struct nvme_qpair *qpair)
 
 	memset(qpair->cmd, 0,
 	       qpair->num_entries * sizeof(struct nvme_command));
-	memset(qpair->cpl, 0,
-	       qpair->num_entries * sizeof(struct nvme_completion));
+	if (qpair->cpl != NULL) {
+		memset(qpair->cpl, 0,
+		       qpair->num_entries * sizeof(struct nvme_completion));
+	}
 }
 
 static void
 _nvme_admin_qpair_enable(struct nvme_qpair *qpair)
 {
 	struct nvme_tracker		*tr;
-	struct nvme_tracker		*tr_temp;
+	uint16_t			i;
 
 	/*
 	 * Manually abort each outstanding admin command.  Do not retry
@@ -780,7 +1983,11 @@ _nvme_admin_qpair_enable(struct nvme_qpair *qpair)
 	 *  a controller reset and its likely the context in which the
 	 *  command was issued no longer applies.
 	 */
-	LIST_FOREACH_SAFE(tr, &qpair->outstanding_tr, list, tr_temp) {
+	for (i = 0; i < qpair->num_trackers; i++) {
+		tr = &qpair->tr[i];
+		if (tr->req == NULL) {
+			continue;
+		}
 		nvme_printf(qpair->ctrlr,
 			    "aborting outstanding admin command\n");
 		nvme_qpair_manual_complete_tracker(qpair, tr, NVME_SCT_GENERIC,
@@ -794,9 +2001,10 @@ static void
 _nvme_io_qpair_enable(struct nvme_qpair *qpair)
 {
 	STAILQ_HEAD(, nvme_request)	temp;
+	struct nvme_qpair		*sq;
 	struct nvme_tracker		*tr;
-	struct nvme_tracker		*tr_temp;
 	struct nvme_request		*req;
+	uint16_t			i;
 
 	qpair->is_enabled = true;
 	/*
@@ -804,7 +2012,11 @@ _nvme_io_qpair_enable(struct nvme_qpair *qpair)
 	 *  retry, unless the retry count on the associated request has
 	 *  reached its limit.
 	 */
-	LIST_FOREACH_SAFE(tr, &qpair->outstanding_tr, list, tr_temp) {
+	for (i = 0; i < qpair->num_trackers; i++) {
+		tr = &qpair->tr[i];
+		if (tr->req == NULL) {
+			continue;
+		}
 		nvme_printf(qpair->ctrlr, "aborting outstanding i/o\n");
 		nvme_qpair_manual_complete_tracker(qpair, tr, NVME_SCT_GENERIC,
 						   NVME_SC_ABORTED_BY_REQUEST, 0, true);
@@ -822,6 +2034,16 @@ _nvme_io_qpair_enable(struct nvme_qpair *qpair)
 		nvme_qpair_print_command(qpair, &req->cmd);
 		nvme_qpair_submit_request(qpair, req);
 	}
+
+	/*
+	 * Qpairs sharing this completion queue are polled through it, so
+	 *  bring them back along with it.
+	 */
+	TAILQ_FOREACH(sq, &qpair->shared_cq_sqs, shared_cq_tailq) {
+		if (!sq->is_enabled) {
+			_nvme_io_qpair_enable(sq);
+		}
+	}
 }
 
 void
@@ -862,6 +2084,7 @@ nvme_qpair_fail(struct nvme_qpair *qpair)
 {
 	struct nvme_tracker		*tr;
 	struct nvme_request		*req;
+	uint16_t			i;
 
 	while (!STAILQ_EMPTY(&qpair->queued_req)) {
 		req = STAILQ_FIRST(&qpair->queued_req);
@@ -871,11 +2094,23 @@ nvme_qpair_fail(struct nvme_qpair *qpair)
 						   NVME_SC_ABORTED_BY_REQUEST, true);
 	}
 
+	while (!STAILQ_EMPTY(&qpair->delayed_req)) {
+		req = STAILQ_FIRST(&qpair->delayed_req);
+		STAILQ_REMOVE_HEAD(&qpair->delayed_req, stailq);
+		qpair->num_delayed_reqs--;
+		nvme_printf(qpair->ctrlr, "failing i/o waiting to be retried\n");
+		nvme_qpair_manual_complete_request(qpair, req, NVME_SCT_GENERIC,
+						   NVME_SC_ABORTED_BY_REQUEST, true);
+	}
+
 	/* Manually abort each outstanding I/O. */
-	while (!LIST_EMPTY(&qpair->outstanding_tr)) {
-		tr = LIST_FIRST(&qpair->outstanding_tr);
+	for (i = 0; i < qpair->num_trackers; i++) {
+		tr = &qpair->tr[i];
+		if (tr->req == NULL) {
+			continue;
+		}
 		/*
-		 * Do not remove the tracker.  The abort_tracker path will
+		 * Do not free the tracker.  The complete_tracker path will
 		 *  do that for us.
 		 */
 		nvme_printf(qpair->ctrlr, "failing outstanding i/o\n");
@@ -0,0 +1,202 @@
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright(c) 2015 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "nvme_internal.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+/** \file
+ * Binary trace of I/O events, exported through POSIX shared memory.
+ */
+
+/** Trace buffer being recorded into, or NULL when tracing is off */
+struct nvme_trace_header	*g_nvme_trace;
+
+/* Incremented by each nvme_trace_enable(), so threads notice rings claimed earlier are stale. */
+static uint32_t			g_nvme_trace_generation;
+
+static __thread struct nvme_trace_ring	*t_ring;
+static __thread uint32_t		t_ring_generation;
+
+/*
+ * Return the calling thread's ring, claiming one on the thread's first
+ *  event, or NULL if all rings were already claimed by other threads.
+ */
+static struct nvme_trace_ring *
+nvme_trace_get_thread_ring(struct nvme_trace_header *trace)
+{
+	uint32_t	generation, i;
+
+	generation = __atomic_load_n(&g_nvme_trace_generation, __ATOMIC_RELAXED);
+	if (t_ring_generation == generation) {
+		return t_ring;
+	}
+
+	t_ring_generation = generation;
+	i = __atomic_fetch_add(&trace->num_rings_used, 1, __ATOMIC_RELAXED);
+	if (i >= trace->num_rings) {
+		t_ring = NULL;
+	} else {
+		t_ring = nvme_trace_get_ring(trace, i);
+		t_ring->thread_id = (uint32_t)syscall(SYS_gettid);
+	}
+
+	return t_ring;
+}
+
+static bool
+nvme_trace_opc_has_lba(uint8_t opc)
+{
+	switch (opc) {
+	case NVME_OPC_WRITE:
+	case NVME_OPC_READ:
+	case NVME_OPC_WRITE_UNCORRECTABLE:
+	case NVME_OPC_COMPARE:
+	case NVME_OPC_WRITE_ZEROES:
+	case NVME_OPC_VERIFY:
+		return true;
+	default:
+		return false;
+	}
+}
+
+void
+nvme_trace_record(struct nvme_qpair *qpair, const struct nvme_request *req,
+		  uint8_t type, uint16_t cid, uint16_t status)
+{
+	struct nvme_trace_header	*trace;
+	struct nvme_trace_ring		*ring;
+	struct nvme_trace_entry		*entry;
+	uint64_t			head;
+
+	trace = __atomic_load_n(&g_nvme_trace, __ATOMIC_ACQUIRE);
+	if (trace == NULL) {
+		return;
+	}
+
+	ring = nvme_trace_get_thread_ring(trace);
+	if (ring == NULL) {
+		return;
+	}
+
+	head = ring->head;
+	entry = &ring->entries[head & (trace->num_entries - 1)];
+	entry->tsc = nvme_get_tsc();
+	entry->ctrlr_id = qpair->ctrlr->trace_id;
+	entry->qid = qpair->id;
+	entry->cid = cid;
+	entry->status = status;
+	entry->type = type;
+	entry->opc = req->cmd.opc;
+	entry->reserved = 0;
+	if (qpair->id != 0 && nvme_trace_opc_has_lba(req->cmd.opc)) {
+		entry->lba = (uint64_t)req->cmd.cdw11 << 32 | req->cmd.cdw10;
+		entry->num_blocks = (req->cmd.cdw12 & 0xFFFF) + 1;
+	} else {
+		entry->lba = 0;
+		entry->num_blocks = 0;
+	}
+
+	/* Publish the entry to readers of a live trace. */
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+int
+nvme_trace_enable(const char *shm_name, uint32_t num_rings, uint32_t num_entries)
+{
+#ifdef NVME_TRACE
+	struct nvme_trace_header	*trace;
+	size_t				size;
+	int				fd;
+
+	if (shm_name == NULL || num_rings == 0 || num_entries == 0 ||
+	    num_entries > (1U << 31)) {
+		return EINVAL;
+	}
+
+	if (g_nvme_trace != NULL) {
+		return EBUSY;
+	}
+
+	num_entries = nvme_align32pow2(num_entries);
+	size = nvme_trace_size(num_rings, num_entries);
+
+	fd = shm_open(shm_name, O_CREAT | O_TRUNC | O_RDWR, 0600);
+	if (fd < 0) {
+		return errno;
+	}
+
+	if (ftruncate(fd, size) != 0) {
+		close(fd);
+		shm_unlink(shm_name);
+		return errno;
+	}
+
+	trace = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (trace == MAP_FAILED) {
+		shm_unlink(shm_name);
+		return ENOMEM;
+	}
+
+	/* The new object is zero-filled, so all rings start out empty. */
+	trace->magic = NVME_TRACE_MAGIC;
+	trace->version = NVME_TRACE_VERSION;
+	trace->num_rings = num_rings;
+	trace->num_entries = num_entries;
+	trace->tsc_hz = nvme_get_tsc_hz();
+
+	__atomic_add_fetch(&g_nvme_trace_generation, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&g_nvme_trace, trace, __ATOMIC_RELEASE);
+
+	return 0;
+#else
+	return ENOTSUP;
+#endif
+}
+
+void
+nvme_trace_disable(void)
+{
+	struct nvme_trace_header	*trace = g_nvme_trace;
+
+	if (trace == NULL) {
+		return;
+	}
+
+	__atomic_store_n(&g_nvme_trace, NULL, __ATOMIC_RELEASE);
+	munmap(trace, nvme_trace_size(trace->num_rings, trace->num_entries));
+}
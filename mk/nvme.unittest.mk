@@ -40,7 +40,11 @@ C_SRCS = $(TEST_FILE) $(OTHER_FILES)
 
 CFLAGS += -I$(SPDK_ROOT_DIR)/lib -include $(SPDK_ROOT_DIR)/test/lib/nvme/unit/nvme_impl.h
 
-LIBS += -lcunit -lpthread
+# The unit tests check the statistics counters and trace events, so always
+#  build them in.
+CFLAGS += -DNVME_STATS -DNVME_TRACE
+
+LIBS += -lcunit -lpthread -lrt
 
 APP = $(TEST_FILE:.c=)
 
@@ -252,7 +252,7 @@ int main(int argc, char **argv)
 			continue; /* TODO: just abort */
 		}
 
-		dev->ctrlr = nvme_attach(pci_dev);
+		dev->ctrlr = nvme_attach(pci_dev, NULL);
 		if (dev->ctrlr == NULL) {
 			fprintf(stderr, "failed to attach to NVMe controller %s\n", dev->name);
 			rc = 1;
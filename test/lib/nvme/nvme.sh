@@ -12,6 +12,8 @@ $testdir/unit/nvme_c/nvme_ut
 $valgrind $testdir/unit/nvme_qpair_c/nvme_qpair_ut
 $valgrind $testdir/unit/nvme_ctrlr_c/nvme_ctrlr_ut
 $valgrind $testdir/unit/nvme_ctrlr_cmd_c/nvme_ctrlr_cmd_ut
+$valgrind $testdir/unit/nvme_trace_c/nvme_trace_ut
+$valgrind $testdir/unit/nvme_ns_dealloc_c/nvme_ns_dealloc_ut
 timing_exit unit
 
 timing_enter aer
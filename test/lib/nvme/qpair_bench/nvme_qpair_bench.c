@@ -0,0 +1,330 @@
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright(c) 2010-2015 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Microbenchmark for the nvme_qpair submission/completion path.
+ *
+ * The qpair is driven against a simulated controller that completes every
+ *  submitted command immediately, so the reported cycles per I/O cover the
+ *  driver's tracker, submission queue and completion queue handling (plus
+ *  the small fixed cost of the simulated controller) without any device
+ *  latency.  Run it before and after a change to nvme_qpair.c to compare.
+ *
+ * With -o, it issues reads of that size through nvme_ns_cmd_read() instead
+ *  of flushes, and with -s the namespace has a driver-assisted stripe size.
+ *  Each read then starts half a stripe into a stripe, so reads that cross a
+ *  stripe boundary are split, which measures the split path as well.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "nvme/nvme_qpair.c"
+#include "nvme/nvme_ns_cmd.c"
+#include "nvme/nvme_trace.c"
+
+struct nvme_driver g_nvme_driver = {
+	.lock = NVME_MUTEX_INITIALIZER,
+	.max_io_queues = DEFAULT_MAX_IO_QUEUES,
+};
+
+int32_t nvme_retry_count = NVME_DEFAULT_RETRY_COUNT;
+uint32_t nvme_cq_doorbell_threshold = NVME_DEFAULT_CQ_DOORBELL_THRESHOLD;
+
+char outbuf[OUTBUF_SIZE];
+
+static struct nvme_request	*g_req_pool;
+static struct nvme_request	**g_free_reqs;
+static uint32_t			g_num_free_reqs;
+
+static uint64_t			g_num_submitted;
+static uint64_t			g_num_completed;
+static uint64_t			g_num_ios;
+static uint64_t			g_num_cmds;
+
+/* Namespace for reads, used when g_io_size is not 0 */
+static struct nvme_namespace	g_ns;
+static uint32_t			g_io_size;
+static uint32_t			g_io_blocks;
+static uint64_t			g_next_lba;
+static void			*g_payload;
+
+#define BENCH_SECTOR_SIZE	512
+#define BENCH_MAX_XFER_SIZE	(128 * 1024)
+
+/* Simulated controller state */
+static uint16_t			g_dev_sq_head;
+static uint16_t			g_dev_cq_tail;
+static uint8_t			g_dev_phase = 1;
+
+static inline uint64_t
+rdtsc(void)
+{
+	uint32_t lo, hi;
+
+	__asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+uint64_t
+nvme_vtophys(void *buf)
+{
+	return (uintptr_t)buf;
+}
+
+struct nvme_request *
+nvme_allocate_request(void *payload, uint32_t payload_size,
+		      nvme_cb_fn_t cb_fn, void *cb_arg)
+{
+	struct nvme_request *req;
+
+	if (g_num_free_reqs == 0) {
+		return NULL;
+	}
+	req = g_free_reqs[--g_num_free_reqs];
+
+	memset(req, 0, offsetof(struct nvme_request, children));
+	req->cb_fn = cb_fn;
+	req->cb_arg = cb_arg;
+	req->timeout = true;
+	req->u.payload = payload;
+	req->payload_size = payload_size;
+
+	return req;
+}
+
+void
+nvme_free_request(struct nvme_request *req)
+{
+	g_free_reqs[g_num_free_reqs++] = req;
+}
+
+void
+nvme_ctrlr_cmd_abort(struct nvme_controller *ctrlr, uint16_t cid,
+		     uint16_t sqid, nvme_cb_fn_t cb_fn, void *cb_arg)
+{
+}
+
+/* Complete every command the driver has placed in the submission queue. */
+static void
+sim_ctrlr_process(struct nvme_qpair *qpair)
+{
+	struct nvme_completion *cpl;
+
+	while (g_dev_sq_head != qpair->sq_tail) {
+		cpl = &qpair->cpl[g_dev_cq_tail];
+		cpl->cid = qpair->cmd[g_dev_sq_head].cid;
+		cpl->sqid = qpair->id;
+		cpl->sqhd = g_dev_sq_head;
+		cpl->status.sc = NVME_SC_SUCCESS;
+		cpl->status.sct = NVME_SCT_GENERIC;
+		cpl->status.p = g_dev_phase;
+		g_num_cmds++;
+
+		if (++g_dev_sq_head == qpair->num_entries) {
+			g_dev_sq_head = 0;
+		}
+		if (++g_dev_cq_tail == qpair->num_entries) {
+			g_dev_cq_tail = 0;
+			g_dev_phase = !g_dev_phase;
+		}
+	}
+}
+
+static void io_complete(void *ctx, const struct nvme_completion *cpl);
+
+static void
+submit_single_io(struct nvme_qpair *qpair)
+{
+	struct nvme_request *req;
+
+	g_num_submitted++;
+
+	if (g_io_size != 0) {
+		if (nvme_ns_cmd_read(&g_ns, qpair, g_payload, g_next_lba, g_io_blocks,
+				     io_complete, qpair, 0) != 0) {
+			fprintf(stderr, "out of requests\n");
+			exit(1);
+		}
+		g_next_lba += g_io_blocks;
+		return;
+	}
+
+	req = nvme_allocate_request(NULL, 0, io_complete, qpair);
+	if (req == NULL) {
+		fprintf(stderr, "out of requests\n");
+		exit(1);
+	}
+	req->cmd.opc = NVME_OPC_FLUSH;
+	req->cmd.nsid = 1;
+
+	nvme_qpair_submit_request(qpair, req);
+}
+
+static void
+io_complete(void *ctx, const struct nvme_completion *cpl)
+{
+	g_num_completed++;
+	if (g_num_submitted < g_num_ios) {
+		submit_single_io((struct nvme_qpair *)ctx);
+	}
+}
+
+static void
+usage(char *program_name)
+{
+	printf("%s options\n", program_name);
+	printf("\t[-q io depth (default: 32)]\n");
+	printf("\t[-n number of I/Os (default: 10000000)]\n");
+	printf("\t[-o read size in bytes (default: 0, flushes without data)]\n");
+	printf("\t[-s stripe size in bytes, a power of 2 (default: 0, no striping)]\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct nvme_qpair	qpair = {};
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	uint64_t		tsc_start, tsc_end;
+	uint32_t		queue_depth = 32;
+	uint32_t		stripe_size = 0;
+	uint32_t		reqs_per_io;
+	uint32_t		i;
+	int			op;
+
+	g_num_ios = 10000000;
+
+	while ((op = getopt(argc, argv, "n:o:q:s:")) != -1) {
+		switch (op) {
+		case 'n':
+			g_num_ios = strtoull(optarg, NULL, 10);
+			break;
+		case 'o':
+			g_io_size = atoi(optarg);
+			break;
+		case 's':
+			stripe_size = atoi(optarg);
+			break;
+		case 'q':
+			queue_depth = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (queue_depth == 0 || queue_depth >= NVME_IO_ENTRIES || g_num_ios < queue_depth ||
+	    g_io_size % BENCH_SECTOR_SIZE != 0 || stripe_size % BENCH_SECTOR_SIZE != 0 ||
+	    (stripe_size & (stripe_size - 1)) != 0 || (stripe_size != 0 && g_io_size == 0)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* A parent request, plus one child per stripe or max transfer crossed. */
+	reqs_per_io = 1;
+	if (g_io_size != 0) {
+		g_ns.ctrlr = &ctrlr;
+		g_ns.id = 1;
+		g_ns.sector_size = BENCH_SECTOR_SIZE;
+		g_ns.sectors_per_max_io = BENCH_MAX_XFER_SIZE / BENCH_SECTOR_SIZE;
+		g_ns.stripe_size = stripe_size;
+		g_ns.sectors_per_stripe = stripe_size / BENCH_SECTOR_SIZE;
+		g_io_blocks = g_io_size / BENCH_SECTOR_SIZE;
+		g_next_lba = g_ns.sectors_per_stripe / 2;
+		reqs_per_io += g_io_size / BENCH_MAX_XFER_SIZE + 1;
+		if (stripe_size != 0) {
+			reqs_per_io += g_io_size / stripe_size + 1;
+		}
+
+		/* The simulated controller never touches the data. */
+		if (posix_memalign(&g_payload, 4096, g_io_size) != 0) {
+			fprintf(stderr, "payload allocation failed\n");
+			return 1;
+		}
+	}
+
+	ctrlr.regs = &regs;
+	ctrlr.doorbell_stride_u32 = 1;
+	if (nvme_qpair_construct(&qpair, 1, NVME_IO_ENTRIES, NVME_IO_TRACKERS, &ctrlr, NULL) != 0) {
+		fprintf(stderr, "nvme_qpair_construct() failed\n");
+		return 1;
+	}
+
+	/*
+	 * The completion callback submits the replacement I/O before the
+	 *  completed request is freed, so one spare request is needed.
+	 */
+	g_req_pool = calloc((queue_depth + 1) * reqs_per_io, sizeof(*g_req_pool));
+	g_free_reqs = calloc((queue_depth + 1) * reqs_per_io, sizeof(*g_free_reqs));
+	if (g_req_pool == NULL || g_free_reqs == NULL) {
+		fprintf(stderr, "request pool allocation failed\n");
+		return 1;
+	}
+	for (i = 0; i < (queue_depth + 1) * reqs_per_io; i++) {
+		g_free_reqs[g_num_free_reqs++] = &g_req_pool[i];
+	}
+
+	tsc_start = rdtsc();
+
+	for (i = 0; i < queue_depth; i++) {
+		submit_single_io(&qpair);
+	}
+
+	while (g_num_completed < g_num_ios) {
+		sim_ctrlr_process(&qpair);
+		nvme_qpair_process_completions(&qpair, 0);
+	}
+
+	tsc_end = rdtsc();
+
+	printf("I/Os:           %" PRIu64 "\n", g_num_completed);
+	printf("Queue depth:    %u\n", queue_depth);
+	printf("Cycles per I/O: %.1f\n", (double)(tsc_end - tsc_start) / g_num_completed);
+	if (g_io_size != 0) {
+		printf("I/O size:       %u\n", g_io_size);
+		printf("Stripe size:    %u\n", stripe_size);
+		printf("Cmds per I/O:   %.2f\n", (double)g_num_cmds / g_num_completed);
+	}
+
+	nvme_qpair_destroy(&qpair);
+	free(g_free_reqs);
+	free(g_req_pool);
+	free(g_payload);
+
+	return 0;
+}
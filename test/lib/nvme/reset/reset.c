@@ -72,6 +72,7 @@ struct ns_worker_ctx {
 	uint64_t		current_queue_depth;
 	uint64_t		offset_in_ios;
 	bool			is_draining;
+	struct nvme_qpair	*qpair;
 
 	struct ns_worker_ctx	*next;
 };
@@ -191,11 +192,13 @@ submit_single_io(struct ns_worker_ctx *ns_ctx)
 
 	if ((g_rw_percentage == 100) ||
 	    (g_rw_percentage != 0 && ((rand_r(&seed) % 100) < g_rw_percentage))) {
-		rc = nvme_ns_cmd_read(entry->ns, task->buf, offset_in_ios * entry->io_size_blocks,
-				      entry->io_size_blocks, io_complete, task);
+		rc = nvme_ns_cmd_read(entry->ns, ns_ctx->qpair, task->buf,
+				      offset_in_ios * entry->io_size_blocks,
+				      entry->io_size_blocks, io_complete, task, 0);
 	} else {
-		rc = nvme_ns_cmd_write(entry->ns, task->buf, offset_in_ios * entry->io_size_blocks,
-				       entry->io_size_blocks, io_complete, task);
+		rc = nvme_ns_cmd_write(entry->ns, ns_ctx->qpair, task->buf,
+				       offset_in_ios * entry->io_size_blocks,
+				       entry->io_size_blocks, io_complete, task, 0);
 	}
 
 	if (rc != 0) {
@@ -241,7 +244,7 @@ io_complete(void *ctx, const struct nvme_completion *completion)
 static void
 check_io(struct ns_worker_ctx *ns_ctx)
 {
-	nvme_ctrlr_process_io_completions(ns_ctx->ctr_entry->ctrlr, 0);
+	nvme_qpair_process_completions(ns_ctx->qpair, 0);
 }
 
 static void
@@ -270,9 +273,15 @@ work_fn(void *arg)
 
 	printf("Starting thread on core %u\n", worker->lcore);
 
-	if (nvme_register_io_thread() != 0) {
-		fprintf(stderr, "nvme_register_io_thread() failed on core %u\n", worker->lcore);
-		return -1;
+	/* Allocate a queue pair for each namespace. */
+	ns_ctx = worker->ns_ctx;
+	while (ns_ctx != NULL) {
+		ns_ctx->qpair = nvme_ctrlr_alloc_io_qpair(ns_ctx->ctr_entry->ctrlr, NULL);
+		if (ns_ctx->qpair == NULL) {
+			fprintf(stderr, "nvme_ctrlr_alloc_io_qpair() failed on core %u\n", worker->lcore);
+			return -1;
+		}
+		ns_ctx = ns_ctx->next;
 	}
 
 	/* Submit initial I/O for each namespace. */
@@ -314,11 +323,10 @@ work_fn(void *arg)
 	ns_ctx = worker->ns_ctx;
 	while (ns_ctx != NULL) {
 		drain_io(ns_ctx);
+		nvme_ctrlr_free_io_qpair(ns_ctx->qpair);
 		ns_ctx = ns_ctx->next;
 	}
 
-	nvme_unregister_io_thread();
-
 	return 0;
 }
 
@@ -538,7 +546,7 @@ register_controllers(void)
 
 		pci_device_probe(pci_dev);
 
-		ctrlr = nvme_attach(pci_dev);
+		ctrlr = nvme_attach(pci_dev, NULL);
 		if (ctrlr == NULL) {
 			fprintf(stderr, "nvme_attach failed for controller at pci bdf %d:%d:%d\n",
 				pci_dev->bus, pci_dev->dev, pci_dev->func);
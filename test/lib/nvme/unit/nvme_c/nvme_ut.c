@@ -37,9 +37,8 @@
 
 char outbuf[OUTBUF_SIZE];
 
-volatile int sync_start = 0;
-volatile int threads_pass = 0;
-volatile int threads_fail = 0;
+struct nvme_ctrlr_opts ut_construct_opts;
+bool ut_construct_called;
 
 uint64_t nvme_vtophys(void *buf)
 {
@@ -53,8 +52,11 @@ nvme_ctrlr_hw_reset(struct nvme_controller *ctrlr)
 }
 
 int
-nvme_ctrlr_construct(struct nvme_controller *ctrlr, void *devhandle)
+nvme_ctrlr_construct(struct nvme_controller *ctrlr,
+		     const struct nvme_ctrlr_opts *opts, void *devhandle)
 {
+	ut_construct_opts = *opts;
+	ut_construct_called = true;
 	return 0;
 }
 
@@ -69,101 +71,119 @@ nvme_ctrlr_start(struct nvme_controller *ctrlr)
 	return 0;
 }
 
-static void prepare_for_test(uint32_t max_io_queues)
-{
-	struct nvme_driver *driver = &g_nvme_driver;
-
-	driver->max_io_queues = max_io_queues;
-	if (driver->ioq_index_pool != NULL) {
-		free(driver->ioq_index_pool);
-		driver->ioq_index_pool = NULL;
-	}
-	driver->ioq_index_pool_next = 0;
-	nvme_thread_ioq_index = -1;
-
-	sync_start = 0;
-	threads_pass = 0;
-	threads_fail = 0;
-}
-
-static void *
-nvme_thread(void *arg)
+static void
+test_nvme_attach_default_opts(void)
 {
-	int rc;
-
-	/* Try to synchronize the nvme_register_io_thread() calls
-	 *  as much as possible to ensure the mutex locking is tested
-	 *  correctly.
-	 */
-	while (sync_start == 0)
-		;
-
-	rc = nvme_register_io_thread();
-	if (rc == 0) {
-		__sync_fetch_and_add(&threads_pass, 1);
-	} else {
-		__sync_fetch_and_add(&threads_fail, 1);
-	}
-
-	pthread_exit(NULL);
+	struct nvme_controller	*ctrlr;
+
+	/* NULL opts means the controller is constructed with the defaults. */
+	memset(&ut_construct_opts, 0, sizeof(ut_construct_opts));
+	ut_construct_called = false;
+
+	ctrlr = nvme_attach(NULL, NULL);
+	CU_ASSERT_FATAL(ctrlr != NULL);
+	CU_ASSERT(ut_construct_called);
+	CU_ASSERT(ut_construct_opts.io_queue_size == NVME_IO_ENTRIES);
+	CU_ASSERT(ut_construct_opts.io_queue_requests == NVME_IO_TRACKERS);
+	CU_ASSERT(ut_construct_opts.enable_wrr == true);
+	CU_ASSERT(ut_construct_opts.high_priority_weight == NVME_DEFAULT_HIGH_PRIORITY_WEIGHT);
+	CU_ASSERT(ut_construct_opts.medium_priority_weight == NVME_DEFAULT_MEDIUM_PRIORITY_WEIGHT);
+	CU_ASSERT(ut_construct_opts.low_priority_weight == NVME_DEFAULT_LOW_PRIORITY_WEIGHT);
+	CU_ASSERT(ut_construct_opts.timeout_sec == NVME_DEFAULT_TIMEOUT_PERIOD);
+	CU_ASSERT(ut_construct_opts.retry_backoff_us[NVME_RETRY_CLASS_ABORTED] == 0);
+	CU_ASSERT(ut_construct_opts.retry_backoff_us[NVME_RETRY_CLASS_NAMESPACE_NOT_READY] ==
+		  NVME_DEFAULT_NS_NOT_READY_BACKOFF_US);
+
+	CU_ASSERT(nvme_detach(ctrlr) == 0);
 }
 
 static void
-test1(void)
+test_nvme_attach_opts(void)
 {
-	struct nvme_driver *driver = &g_nvme_driver;
-	int rc;
-	int last_index;
-
-	prepare_for_test(1);
+	struct nvme_controller	*ctrlr;
+	struct nvme_ctrlr_opts	opts;
 
-	CU_ASSERT(nvme_thread_ioq_index == -1);
+	nvme_ctrlr_opts_set_defaults(&opts);
+	opts.io_queue_size = 1024;
+	opts.io_queue_requests = 512;
 
-	rc = nvme_register_io_thread();
-	CU_ASSERT(rc == 0);
-	CU_ASSERT(nvme_thread_ioq_index >= 0);
-	CU_ASSERT(driver->ioq_index_pool_next == 1);
+	ut_construct_called = false;
 
-	/* try to register thread again - this should fail */
-	last_index = nvme_thread_ioq_index;
-	rc = nvme_register_io_thread();
-	CU_ASSERT(rc != 0);
-	/* assert that the ioq_index was unchanged */
-	CU_ASSERT(nvme_thread_ioq_index == last_index);
+	ctrlr = nvme_attach(NULL, &opts);
+	CU_ASSERT_FATAL(ctrlr != NULL);
+	CU_ASSERT(ut_construct_called);
+	CU_ASSERT(ut_construct_opts.io_queue_size == 1024);
+	CU_ASSERT(ut_construct_opts.io_queue_requests == 512);
 
-	nvme_unregister_io_thread();
-	CU_ASSERT(nvme_thread_ioq_index == -1);
-	CU_ASSERT(driver->ioq_index_pool_next == 0);
+	CU_ASSERT(nvme_detach(ctrlr) == 0);
 }
 
 static void
-test2(void)
+test_nvme_request_cache(void)
 {
-	int num_threads = 16;
-	int i;
-	pthread_t td;
-
-	/*
-	 * Start 16 threads, but only simulate a maximum of 12 I/O
-	 *  queues.  12 threads should be able to successfully
-	 *  register, while the other 4 should fail.
-	 */
-	prepare_for_test(12);
-
-	for (i = 0; i < num_threads; i++) {
-		pthread_create(&td, NULL, nvme_thread, NULL);
+	struct nvme_request_cache_stats	stats;
+	struct nvme_request		*reqs[5];
+	uint32_t			size = nvme_request_cache_size;
+	uint32_t			batch = nvme_request_cache_batch;
+	int				i;
+
+	nvme_request_cache_flush();
+	memset(&t_request_cache.stats, 0, sizeof(t_request_cache.stats));
+	nvme_request_cache_size = 4;
+	nvme_request_cache_batch = 2;
+
+	/* An empty cache is refilled a batch at a time. */
+	for (i = 0; i < 5; i++) {
+		reqs[i] = nvme_allocate_request(NULL, 0, NULL, NULL);
+		CU_ASSERT_FATAL(reqs[i] != NULL);
 	}
-
-	sync_start = 1;
-
-	while ((threads_pass + threads_fail) < num_threads)
-		;
-
-	CU_ASSERT(threads_pass == 12);
-	CU_ASSERT(threads_fail == 4);
+	nvme_request_cache_get_stats(&stats);
+	CU_ASSERT(stats.allocs == 5);
+	CU_ASSERT(stats.pool_gets == 3);
+	CU_ASSERT(stats.cached == 1);
+
+	/* A full cache returns a batch to the pool. */
+	for (i = 0; i < 5; i++) {
+		nvme_free_request(reqs[i]);
+	}
+	nvme_request_cache_get_stats(&stats);
+	CU_ASSERT(stats.frees == 5);
+	CU_ASSERT(stats.pool_puts == 1);
+	CU_ASSERT(stats.cached == 4);
+
+	/* Steady state does not touch the pool. */
+	for (i = 0; i < 100; i++) {
+		reqs[0] = nvme_allocate_request(NULL, 0, NULL, NULL);
+		reqs[1] = nvme_allocate_request(NULL, 0, NULL, NULL);
+		nvme_free_request(reqs[1]);
+		nvme_free_request(reqs[0]);
+	}
+	nvme_request_cache_get_stats(&stats);
+	CU_ASSERT(stats.pool_gets == 3);
+	CU_ASSERT(stats.pool_puts == 1);
+	CU_ASSERT(stats.cached == 4);
+
+	/* Disabling the cache empties it on the next free. */
+	nvme_request_cache_size = 0;
+	reqs[0] = nvme_allocate_request(NULL, 0, NULL, NULL);
+	CU_ASSERT_FATAL(reqs[0] != NULL);
+	nvme_free_request(reqs[0]);
+	nvme_request_cache_get_stats(&stats);
+	CU_ASSERT(stats.pool_puts == 3);
+	CU_ASSERT(stats.cached == 0);
+
+	reqs[0] = nvme_allocate_request(NULL, 0, NULL, NULL);
+	CU_ASSERT_FATAL(reqs[0] != NULL);
+	nvme_free_request(reqs[0]);
+	nvme_request_cache_get_stats(&stats);
+	CU_ASSERT(stats.pool_gets == 4);
+	CU_ASSERT(stats.pool_puts == 4);
+	CU_ASSERT(stats.cached == 0);
+
+	nvme_request_cache_size = size;
+	nvme_request_cache_batch = batch;
 }
 
-
 int main(int argc, char **argv)
 {
 	CU_pSuite	suite = NULL;
@@ -180,8 +200,9 @@ int main(int argc, char **argv)
 	}
 
 	if (
-		CU_add_test(suite, "test1", test1) == NULL
-		|| CU_add_test(suite, "test2", test2) == NULL
+		CU_add_test(suite, "nvme_attach_default_opts", test_nvme_attach_default_opts) == NULL
+		|| CU_add_test(suite, "nvme_attach_opts", test_nvme_attach_opts) == NULL
+		|| CU_add_test(suite, "nvme_request_cache", test_nvme_request_cache) == NULL
 	) {
 		CU_cleanup_registry();
 		return CU_get_error();
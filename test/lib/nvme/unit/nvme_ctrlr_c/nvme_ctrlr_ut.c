@@ -31,6 +31,8 @@
  *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <fcntl.h>
+
 #include "CUnit/Basic.h"
 
 #include "nvme/nvme_ctrlr.c"
@@ -42,12 +44,49 @@ struct nvme_driver g_nvme_driver = {
 
 char outbuf[OUTBUF_SIZE];
 
-__thread int    nvme_thread_ioq_index = -1;
+volatile int sync_start = 0;
+volatile int threads_pass = 0;
+volatile int threads_fail = 0;
+
+int g_num_created_io_cqs = 0;
+int g_num_created_io_sqs = 0;
+int g_num_deleted_io_cqs = 0;
+int g_num_deleted_io_sqs = 0;
+bool g_create_io_sq_fails = false;
+uint32_t g_arbitration_cdw0 = 0;
+uint32_t g_set_arbitration_raw = 0;
+
+static void
+complete_admin_cmd(nvme_cb_fn_t cb_fn, void *cb_arg, bool error)
+{
+	struct nvme_completion cpl = {};
+
+	if (error) {
+		cpl.status.sc = NVME_SC_MAXIMUM_QUEUE_SIZE_EXCEEDED;
+		cpl.status.sct = NVME_SCT_COMMAND_SPECIFIC;
+	}
+	cb_fn(cb_arg, &cpl);
+}
+
+bool g_qpair_construct_fails = false;
+int g_num_qpair_destroys = 0;
 
 int nvme_qpair_construct(struct nvme_qpair *qpair, uint16_t id,
 			 uint16_t num_entries, uint16_t num_trackers,
-			 struct nvme_controller *ctrlr)
+			 struct nvme_controller *ctrlr, struct nvme_qpair *cq_qpair)
 {
+	if (g_qpair_construct_fails) {
+		return -1;
+	}
+	qpair->id = id;
+	qpair->cq_qpair = cq_qpair ? cq_qpair : qpair;
+	TAILQ_INIT(&qpair->shared_cq_sqs);
+	qpair->intr_fd = -1;
+	qpair->num_entries = num_entries;
+	qpair->num_trackers = num_trackers;
+	qpair->num_free_tr = num_trackers;
+	qpair->ctrlr = ctrlr;
+	STAILQ_INIT(&qpair->queued_req);
 	return 0;
 }
 
@@ -62,9 +101,10 @@ nvme_qpair_submit_request(struct nvme_qpair *qpair, struct nvme_request *req)
 	CU_ASSERT(req->cmd.opc == NVME_OPC_ASYNC_EVENT_REQUEST);
 }
 
-void
+int32_t
 nvme_qpair_process_completions(struct nvme_qpair *qpair, uint32_t max_completions)
 {
+	return 0;
 }
 
 void
@@ -75,6 +115,7 @@ nvme_qpair_disable(struct nvme_qpair *qpair)
 void
 nvme_qpair_destroy(struct nvme_qpair *qpair)
 {
+	g_num_qpair_destroys++;
 }
 
 void
@@ -87,9 +128,69 @@ nvme_qpair_reset(struct nvme_qpair *qpair)
 {
 }
 
+uint32_t g_mpsc_ring_size = 0;
+
+int
+nvme_qpair_init_mpsc(struct nvme_qpair *qpair, uint32_t ring_size)
+{
+	g_mpsc_ring_size = ring_size;
+	return 0;
+}
+
+void
+nvme_qpair_get_stats(struct nvme_qpair *qpair, struct nvme_qpair_stats *stats)
+{
+	*stats = qpair->stats;
+}
+
+int
+nvme_qpair_init_latency_tracking(struct nvme_qpair *qpair)
+{
+	qpair->latency_hist = calloc(NVME_LATENCY_HIST_OPCODES, sizeof(struct histogram *));
+	return qpair->latency_hist == NULL ? ENOMEM : 0;
+}
+
+void
+nvme_qpair_merge_latency_histogram(struct nvme_qpair *qpair, uint8_t opc,
+				   struct histogram *hist)
+{
+	if (qpair->latency_hist != NULL && qpair->latency_hist[opc] != NULL) {
+		histogram_merge(hist, qpair->latency_hist[opc]);
+	}
+}
+
+uint32_t g_timeout_sec = 0;
+
+int
+nvme_qpair_init_timeouts(struct nvme_qpair *qpair, uint32_t timeout_sec)
+{
+	g_timeout_sec = timeout_sec;
+	return 0;
+}
+
+void
+nvme_qpair_plug(struct nvme_qpair *qpair)
+{
+}
+
+void
+nvme_qpair_unplug(struct nvme_qpair *qpair)
+{
+}
+
+void
+nvme_qpair_set_batch_callback(struct nvme_qpair *qpair,
+			      nvme_batch_cb_fn_t batch_cb_fn, void *ctx)
+{
+}
+
 void
 nvme_completion_poll_cb(void *arg, const struct nvme_completion *cpl)
 {
+	struct nvme_completion_poll_status *status = arg;
+
+	memcpy(&status->cpl, cpl, sizeof(*cpl));
+	status->done = true;
 }
 
 void
@@ -116,12 +217,62 @@ nvme_ctrlr_cmd_create_io_cq(struct nvme_controller *ctrlr,
 			    struct nvme_qpair *io_que, nvme_cb_fn_t cb_fn,
 			    void *cb_arg)
 {
+	g_num_created_io_cqs++;
+	complete_admin_cmd(cb_fn, cb_arg, false);
 }
 
 void
 nvme_ctrlr_cmd_create_io_sq(struct nvme_controller *ctrlr,
 			    struct nvme_qpair *io_que, nvme_cb_fn_t cb_fn,
 			    void *cb_arg)
+{
+	g_num_created_io_sqs++;
+	complete_admin_cmd(cb_fn, cb_arg, g_create_io_sq_fails);
+}
+
+void
+nvme_ctrlr_cmd_delete_io_cq(struct nvme_controller *ctrlr,
+			    struct nvme_qpair *io_que, nvme_cb_fn_t cb_fn,
+			    void *cb_arg)
+{
+	g_num_deleted_io_cqs++;
+	complete_admin_cmd(cb_fn, cb_arg, false);
+}
+
+void
+nvme_ctrlr_cmd_delete_io_sq(struct nvme_controller *ctrlr,
+			    struct nvme_qpair *io_que, nvme_cb_fn_t cb_fn,
+			    void *cb_arg)
+{
+	g_num_deleted_io_sqs++;
+	complete_admin_cmd(cb_fn, cb_arg, false);
+}
+
+void
+nvme_ctrlr_cmd_get_feature(struct nvme_controller *ctrlr, uint8_t feature,
+			   uint32_t cdw11, void *payload, uint32_t payload_size,
+			   nvme_cb_fn_t cb_fn, void *cb_arg)
+{
+	struct nvme_completion cpl = {};
+
+	CU_ASSERT(feature == NVME_FEAT_ARBITRATION);
+	cpl.cdw0 = g_arbitration_cdw0;
+	cb_fn(cb_arg, &cpl);
+}
+
+void
+nvme_ctrlr_cmd_set_arbitration(struct nvme_controller *ctrlr,
+			       union nvme_feat_arbitration arb, nvme_cb_fn_t cb_fn,
+			       void *cb_arg)
+{
+	g_set_arbitration_raw = arb.raw;
+	complete_admin_cmd(cb_fn, cb_arg, false);
+}
+
+void
+nvme_ctrlr_cmd_doorbell_buffer_config(struct nvme_controller *ctrlr,
+				      uint64_t shadow_doorbell_bus_addr, uint64_t eventidx_bus_addr,
+				      nvme_cb_fn_t cb_fn, void *cb_arg)
 {
 }
 
@@ -174,6 +325,681 @@ test_nvme_ctrlr_fail(void)
 	CU_ASSERT(ctrlr.is_failed == true);
 }
 
+static void
+test_nvme_ctrlr_io_queue_opts(void)
+{
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+
+	ctrlr.regs = &regs;
+
+	/* Requested sizes above CAP.MQES are clamped to what the controller supports. */
+	regs.cap_lo.bits.mqes = 63;
+	ctrlr.opts.io_queue_size = 1024;
+	ctrlr.opts.io_queue_requests = 1024;
+	nvme_ctrlr_init_io_queue_opts(&ctrlr);
+	CU_ASSERT(ctrlr.opts.io_queue_size == 64);
+	CU_ASSERT(ctrlr.opts.io_queue_requests == 63);
+
+	/* Deep queues are allowed when the controller supports them. */
+	regs.cap_lo.bits.mqes = 0xFFFF;
+	ctrlr.opts.io_queue_size = 4096;
+	ctrlr.opts.io_queue_requests = 2048;
+	nvme_ctrlr_init_io_queue_opts(&ctrlr);
+	CU_ASSERT(ctrlr.opts.io_queue_size == 4096);
+	CU_ASSERT(ctrlr.opts.io_queue_requests == 2048);
+
+	/* 64K entries do not fit in the 16-bit queue size. */
+	ctrlr.opts.io_queue_size = 65536;
+	ctrlr.opts.io_queue_requests = 65536;
+	nvme_ctrlr_init_io_queue_opts(&ctrlr);
+	CU_ASSERT(ctrlr.opts.io_queue_size == 65535);
+	CU_ASSERT(ctrlr.opts.io_queue_requests == 65534);
+
+	/* Tiny queues are grown so that a fused pair always has two trackers. */
+	ctrlr.opts.io_queue_size = 2;
+	ctrlr.opts.io_queue_requests = 1;
+	nvme_ctrlr_init_io_queue_opts(&ctrlr);
+	CU_ASSERT(ctrlr.opts.io_queue_size == NVME_MIN_IO_TRACKERS + 1);
+	CU_ASSERT(ctrlr.opts.io_queue_requests == NVME_MIN_IO_TRACKERS);
+
+	/* Unless the controller cannot hold that many. */
+	regs.cap_lo.bits.mqes = 2;
+	nvme_ctrlr_init_io_queue_opts(&ctrlr);
+	CU_ASSERT(ctrlr.opts.io_queue_size == 3);
+	CU_ASSERT(ctrlr.opts.io_queue_requests == 2);
+	regs.cap_lo.bits.mqes = 1;
+	nvme_ctrlr_init_io_queue_opts(&ctrlr);
+	CU_ASSERT(ctrlr.opts.io_queue_size == 2);
+	CU_ASSERT(ctrlr.opts.io_queue_requests == 1);
+
+	/* Command timeouts are clamped to the supported range, or left disabled. */
+	ctrlr.opts.timeout_sec = 1;
+	nvme_ctrlr_init_io_queue_opts(&ctrlr);
+	CU_ASSERT(ctrlr.opts.timeout_sec == NVME_MIN_TIMEOUT_PERIOD);
+	ctrlr.opts.timeout_sec = 3600;
+	nvme_ctrlr_init_io_queue_opts(&ctrlr);
+	CU_ASSERT(ctrlr.opts.timeout_sec == NVME_MAX_TIMEOUT_PERIOD);
+	ctrlr.opts.timeout_sec = 0;
+	nvme_ctrlr_init_io_queue_opts(&ctrlr);
+	CU_ASSERT(ctrlr.opts.timeout_sec == 0);
+}
+
+static void
+prepare_io_qpairs(struct nvme_controller *ctrlr, struct nvme_registers *regs,
+		  uint32_t num_io_queues)
+{
+	uint32_t i;
+
+	memset(ctrlr, 0, sizeof(*ctrlr));
+	memset(regs, 0, sizeof(*regs));
+	ctrlr->regs = regs;
+	ctrlr->num_io_queues = num_io_queues;
+	ctrlr->opts.io_queue_size = NVME_IO_ENTRIES;
+	ctrlr->opts.io_queue_requests = NVME_IO_TRACKERS;
+	regs->cap_lo.bits.mqes = NVME_IO_ENTRIES - 1;
+	TAILQ_INIT(&ctrlr->active_io_qpairs);
+	nvme_mutex_init_recursive(&ctrlr->ctrlr_lock);
+
+	ctrlr->free_io_qids = calloc((num_io_queues + 63) / 64, sizeof(uint64_t));
+	CU_ASSERT_FATAL(ctrlr->free_io_qids != NULL);
+	ctrlr->io_qpair_by_qid = calloc(num_io_queues + 1, sizeof(struct nvme_qpair *));
+	CU_ASSERT_FATAL(ctrlr->io_qpair_by_qid != NULL);
+	for (i = 0; i < num_io_queues; i++) {
+		nvme_ctrlr_put_free_io_qid(ctrlr, i + 1);
+	}
+
+	CU_ASSERT_FATAL(nvme_ctrlr_create_qpairs(ctrlr) == 0);
+
+	g_num_created_io_cqs = 0;
+	g_num_created_io_sqs = 0;
+	g_num_deleted_io_cqs = 0;
+	g_num_deleted_io_sqs = 0;
+	g_create_io_sq_fails = false;
+}
+
+static void
+cleanup_io_qpairs(struct nvme_controller *ctrlr)
+{
+	struct nvme_qpair *qpair;
+
+	while (!TAILQ_EMPTY(&ctrlr->active_io_qpairs)) {
+		qpair = TAILQ_FIRST(&ctrlr->active_io_qpairs);
+		TAILQ_REMOVE(&ctrlr->active_io_qpairs, qpair, tailq);
+		free(qpair);
+	}
+	free(ctrlr->free_io_qids);
+	ctrlr->free_io_qids = NULL;
+	free(ctrlr->io_qpair_by_qid);
+	ctrlr->io_qpair_by_qid = NULL;
+	nvme_mutex_destroy(&ctrlr->ctrlr_lock);
+}
+
+static void
+test_nvme_ctrlr_alloc_io_qpair(void)
+{
+	struct nvme_controller	ctrlr;
+	struct nvme_registers	regs;
+	struct nvme_qpair	*q0, *q1;
+	struct nvme_request	req = {};
+
+	prepare_io_qpairs(&ctrlr, &regs, 2);
+
+	/* Queues are created on the controller only when allocated. */
+	CU_ASSERT(g_num_created_io_cqs == 0);
+	CU_ASSERT(g_num_created_io_sqs == 0);
+
+	q0 = nvme_ctrlr_alloc_io_qpair(&ctrlr, NULL);
+	q1 = nvme_ctrlr_alloc_io_qpair(&ctrlr, NULL);
+	CU_ASSERT_FATAL(q0 != NULL && q1 != NULL);
+	CU_ASSERT(q0->id == 1);
+	CU_ASSERT(q1->id == 2);
+	CU_ASSERT(q0->ctrlr == &ctrlr);
+	CU_ASSERT(q0->num_entries == NVME_IO_ENTRIES);
+	CU_ASSERT(g_num_created_io_cqs == 2);
+	CU_ASSERT(g_num_created_io_sqs == 2);
+
+	/* Every I/O queue is in use. */
+	CU_ASSERT(nvme_ctrlr_alloc_io_qpair(&ctrlr, NULL) == NULL);
+	CU_ASSERT(g_num_created_io_cqs == 2);
+
+	/* A qpair with outstanding I/O cannot be freed. */
+	q1->num_free_tr--;
+	CU_ASSERT(nvme_ctrlr_free_io_qpair(q1) == EBUSY);
+	q1->num_free_tr++;
+	STAILQ_INSERT_TAIL(&q1->queued_req, &req, stailq);
+	CU_ASSERT(nvme_ctrlr_free_io_qpair(q1) == EBUSY);
+	STAILQ_REMOVE_HEAD(&q1->queued_req, stailq);
+	CU_ASSERT(g_num_deleted_io_sqs == 0);
+
+	/* Freeing deletes the queues and releases the queue ID for reuse. */
+	CU_ASSERT(nvme_ctrlr_free_io_qpair(q1) == 0);
+	CU_ASSERT(g_num_deleted_io_sqs == 1);
+	CU_ASSERT(g_num_deleted_io_cqs == 1);
+
+	/* Commands are only timed when the controller has a timeout. */
+	CU_ASSERT(g_timeout_sec == 0);
+	ctrlr.opts.timeout_sec = 30;
+	q1 = nvme_ctrlr_alloc_io_qpair(&ctrlr, NULL);
+	CU_ASSERT_FATAL(q1 != NULL);
+	CU_ASSERT(q1->id == 2);
+	CU_ASSERT(g_timeout_sec == 30);
+	ctrlr.opts.timeout_sec = 0;
+	g_timeout_sec = 0;
+
+	/*
+	 * A failed submission queue creation deletes the completion queue
+	 *  and returns the queue ID.
+	 */
+	CU_ASSERT(nvme_ctrlr_free_io_qpair(q0) == 0);
+	g_num_deleted_io_cqs = 0;
+	g_num_deleted_io_sqs = 0;
+	g_create_io_sq_fails = true;
+	CU_ASSERT(nvme_ctrlr_alloc_io_qpair(&ctrlr, NULL) == NULL);
+	CU_ASSERT(g_num_deleted_io_cqs == 1);
+	CU_ASSERT(g_num_deleted_io_sqs == 0);
+	g_create_io_sq_fails = false;
+
+	/* A failed construct has already cleaned up, so the qpair is not destroyed again. */
+	g_num_qpair_destroys = 0;
+	g_qpair_construct_fails = true;
+	CU_ASSERT(nvme_ctrlr_alloc_io_qpair(&ctrlr, NULL) == NULL);
+	CU_ASSERT(g_num_qpair_destroys == 0);
+	g_qpair_construct_fails = false;
+
+	q0 = nvme_ctrlr_alloc_io_qpair(&ctrlr, NULL);
+	CU_ASSERT_FATAL(q0 != NULL);
+	CU_ASSERT(q0->id == 1);
+
+	CU_ASSERT(nvme_ctrlr_free_io_qpair(q0) == 0);
+	CU_ASSERT(nvme_ctrlr_free_io_qpair(q1) == 0);
+	CU_ASSERT(nvme_ctrlr_free_io_qpair(NULL) == 0);
+	CU_ASSERT(TAILQ_EMPTY(&ctrlr.active_io_qpairs));
+
+	/* No queues can be created on a failed controller. */
+	ctrlr.is_failed = true;
+	CU_ASSERT(nvme_ctrlr_alloc_io_qpair(&ctrlr, NULL) == NULL);
+
+	cleanup_io_qpairs(&ctrlr);
+}
+
+static void
+test_nvme_ctrlr_alloc_shared_cq_qpair(void)
+{
+	struct nvme_controller		ctrlr, other_ctrlr = {};
+	struct nvme_registers		regs;
+	struct nvme_io_qpair_opts	opts;
+	struct nvme_qpair		*q0, *q1, *q2, other_qpair = {};
+
+	prepare_io_qpairs(&ctrlr, &regs, 4);
+
+	q0 = nvme_ctrlr_alloc_io_qpair(&ctrlr, NULL);
+	CU_ASSERT_FATAL(q0 != NULL);
+	CU_ASSERT(q0->cq_qpair == q0);
+	CU_ASSERT(ctrlr.io_qpair_by_qid[q0->id] == q0);
+
+	/* A qpair sharing q0's completion queue only gets a submission queue. */
+	nvme_io_qpair_opts_set_defaults(&opts);
+	CU_ASSERT(opts.shared_cq == NULL);
+	opts.shared_cq = q0;
+	q1 = nvme_ctrlr_alloc_io_qpair(&ctrlr, &opts);
+	CU_ASSERT_FATAL(q1 != NULL);
+	CU_ASSERT(q1->cq_qpair == q0);
+	CU_ASSERT(TAILQ_FIRST(&q0->shared_cq_sqs) == q1);
+	CU_ASSERT(g_num_created_io_cqs == 1);
+	CU_ASSERT(g_num_created_io_sqs == 2);
+
+	/* Sharing with q1 means sharing q0's completion queue. */
+	opts.shared_cq = q1;
+	q2 = nvme_ctrlr_alloc_io_qpair(&ctrlr, &opts);
+	CU_ASSERT_FATAL(q2 != NULL);
+	CU_ASSERT(q2->cq_qpair == q0);
+	CU_ASSERT(g_num_created_io_cqs == 1);
+
+	/* The completion queue of another controller's qpair cannot be shared. */
+	other_qpair.ctrlr = &other_ctrlr;
+	opts.shared_cq = &other_qpair;
+	CU_ASSERT(nvme_ctrlr_alloc_io_qpair(&ctrlr, &opts) == NULL);
+
+	/* q0 cannot go away while its completion queue is still shared. */
+	CU_ASSERT(nvme_ctrlr_free_io_qpair(q0) == EBUSY);
+
+	CU_ASSERT(nvme_ctrlr_free_io_qpair(q1) == 0);
+	CU_ASSERT(nvme_ctrlr_free_io_qpair(q2) == 0);
+	CU_ASSERT(g_num_deleted_io_sqs == 2);
+	CU_ASSERT(g_num_deleted_io_cqs == 0);
+	CU_ASSERT(TAILQ_EMPTY(&q0->shared_cq_sqs));
+
+	CU_ASSERT(nvme_ctrlr_free_io_qpair(q0) == 0);
+	CU_ASSERT(g_num_deleted_io_sqs == 3);
+	CU_ASSERT(g_num_deleted_io_cqs == 1);
+	CU_ASSERT(ctrlr.io_qpair_by_qid[1] == NULL);
+
+	cleanup_io_qpairs(&ctrlr);
+}
+
+static void
+test_nvme_ctrlr_wrr(void)
+{
+	struct nvme_controller		ctrlr;
+	struct nvme_registers		regs;
+	struct nvme_io_qpair_opts	opts;
+	struct nvme_qpair		*qpair;
+	union nvme_feat_arbitration	arb;
+
+	prepare_io_qpairs(&ctrlr, &regs, 2);
+	ctrlr.opts.enable_wrr = true;
+	regs.csts = 1; /* RDY */
+
+	/* Round robin is kept when the controller does not support WRR. */
+	regs.cap_lo.bits.ams = 0;
+	CU_ASSERT(nvme_ctrlr_enable(&ctrlr) == 0);
+	CU_ASSERT(regs.cc.bits.ams == NVME_CC_AMS_RR);
+	CU_ASSERT(nvme_ctrlr_is_wrr_enabled(&ctrlr) == false);
+
+	/* Only the default priority is accepted under round robin. */
+	nvme_io_qpair_opts_set_defaults(&opts);
+	CU_ASSERT(opts.qprio == NVME_QPRIO_MEDIUM);
+	opts.qprio = NVME_QPRIO_URGENT;
+	CU_ASSERT(nvme_ctrlr_alloc_io_qpair(&ctrlr, &opts) == NULL);
+
+	/* ...and no weights are programmed. */
+	g_set_arbitration_raw = 0;
+	nvme_ctrlr_set_arbitration(&ctrlr);
+	CU_ASSERT(g_set_arbitration_raw == 0);
+
+	/* WRR is selected when supported and requested. */
+	regs.cc.raw = 0;
+	regs.cap_lo.bits.ams = NVME_CAP_AMS_WRR;
+	CU_ASSERT(nvme_ctrlr_enable(&ctrlr) == 0);
+	CU_ASSERT(regs.cc.bits.ams == NVME_CC_AMS_WRR);
+	CU_ASSERT(nvme_ctrlr_is_wrr_enabled(&ctrlr) == true);
+
+	/* Weights are 0's based and clamped; the arbitration burst is preserved. */
+	ctrlr.opts.high_priority_weight = 1000;
+	ctrlr.opts.medium_priority_weight = 8;
+	ctrlr.opts.low_priority_weight = 0;
+	arb.raw = 0;
+	arb.bits.ab = 5;
+	g_arbitration_cdw0 = arb.raw;
+	nvme_ctrlr_set_arbitration(&ctrlr);
+	arb.raw = g_set_arbitration_raw;
+	CU_ASSERT(arb.bits.ab == 5);
+	CU_ASSERT(arb.bits.hpw == 255);
+	CU_ASSERT(arb.bits.mpw == 7);
+	CU_ASSERT(arb.bits.lpw == 0);
+
+	qpair = nvme_ctrlr_alloc_io_qpair(&ctrlr, &opts);
+	CU_ASSERT_FATAL(qpair != NULL);
+	CU_ASSERT(qpair->qprio == NVME_QPRIO_URGENT);
+	CU_ASSERT(nvme_ctrlr_free_io_qpair(qpair) == 0);
+
+	opts.qprio = NVME_QPRIO_LOW + 1;
+	CU_ASSERT(nvme_ctrlr_alloc_io_qpair(&ctrlr, &opts) == NULL);
+
+	/* WRR can be turned off in the controller options. */
+	regs.cc.raw = 0;
+	ctrlr.opts.enable_wrr = false;
+	CU_ASSERT(nvme_ctrlr_enable(&ctrlr) == 0);
+	CU_ASSERT(regs.cc.bits.ams == NVME_CC_AMS_RR);
+
+	cleanup_io_qpairs(&ctrlr);
+}
+
+struct ut_intr_backend {
+	int		bind_rc;
+	uint16_t	vector;
+	int		efd;
+	int		num_bound;
+};
+
+static int
+ut_bind_vector(void *ctx, void *devhandle, uint16_t vector, int efd)
+{
+	struct ut_intr_backend *backend = ctx;
+
+	if (backend->bind_rc != 0) {
+		return backend->bind_rc;
+	}
+	backend->vector = vector;
+	backend->efd = efd;
+	backend->num_bound++;
+	return 0;
+}
+
+static void
+ut_unbind_vector(void *ctx, void *devhandle, uint16_t vector)
+{
+	struct ut_intr_backend *backend = ctx;
+
+	CU_ASSERT(vector == backend->vector);
+	backend->num_bound--;
+}
+
+static const struct nvme_intr_ops ut_intr_ops = {
+	.bind_vector	= ut_bind_vector,
+	.unbind_vector	= ut_unbind_vector,
+};
+
+static void
+test_nvme_ctrlr_alloc_interrupt_qpair(void)
+{
+	struct nvme_controller		ctrlr;
+	struct nvme_registers		regs;
+	struct nvme_io_qpair_opts	opts;
+	struct nvme_qpair		*qpair, *sharer;
+	struct ut_intr_backend		backend = {};
+	int				efd;
+
+	prepare_io_qpairs(&ctrlr, &regs, 2);
+	nvme_io_qpair_opts_set_defaults(&opts);
+	CU_ASSERT(opts.enable_interrupts == false);
+
+	/* Polled qpairs have no eventfd. */
+	qpair = nvme_ctrlr_alloc_io_qpair(&ctrlr, &opts);
+	CU_ASSERT_FATAL(qpair != NULL);
+	CU_ASSERT(qpair->intr_fd == -1);
+	CU_ASSERT(nvme_ctrlr_free_io_qpair(qpair) == 0);
+
+	/* Interrupts need a backend. */
+	opts.enable_interrupts = true;
+	CU_ASSERT(nvme_ctrlr_alloc_io_qpair(&ctrlr, &opts) == NULL);
+
+	ctrlr.opts.intr_ops = &ut_intr_ops;
+	ctrlr.opts.intr_ctx = &backend;
+
+	/* A backend failure fails the allocation and returns the queue ID. */
+	backend.bind_rc = ENOTSUP;
+	g_num_created_io_cqs = 0;
+	CU_ASSERT(nvme_ctrlr_alloc_io_qpair(&ctrlr, &opts) == NULL);
+	CU_ASSERT(g_num_created_io_cqs == 0);
+	backend.bind_rc = 0;
+
+	/* The completion queue's vector, numbered after its qid, is bound to an eventfd. */
+	qpair = nvme_ctrlr_alloc_io_qpair(&ctrlr, &opts);
+	CU_ASSERT_FATAL(qpair != NULL);
+	CU_ASSERT(backend.num_bound == 1);
+	CU_ASSERT(backend.vector == qpair->id);
+	CU_ASSERT(qpair->intr_fd >= 0);
+	CU_ASSERT(qpair->intr_fd == backend.efd);
+
+	/* Qpairs sharing the completion queue share its interrupt. */
+	opts.shared_cq = qpair;
+	CU_ASSERT(nvme_ctrlr_alloc_io_qpair(&ctrlr, &opts) == NULL);
+	opts.enable_interrupts = false;
+	sharer = nvme_ctrlr_alloc_io_qpair(&ctrlr, &opts);
+	CU_ASSERT_FATAL(sharer != NULL);
+	CU_ASSERT(sharer->intr_fd == -1);
+	CU_ASSERT(backend.num_bound == 1);
+	CU_ASSERT(nvme_ctrlr_free_io_qpair(sharer) == 0);
+
+	/* Freeing unbinds the vector and closes the eventfd. */
+	efd = qpair->intr_fd;
+	CU_ASSERT(nvme_ctrlr_free_io_qpair(qpair) == 0);
+	CU_ASSERT(backend.num_bound == 0);
+	CU_ASSERT(fcntl(efd, F_GETFD) == -1);
+
+	cleanup_io_qpairs(&ctrlr);
+}
+
+static void
+test_nvme_ctrlr_alloc_proxied_qpair(void)
+{
+	struct nvme_controller		ctrlr;
+	struct nvme_registers		regs;
+	struct nvme_io_qpair_opts	opts;
+	struct nvme_qpair		*qpair, proxy = {};
+
+	prepare_io_qpairs(&ctrlr, &regs, 2);
+	nvme_io_qpair_opts_set_defaults(&opts);
+	CU_ASSERT(opts.proxy_ring_size == 0);
+
+	g_mpsc_ring_size = 0;
+	opts.proxy_ring_size = 64;
+	qpair = nvme_ctrlr_alloc_io_qpair(&ctrlr, &opts);
+	CU_ASSERT_FATAL(qpair != NULL);
+	CU_ASSERT(g_mpsc_ring_size == 64);
+
+	/* A qpair with proxies must drain them from its own completion queue. */
+	opts.shared_cq = qpair;
+	CU_ASSERT(nvme_ctrlr_alloc_io_qpair(&ctrlr, &opts) == NULL);
+
+	/* A proxy has no completion queue of its own to share. */
+	proxy.ctrlr = &ctrlr;
+	proxy.cq_qpair = &proxy;
+	proxy.id = qpair->id;
+	proxy.mpsc_owner = qpair;
+	nvme_io_qpair_opts_set_defaults(&opts);
+	opts.shared_cq = &proxy;
+	CU_ASSERT(nvme_ctrlr_alloc_io_qpair(&ctrlr, &opts) == NULL);
+	CU_ASSERT(g_num_created_io_sqs == 1);
+
+	/* Proxies are freed with nvme_qpair_free_proxy(), and before their qpair. */
+	CU_ASSERT(nvme_ctrlr_free_io_qpair(&proxy) == EINVAL);
+	qpair->num_proxies = 1;
+	CU_ASSERT(nvme_ctrlr_free_io_qpair(qpair) == EBUSY);
+	qpair->num_proxies = 0;
+	CU_ASSERT(nvme_ctrlr_free_io_qpair(qpair) == 0);
+
+	cleanup_io_qpairs(&ctrlr);
+}
+
+static void
+test_nvme_ctrlr_io_qpair_stats(void)
+{
+	struct nvme_controller	ctrlr;
+	struct nvme_registers	regs;
+	struct nvme_qpair	*q0, *q1;
+	struct nvme_qpair_stats	stats;
+
+	prepare_io_qpairs(&ctrlr, &regs, 2);
+
+	q0 = nvme_ctrlr_alloc_io_qpair(&ctrlr, NULL);
+	q1 = nvme_ctrlr_alloc_io_qpair(&ctrlr, NULL);
+	CU_ASSERT_FATAL(q0 != NULL && q1 != NULL);
+
+	q0->stats.submitted = 10;
+	q0->stats.max_outstanding = 4;
+	q1->stats.submitted = 5;
+	q1->stats.max_outstanding = 7;
+	q1->stats.empty_polls = 3;
+
+	/* Counters are summed, except max_outstanding which is the highest of any qpair. */
+	nvme_ctrlr_get_io_qpair_stats(&ctrlr, &stats);
+	CU_ASSERT(stats.submitted == 15);
+	CU_ASSERT(stats.max_outstanding == 7);
+	CU_ASSERT(stats.empty_polls == 3);
+
+	/* Freed qpairs still count. */
+	CU_ASSERT(nvme_ctrlr_free_io_qpair(q1) == 0);
+	nvme_ctrlr_get_io_qpair_stats(&ctrlr, &stats);
+	CU_ASSERT(stats.submitted == 15);
+	CU_ASSERT(stats.max_outstanding == 7);
+	CU_ASSERT(stats.empty_polls == 3);
+
+	CU_ASSERT(nvme_ctrlr_free_io_qpair(q0) == 0);
+	cleanup_io_qpairs(&ctrlr);
+}
+
+static void
+test_nvme_ctrlr_io_latency_histogram(void)
+{
+	struct nvme_controller		ctrlr;
+	struct nvme_registers		regs;
+	struct nvme_io_qpair_opts	opts;
+	struct nvme_qpair		*q0, *q1, *q2;
+	struct histogram		*hist, *q1_read;
+	uint32_t			i;
+
+	hist = calloc(1, sizeof(*hist));
+	CU_ASSERT_FATAL(hist != NULL);
+
+	prepare_io_qpairs(&ctrlr, &regs, 3);
+
+	q0 = nvme_ctrlr_alloc_io_qpair(&ctrlr, NULL);
+	CU_ASSERT_FATAL(q0 != NULL);
+	CU_ASSERT(q0->latency_hist == NULL);
+
+	nvme_io_qpair_opts_set_defaults(&opts);
+	CU_ASSERT(opts.track_latency == false);
+	opts.track_latency = true;
+	q1 = nvme_ctrlr_alloc_io_qpair(&ctrlr, &opts);
+	q2 = nvme_ctrlr_alloc_io_qpair(&ctrlr, &opts);
+	CU_ASSERT_FATAL(q1 != NULL && q2 != NULL);
+	CU_ASSERT_FATAL(q1->latency_hist != NULL && q2->latency_hist != NULL);
+
+	q1_read = calloc(1, sizeof(*q1_read));
+	q2->latency_hist[NVME_OPC_READ] = calloc(1, sizeof(struct histogram));
+	CU_ASSERT_FATAL(q1_read != NULL && q2->latency_hist[NVME_OPC_READ] != NULL);
+	q1->latency_hist[NVME_OPC_READ] = q1_read;
+	histogram_tally(q1_read, 100);
+	histogram_tally(q1_read, 200);
+	histogram_tally(q2->latency_hist[NVME_OPC_READ], 300);
+
+	nvme_ctrlr_merge_io_latency_histogram(&ctrlr, NVME_OPC_READ, hist);
+	CU_ASSERT(histogram_count(hist) == 3);
+	histogram_reset(hist);
+	nvme_ctrlr_merge_io_latency_histogram(&ctrlr, NVME_OPC_WRITE, hist);
+	CU_ASSERT(histogram_count(hist) == 0);
+
+	/* The first freed qpair's histogram is taken over, later ones are merged into it. */
+	CU_ASSERT(nvme_ctrlr_free_io_qpair(q1) == 0);
+	CU_ASSERT_FATAL(ctrlr.freed_io_qpair_latency_hist != NULL);
+	CU_ASSERT(ctrlr.freed_io_qpair_latency_hist[NVME_OPC_READ] == q1_read);
+	CU_ASSERT(nvme_ctrlr_free_io_qpair(q2) == 0);
+	CU_ASSERT(histogram_count(q1_read) == 3);
+
+	nvme_ctrlr_merge_io_latency_histogram(&ctrlr, NVME_OPC_READ, hist);
+	CU_ASSERT(histogram_count(hist) == 3);
+	CU_ASSERT(histogram_percentile(hist, 100.0) == histogram_bucket_end(4, 5));
+
+	CU_ASSERT(nvme_ctrlr_free_io_qpair(q0) == 0);
+	for (i = 0; i < NVME_LATENCY_HIST_OPCODES; i++) {
+		free(ctrlr.freed_io_qpair_latency_hist[i]);
+	}
+	free(ctrlr.freed_io_qpair_latency_hist);
+	cleanup_io_qpairs(&ctrlr);
+	free(hist);
+}
+
+static void
+test_nvme_ctrlr_recreate_io_qpairs(void)
+{
+	struct nvme_controller	ctrlr;
+	struct nvme_registers	regs;
+	struct nvme_qpair	*q0, *q1, *q2;
+
+	prepare_io_qpairs(&ctrlr, &regs, 8);
+
+	q0 = nvme_ctrlr_alloc_io_qpair(&ctrlr, NULL);
+	q1 = nvme_ctrlr_alloc_io_qpair(&ctrlr, NULL);
+	q2 = nvme_ctrlr_alloc_io_qpair(&ctrlr, NULL);
+	CU_ASSERT_FATAL(q0 != NULL && q1 != NULL && q2 != NULL);
+	CU_ASSERT(nvme_ctrlr_free_io_qpair(q1) == 0);
+
+	/* Only the two live qpairs are re-created after a reset. */
+	g_num_created_io_cqs = 0;
+	g_num_created_io_sqs = 0;
+	CU_ASSERT(nvme_ctrlr_create_qpairs(&ctrlr) == 0);
+	CU_ASSERT(g_num_created_io_cqs == 2);
+	CU_ASSERT(g_num_created_io_sqs == 2);
+
+	cleanup_io_qpairs(&ctrlr);
+}
+
+static void
+ut_timeout_cb(void *cb_arg, struct nvme_controller *ctrlr)
+{
+	(*(uint32_t *)cb_arg)++;
+}
+
+static void
+test_nvme_ctrlr_timeout_callback(void)
+{
+	struct nvme_controller	ctrlr;
+	struct nvme_registers	regs;
+	uint32_t		num_timeouts = 0;
+
+	prepare_io_qpairs(&ctrlr, &regs, 1);
+
+	/* An escalation before a callback is registered is only dropped. */
+	ctrlr.timeout_escalated = true;
+	nvme_ctrlr_process_admin_completions(&ctrlr);
+	CU_ASSERT(ctrlr.timeout_escalated == false);
+
+	nvme_ctrlr_register_timeout_callback(&ctrlr, ut_timeout_cb, &num_timeouts);
+	nvme_ctrlr_process_admin_completions(&ctrlr);
+	CU_ASSERT(num_timeouts == 0);
+
+	/* An escalation is reported once, then cleared. */
+	ctrlr.timeout_escalated = true;
+	nvme_ctrlr_process_admin_completions(&ctrlr);
+	CU_ASSERT(num_timeouts == 1);
+	CU_ASSERT(ctrlr.timeout_escalated == false);
+	nvme_ctrlr_process_admin_completions(&ctrlr);
+	CU_ASSERT(num_timeouts == 1);
+
+	cleanup_io_qpairs(&ctrlr);
+}
+
+static void *
+alloc_qpair_thread(void *arg)
+{
+	struct nvme_controller *ctrlr = arg;
+
+	/*
+	 * Try to synchronize the nvme_ctrlr_alloc_io_qpair() calls
+	 *  as much as possible to ensure the mutex locking is tested
+	 *  correctly.
+	 */
+	while (sync_start == 0)
+		;
+
+	if (nvme_ctrlr_alloc_io_qpair(ctrlr, NULL) != NULL) {
+		__sync_fetch_and_add(&threads_pass, 1);
+	} else {
+		__sync_fetch_and_add(&threads_fail, 1);
+	}
+
+	pthread_exit(NULL);
+}
+
+static void
+test_nvme_ctrlr_alloc_io_qpair_threads(void)
+{
+	struct nvme_controller	ctrlr;
+	struct nvme_registers	regs;
+	int			num_threads = 16;
+	int			i;
+	pthread_t		td[16];
+
+	/*
+	 * Start 16 threads, but only simulate a maximum of 12 I/O
+	 *  queues.  12 threads should be able to allocate a qpair,
+	 *  while the other 4 should fail.
+	 */
+	prepare_io_qpairs(&ctrlr, &regs, 12);
+	sync_start = 0;
+	threads_pass = 0;
+	threads_fail = 0;
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_create(&td[i], NULL, alloc_qpair_thread, &ctrlr);
+	}
+
+	sync_start = 1;
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(td[i], NULL);
+	}
+
+	CU_ASSERT(threads_pass == 12);
+	CU_ASSERT(threads_fail == 4);
+	CU_ASSERT(nvme_ctrlr_get_free_io_qid(&ctrlr) == 0);
+
+	cleanup_io_qpairs(&ctrlr);
+}
+
 int main(int argc, char **argv)
 {
 	CU_pSuite	suite = NULL;
@@ -191,6 +1017,25 @@ int main(int argc, char **argv)
 
 	if (
 		CU_add_test(suite, "test nvme_ctrlr function nvme_ctrlr_fail", test_nvme_ctrlr_fail) == NULL
+		|| CU_add_test(suite, "test nvme_ctrlr I/O queue options", test_nvme_ctrlr_io_queue_opts) == NULL
+		|| CU_add_test(suite, "test nvme_ctrlr_alloc_io_qpair", test_nvme_ctrlr_alloc_io_qpair) == NULL
+		|| CU_add_test(suite, "test nvme_ctrlr_alloc_io_qpair from many threads",
+			       test_nvme_ctrlr_alloc_io_qpair_threads) == NULL
+		|| CU_add_test(suite, "test nvme_ctrlr_alloc_io_qpair with a shared CQ",
+			       test_nvme_ctrlr_alloc_shared_cq_qpair) == NULL
+		|| CU_add_test(suite, "test nvme_ctrlr weighted round robin", test_nvme_ctrlr_wrr) == NULL
+		|| CU_add_test(suite, "test nvme_ctrlr alloc interrupt qpair",
+			       test_nvme_ctrlr_alloc_interrupt_qpair) == NULL
+		|| CU_add_test(suite, "test nvme_ctrlr alloc proxied qpair",
+			       test_nvme_ctrlr_alloc_proxied_qpair) == NULL
+		|| CU_add_test(suite, "test nvme_ctrlr I/O qpair statistics",
+			       test_nvme_ctrlr_io_qpair_stats) == NULL
+		|| CU_add_test(suite, "test nvme_ctrlr I/O latency histograms",
+			       test_nvme_ctrlr_io_latency_histogram) == NULL
+		|| CU_add_test(suite, "test nvme_ctrlr I/O qpair re-creation",
+			       test_nvme_ctrlr_recreate_io_qpairs) == NULL
+		|| CU_add_test(suite, "test nvme_ctrlr timeout callback",
+			       test_nvme_ctrlr_timeout_callback) == NULL
 	) {
 		CU_cleanup_registry();
 		return CU_get_error();
@@ -50,6 +50,11 @@ uint8_t get_feature = 1;
 uint32_t get_feature_cdw11 = 1;
 uint16_t abort_cid = 1;
 uint16_t abort_sqid = 1;
+uint64_t shadow_doorbell_bus_addr = 0x1000;
+uint64_t eventidx_bus_addr = 0x2000;
+uint16_t delete_qid = 3;
+uint16_t create_sq_qid = 5;
+uint16_t create_sq_cqid = 4;
 
 
 typedef void (*verify_request_fn_t)(struct nvme_request *req);
@@ -111,6 +116,50 @@ static void verify_abort_cmd(struct nvme_request *req)
 	CU_ASSERT(req->cmd.cdw10 == (((uint32_t)abort_cid << 16) | abort_sqid));
 }
 
+static void verify_doorbell_buffer_config_cmd(struct nvme_request *req)
+{
+	CU_ASSERT(req->cmd.opc == NVME_OPC_DOORBELL_BUFFER_CONFIG);
+	CU_ASSERT(req->cmd.dptr.prp.prp1 == shadow_doorbell_bus_addr);
+	CU_ASSERT(req->cmd.dptr.prp.prp2 == eventidx_bus_addr);
+}
+
+static void verify_delete_io_cq_cmd(struct nvme_request *req)
+{
+	CU_ASSERT(req->cmd.opc == NVME_OPC_DELETE_IO_CQ);
+	CU_ASSERT(req->cmd.cdw10 == delete_qid);
+}
+
+static void verify_delete_io_sq_cmd(struct nvme_request *req)
+{
+	CU_ASSERT(req->cmd.opc == NVME_OPC_DELETE_IO_SQ);
+	CU_ASSERT(req->cmd.cdw10 == delete_qid);
+}
+
+static void verify_create_io_cq_cmd(struct nvme_request *req)
+{
+	CU_ASSERT(req->cmd.opc == NVME_OPC_CREATE_IO_CQ);
+	CU_ASSERT(req->cmd.cdw10 == ((255u << 16) | create_sq_cqid));
+	/* IV = qid, IEN and PC */
+	CU_ASSERT(req->cmd.cdw11 == (((uint32_t)create_sq_cqid << 16) | 0x2 | 0x1));
+}
+
+static void verify_create_io_sq_cmd(struct nvme_request *req)
+{
+	CU_ASSERT(req->cmd.opc == NVME_OPC_CREATE_IO_SQ);
+	CU_ASSERT((req->cmd.cdw10 & 0xFFFF) == create_sq_qid);
+	CU_ASSERT((req->cmd.cdw10 >> 16) == 255);
+	/* CQID, QPRIO = high, PC = 1 */
+	CU_ASSERT(req->cmd.cdw11 == (((uint32_t)create_sq_cqid << 16) | (NVME_QPRIO_HIGH << 1) | 0x1));
+}
+
+static void verify_set_arbitration_cmd(struct nvme_request *req)
+{
+	CU_ASSERT(req->cmd.opc == NVME_OPC_SET_FEATURES);
+	CU_ASSERT(req->cmd.cdw10 == NVME_FEAT_ARBITRATION);
+	/* AB = 3, LPW = 1, MPW = 3, HPW = 7 */
+	CU_ASSERT(req->cmd.cdw11 == 0x07030103);
+}
+
 static void verify_io_raw_cmd(struct nvme_request *req)
 {
 	struct nvme_command	command = {};
@@ -142,8 +191,7 @@ nvme_allocate_request(void *payload, uint32_t payload_size,
 }
 
 void
-nvme_ctrlr_submit_io_request(struct nvme_controller *ctrlr,
-			     struct nvme_request *req)
+nvme_qpair_submit_request(struct nvme_qpair *qpair, struct nvme_request *req)
 {
 	verify_fn(req);
 	/* stop analyzer from thinking stack variable addresses are stored in a global */
@@ -227,15 +275,88 @@ test_abort_cmd(void)
 	nvme_ctrlr_cmd_abort(&ctrlr, abort_cid, abort_sqid, NULL, NULL);
 }
 
+static void
+test_doorbell_buffer_config_cmd(void)
+{
+	struct nvme_controller	ctrlr = {};
+
+	verify_fn = verify_doorbell_buffer_config_cmd;
+
+	nvme_ctrlr_cmd_doorbell_buffer_config(&ctrlr, shadow_doorbell_bus_addr, eventidx_bus_addr,
+					      NULL, NULL);
+}
+
+static void
+test_delete_io_queue_cmds(void)
+{
+	struct nvme_controller	ctrlr = {};
+	struct nvme_qpair	qpair = {};
+
+	qpair.id = delete_qid;
+
+	verify_fn = verify_delete_io_sq_cmd;
+	nvme_ctrlr_cmd_delete_io_sq(&ctrlr, &qpair, NULL, NULL);
+
+	verify_fn = verify_delete_io_cq_cmd;
+	nvme_ctrlr_cmd_delete_io_cq(&ctrlr, &qpair, NULL, NULL);
+}
+
+static void
+test_create_io_cq_cmd(void)
+{
+	struct nvme_controller	ctrlr = {};
+	struct nvme_qpair	qpair = {};
+
+	qpair.id = create_sq_cqid;
+	qpair.num_entries = 256;
+	qpair.intr_fd = 3;
+
+	verify_fn = verify_create_io_cq_cmd;
+	nvme_ctrlr_cmd_create_io_cq(&ctrlr, &qpair, NULL, NULL);
+}
+
+static void
+test_create_io_sq_cmd(void)
+{
+	struct nvme_controller	ctrlr = {};
+	struct nvme_qpair	cq_qpair = {}, qpair = {};
+
+	cq_qpair.id = create_sq_cqid;
+	qpair.id = create_sq_qid;
+	qpair.num_entries = 256;
+	qpair.cq_qpair = &cq_qpair;
+	qpair.qprio = NVME_QPRIO_HIGH;
+
+	verify_fn = verify_create_io_sq_cmd;
+	nvme_ctrlr_cmd_create_io_sq(&ctrlr, &qpair, NULL, NULL);
+}
+
+static void
+test_set_arbitration_cmd(void)
+{
+	struct nvme_controller		ctrlr = {};
+	union nvme_feat_arbitration	arb;
+
+	arb.raw = 0;
+	arb.bits.ab = 3;
+	arb.bits.lpw = 1;
+	arb.bits.mpw = 3;
+	arb.bits.hpw = 7;
+
+	verify_fn = verify_set_arbitration_cmd;
+	nvme_ctrlr_cmd_set_arbitration(&ctrlr, arb, NULL, NULL);
+}
+
 static void
 test_io_raw_cmd(void)
 {
 	struct nvme_controller	ctrlr = {};
+	struct nvme_qpair	qpair = {};
 	struct nvme_command	cmd = {};
 
 	verify_fn = verify_io_raw_cmd;
 
-	nvme_ctrlr_cmd_io_raw(&ctrlr, &cmd, NULL, 1, NULL, NULL);
+	nvme_ctrlr_cmd_io_raw(&ctrlr, &qpair, &cmd, NULL, 1, NULL, NULL);
 }
 
 int main(int argc, char **argv)
@@ -260,6 +381,12 @@ int main(int argc, char **argv)
 		|| CU_add_test(suite, "test ctrlr cmd set_feature", test_set_feature_cmd) == NULL
 		|| CU_add_test(suite, "test ctrlr cmd get_feature", test_get_feature_cmd) == NULL
 		|| CU_add_test(suite, "test ctrlr cmd abort_cmd", test_abort_cmd) == NULL
+		|| CU_add_test(suite, "test ctrlr cmd doorbell_buffer_config_cmd",
+			       test_doorbell_buffer_config_cmd) == NULL
+		|| CU_add_test(suite, "test ctrlr cmd delete_io_sq/cq", test_delete_io_queue_cmds) == NULL
+		|| CU_add_test(suite, "test ctrlr cmd create_io_cq", test_create_io_cq_cmd) == NULL
+		|| CU_add_test(suite, "test ctrlr cmd create_io_sq", test_create_io_sq_cmd) == NULL
+		|| CU_add_test(suite, "test ctrlr cmd set_arbitration", test_set_arbitration_cmd) == NULL
 		|| CU_add_test(suite, "test ctrlr cmd io_raw_cmd", test_io_raw_cmd) == NULL
 	) {
 		CU_cleanup_registry();
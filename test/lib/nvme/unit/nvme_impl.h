@@ -37,13 +37,23 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <time.h>
 
 static inline void *
 nvme_malloc(const char *tag, size_t size, unsigned align, uint64_t *phys_addr)
 {
-	void *buf = calloc(1, size);
+	void *buf = NULL;
+
+	if (align < sizeof(void *)) {
+		align = sizeof(void *);
+	}
+	if (posix_memalign(&buf, align, size) != 0) {
+		return NULL;
+	}
+	memset(buf, 0, size);
 	*phys_addr = (uint64_t)buf;
 	return buf;
 }
@@ -75,6 +85,36 @@ do					\
 	while (0)
 
 #define nvme_dealloc_request(buf)	free(buf)
+
+static inline int
+nvme_ut_alloc_bulk(void **bufs, unsigned count, size_t size)
+{
+	unsigned i;
+
+	for (i = 0; i < count; i++) {
+		bufs[i] = malloc(size);
+		if (bufs[i] == NULL) {
+			while (i > 0) {
+				free(bufs[--i]);
+			}
+			return -1;
+		}
+	}
+	return 0;
+}
+
+#define nvme_alloc_request_bulk(bufs, count)	\
+	nvme_ut_alloc_bulk(bufs, count, sizeof(struct nvme_request))
+
+static inline void
+nvme_dealloc_request_bulk(void **bufs, unsigned count)
+{
+	unsigned i;
+
+	for (i = 0; i < count; i++) {
+		free(bufs[i]);
+	}
+}
 #define nvme_pcicfg_read32(handle, var, offset)		do { *(var) = 0xFFFFFFFFu; } while (0)
 #define nvme_pcicfg_write32(handle, var, offset)	do { (void)(var); } while (0)
 
@@ -116,6 +156,17 @@ nvme_mutex_init_recursive(nvme_mutex_t *mtx)
 	return rc;
 }
 
+static inline uint64_t
+nvme_get_tsc(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#define nvme_get_tsc_hz()		1000000000ULL
+
 /**
  * Copy a struct nvme_command from one memory location to another.
  */
@@ -38,6 +38,7 @@
 char outbuf[OUTBUF_SIZE];
 
 struct nvme_request *g_request = NULL;
+struct nvme_qpair *g_qpair = NULL;
 
 uint64_t nvme_vtophys(void *buf)
 {
@@ -51,7 +52,8 @@ nvme_ctrlr_hw_reset(struct nvme_controller *ctrlr)
 }
 
 int
-nvme_ctrlr_construct(struct nvme_controller *ctrlr, void *devhandle)
+nvme_ctrlr_construct(struct nvme_controller *ctrlr,
+		     const struct nvme_ctrlr_opts *opts, void *devhandle)
 {
 	return 0;
 }
@@ -80,10 +82,10 @@ nvme_ns_get_max_io_xfer_size(struct nvme_namespace *ns)
 }
 
 void
-nvme_ctrlr_submit_io_request(struct nvme_controller *ctrlr,
-			     struct nvme_request *req)
+nvme_qpair_submit_request(struct nvme_qpair *qpair, struct nvme_request *req)
 {
 	g_request = req;
+	g_qpair = qpair;
 }
 
 static void
@@ -92,6 +94,7 @@ prepare_for_test(struct nvme_namespace *ns, struct nvme_controller *ctrlr,
 		 uint32_t stripe_size)
 {
 	ctrlr->max_xfer_size = max_xfer_size;
+	ctrlr->opts.io_queue_requests = NVME_IO_TRACKERS;
 	memset(ns, 0, sizeof(*ns));
 	ns->ctrlr = ctrlr;
 	ns->sector_size = sector_size;
@@ -100,6 +103,7 @@ prepare_for_test(struct nvme_namespace *ns, struct nvme_controller *ctrlr,
 	ns->sectors_per_stripe = ns->stripe_size / ns->sector_size;
 
 	g_request = NULL;
+	g_qpair = NULL;
 }
 
 static void
@@ -115,6 +119,7 @@ split_test(void)
 {
 	struct nvme_namespace	ns;
 	struct nvme_controller	ctrlr;
+	struct nvme_qpair	qpair;
 	void			*payload;
 	uint64_t		lba, cmd_lba;
 	uint32_t		lba_count, cmd_lba_count;
@@ -125,7 +130,7 @@ split_test(void)
 	lba = 0;
 	lba_count = 1;
 
-	rc = nvme_ns_cmd_read(&ns, payload, lba, lba_count, NULL, NULL);
+	rc = nvme_ns_cmd_read(&ns, &qpair, payload, lba, lba_count, NULL, NULL, 0);
 
 	CU_ASSERT(rc == 0);
 	CU_ASSERT_FATAL(g_request != NULL);
@@ -144,6 +149,7 @@ split_test2(void)
 {
 	struct nvme_namespace	ns;
 	struct nvme_controller	ctrlr;
+	struct nvme_qpair	qpair;
 	struct nvme_request	*child;
 	void			*payload;
 	uint64_t		lba, cmd_lba;
@@ -161,15 +167,15 @@ split_test2(void)
 	lba = 0;
 	lba_count = (256 * 1024) / 512;
 
-	rc = nvme_ns_cmd_read(&ns, payload, lba, lba_count, NULL, NULL);
+	rc = nvme_ns_cmd_read(&ns, &qpair, payload, lba, lba_count, NULL, NULL, 0);
 
 	CU_ASSERT(rc == 0);
 	CU_ASSERT_FATAL(g_request != NULL);
 
 	CU_ASSERT(g_request->num_children == 2);
 
-	child = TAILQ_FIRST(&g_request->children);
-	TAILQ_REMOVE(&g_request->children, child, child_tailq);
+	child = STAILQ_FIRST(&g_request->children);
+	STAILQ_REMOVE_HEAD(&g_request->children, child_stailq);
 	nvme_cmd_interpret_rw(&child->cmd, &cmd_lba, &cmd_lba_count);
 	CU_ASSERT(child->num_children == 0);
 	CU_ASSERT(child->payload_size == 128 * 1024);
@@ -177,8 +183,8 @@ split_test2(void)
 	CU_ASSERT(cmd_lba_count == 256); /* 256 * 512 byte blocks = 128 KB */
 	nvme_free_request(child);
 
-	child = TAILQ_FIRST(&g_request->children);
-	TAILQ_REMOVE(&g_request->children, child, child_tailq);
+	child = STAILQ_FIRST(&g_request->children);
+	STAILQ_REMOVE_HEAD(&g_request->children, child_stailq);
 	nvme_cmd_interpret_rw(&child->cmd, &cmd_lba, &cmd_lba_count);
 	CU_ASSERT(child->num_children == 0);
 	CU_ASSERT(child->payload_size == 128 * 1024);
@@ -186,7 +192,7 @@ split_test2(void)
 	CU_ASSERT(cmd_lba_count == 256);
 	nvme_free_request(child);
 
-	CU_ASSERT(TAILQ_EMPTY(&g_request->children));
+	CU_ASSERT(STAILQ_EMPTY(&g_request->children));
 
 	free(payload);
 	nvme_free_request(g_request);
@@ -197,6 +203,7 @@ split_test3(void)
 {
 	struct nvme_namespace	ns;
 	struct nvme_controller	ctrlr;
+	struct nvme_qpair	qpair;
 	struct nvme_request	*child;
 	void			*payload;
 	uint64_t		lba, cmd_lba;
@@ -216,15 +223,15 @@ split_test3(void)
 	lba = 10; /* Start at an LBA that isn't aligned to the stripe size */
 	lba_count = (256 * 1024) / 512;
 
-	rc = nvme_ns_cmd_read(&ns, payload, lba, lba_count, NULL, NULL);
+	rc = nvme_ns_cmd_read(&ns, &qpair, payload, lba, lba_count, NULL, NULL, 0);
 
 	CU_ASSERT(rc == 0);
 	CU_ASSERT_FATAL(g_request != NULL);
 
 	CU_ASSERT_FATAL(g_request->num_children == 2);
 
-	child = TAILQ_FIRST(&g_request->children);
-	TAILQ_REMOVE(&g_request->children, child, child_tailq);
+	child = STAILQ_FIRST(&g_request->children);
+	STAILQ_REMOVE_HEAD(&g_request->children, child_stailq);
 	nvme_cmd_interpret_rw(&child->cmd, &cmd_lba, &cmd_lba_count);
 	CU_ASSERT(child->num_children == 0);
 	CU_ASSERT(child->payload_size == 128 * 1024);
@@ -232,8 +239,8 @@ split_test3(void)
 	CU_ASSERT(cmd_lba_count == 256);
 	nvme_free_request(child);
 
-	child = TAILQ_FIRST(&g_request->children);
-	TAILQ_REMOVE(&g_request->children, child, child_tailq);
+	child = STAILQ_FIRST(&g_request->children);
+	STAILQ_REMOVE_HEAD(&g_request->children, child_stailq);
 	nvme_cmd_interpret_rw(&child->cmd, &cmd_lba, &cmd_lba_count);
 	CU_ASSERT(child->num_children == 0);
 	CU_ASSERT(child->payload_size == 128 * 1024);
@@ -241,7 +248,7 @@ split_test3(void)
 	CU_ASSERT(cmd_lba_count == 256);
 	nvme_free_request(child);
 
-	CU_ASSERT(TAILQ_EMPTY(&g_request->children));
+	CU_ASSERT(STAILQ_EMPTY(&g_request->children));
 
 	free(payload);
 	nvme_free_request(g_request);
@@ -252,6 +259,7 @@ split_test4(void)
 {
 	struct nvme_namespace	ns;
 	struct nvme_controller	ctrlr;
+	struct nvme_qpair	qpair;
 	struct nvme_request	*child;
 	void			*payload;
 	uint64_t		lba, cmd_lba;
@@ -273,15 +281,15 @@ split_test4(void)
 	lba = 10; /* Start at an LBA that isn't aligned to the stripe size */
 	lba_count = (256 * 1024) / 512;
 
-	rc = nvme_ns_cmd_read(&ns, payload, lba, lba_count, NULL, NULL);
+	rc = nvme_ns_cmd_read(&ns, &qpair, payload, lba, lba_count, NULL, NULL, 0);
 
 	CU_ASSERT(rc == 0);
 	CU_ASSERT_FATAL(g_request != NULL);
 
 	CU_ASSERT_FATAL(g_request->num_children == 3);
 
-	child = TAILQ_FIRST(&g_request->children);
-	TAILQ_REMOVE(&g_request->children, child, child_tailq);
+	child = STAILQ_FIRST(&g_request->children);
+	STAILQ_REMOVE_HEAD(&g_request->children, child_stailq);
 	nvme_cmd_interpret_rw(&child->cmd, &cmd_lba, &cmd_lba_count);
 	CU_ASSERT(child->num_children == 0);
 	CU_ASSERT(child->payload_size == (256 - 10) * 512);
@@ -289,8 +297,8 @@ split_test4(void)
 	CU_ASSERT(cmd_lba_count == 256 - 10);
 	nvme_free_request(child);
 
-	child = TAILQ_FIRST(&g_request->children);
-	TAILQ_REMOVE(&g_request->children, child, child_tailq);
+	child = STAILQ_FIRST(&g_request->children);
+	STAILQ_REMOVE_HEAD(&g_request->children, child_stailq);
 	nvme_cmd_interpret_rw(&child->cmd, &cmd_lba, &cmd_lba_count);
 	CU_ASSERT(child->num_children == 0);
 	CU_ASSERT(child->payload_size == 128 * 1024);
@@ -298,8 +306,8 @@ split_test4(void)
 	CU_ASSERT(cmd_lba_count == 256);
 	nvme_free_request(child);
 
-	child = TAILQ_FIRST(&g_request->children);
-	TAILQ_REMOVE(&g_request->children, child, child_tailq);
+	child = STAILQ_FIRST(&g_request->children);
+	STAILQ_REMOVE_HEAD(&g_request->children, child_stailq);
 	nvme_cmd_interpret_rw(&child->cmd, &cmd_lba, &cmd_lba_count);
 	CU_ASSERT(child->num_children == 0);
 	CU_ASSERT(child->payload_size == 10 * 512);
@@ -307,24 +315,339 @@ split_test4(void)
 	CU_ASSERT(cmd_lba_count == 10);
 	nvme_free_request(child);
 
-	CU_ASSERT(TAILQ_EMPTY(&g_request->children));
+	CU_ASSERT(STAILQ_EMPTY(&g_request->children));
 
 	free(payload);
 	nvme_free_request(g_request);
 }
 
+static void
+split_test5(void)
+{
+	struct nvme_namespace	ns;
+	struct nvme_controller	ctrlr;
+	struct nvme_qpair	qpair;
+	struct nvme_request	*child;
+	void			*payload;
+	uint64_t		lba, cmd_lba;
+	uint32_t		lba_count, cmd_lba_count;
+	uint32_t		i;
+	int			rc;
+	const uint64_t		expected_lba[3] = { 10, 266, 512 };
+	const uint32_t		expected_lba_count[3] = { 256, 246, 10 };
+
+	/*
+	 * Controller has max xfer of 128 KB (256 blocks) and a stripe size of 256 KB.
+	 * Submit an I/O of 256 KB starting at LBA 10.  The part before the stripe
+	 * boundary at LBA 512 is larger than the max xfer size, so it is cut again,
+	 * giving three children of the original request (none nested):
+	 *  1) LBA = 10, count = 256 blocks (max xfer size)
+	 *  2) LBA = 266, count = 246 blocks (up to the stripe boundary)
+	 *  3) LBA = 512, count = 10 blocks (finish off the remaining I/O size)
+	 */
+
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 256 * 1024);
+	payload = malloc(256 * 1024);
+	lba = 10;
+	lba_count = (256 * 1024) / 512;
+
+	rc = nvme_ns_cmd_read(&ns, &qpair, payload, lba, lba_count, NULL, NULL, 0);
+
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_request != NULL);
+
+	CU_ASSERT_FATAL(g_request->num_children == 3);
+
+	for (i = 0; i < 3; i++) {
+		child = STAILQ_FIRST(&g_request->children);
+		CU_ASSERT_FATAL(child != NULL);
+		STAILQ_REMOVE_HEAD(&g_request->children, child_stailq);
+		nvme_cmd_interpret_rw(&child->cmd, &cmd_lba, &cmd_lba_count);
+		CU_ASSERT(child->num_children == 0);
+		CU_ASSERT(child->parent == g_request);
+		CU_ASSERT(child->payload_size == expected_lba_count[i] * 512);
+		CU_ASSERT(cmd_lba == expected_lba[i]);
+		CU_ASSERT(cmd_lba_count == expected_lba_count[i]);
+		nvme_free_request(child);
+	}
+
+	CU_ASSERT(STAILQ_EMPTY(&g_request->children));
+
+	free(payload);
+	nvme_free_request(g_request);
+}
+
+static void
+ut_free_split_request(struct nvme_request *req)
+{
+	struct nvme_request *child;
+
+	while (req->num_children != 0) {
+		child = STAILQ_FIRST(&req->children);
+		STAILQ_REMOVE_HEAD(&req->children, child_stailq);
+		req->num_children--;
+		nvme_free_request(child);
+	}
+	nvme_free_request(req);
+}
+
+static void
+test_nvme_ns_cmd_write_zeroes(void)
+{
+	struct nvme_namespace	ns;
+	struct nvme_controller	ctrlr;
+	struct nvme_qpair	qpair;
+	struct nvme_request	*child;
+	uint64_t		cmd_lba;
+	uint32_t		cmd_lba_count;
+	char			zero_buf[512];
+	int			rc;
+
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	ns.flags = NVME_NS_WRITE_ZEROES_SUPPORTED;
+
+	rc = nvme_ns_cmd_write_zeroes(&ns, &qpair, 0, 0, NULL, NULL);
+	CU_ASSERT(rc == EINVAL);
+
+	/* Supported: one command with no data, not limited by the max xfer size. */
+	rc = nvme_ns_cmd_write_zeroes(&ns, &qpair, 8, 1024, NULL, NULL);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_request != NULL);
+	CU_ASSERT(g_request->num_children == 0);
+	CU_ASSERT(g_request->cmd.opc == NVME_OPC_WRITE_ZEROES);
+	CU_ASSERT(g_request->payload_size == 0);
+	nvme_cmd_interpret_rw(&g_request->cmd, &cmd_lba, &cmd_lba_count);
+	CU_ASSERT(cmd_lba == 8);
+	CU_ASSERT(cmd_lba_count == 1024);
+	nvme_free_request(g_request);
+
+	/* Split at the 16-bit block count limit. */
+	rc = nvme_ns_cmd_write_zeroes(&ns, &qpair, 0, 65536 + 10, NULL, NULL);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_request != NULL);
+	CU_ASSERT_FATAL(g_request->num_children == 2);
+	child = STAILQ_FIRST(&g_request->children);
+	nvme_cmd_interpret_rw(&child->cmd, &cmd_lba, &cmd_lba_count);
+	CU_ASSERT(child->cmd.opc == NVME_OPC_WRITE_ZEROES);
+	CU_ASSERT(cmd_lba == 0);
+	CU_ASSERT(cmd_lba_count == 65536);
+	child = STAILQ_NEXT(child, child_stailq);
+	nvme_cmd_interpret_rw(&child->cmd, &cmd_lba, &cmd_lba_count);
+	CU_ASSERT(cmd_lba == 65536);
+	CU_ASSERT(cmd_lba_count == 10);
+	ut_free_split_request(g_request);
+
+	/* Split at stripe boundaries. */
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 128 * 1024);
+	ns.flags = NVME_NS_WRITE_ZEROES_SUPPORTED;
+	rc = nvme_ns_cmd_write_zeroes(&ns, &qpair, 128, 256, NULL, NULL);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_request != NULL);
+	CU_ASSERT_FATAL(g_request->num_children == 2);
+	child = STAILQ_FIRST(&g_request->children);
+	nvme_cmd_interpret_rw(&child->cmd, &cmd_lba, &cmd_lba_count);
+	CU_ASSERT(cmd_lba == 128);
+	CU_ASSERT(cmd_lba_count == 128);
+	CU_ASSERT(child->payload_size == 0);
+	ut_free_split_request(g_request);
+
+	/* Not supported: writes from the shared buffer of zeroes, one per max xfer. */
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	ctrlr.zero_buf = NULL;
+	rc = nvme_ns_cmd_write_zeroes(&ns, &qpair, 0, 8, NULL, NULL);
+	CU_ASSERT(rc == ENOMEM);
+
+	ctrlr.zero_buf = zero_buf;
+	rc = nvme_ns_cmd_write_zeroes(&ns, &qpair, 0, 512, NULL, NULL);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_request != NULL);
+	CU_ASSERT_FATAL(g_request->num_children == 2);
+	STAILQ_FOREACH(child, &g_request->children, child_stailq) {
+		CU_ASSERT(child->cmd.opc == NVME_OPC_WRITE);
+		CU_ASSERT(child->u.payload == zero_buf);
+		CU_ASSERT(child->payload_size == 128 * 1024);
+	}
+	ut_free_split_request(g_request);
+}
+
+static void
+test_nvme_ns_cmd_verify(void)
+{
+	struct nvme_namespace	ns;
+	struct nvme_controller	ctrlr;
+	struct nvme_qpair	qpair;
+	uint64_t		cmd_lba;
+	uint32_t		cmd_lba_count;
+	char			discard_buf[512];
+	int			rc;
+
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+	ns.flags = NVME_NS_VERIFY_SUPPORTED;
+
+	rc = nvme_ns_cmd_verify(&ns, &qpair, 0, 0, NULL, NULL);
+	CU_ASSERT(rc == EINVAL);
+
+	rc = nvme_ns_cmd_verify(&ns, &qpair, 16, 4096, NULL, NULL);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_request != NULL);
+	CU_ASSERT(g_request->num_children == 0);
+	CU_ASSERT(g_request->cmd.opc == NVME_OPC_VERIFY);
+	CU_ASSERT(g_request->cmd.nsid == ns.id);
+	CU_ASSERT(g_request->payload_size == 0);
+	nvme_cmd_interpret_rw(&g_request->cmd, &cmd_lba, &cmd_lba_count);
+	CU_ASSERT(cmd_lba == 16);
+	CU_ASSERT(cmd_lba_count == 4096);
+	nvme_free_request(g_request);
+
+	/* Not supported: reads into the discard buffer. */
+	ns.flags = 0;
+	ctrlr.discard_buf = discard_buf;
+	rc = nvme_ns_cmd_verify(&ns, &qpair, 16, 8, NULL, NULL);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_request != NULL);
+	CU_ASSERT(g_request->cmd.opc == NVME_OPC_READ);
+	CU_ASSERT(g_request->u.payload == discard_buf);
+	CU_ASSERT(g_request->payload_size == 8 * 512);
+	nvme_free_request(g_request);
+}
+
+static void
+test_nvme_ns_cmd_compare_and_write(void)
+{
+	struct nvme_namespace	ns;
+	struct nvme_controller	ctrlr;
+	struct nvme_qpair	qpair;
+	struct nvme_request	*cmp, *write;
+	char			cmp_buf[512 * 8], write_buf[512 * 8];
+	uint64_t		cmd_lba;
+	uint32_t		cmd_lba_count;
+	int			rc;
+
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 128 * 1024);
+
+	rc = nvme_ns_cmd_compare(&ns, &qpair, cmp_buf, 8, 8, NULL, NULL);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_request != NULL);
+	CU_ASSERT(g_request->num_children == 0);
+	CU_ASSERT(g_request->cmd.opc == NVME_OPC_COMPARE);
+	CU_ASSERT(g_request->cmd.fuse == NVME_FUSE_NORMAL);
+	nvme_free_request(g_request);
+	g_request = NULL;
+
+	/* The pair is never split. */
+	rc = nvme_ns_cmd_compare_and_write(&ns, &qpair, cmp_buf, write_buf, 0, 0, NULL, NULL);
+	CU_ASSERT(rc == EINVAL);
+	rc = nvme_ns_cmd_compare_and_write(&ns, &qpair, cmp_buf, write_buf, 0, 257, NULL, NULL);
+	CU_ASSERT(rc == EINVAL);
+	rc = nvme_ns_cmd_compare_and_write(&ns, &qpair, cmp_buf, write_buf, 252, 8, NULL, NULL);
+	CU_ASSERT(rc == EINVAL);
+	CU_ASSERT(g_request == NULL);
+
+	/* A qpair with a single tracker could never start the pair. */
+	ctrlr.opts.io_queue_requests = 1;
+	rc = nvme_ns_cmd_compare_and_write(&ns, &qpair, cmp_buf, write_buf, 16, 8, NULL, NULL);
+	CU_ASSERT(rc == EINVAL);
+	CU_ASSERT(g_request == NULL);
+	ctrlr.opts.io_queue_requests = NVME_IO_TRACKERS;
+
+	rc = nvme_ns_cmd_compare_and_write(&ns, &qpair, cmp_buf, write_buf, 16, 8, NULL, NULL);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_request != NULL);
+	CU_ASSERT_FATAL(g_request->num_children == 2);
+	CU_ASSERT(nvme_request_is_fused(g_request));
+	cmp = STAILQ_FIRST(&g_request->children);
+	write = STAILQ_NEXT(cmp, child_stailq);
+	CU_ASSERT(cmp->cmd.opc == NVME_OPC_COMPARE);
+	CU_ASSERT(cmp->cmd.fuse == NVME_FUSE_FIRST);
+	CU_ASSERT(cmp->u.payload == cmp_buf);
+	CU_ASSERT(write->cmd.opc == NVME_OPC_WRITE);
+	CU_ASSERT(write->cmd.fuse == NVME_FUSE_SECOND);
+	CU_ASSERT(write->u.payload == write_buf);
+	nvme_cmd_interpret_rw(&write->cmd, &cmd_lba, &cmd_lba_count);
+	CU_ASSERT(cmd_lba == 16);
+	CU_ASSERT(cmd_lba_count == 8);
+	ut_free_split_request(g_request);
+}
+
+static void
+test_nvme_ns_cmd_io_flags(void)
+{
+	struct nvme_namespace	ns;
+	struct nvme_controller	ctrlr;
+	struct nvme_qpair	qpair;
+	struct nvme_request	*child;
+	uint64_t		cmd_lba;
+	uint32_t		cmd_lba_count, io_flags;
+	void			*payload;
+	int			rc;
+
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 128 * 1024);
+	payload = malloc(256 * 512);
+
+	io_flags = NVME_IO_FLAGS_FORCE_UNIT_ACCESS | NVME_IO_FLAGS_LIMITED_RETRY |
+		   NVME_IO_FLAGS_ACCESS_FREQUENCY(NVME_DSM_FREQ_INFREQ_READ_FREQ_WRITE) |
+		   NVME_IO_FLAGS_ACCESS_LATENCY(NVME_DSM_LATENCY_LOW) |
+		   NVME_IO_FLAGS_SEQUENTIAL;
+	rc = nvme_ns_cmd_write(&ns, &qpair, payload, 0, 8, NULL, NULL, io_flags);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_request != NULL);
+	CU_ASSERT(g_request->cmd.cdw12 == (7 | NVME_RW_FORCE_UNIT_ACCESS | NVME_RW_LIMITED_RETRY));
+	CU_ASSERT(g_request->cmd.cdw13 == (0x3 | (0x3 << 4) | NVME_DSM_SEQUENTIAL_REQUEST));
+	nvme_cmd_interpret_rw(&g_request->cmd, &cmd_lba, &cmd_lba_count);
+	CU_ASSERT(cmd_lba_count == 8);
+	nvme_free_request(g_request);
+
+	/* Every command of a split I/O carries the flags. */
+	rc = nvme_ns_cmd_read(&ns, &qpair, payload, 128, 256, NULL, NULL,
+			      NVME_IO_FLAGS_FORCE_UNIT_ACCESS | NVME_IO_FLAGS_INCOMPRESSIBLE);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT_FATAL(g_request != NULL);
+	CU_ASSERT_FATAL(g_request->num_children == 2);
+	STAILQ_FOREACH(child, &g_request->children, child_stailq) {
+		CU_ASSERT(child->cmd.cdw12 == (127 | NVME_RW_FORCE_UNIT_ACCESS));
+		CU_ASSERT(child->cmd.cdw13 == NVME_DSM_INCOMPRESSIBLE);
+	}
+	ut_free_split_request(g_request);
+
+	g_request = NULL;
+	rc = nvme_ns_cmd_read(&ns, &qpair, payload, 0, 8, NULL, NULL, 1u << 8);
+	CU_ASSERT(rc == EINVAL);
+	rc = nvme_ns_cmd_write(&ns, &qpair, payload, 0, 8, NULL, NULL, 1u << 29);
+	CU_ASSERT(rc == EINVAL);
+	CU_ASSERT(g_request == NULL);
+
+	free(payload);
+}
+
+static void
+test_nvme_ns_cmd_too_many_children(void)
+{
+	struct nvme_namespace	ns;
+	struct nvme_controller	ctrlr;
+	struct nvme_qpair	qpair;
+	int			rc;
+
+	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
+
+	rc = nvme_ns_cmd_read(&ns, &qpair, (void *)0x1000, 0, UINT32_MAX, NULL, NULL, 0);
+	CU_ASSERT(rc == EINVAL);
+	CU_ASSERT(g_request == NULL);
+}
+
 static void
 test_nvme_ns_cmd_flush(void)
 {
 	struct nvme_namespace	ns;
 	struct nvme_controller	ctrlr;
+	struct nvme_qpair	qpair;
 	nvme_cb_fn_t		cb_fn = NULL;
 	void			*cb_arg = NULL;
 
 	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
 
-	nvme_ns_cmd_flush(&ns, cb_fn, cb_arg);
+	nvme_ns_cmd_flush(&ns, &qpair, cb_fn, cb_arg);
 	CU_ASSERT(g_request->cmd.opc == NVME_OPC_FLUSH);
+	CU_ASSERT(g_qpair == &qpair);
 	CU_ASSERT(g_request->cmd.nsid == ns.id);
 
 	nvme_free_request(g_request);
@@ -335,6 +658,7 @@ test_nvme_ns_cmd_deallocate(void)
 {
 	struct nvme_namespace	ns;
 	struct nvme_controller	ctrlr;
+	struct nvme_qpair	qpair;
 	nvme_cb_fn_t		cb_fn = NULL;
 	void			*cb_arg = NULL;
 	uint8_t			num_ranges = 1;
@@ -344,7 +668,7 @@ test_nvme_ns_cmd_deallocate(void)
 	prepare_for_test(&ns, &ctrlr, 512, 128 * 1024, 0);
 	payload = malloc(num_ranges * sizeof(struct nvme_dsm_range));
 
-	nvme_ns_cmd_deallocate(&ns, payload, num_ranges, cb_fn, cb_arg);
+	nvme_ns_cmd_deallocate(&ns, &qpair, payload, num_ranges, cb_fn, cb_arg);
 	CU_ASSERT(g_request->cmd.opc == NVME_OPC_DATASET_MANAGEMENT);
 	CU_ASSERT(g_request->cmd.nsid == ns.id);
 	CU_ASSERT(g_request->cmd.cdw10 == num_ranges - 1u);
@@ -354,8 +678,20 @@ test_nvme_ns_cmd_deallocate(void)
 
 	payload = NULL;
 	num_ranges = 0;
-	rc = nvme_ns_cmd_deallocate(&ns, payload, num_ranges, cb_fn, cb_arg);
+	rc = nvme_ns_cmd_deallocate(&ns, &qpair, payload, num_ranges, cb_fn, cb_arg);
 	CU_ASSERT(rc != 0);
+
+	payload = malloc(NVME_DATASET_MANAGEMENT_MAX_RANGES * sizeof(struct nvme_dsm_range));
+	rc = nvme_ns_cmd_deallocate(&ns, &qpair, payload, NVME_DATASET_MANAGEMENT_MAX_RANGES,
+				    cb_fn, cb_arg);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT(g_request->cmd.cdw10 == NVME_DATASET_MANAGEMENT_MAX_RANGES - 1);
+	nvme_free_request(g_request);
+
+	rc = nvme_ns_cmd_deallocate(&ns, &qpair, payload, NVME_DATASET_MANAGEMENT_MAX_RANGES + 1,
+				    cb_fn, cb_arg);
+	CU_ASSERT(rc == EINVAL);
+	free(payload);
 }
 
 int main(int argc, char **argv)
@@ -378,8 +714,15 @@ int main(int argc, char **argv)
 		|| CU_add_test(suite, "split_test2", split_test2) == NULL
 		|| CU_add_test(suite, "split_test3", split_test3) == NULL
 		|| CU_add_test(suite, "split_test4", split_test4) == NULL
+		|| CU_add_test(suite, "split_test5", split_test5) == NULL
 		|| CU_add_test(suite, "nvme_ns_cmd_flush testing", test_nvme_ns_cmd_flush) == NULL
 		|| CU_add_test(suite, "nvme_ns_cmd_deallocate testing", test_nvme_ns_cmd_deallocate) == NULL
+		|| CU_add_test(suite, "nvme_ns_cmd_write_zeroes", test_nvme_ns_cmd_write_zeroes) == NULL
+		|| CU_add_test(suite, "nvme_ns_cmd_verify", test_nvme_ns_cmd_verify) == NULL
+		|| CU_add_test(suite, "nvme_ns_cmd_compare_and_write",
+			       test_nvme_ns_cmd_compare_and_write) == NULL
+		|| CU_add_test(suite, "nvme_ns_cmd_io_flags", test_nvme_ns_cmd_io_flags) == NULL
+		|| CU_add_test(suite, "nvme_ns_cmd_too_many_children", test_nvme_ns_cmd_too_many_children) == NULL
 	) {
 		CU_cleanup_registry();
 		return CU_get_error();
@@ -0,0 +1,392 @@
+
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright(c) 2010-2015 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "CUnit/Basic.h"
+
+#include "nvme/nvme_ns_dealloc.c"
+
+char outbuf[OUTBUF_SIZE];
+
+struct ut_dsm {
+	struct nvme_dsm_range	*ranges;
+	uint16_t		num_ranges;
+	nvme_cb_fn_t		cb_fn;
+	void			*cb_arg;
+};
+
+static struct ut_dsm	g_dsm[64];
+static uint32_t		g_num_dsm;
+static int		g_dsm_rc;
+
+int
+nvme_ns_cmd_deallocate(struct nvme_namespace *ns, struct nvme_qpair *qpair, void *payload,
+		       uint16_t num_ranges, nvme_cb_fn_t cb_fn, void *cb_arg)
+{
+	if (g_dsm_rc != 0) {
+		return g_dsm_rc;
+	}
+
+	CU_ASSERT_FATAL(g_num_dsm < sizeof(g_dsm) / sizeof(g_dsm[0]));
+	g_dsm[g_num_dsm].ranges = payload;
+	g_dsm[g_num_dsm].num_ranges = num_ranges;
+	g_dsm[g_num_dsm].cb_fn = cb_fn;
+	g_dsm[g_num_dsm].cb_arg = cb_arg;
+	g_num_dsm++;
+
+	return 0;
+}
+
+static void
+ut_complete_dsm(uint32_t i, uint16_t sc)
+{
+	struct nvme_completion cpl = {};
+
+	cpl.status.sc = sc;
+	g_dsm[i].cb_fn(g_dsm[i].cb_arg, &cpl);
+}
+
+struct ut_sync_result {
+	struct nvme_completion	cpl;
+	int			num_cpls;
+};
+
+static void
+ut_sync_done(void *arg, const struct nvme_completion *cpl)
+{
+	struct ut_sync_result *result = arg;
+
+	result->cpl = *cpl;
+	result->num_cpls++;
+}
+
+static struct nvme_deallocator *
+ut_alloc(struct nvme_namespace *ns, uint32_t max_ranges, uint32_t max_age_us,
+	 uint64_t max_blocks_per_sec)
+{
+	struct nvme_deallocator		*dealloc;
+	struct nvme_deallocator_opts	opts;
+
+	memset(ns, 0, sizeof(*ns));
+	ns->flags = NVME_NS_DEALLOCATE_SUPPORTED;
+	g_num_dsm = 0;
+	g_dsm_rc = 0;
+
+	nvme_deallocator_opts_set_defaults(&opts);
+	opts.max_ranges_per_cmd = max_ranges;
+	opts.max_age_us = max_age_us;
+	opts.max_blocks_per_sec = max_blocks_per_sec;
+	opts.max_pending_ranges = 2 * max_ranges;
+	dealloc = nvme_ns_alloc_deallocator(ns, NULL, &opts);
+	CU_ASSERT_FATAL(dealloc != NULL);
+
+	return dealloc;
+}
+
+static void
+test_nvme_deallocator_alloc(void)
+{
+	struct nvme_namespace		ns = {};
+	struct nvme_deallocator_opts	opts;
+	struct nvme_deallocator		*dealloc;
+
+	CU_ASSERT(nvme_ns_alloc_deallocator(&ns, NULL, NULL) == NULL);
+
+	ns.flags = NVME_NS_DEALLOCATE_SUPPORTED;
+	nvme_deallocator_opts_set_defaults(&opts);
+	opts.max_ranges_per_cmd = NVME_DATASET_MANAGEMENT_MAX_RANGES + 1;
+	CU_ASSERT(nvme_ns_alloc_deallocator(&ns, NULL, &opts) == NULL);
+	nvme_deallocator_opts_set_defaults(&opts);
+	opts.queue_depth = 0;
+	CU_ASSERT(nvme_ns_alloc_deallocator(&ns, NULL, &opts) == NULL);
+	nvme_deallocator_opts_set_defaults(&opts);
+	opts.max_pending_ranges = opts.max_ranges_per_cmd - 1;
+	CU_ASSERT(nvme_ns_alloc_deallocator(&ns, NULL, &opts) == NULL);
+
+	dealloc = nvme_ns_alloc_deallocator(&ns, NULL, NULL);
+	CU_ASSERT_FATAL(dealloc != NULL);
+	CU_ASSERT(dealloc->opts.max_ranges_per_cmd == NVME_DATASET_MANAGEMENT_MAX_RANGES);
+	CU_ASSERT(nvme_ns_free_deallocator(dealloc) == 0);
+}
+
+static void
+test_nvme_deallocator_merge(void)
+{
+	struct nvme_namespace		ns;
+	struct nvme_deallocator		*dealloc;
+	struct nvme_deallocator_stats	stats;
+
+	dealloc = ut_alloc(&ns, 8, 1000 * 1000, 0);
+
+	CU_ASSERT(nvme_deallocator_add(dealloc, 0, 0) == EINVAL);
+	CU_ASSERT(nvme_deallocator_add(dealloc, UINT64_MAX, 2) == EINVAL);
+
+	CU_ASSERT(nvme_deallocator_add(dealloc, 100, 10) == 0);
+	CU_ASSERT(nvme_deallocator_add(dealloc, 200, 10) == 0);
+	CU_ASSERT(nvme_deallocator_add(dealloc, 10, 10) == 0);
+	CU_ASSERT(dealloc->num_pending == 3);
+	CU_ASSERT(dealloc->pending[0].lba == 10);
+	CU_ASSERT(dealloc->pending[1].lba == 100);
+	CU_ASSERT(dealloc->pending[2].lba == 200);
+
+	/* Adjoining on either side */
+	CU_ASSERT(nvme_deallocator_add(dealloc, 110, 5) == 0);
+	CU_ASSERT(nvme_deallocator_add(dealloc, 95, 5) == 0);
+	CU_ASSERT(dealloc->num_pending == 3);
+	CU_ASSERT(dealloc->pending[1].lba == 95);
+	CU_ASSERT(dealloc->pending[1].lba_count == 20);
+
+	/* Overlapping, and bridging two ranges */
+	CU_ASSERT(nvme_deallocator_add(dealloc, 12, 4) == 0);
+	CU_ASSERT(nvme_deallocator_add(dealloc, 105, 100) == 0);
+	CU_ASSERT(dealloc->num_pending == 2);
+	CU_ASSERT(dealloc->pending[0].lba == 10);
+	CU_ASSERT(dealloc->pending[0].lba_count == 10);
+	CU_ASSERT(dealloc->pending[1].lba == 95);
+	CU_ASSERT(dealloc->pending[1].lba_count == 115);
+	CU_ASSERT(dealloc->pending_blocks == 125);
+	CU_ASSERT(g_num_dsm == 0);
+
+	nvme_deallocator_get_stats(dealloc, &stats);
+	CU_ASSERT(stats.ranges_added == 7);
+	CU_ASSERT(stats.ranges_merged == 4);
+	CU_ASSERT(stats.cmds == 0);
+
+	CU_ASSERT(nvme_ns_free_deallocator(dealloc) == 0);
+}
+
+static void
+test_nvme_deallocator_flush(void)
+{
+	struct nvme_namespace		ns;
+	struct nvme_deallocator		*dealloc;
+	struct nvme_deallocator_stats	stats;
+	uint64_t			i;
+
+	dealloc = ut_alloc(&ns, 4, 1000 * 1000, 0);
+
+	/* A full command goes out at once, lowest LBAs first. */
+	for (i = 4; i > 0; i--) {
+		CU_ASSERT(nvme_deallocator_add(dealloc, i * 100, 8) == 0);
+	}
+	CU_ASSERT(nvme_deallocator_add(dealloc, 500, 8) == 0);
+	CU_ASSERT(g_num_dsm == 1);
+	CU_ASSERT(g_dsm[0].num_ranges == 4);
+	CU_ASSERT(g_dsm[0].ranges[0].starting_lba == 100);
+	CU_ASSERT(g_dsm[0].ranges[0].length == 8);
+	CU_ASSERT(g_dsm[0].ranges[3].starting_lba == 400);
+	CU_ASSERT(dealloc->num_pending == 1);
+	CU_ASSERT(dealloc->pending_blocks == 8);
+
+	/* The queue depth of 1 holds the next full command until the first completes. */
+	for (i = 6; i <= 8; i++) {
+		CU_ASSERT(nvme_deallocator_add(dealloc, i * 100, 8) == 0);
+	}
+	CU_ASSERT(g_num_dsm == 1);
+	CU_ASSERT(nvme_ns_free_deallocator(dealloc) == EBUSY);
+	ut_complete_dsm(0, NVME_SC_SUCCESS);
+	CU_ASSERT(g_num_dsm == 2);
+	CU_ASSERT(g_dsm[1].ranges[0].starting_lba == 500);
+
+	/* Ranges that have waited max_age_us go out from poll. */
+	CU_ASSERT(nvme_deallocator_add(dealloc, 1000, 8) == 0);
+	ut_complete_dsm(1, NVME_SC_SUCCESS);
+	CU_ASSERT(nvme_deallocator_poll(dealloc) == 0);
+	dealloc->pending_tsc -= dealloc->max_age_tsc;
+	CU_ASSERT(nvme_deallocator_poll(dealloc) == 1);
+	CU_ASSERT(g_dsm[2].num_ranges == 1);
+	ut_complete_dsm(2, NVME_SC_SUCCESS);
+
+	/* A range too long for one DSM range is sent in pieces. */
+	CU_ASSERT(nvme_deallocator_add(dealloc, 0, (uint64_t)UINT32_MAX + 10) == 0);
+	dealloc->pending_tsc -= dealloc->max_age_tsc;
+	CU_ASSERT(nvme_deallocator_poll(dealloc) == 1);
+	CU_ASSERT(g_dsm[3].num_ranges == 2);
+	CU_ASSERT(g_dsm[3].ranges[0].length == UINT32_MAX);
+	CU_ASSERT(g_dsm[3].ranges[1].starting_lba == UINT32_MAX);
+	CU_ASSERT(g_dsm[3].ranges[1].length == 10);
+	ut_complete_dsm(3, NVME_SC_SUCCESS);
+
+	nvme_deallocator_get_stats(dealloc, &stats);
+	CU_ASSERT(stats.cmds == 4);
+	CU_ASSERT(stats.cmd_ranges == 11);
+	CU_ASSERT(stats.cmd_blocks == 9 * 8 + (uint64_t)UINT32_MAX + 10);
+	CU_ASSERT(dealloc->num_pending == 0);
+	CU_ASSERT(nvme_ns_free_deallocator(dealloc) == 0);
+}
+
+static void
+test_nvme_deallocator_rate_limit(void)
+{
+	struct nvme_namespace		ns;
+	struct nvme_deallocator		*dealloc;
+	struct nvme_deallocator_stats	stats;
+
+	/* With max_age_us 0, ranges go out as soon as the rate limit allows. */
+	dealloc = ut_alloc(&ns, 4, 0, 1000);
+	dealloc->opts.queue_depth = 4;
+
+	/* 500 blocks at 1000 per second use up the burst and 0.4 seconds more. */
+	CU_ASSERT(nvme_deallocator_add(dealloc, 0, 500) == 0);
+	CU_ASSERT(g_num_dsm == 1);
+	CU_ASSERT(nvme_deallocator_add(dealloc, 1000, 8) == 0);
+	CU_ASSERT(g_num_dsm == 1);
+	CU_ASSERT(nvme_deallocator_poll(dealloc) == 0);
+	nvme_deallocator_get_stats(dealloc, &stats);
+	CU_ASSERT(stats.throttled == 2);
+
+	dealloc->rate_tsc = nvme_get_tsc();
+	CU_ASSERT(nvme_deallocator_poll(dealloc) == 1);
+	CU_ASSERT(g_dsm[1].ranges[0].starting_lba == 1000);
+
+	/* Out of requests: the command is kept and sent on a later poll. */
+	g_dsm_rc = ENOMEM;
+	dealloc->rate_tsc = nvme_get_tsc() - dealloc->burst_tsc;
+	CU_ASSERT(nvme_deallocator_add(dealloc, 2000, 8) == 0);
+	CU_ASSERT(g_num_dsm == 2);
+	CU_ASSERT(!STAILQ_EMPTY(&dealloc->ready));
+	g_dsm_rc = 0;
+	CU_ASSERT(nvme_deallocator_poll(dealloc) == 1);
+	CU_ASSERT(g_dsm[2].ranges[0].starting_lba == 2000);
+
+	ut_complete_dsm(0, NVME_SC_SUCCESS);
+	ut_complete_dsm(1, NVME_SC_SUCCESS);
+	ut_complete_dsm(2, NVME_SC_SUCCESS);
+	CU_ASSERT(nvme_ns_free_deallocator(dealloc) == 0);
+}
+
+static void
+test_nvme_deallocator_sync(void)
+{
+	struct nvme_namespace		ns;
+	struct nvme_deallocator		*dealloc;
+	struct ut_sync_result		result = {}, result2 = {};
+	uint64_t			i;
+
+	dealloc = ut_alloc(&ns, 2, 1000 * 1000, 1);
+
+	/* Nothing pending or outstanding completes at once. */
+	CU_ASSERT(nvme_deallocator_sync(dealloc, ut_sync_done, &result) == 0);
+	CU_ASSERT(result.num_cpls == 1);
+	CU_ASSERT(!nvme_completion_is_error(&result.cpl));
+
+	/* Sync sends past the rate limit, but within the queue depth. */
+	memset(&result, 0, sizeof(result));
+	for (i = 0; i < 3; i++) {
+		CU_ASSERT(nvme_deallocator_add(dealloc, i * 100, 8) == 0);
+	}
+	CU_ASSERT(g_num_dsm == 1);
+	CU_ASSERT(nvme_deallocator_sync(dealloc, ut_sync_done, &result) == 0);
+	CU_ASSERT(g_num_dsm == 1);
+	CU_ASSERT(dealloc->num_pending == 0);
+
+	/* Ranges added after the sync are not waited for. */
+	CU_ASSERT(nvme_deallocator_add(dealloc, 1000, 8) == 0);
+	CU_ASSERT(nvme_deallocator_sync(dealloc, ut_sync_done, &result2) == 0);
+
+	ut_complete_dsm(0, NVME_SC_INTERNAL_DEVICE_ERROR);
+	CU_ASSERT(g_num_dsm == 2);
+	CU_ASSERT(g_dsm[1].ranges[0].starting_lba == 200);
+	CU_ASSERT(result.num_cpls == 0);
+	ut_complete_dsm(1, NVME_SC_SUCCESS);
+	CU_ASSERT(result.num_cpls == 1);
+	CU_ASSERT(result.cpl.status.sc == NVME_SC_INTERNAL_DEVICE_ERROR);
+	CU_ASSERT(result2.num_cpls == 0);
+	CU_ASSERT(g_num_dsm == 3);
+	CU_ASSERT(g_dsm[2].ranges[0].starting_lba == 1000);
+
+	ut_complete_dsm(2, NVME_SC_SUCCESS);
+	CU_ASSERT(result2.num_cpls == 1);
+	CU_ASSERT(result2.cpl.status.sc == NVME_SC_INTERNAL_DEVICE_ERROR);
+	CU_ASSERT(dealloc->stats.errors == 1);
+
+	/*
+	 * Out of order completion retires both syncs at once, but each only
+	 *  sees failures of the commands it covers.
+	 */
+	memset(&result, 0, sizeof(result));
+	memset(&result2, 0, sizeof(result2));
+	dealloc->opts.queue_depth = 2;
+	CU_ASSERT(nvme_deallocator_add(dealloc, 2000, 8) == 0);
+	CU_ASSERT(nvme_deallocator_sync(dealloc, ut_sync_done, &result) == 0);
+	CU_ASSERT(nvme_deallocator_add(dealloc, 3000, 8) == 0);
+	CU_ASSERT(nvme_deallocator_sync(dealloc, ut_sync_done, &result2) == 0);
+	CU_ASSERT(g_num_dsm == 5);
+
+	ut_complete_dsm(4, NVME_SC_INTERNAL_DEVICE_ERROR);
+	CU_ASSERT(result.num_cpls == 0);
+	CU_ASSERT(result2.num_cpls == 0);
+	ut_complete_dsm(3, NVME_SC_SUCCESS);
+	CU_ASSERT(result.num_cpls == 1);
+	CU_ASSERT(!nvme_completion_is_error(&result.cpl));
+	CU_ASSERT(result2.num_cpls == 1);
+	CU_ASSERT(result2.cpl.status.sc == NVME_SC_INTERNAL_DEVICE_ERROR);
+	CU_ASSERT(dealloc->stats.errors == 2);
+
+	CU_ASSERT(nvme_ns_free_deallocator(dealloc) == 0);
+}
+
+int main(int argc, char **argv)
+{
+	CU_pSuite	suite = NULL;
+	unsigned int	num_failures;
+
+	if (CU_initialize_registry() != CUE_SUCCESS) {
+		return CU_get_error();
+	}
+
+	suite = CU_add_suite("nvme_ns_dealloc", NULL, NULL);
+	if (suite == NULL) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	if (
+		CU_add_test(suite, "nvme_deallocator_alloc", test_nvme_deallocator_alloc) == NULL
+		|| CU_add_test(suite, "nvme_deallocator_merge", test_nvme_deallocator_merge) == NULL
+		|| CU_add_test(suite, "nvme_deallocator_flush", test_nvme_deallocator_flush) == NULL
+		|| CU_add_test(suite, "nvme_deallocator_rate_limit",
+			       test_nvme_deallocator_rate_limit) == NULL
+		|| CU_add_test(suite, "nvme_deallocator_sync", test_nvme_deallocator_sync) == NULL
+	) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	num_failures = CU_get_number_of_failures();
+	CU_cleanup_registry();
+	return num_failures;
+}
@@ -31,6 +31,10 @@
  *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+
 #include "CUnit/Basic.h"
 
 #include "nvme/nvme_qpair.c"
@@ -41,6 +45,7 @@ struct nvme_driver g_nvme_driver = {
 };
 
 int32_t nvme_retry_count = 1;
+uint32_t nvme_cq_doorbell_threshold = NVME_DEFAULT_CQ_DOORBELL_THRESHOLD;
 
 char outbuf[OUTBUF_SIZE];
 
@@ -69,7 +74,7 @@ nvme_allocate_request(void *payload, uint32_t payload_size,
 
 	/*
 	 * Only memset up to (but not including) the children
-	 *  TAILQ_ENTRY.  children, and following members, are
+	 *  STAILQ_HEAD.  children, and following members, are
 	 *  only used as part of I/O splitting so we avoid
 	 *  memsetting them until it is actually needed.
 	 *  They will be initialized in nvme_request_add_child()
@@ -99,6 +104,19 @@ nvme_free_request(struct nvme_request *req)
 	nvme_dealloc_request(req);
 }
 
+static uint32_t g_num_aborts;
+static uint16_t g_abort_cid;
+static uint16_t g_abort_sqid;
+
+void
+nvme_ctrlr_cmd_abort(struct nvme_controller *ctrlr, uint16_t cid,
+		     uint16_t sqid, nvme_cb_fn_t cb_fn, void *cb_arg)
+{
+	g_num_aborts++;
+	g_abort_cid = cid;
+	g_abort_sqid = sqid;
+}
+
 static void
 test1(void)
 {
@@ -148,7 +166,7 @@ prepare_submit_request_test(struct nvme_qpair *qpair,
 {
 	memset(ctrlr, 0, sizeof(*ctrlr));
 	ctrlr->regs = regs;
-	nvme_qpair_construct(qpair, 1, 128, 32, ctrlr);
+	nvme_qpair_construct(qpair, 1, 128, 32, ctrlr, NULL);
 
 	CU_ASSERT(qpair->sq_tail == 0);
 	CU_ASSERT(qpair->cq_head == 0);
@@ -162,6 +180,20 @@ cleanup_submit_request_test(struct nvme_qpair *qpair)
 	nvme_qpair_destroy(qpair);
 }
 
+/* Mark a free tracker as outstanding for req, as if req had been submitted. */
+static struct nvme_tracker *
+ut_take_tracker(struct nvme_qpair *qpair, struct nvme_request *req)
+{
+	struct nvme_tracker *tr;
+
+	CU_ASSERT_FATAL(qpair->num_free_tr > 0);
+	tr = &qpair->tr[qpair->free_cid[--qpair->num_free_tr]];
+	tr->req = req;
+	req->cmd.cid = tr->cid;
+
+	return tr;
+}
+
 static void
 ut_insert_cq_entry(struct nvme_qpair *qpair, uint32_t slot)
 {
@@ -171,18 +203,12 @@ ut_insert_cq_entry(struct nvme_qpair *qpair, uint32_t slot)
 
 	nvme_alloc_request(&req);
 	memset(req, 0, sizeof(*req));
-	req->cmd.cid = slot;
 
-	tr = LIST_FIRST(&qpair->free_tr);
-	LIST_REMOVE(tr, list); /* remove tr from free_tr */
-	LIST_INSERT_HEAD(&qpair->outstanding_tr, tr, list);
-	tr->cid = slot;
-	tr->req = req;
-	qpair->act_tr[tr->cid] = tr;
+	tr = ut_take_tracker(qpair, req);
 
 	cpl = &qpair->cpl[slot];
 	cpl->status.p = qpair->phase;
-	cpl->cid = slot;
+	cpl->cid = tr->cid;
 }
 
 static void
@@ -212,9 +238,15 @@ test3(void)
 
 	CU_ASSERT(qpair.sq_tail == 0);
 
+	req->cmd.opc = NVME_OPC_FLUSH;
+	req->cmd.nsid = 1;
+	req->cmd.cdw15 = 0xdeadbeef;
+
 	nvme_qpair_submit_request(&qpair, req);
 
 	CU_ASSERT(qpair.sq_tail == 1);
+	/* The submission queue entry is a copy of the request's command. */
+	CU_ASSERT(memcmp(&qpair.cmd[0], &req->cmd, sizeof(req->cmd)) == 0);
 
 	cleanup_submit_request_test(&qpair);
 	nvme_free_request(req);
@@ -253,6 +285,86 @@ test4(void)
 	cleanup_submit_request_test(&qpair);
 }
 
+static void
+test_nvme_qpair_plug(void)
+{
+	struct nvme_qpair	qpair = {};
+	struct nvme_request	*req1, *req2;
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+
+	req1 = nvme_allocate_request(NULL, 0, expected_success_callback, NULL);
+	CU_ASSERT_FATAL(req1 != NULL);
+	req2 = nvme_allocate_request(NULL, 0, expected_success_callback, NULL);
+	CU_ASSERT_FATAL(req2 != NULL);
+
+	/* While plugged, commands are queued but the doorbell is not written. */
+	nvme_qpair_plug(&qpair);
+	nvme_qpair_submit_request(&qpair, req1);
+	nvme_qpair_submit_request(&qpair, req2);
+
+	CU_ASSERT(qpair.sq_tail == 2);
+	CU_ASSERT(*qpair.sq_tdbl == 0);
+
+	/* Unplugging writes the doorbell once with the latest tail. */
+	nvme_qpair_unplug(&qpair);
+	CU_ASSERT(*qpair.sq_tdbl == 2);
+	CU_ASSERT(qpair.sq_tdbl_pending == false);
+
+	/* Unplugging with nothing submitted must not touch the doorbell. */
+	*qpair.sq_tdbl = 0;
+	nvme_qpair_plug(&qpair);
+	nvme_qpair_unplug(&qpair);
+	CU_ASSERT(*qpair.sq_tdbl == 0);
+
+	cleanup_submit_request_test(&qpair);
+	nvme_free_request(req1);
+	nvme_free_request(req2);
+}
+
+static void
+test_nvme_qpair_shadow_doorbell(void)
+{
+	struct nvme_qpair	qpair = {};
+	struct nvme_request	*req;
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	uint32_t		shadow_db = 0, eventidx = 0;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.sq_shadow_tdbl = &shadow_db;
+	qpair.sq_eventidx = &eventidx;
+
+	/* EventIdx 0: moving the tail from 0 to 1 crosses it, so ring. */
+	req = nvme_allocate_request(NULL, 0, expected_success_callback, NULL);
+	CU_ASSERT_FATAL(req != NULL);
+	nvme_qpair_submit_request(&qpair, req);
+	CU_ASSERT(shadow_db == 1);
+	CU_ASSERT(*qpair.sq_tdbl == 1);
+	CU_ASSERT(qpair.stats.sq_doorbell_writes == 1);
+
+	/* EventIdx still 0: the controller is already awake, skip the MMIO write. */
+	req = nvme_allocate_request(NULL, 0, expected_success_callback, NULL);
+	CU_ASSERT_FATAL(req != NULL);
+	nvme_qpair_submit_request(&qpair, req);
+	CU_ASSERT(shadow_db == 2);
+	CU_ASSERT(*qpair.sq_tdbl == 1);
+	CU_ASSERT(qpair.stats.sq_doorbell_writes == 1);
+
+	/* Controller caught up and asks to be notified past 2. */
+	eventidx = 2;
+	req = nvme_allocate_request(NULL, 0, expected_success_callback, NULL);
+	CU_ASSERT_FATAL(req != NULL);
+	nvme_qpair_submit_request(&qpair, req);
+	CU_ASSERT(shadow_db == 3);
+	CU_ASSERT(*qpair.sq_tdbl == 3);
+	CU_ASSERT(qpair.stats.sq_doorbell_writes == 2);
+
+	cleanup_submit_request_test(&qpair);
+}
+
 static void
 test_ctrlr_failed(void)
 {
@@ -287,6 +399,64 @@ test_ctrlr_failed(void)
 	cleanup_submit_request_test(&qpair);
 }
 
+static void
+ut_count_callback(void *arg, const struct nvme_completion *cpl)
+{
+	(*(int *)arg)++;
+}
+
+static void
+ut_complete_child(void *arg, const struct nvme_completion *cpl)
+{
+	struct nvme_request *parent;
+
+	parent = nvme_request_complete_child(arg, cpl);
+	if (parent != NULL) {
+		parent->cb_fn(parent->cb_arg, &parent->parent_status);
+		nvme_free_request(parent);
+	}
+}
+
+static void
+test_ctrlr_failed_split(void)
+{
+	struct nvme_qpair	qpair = {};
+	struct nvme_request	*parent, *child;
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	int			num_cpls = 0;
+	int			i;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+
+	parent = nvme_allocate_request(NULL, 0, ut_count_callback, &num_cpls);
+	CU_ASSERT_FATAL(parent != NULL);
+	STAILQ_INIT(&parent->children);
+	memset(&parent->parent_status, 0, sizeof(parent->parent_status));
+	for (i = 0; i < 3; i++) {
+		child = nvme_allocate_request(NULL, 0, ut_complete_child, NULL);
+		CU_ASSERT_FATAL(child != NULL);
+		child->cb_arg = child;
+		child->parent = parent;
+		parent->num_children++;
+		STAILQ_INSERT_TAIL(&parent->children, child, child_stailq);
+	}
+
+	qpair.is_enabled = false;
+	ctrlr.is_failed = true;
+	ctrlr.is_resetting = true;
+
+	/*
+	 * Every child fails as it is submitted, and the last one frees the
+	 *  parent, which must not be touched afterwards.
+	 */
+	nvme_qpair_submit_request(&qpair, parent);
+	CU_ASSERT(num_cpls == 1);
+	CU_ASSERT(qpair.sq_tail == 0);
+
+	cleanup_submit_request_test(&qpair);
+}
+
 static void struct_packing(void)
 {
 	/* ctrlr is the first field in nvme_qpair after the fields
@@ -302,19 +472,16 @@ static void test_nvme_qpair_fail(void)
 	struct nvme_request	*req = NULL;
 	struct nvme_controller	ctrlr = {};
 	struct nvme_registers	regs = {};
-	struct nvme_tracker	*tr_temp;
-	uint64_t		phys_addr = 0;
 
 	prepare_submit_request_test(&qpair, &ctrlr, &regs);
 
-	tr_temp = nvme_malloc("nvme_tracker", sizeof(struct nvme_tracker),
-			      64, &phys_addr);
-	tr_temp->req = nvme_allocate_request(NULL, 0, expected_failure_callback, NULL);
-	CU_ASSERT_FATAL(tr_temp->req != NULL);
+	req = nvme_allocate_request(NULL, 0, expected_failure_callback, NULL);
+	CU_ASSERT_FATAL(req != NULL);
 
-	LIST_INSERT_HEAD(&qpair.outstanding_tr, tr_temp, list);
+	ut_take_tracker(&qpair, req);
+	CU_ASSERT(qpair.num_free_tr == qpair.num_trackers - 1);
 	nvme_qpair_fail(&qpair);
-	CU_ASSERT_TRUE(LIST_EMPTY(&qpair.outstanding_tr));
+	CU_ASSERT(qpair.num_free_tr == qpair.num_trackers);
 
 	req = nvme_allocate_request(NULL, 0, expected_failure_callback, NULL);
 	CU_ASSERT_FATAL(req != NULL);
@@ -372,34 +539,1213 @@ test_nvme_qpair_process_completions_limit(void)
 	cleanup_submit_request_test(&qpair);
 }
 
+static void
+test_nvme_qpair_process_completions_doorbell(void)
+{
+	struct nvme_qpair	qpair = {};
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	uint32_t		i;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+
+	/* By default, a whole batch of completions costs one doorbell write. */
+	for (i = 0; i < 4; i++) {
+		ut_insert_cq_entry(&qpair, i);
+	}
+	nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(qpair.cq_head == 4);
+	CU_ASSERT(*qpair.cq_hdbl == 4);
+	CU_ASSERT(qpair.stats.completed == 4);
+	CU_ASSERT(qpair.stats.cq_doorbell_writes == 1);
+
+	/* Nothing reaped means no doorbell write. */
+	nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(qpair.stats.cq_doorbell_writes == 1);
+
+	/* With a threshold, the doorbell is also written every N completions. */
+	nvme_cq_doorbell_threshold = 2;
+	for (i = 4; i < 9; i++) {
+		ut_insert_cq_entry(&qpair, i);
+	}
+	nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(qpair.cq_head == 9);
+	CU_ASSERT(*qpair.cq_hdbl == 9);
+	CU_ASSERT(qpair.stats.completed == 9);
+	CU_ASSERT(qpair.stats.cq_doorbell_writes == 4);
+	nvme_cq_doorbell_threshold = NVME_DEFAULT_CQ_DOORBELL_THRESHOLD;
+
+	cleanup_submit_request_test(&qpair);
+}
+
+static struct nvme_batch_cpl	ut_batch_cpl[NVME_BATCH_CPL_ENTRIES];
+static uint32_t			ut_num_batch_cpl;
+static uint32_t			ut_num_batch_calls;
+
+static void
+ut_batch_callback(void *ctx, const struct nvme_batch_cpl *cpls, uint32_t num_cpls)
+{
+	CU_ASSERT(ctx == &ut_num_batch_calls);
+	CU_ASSERT(num_cpls > 0 && num_cpls <= NVME_BATCH_CPL_ENTRIES);
+	memcpy(ut_batch_cpl, cpls, num_cpls * sizeof(*cpls));
+	ut_num_batch_cpl = num_cpls;
+	ut_num_batch_calls++;
+}
+
+static void
+unexpected_callback(void *arg, const struct nvme_completion *cpl)
+{
+	CU_FAIL("per-request callback called in batch mode");
+}
+
+static void
+test_nvme_qpair_batch_callback(void)
+{
+	struct nvme_qpair	qpair = {};
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	struct nvme_request	*req, *parent, *child[2];
+	struct nvme_tracker	*tr;
+	struct nvme_completion	*cpl;
+	uint32_t		i;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+	ut_num_batch_calls = 0;
+	nvme_qpair_set_batch_callback(&qpair, ut_batch_callback, &ut_num_batch_calls);
+
+	/*
+	 * Four completions, one of them for a request without a callback,
+	 *  are delivered together once the poll finishes.
+	 */
+	for (i = 0; i < 4; i++) {
+		req = nvme_allocate_request(NULL, 0, i == 2 ? NULL : unexpected_callback,
+					    (void *)(uintptr_t)(i + 1));
+		CU_ASSERT_FATAL(req != NULL);
+		tr = ut_take_tracker(&qpair, req);
+		cpl = &qpair.cpl[i];
+		cpl->status.p = qpair.phase;
+		cpl->status.sc = i == 3 ? NVME_SC_INVALID_FIELD : NVME_SC_SUCCESS;
+		cpl->status.dnr = 1;
+		cpl->cid = tr->cid;
+	}
+	nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(ut_num_batch_calls == 1);
+	CU_ASSERT(ut_num_batch_cpl == 3);
+	CU_ASSERT(ut_batch_cpl[0].cb_arg == (void *)1);
+	CU_ASSERT(ut_batch_cpl[1].cb_arg == (void *)2);
+	CU_ASSERT(ut_batch_cpl[2].cb_arg == (void *)4);
+	CU_ASSERT(ut_batch_cpl[0].status.sc == NVME_SC_SUCCESS);
+	CU_ASSERT(ut_batch_cpl[2].status.sc == NVME_SC_INVALID_FIELD);
+	CU_ASSERT(qpair.num_free_tr == qpair.num_trackers);
+
+	/* An empty poll does not call the batch callback. */
+	nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(ut_num_batch_calls == 1);
+
+	/* A split request is reported once, after its last child completes. */
+	parent = nvme_allocate_request(NULL, 0, unexpected_callback, (void *)5);
+	CU_ASSERT_FATAL(parent != NULL);
+	for (i = 0; i < 2; i++) {
+		child[i] = nvme_allocate_request(NULL, 0, NULL, NULL);
+		CU_ASSERT_FATAL(child[i] != NULL);
+		if (i == 0) {
+			STAILQ_INIT(&parent->children);
+			memset(&parent->parent_status, 0, sizeof(parent->parent_status));
+		}
+		parent->num_children++;
+		STAILQ_INSERT_TAIL(&parent->children, child[i], child_stailq);
+		child[i]->parent = parent;
+		child[i]->cb_fn = unexpected_callback;
+		child[i]->cb_arg = child[i];
+
+		tr = ut_take_tracker(&qpair, child[i]);
+		cpl = &qpair.cpl[4 + i];
+		cpl->status.p = qpair.phase;
+		cpl->cid = tr->cid;
+	}
+
+	nvme_qpair_process_completions(&qpair, 1);
+	CU_ASSERT(ut_num_batch_calls == 1);
+	CU_ASSERT(parent->num_children == 1);
+
+	nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(ut_num_batch_calls == 2);
+	CU_ASSERT(ut_num_batch_cpl == 1);
+	CU_ASSERT(ut_batch_cpl[0].cb_arg == (void *)5);
+
+	/* Manually completed requests are delivered right away. */
+	req = nvme_allocate_request(NULL, 0, unexpected_callback, (void *)6);
+	CU_ASSERT_FATAL(req != NULL);
+	nvme_qpair_manual_complete_request(&qpair, req, NVME_SCT_GENERIC,
+					   NVME_SC_ABORTED_BY_REQUEST, false);
+	CU_ASSERT(ut_num_batch_calls == 3);
+	CU_ASSERT(ut_num_batch_cpl == 1);
+	CU_ASSERT(ut_batch_cpl[0].cb_arg == (void *)6);
+	CU_ASSERT(ut_batch_cpl[0].status.sc == NVME_SC_ABORTED_BY_REQUEST);
+
+	/* Clearing the batch callback restores per-request callbacks. */
+	nvme_qpair_set_batch_callback(&qpair, NULL, NULL);
+	req = nvme_allocate_request(NULL, 0, expected_failure_callback, NULL);
+	CU_ASSERT_FATAL(req != NULL);
+	nvme_qpair_manual_complete_request(&qpair, req, NVME_SCT_GENERIC,
+					   NVME_SC_ABORTED_BY_REQUEST, false);
+	CU_ASSERT(ut_num_batch_calls == 3);
+
+	cleanup_submit_request_test(&qpair);
+}
+
+static void
+test_nvme_qpair_shared_cq(void)
+{
+	struct nvme_qpair	owner = {}, sq = {};
+	struct nvme_qpair	*io_qpair_by_qid[3] = {};
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	struct nvme_request	*req;
+	struct nvme_tracker	*tr;
+	struct nvme_completion	*cpl;
+	int			owner_cpls = 0;
+	uint32_t		i;
+
+	ctrlr.regs = &regs;
+	ctrlr.num_io_queues = 2;
+	ctrlr.io_qpair_by_qid = io_qpair_by_qid;
+
+	CU_ASSERT_FATAL(nvme_qpair_construct(&owner, 1, 128, 32, &ctrlr, NULL) == 0);
+	CU_ASSERT_FATAL(nvme_qpair_construct(&sq, 2, 128, 32, &ctrlr, &owner) == 0);
+	CU_ASSERT(owner.cq_qpair == &owner);
+	CU_ASSERT(sq.cq_qpair == &owner);
+	CU_ASSERT(sq.cpl == NULL);
+	TAILQ_INSERT_TAIL(&owner.shared_cq_sqs, &sq, shared_cq_tailq);
+	io_qpair_by_qid[1] = &owner;
+	io_qpair_by_qid[2] = &sq;
+	owner.is_enabled = true;
+	sq.is_enabled = true;
+
+	ut_num_batch_calls = 0;
+	nvme_qpair_set_batch_callback(&sq, ut_batch_callback, &ut_num_batch_calls);
+
+	/* Interleave completions for both submission queues on the owner's ring. */
+	for (i = 0; i < 4; i++) {
+		if (i % 2 == 0) {
+			req = nvme_allocate_request(NULL, 0, unexpected_callback, (void *)(uintptr_t)(i + 1));
+			CU_ASSERT_FATAL(req != NULL);
+			tr = ut_take_tracker(&sq, req);
+		} else {
+			req = nvme_allocate_request(NULL, 0, ut_count_callback, &owner_cpls);
+			CU_ASSERT_FATAL(req != NULL);
+			tr = ut_take_tracker(&owner, req);
+		}
+		cpl = &owner.cpl[i];
+		cpl->status.p = owner.phase;
+		cpl->sqid = (i % 2 == 0) ? sq.id : owner.id;
+		cpl->cid = tr->cid;
+	}
+
+	/* Polling any qpair sharing the CQ reaps completions for all of them. */
+	CU_ASSERT(nvme_qpair_process_completions(&sq, 0) == 4);
+	CU_ASSERT(owner.cq_head == 4);
+	CU_ASSERT(owner_cpls == 2);
+	CU_ASSERT(ut_num_batch_calls == 1);
+	CU_ASSERT(ut_num_batch_cpl == 2);
+	CU_ASSERT(ut_batch_cpl[0].cb_arg == (void *)1);
+	CU_ASSERT(ut_batch_cpl[1].cb_arg == (void *)3);
+	CU_ASSERT(owner.num_free_tr == owner.num_trackers);
+	CU_ASSERT(sq.num_free_tr == sq.num_trackers);
+
+	/* Re-enabling the owner after a reset also re-enables the sharing qpairs. */
+	nvme_qpair_disable(&owner);
+	nvme_qpair_disable(&sq);
+	nvme_qpair_process_completions(&owner, 0);
+	CU_ASSERT(owner.is_enabled == true);
+	CU_ASSERT(sq.is_enabled == true);
+
+	nvme_qpair_set_batch_callback(&sq, NULL, NULL);
+	nvme_qpair_destroy(&sq);
+	nvme_qpair_destroy(&owner);
+}
+
+static void
+test_nvme_qpair_poll(void)
+{
+	struct nvme_qpair	qpair = {};
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	struct nvme_poll_opts	opts;
+	struct nvme_poll_stats	stats;
+	struct nvme_request	*req;
+	int			num_cpls = 0;
+	uint32_t		i;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+
+	nvme_poll_opts_set_defaults(&opts);
+	CU_ASSERT(opts.mode == NVME_POLL_MODE_BUSY);
+	CU_ASSERT(opts.latency_budget_us == NVME_DEFAULT_POLL_LATENCY_BUDGET_US);
+	CU_ASSERT(opts.idle_poll_threshold == NVME_DEFAULT_IDLE_POLL_THRESHOLD);
+
+	/* Busy polling only counts. */
+	CU_ASSERT(nvme_qpair_poll(&qpair, 0) == 0);
+	nvme_qpair_get_poll_stats(&qpair, &stats);
+	CU_ASSERT(stats.polls == 1);
+	CU_ASSERT(stats.idle_polls == 1);
+	CU_ASSERT(stats.pause_us == 0);
+	CU_ASSERT(stats.sleeps == 0);
+
+	opts.mode = 2;
+	CU_ASSERT(nvme_qpair_set_poll_opts(&qpair, &opts) == EINVAL);
+
+	opts.mode = NVME_POLL_MODE_HYBRID;
+	opts.latency_budget_us = 20;
+	opts.idle_poll_threshold = 2;
+	CU_ASSERT(nvme_qpair_set_poll_opts(&qpair, &opts) == 0);
+
+	/*
+	 * With nothing outstanding, idle polls back off exponentially once the
+	 *  threshold is reached: pauses of 1, 2, 4 and 8 us, then sleeps of
+	 *  16 and 20 (the budget) us.
+	 */
+	for (i = 0; i < 7; i++) {
+		CU_ASSERT(nvme_qpair_poll(&qpair, 0) == 0);
+	}
+	nvme_qpair_get_poll_stats(&qpair, &stats);
+	CU_ASSERT(stats.polls == 8);
+	CU_ASSERT(stats.idle_polls == 8);
+	CU_ASSERT(stats.pause_us >= 15);
+	CU_ASSERT(stats.sleeps == 2);
+	CU_ASSERT(stats.sleep_us >= 36);
+	CU_ASSERT(qpair.backoff_us == 20);
+
+	/* A completion returns the qpair to busy polling. */
+	req = nvme_allocate_request(NULL, 0, ut_count_callback, &num_cpls);
+	CU_ASSERT_FATAL(req != NULL);
+	qpair.cpl[0].cid = ut_take_tracker(&qpair, req)->cid;
+	qpair.cpl[0].status.p = qpair.phase;
+	CU_ASSERT(nvme_qpair_poll(&qpair, 0) == 1);
+	CU_ASSERT(num_cpls == 1);
+	CU_ASSERT(qpair.idle_polls == 0);
+	CU_ASSERT(qpair.backoff_us == 0);
+
+	/*
+	 * With a command outstanding, sleep once for half the estimated
+	 *  latency (capped by the budget), then busy poll for it.
+	 */
+	req = nvme_allocate_request(NULL, 0, ut_count_callback, &num_cpls);
+	CU_ASSERT_FATAL(req != NULL);
+	ut_take_tracker(&qpair, req);
+	qpair.poll_stats.est_latency_us = 30;
+	nvme_qpair_get_poll_stats(&qpair, &stats);
+	for (i = 0; i < 5; i++) {
+		CU_ASSERT(nvme_qpair_poll(&qpair, 0) == 0);
+	}
+	CU_ASSERT(qpair.hybrid_slept == true);
+	CU_ASSERT(qpair.poll_stats.sleeps == stats.sleeps + 1);
+	CU_ASSERT(qpair.poll_stats.sleep_us >= stats.sleep_us + 15);
+	CU_ASSERT(qpair.poll_stats.pause_us == stats.pause_us);
+	nvme_free_request(req);
+
+	cleanup_submit_request_test(&qpair);
+}
+
+static void
+test_nvme_qpair_poll_window(void)
+{
+	struct nvme_qpair	qpair = {};
+
+	/* The first poll only starts the window. */
+	nvme_qpair_update_poll_window(&qpair, 1000, 0, 4);
+	CU_ASSERT(qpair.window_start_us == 1000);
+	CU_ASSERT(qpair.window_outstanding_us == 0);
+
+	/* 4 commands outstanding for 1000 us, completed at the end: 1000 us each. */
+	nvme_qpair_update_poll_window(&qpair, 1500, 0, 4);
+	CU_ASSERT(qpair.window_outstanding_us == 2000);
+	nvme_qpair_update_poll_window(&qpair, 2000, 4, 0);
+	CU_ASSERT(qpair.poll_stats.completion_rate == 4000);
+	CU_ASSERT(qpair.poll_stats.est_latency_us == 1000);
+	CU_ASSERT(qpair.window_start_us == 2000);
+	CU_ASSERT(qpair.window_completions == 0);
+	CU_ASSERT(qpair.window_outstanding_us == 0);
+
+	/* Later windows (here 1500 outstanding-us / 2 completions) are averaged in. */
+	nvme_qpair_update_poll_window(&qpair, 2500, 0, 1);
+	nvme_qpair_update_poll_window(&qpair, 3000, 2, 0);
+	CU_ASSERT(qpair.poll_stats.completion_rate == 2000);
+	CU_ASSERT(qpair.poll_stats.est_latency_us == (1000 * 7 + 750) / 8);
+
+	/* An idle window reports no completions but keeps the estimate. */
+	nvme_qpair_update_poll_window(&qpair, 4000, 0, 0);
+	CU_ASSERT(qpair.poll_stats.completion_rate == 0);
+	CU_ASSERT(qpair.poll_stats.est_latency_us == (1000 * 7 + 750) / 8);
+}
+
+struct ut_sim_device {
+	struct nvme_qpair	*qpair;
+	int			efd;
+};
+
+/* Post a completion and raise the completion queue's interrupt, like a device. */
+static void *
+ut_sim_device_complete(void *arg)
+{
+	struct ut_sim_device	*dev = arg;
+	uint64_t		one = 1;
+
+	usleep(10000);
+	dev->qpair->cpl[0].status.p = dev->qpair->phase;
+	CU_ASSERT(write(dev->efd, &one, sizeof(one)) == sizeof(one));
+
+	return NULL;
+}
+
+static void
+test_nvme_qpair_interrupt(void)
+{
+	struct nvme_qpair	qpair = {};
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	struct nvme_request	*req;
+	struct ut_sim_device	dev;
+	struct epoll_event	event = {};
+	pthread_t		thread;
+	uint64_t		count;
+	int			epfd, num_cpls = 0;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+	CU_ASSERT(nvme_qpair_get_interrupt_fd(&qpair) == -1);
+
+	qpair.intr_fd = eventfd(0, EFD_NONBLOCK);
+	CU_ASSERT_FATAL(qpair.intr_fd >= 0);
+	CU_ASSERT(nvme_qpair_get_interrupt_fd(&qpair) == qpair.intr_fd);
+
+	/* Nothing pending: the eventfd is left unsignaled. */
+	CU_ASSERT(nvme_qpair_process_interrupt(&qpair, 0) == 0);
+
+	req = nvme_allocate_request(NULL, 0, ut_count_callback, &num_cpls);
+	CU_ASSERT_FATAL(req != NULL);
+	qpair.cpl[0].cid = ut_take_tracker(&qpair, req)->cid;
+
+	epfd = epoll_create1(0);
+	CU_ASSERT_FATAL(epfd >= 0);
+	event.events = EPOLLIN;
+	CU_ASSERT(epoll_ctl(epfd, EPOLL_CTL_ADD, nvme_qpair_get_interrupt_fd(&qpair), &event) == 0);
+
+	/* Block until the simulated device signals the completion. */
+	dev.qpair = &qpair;
+	dev.efd = qpair.intr_fd;
+	CU_ASSERT_FATAL(pthread_create(&thread, NULL, ut_sim_device_complete, &dev) == 0);
+	CU_ASSERT(epoll_wait(epfd, &event, 1, 5000) == 1);
+	pthread_join(thread, NULL);
+
+	CU_ASSERT(nvme_qpair_process_interrupt(&qpair, 0) == 1);
+	CU_ASSERT(num_cpls == 1);
+
+	/* The interrupt was acknowledged. */
+	CU_ASSERT(epoll_wait(epfd, &event, 1, 0) == 0);
+	CU_ASSERT(read(qpair.intr_fd, &count, sizeof(count)) < 0);
+
+	close(epfd);
+	close(qpair.intr_fd);
+	cleanup_submit_request_test(&qpair);
+}
+
+static void
+test_nvme_mpsc_ring(void)
+{
+	struct nvme_mpsc_ring	*ring;
+	uintptr_t		i, round;
+
+	/* Sizes are rounded up to a power of two. */
+	ring = nvme_mpsc_ring_create(3);
+	CU_ASSERT_FATAL(ring != NULL);
+	CU_ASSERT(ring->mask == 3);
+	CU_ASSERT(nvme_mpsc_ring_dequeue(ring) == NULL);
+
+	/* Items come out in order, across several wraps of the ring. */
+	for (round = 0; round < 3; round++) {
+		for (i = 1; i <= 4; i++) {
+			CU_ASSERT(nvme_mpsc_ring_enqueue(ring, (void *)(round * 4 + i)));
+		}
+		CU_ASSERT(!nvme_mpsc_ring_enqueue(ring, (void *)5));
+		for (i = 1; i <= 4; i++) {
+			CU_ASSERT(nvme_mpsc_ring_dequeue(ring) == (void *)(round * 4 + i));
+		}
+		CU_ASSERT(nvme_mpsc_ring_dequeue(ring) == NULL);
+	}
+
+	free(ring);
+}
+
+/* Completes every command in qpair's submission queue, like a device would. */
+struct ut_sim_queue {
+	uint16_t	sq_head;
+	uint16_t	cq_tail;
+	uint8_t		phase;
+};
+
+static uint32_t
+ut_sim_queue_process(struct nvme_qpair *qpair, struct ut_sim_queue *dev)
+{
+	struct nvme_completion	*cpl;
+	uint32_t		num_cpls = 0;
+
+	while (dev->sq_head != qpair->sq_tail) {
+		cpl = &qpair->cpl[dev->cq_tail];
+		memset(cpl, 0, sizeof(*cpl));
+		cpl->cid = qpair->cmd[dev->sq_head].cid;
+		cpl->sqid = qpair->id;
+		cpl->status.p = dev->phase;
+
+		if (++dev->sq_head == qpair->num_entries) {
+			dev->sq_head = 0;
+		}
+		if (++dev->cq_tail == qpair->num_entries) {
+			dev->cq_tail = 0;
+			dev->phase = !dev->phase;
+		}
+		num_cpls++;
+	}
+
+	return num_cpls;
+}
+
+static void
+test_nvme_qpair_proxy(void)
+{
+	struct nvme_qpair	qpair = {}, plain_qpair = {};
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	struct nvme_qpair	*proxy;
+	struct nvme_request	*req;
+	struct ut_sim_queue	dev = {};
+	int			num_cpls = 0, i;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+	dev.phase = qpair.phase;
+	CU_ASSERT_FATAL(nvme_qpair_init_mpsc(&qpair, 4) == 0);
+
+	/* Only qpairs set up for proxies can have them. */
+	CU_ASSERT(nvme_qpair_alloc_proxy(&plain_qpair, 2) == NULL);
+	CU_ASSERT(nvme_qpair_alloc_proxy(&qpair, 0) == NULL);
+
+	proxy = nvme_qpair_alloc_proxy(&qpair, 2);
+	CU_ASSERT_FATAL(proxy != NULL);
+	CU_ASSERT(qpair.num_proxies == 1);
+
+	/* The proxy hands over up to its depth and queues the rest. */
+	for (i = 0; i < 3; i++) {
+		req = nvme_allocate_request(NULL, 0, ut_count_callback, &num_cpls);
+		CU_ASSERT_FATAL(req != NULL);
+		nvme_qpair_submit_request(proxy, req);
+	}
+	CU_ASSERT(qpair.sq_tail == 0);
+
+	/* The owner submits them when it polls, with a single doorbell write. */
+	CU_ASSERT(nvme_qpair_process_completions(&qpair, 0) == 0);
+	CU_ASSERT(qpair.sq_tail == 2);
+	CU_ASSERT(qpair.stats.sq_doorbell_writes == 1);
+
+	/* Completions reaped by the owner are reported on the proxy's thread. */
+	CU_ASSERT(ut_sim_queue_process(&qpair, &dev) == 2);
+	CU_ASSERT(nvme_qpair_process_completions(&qpair, 0) == 2);
+	CU_ASSERT(num_cpls == 0);
+	CU_ASSERT(nvme_qpair_free_proxy(proxy) == EBUSY);
+	CU_ASSERT(nvme_qpair_process_completions(proxy, 1) == 1);
+	CU_ASSERT(num_cpls == 1);
+	CU_ASSERT(nvme_qpair_process_completions(proxy, 0) == 1);
+	CU_ASSERT(num_cpls == 2);
+
+	/* Reaping made room for the queued request; batch mode does not apply to it. */
+	ut_num_batch_calls = 0;
+	nvme_qpair_set_batch_callback(&qpair, ut_batch_callback, &ut_num_batch_calls);
+	CU_ASSERT(nvme_qpair_process_completions(&qpair, 0) == 0);
+	CU_ASSERT(ut_sim_queue_process(&qpair, &dev) == 1);
+	CU_ASSERT(nvme_qpair_process_completions(&qpair, 0) == 1);
+	CU_ASSERT(ut_num_batch_calls == 0);
+	CU_ASSERT(nvme_qpair_process_completions(proxy, 0) == 1);
+	CU_ASSERT(num_cpls == 3);
+	nvme_qpair_set_batch_callback(&qpair, NULL, NULL);
+
+	CU_ASSERT(nvme_qpair_free_proxy(&qpair) == EINVAL);
+	CU_ASSERT(nvme_qpair_free_proxy(proxy) == 0);
+	CU_ASSERT(qpair.num_proxies == 0);
+	CU_ASSERT(qpair.num_free_tr == qpair.num_trackers);
+
+	cleanup_submit_request_test(&qpair);
+}
+
+#define UT_NUM_PRODUCERS	4
+#define UT_PRODUCER_REQUESTS	2000
+
+struct ut_producer {
+	struct nvme_qpair	*qpair;
+	int			num_cpls;
+	int			rc;
+	bool			done;
+};
+
+static void *
+ut_producer_thread(void *arg)
+{
+	struct ut_producer	*producer = arg;
+	struct nvme_qpair	*proxy;
+	struct nvme_request	*req;
+	int			i;
+
+	proxy = nvme_qpair_alloc_proxy(producer->qpair, 8);
+	if (proxy == NULL) {
+		producer->rc = -1;
+		__atomic_store_n(&producer->done, true, __ATOMIC_RELEASE);
+		return NULL;
+	}
+
+	for (i = 0; i < UT_PRODUCER_REQUESTS; i++) {
+		req = nvme_allocate_request(NULL, 0, ut_count_callback, &producer->num_cpls);
+		nvme_qpair_submit_request(proxy, req);
+		nvme_qpair_process_completions(proxy, 0);
+	}
+	while (producer->num_cpls < UT_PRODUCER_REQUESTS) {
+		nvme_qpair_process_completions(proxy, 0);
+		sched_yield();
+	}
+
+	producer->rc = nvme_qpair_free_proxy(proxy);
+	__atomic_store_n(&producer->done, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void
+test_nvme_qpair_proxy_threads(void)
+{
+	struct nvme_qpair	qpair = {};
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	struct ut_sim_queue	dev = {};
+	struct ut_producer	producers[UT_NUM_PRODUCERS] = {};
+	pthread_t		threads[UT_NUM_PRODUCERS];
+	int			i, num_done;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+	dev.phase = qpair.phase;
+	CU_ASSERT_FATAL(nvme_qpair_init_mpsc(&qpair, 16) == 0);
+
+	for (i = 0; i < UT_NUM_PRODUCERS; i++) {
+		producers[i].qpair = &qpair;
+		CU_ASSERT_FATAL(pthread_create(&threads[i], NULL, ut_producer_thread,
+					       &producers[i]) == 0);
+	}
+
+	/* More producers than the owner has trackers or ring slots for. */
+	do {
+		nvme_qpair_process_completions(&qpair, 0);
+		ut_sim_queue_process(&qpair, &dev);
+		sched_yield();
+
+		num_done = 0;
+		for (i = 0; i < UT_NUM_PRODUCERS; i++) {
+			num_done += __atomic_load_n(&producers[i].done, __ATOMIC_ACQUIRE);
+		}
+	} while (num_done < UT_NUM_PRODUCERS);
+
+	for (i = 0; i < UT_NUM_PRODUCERS; i++) {
+		pthread_join(threads[i], NULL);
+		CU_ASSERT(producers[i].rc == 0);
+		CU_ASSERT(producers[i].num_cpls == UT_PRODUCER_REQUESTS);
+	}
+	CU_ASSERT(qpair.num_proxies == 0);
+	CU_ASSERT(qpair.num_free_tr == qpair.num_trackers);
+	CU_ASSERT(nvme_mpsc_ring_dequeue(qpair.mpsc_ring) == NULL);
+
+	cleanup_submit_request_test(&qpair);
+}
+
+static void
+test_nvme_qpair_timeout(void)
+{
+	struct nvme_qpair	qpair = {};
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	struct nvme_request	*req, *untimed;
+	struct nvme_tracker	*tr;
+	int			num_cpls = 0;
+	uint32_t		now, i, num_armed;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+	CU_ASSERT(nvme_qpair_init_timeouts(&qpair, 5) == 0);
+	CU_ASSERT(qpair.timeout_ticks == 20);
+
+	g_num_aborts = 0;
+
+	/* Commands that opt out of timeouts are not armed. */
+	untimed = nvme_allocate_request(NULL, 0, ut_count_callback, &num_cpls);
+	CU_ASSERT_FATAL(untimed != NULL);
+	untimed->timeout = false;
+	nvme_qpair_submit_request(&qpair, untimed);
+	CU_ASSERT(qpair.num_timeouts_armed == 0);
+
+	req = nvme_allocate_request(NULL, 0, ut_count_callback, &num_cpls);
+	CU_ASSERT_FATAL(req != NULL);
+	nvme_qpair_submit_request(&qpair, req);
+	tr = &qpair.tr[req->cmd.cid];
+	now = qpair.timeout_tick;
+	CU_ASSERT(qpair.num_timeouts_armed == 1);
+	CU_ASSERT(tr->timeout_state == NVME_TIMEOUT_ARMED);
+	CU_ASSERT(qpair.timeout_wheel[now % NVME_TIMEOUT_WHEEL_SLOTS] == 1);
+
+	nvme_qpair_expire_timeouts(&qpair, now + 19);
+	CU_ASSERT(g_num_aborts == 0);
+
+	/* The first expiry aborts the command and gives the abort a period of its own. */
+	nvme_qpair_expire_timeouts(&qpair, now + 20);
+	CU_ASSERT(g_num_aborts == 1);
+	CU_ASSERT(g_abort_cid == tr->cid);
+	CU_ASSERT(g_abort_sqid == 1);
+	CU_ASSERT(tr->timeout_state == NVME_TIMEOUT_ABORTED);
+	CU_ASSERT(qpair.timeout_wheel[now % NVME_TIMEOUT_WHEEL_SLOTS] == 0);
+	CU_ASSERT(qpair.timeout_wheel[(now + 20) % NVME_TIMEOUT_WHEEL_SLOTS] == 1);
+
+	/* Still outstanding after that, so the escalation is left to the application. */
+	nvme_qpair_expire_timeouts(&qpair, now + 39);
+	CU_ASSERT(ctrlr.timeout_escalated == false);
+	nvme_qpair_expire_timeouts(&qpair, now + 40);
+	CU_ASSERT(g_num_aborts == 1);
+	CU_ASSERT(ctrlr.timeout_escalated == true);
+
+	/* Completion disarms the timeout. */
+	qpair.cpl[0].cid = untimed->cmd.cid;
+	qpair.cpl[0].status.p = qpair.phase;
+	qpair.cpl[1].cid = req->cmd.cid;
+	qpair.cpl[1].status.p = qpair.phase;
+	CU_ASSERT(nvme_qpair_process_completions(&qpair, 0) == 2);
+	CU_ASSERT(num_cpls == 2);
+	CU_ASSERT(qpair.num_timeouts_armed == 0);
+	CU_ASSERT(tr->timeout_state == NVME_TIMEOUT_NONE);
+	num_armed = 0;
+	for (i = 0; i < NVME_TIMEOUT_WHEEL_SLOTS; i++) {
+		num_armed += qpair.timeout_wheel[i];
+	}
+	CU_ASSERT(num_armed == 0);
+
+	/* A command is still found after a gap between polls longer than the wheel. */
+	req = nvme_allocate_request(NULL, 0, ut_count_callback, &num_cpls);
+	CU_ASSERT_FATAL(req != NULL);
+	nvme_qpair_submit_request(&qpair, req);
+	now = qpair.timeout_tick;
+	nvme_qpair_expire_timeouts(&qpair, now + 5 * NVME_TIMEOUT_WHEEL_SLOTS);
+	CU_ASSERT(g_num_aborts == 2);
+	CU_ASSERT(g_abort_cid == req->cmd.cid);
+
+	qpair.cpl[2].cid = req->cmd.cid;
+	qpair.cpl[2].status.p = qpair.phase;
+	CU_ASSERT(nvme_qpair_process_completions(&qpair, 0) == 1);
+	CU_ASSERT(qpair.num_timeouts_armed == 0);
+
+	cleanup_submit_request_test(&qpair);
+}
+
+static void
+test_nvme_qpair_stats(void)
+{
+	struct nvme_qpair	qpair = {};
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	struct nvme_qpair_stats	stats;
+	struct nvme_request	*req;
+	int			num_cpls = 0;
+	uint32_t		i;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+
+	/* Requests beyond the 32 trackers are queued in software. */
+	for (i = 0; i < 34; i++) {
+		req = nvme_allocate_request(NULL, 0, ut_count_callback, &num_cpls);
+		CU_ASSERT_FATAL(req != NULL);
+		nvme_qpair_submit_request(&qpair, req);
+	}
+
+	CU_ASSERT(nvme_qpair_process_completions(&qpair, 0) == 0);
+
+	/* A retryable error resubmits the command on the same tracker. */
+	qpair.cpl[0].cid = qpair.tr[0].cid;
+	qpair.cpl[0].status.sc = NVME_SC_ABORTED_BY_REQUEST;
+	qpair.cpl[0].status.p = qpair.phase;
+	CU_ASSERT(nvme_qpair_process_completions(&qpair, 0) == 1);
+	CU_ASSERT(num_cpls == 0);
+
+	nvme_qpair_get_stats(&qpair, &stats);
+	CU_ASSERT(stats.submitted == 33);
+	CU_ASSERT(stats.completed == 1);
+	CU_ASSERT(stats.retries == 1);
+	CU_ASSERT(stats.queued_reqs == 2);
+	CU_ASSERT(stats.max_outstanding == 32);
+	CU_ASSERT(stats.empty_polls == 1);
+	CU_ASSERT(stats.sq_doorbell_writes == 33);
+	CU_ASSERT(stats.cq_doorbell_writes == 1);
+
+	nvme_qpair_fail(&qpair);
+	CU_ASSERT(num_cpls == 34);
+
+	cleanup_submit_request_test(&qpair);
+}
+
+static void
+test_histogram(void)
+{
+	struct histogram	*h, *h2;
+	uint64_t		i;
+
+	h = calloc(1, sizeof(*h));
+	h2 = calloc(1, sizeof(*h2));
+	CU_ASSERT_FATAL(h != NULL && h2 != NULL);
+
+	CU_ASSERT(histogram_percentile(h, 50.0) == 0);
+
+	/* Small values get a bucket each, larger ones share 1/32 of a power of two. */
+	CU_ASSERT(histogram_bucket_start(0, 31) == 31);
+	CU_ASSERT(histogram_bucket_end(0, 31) == 31);
+	CU_ASSERT(histogram_bucket_start(1, 0) == 32);
+	CU_ASSERT(histogram_bucket_end(1, 31) == 63);
+	CU_ASSERT(histogram_bucket_start(2, 0) == 64);
+	CU_ASSERT(histogram_bucket_end(2, 0) == 65);
+	CU_ASSERT(histogram_bucket_end(HISTOGRAM_NUM_RANGES - 1, HISTOGRAM_BUCKET_MASK) == UINT64_MAX);
+
+	for (i = 1; i <= 100; i++) {
+		histogram_tally(h, i);
+	}
+	CU_ASSERT(h->bucket[0][1] == 1);
+	CU_ASSERT(h->bucket[1][0] == 1);
+	CU_ASSERT(h->bucket[2][0] == 2);
+	CU_ASSERT(histogram_count(h) == 100);
+	CU_ASSERT(histogram_percentile(h, 0.0) == 1);
+	CU_ASSERT(histogram_percentile(h, 50.0) == 50);
+	CU_ASSERT(histogram_percentile(h, 99.0) == 99);
+	CU_ASSERT(histogram_percentile(h, 100.0) == 101);
+
+	histogram_tally(h2, UINT64_MAX);
+	histogram_merge(h, h2);
+	CU_ASSERT(histogram_count(h) == 101);
+	CU_ASSERT(histogram_percentile(h, 50.0) == 51);
+	CU_ASSERT(histogram_percentile(h, 100.0) == UINT64_MAX);
+
+	histogram_reset(h);
+	CU_ASSERT(histogram_count(h) == 0);
+
+	free(h);
+	free(h2);
+}
+
+static void
+ut_post_completion(struct nvme_qpair *qpair, struct nvme_request *req, uint16_t sc)
+{
+	struct nvme_completion	*cpl = &qpair->cpl[qpair->cq_head];
+
+	memset(cpl, 0, sizeof(*cpl));
+	cpl->cid = req->cmd.cid;
+	cpl->status.sc = sc;
+	cpl->status.p = qpair->phase;
+}
+
+static void
+test_nvme_qpair_latency_histogram(void)
+{
+	struct nvme_qpair	qpair = {};
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	struct nvme_request	*req;
+	struct histogram	*hist;
+	uint64_t		submit_tsc;
+	int			num_cpls = 0;
+
+	hist = calloc(1, sizeof(*hist));
+	CU_ASSERT_FATAL(hist != NULL);
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+
+	/* Untracked qpairs neither stamp requests nor record latencies. */
+	req = nvme_allocate_request(NULL, 0, ut_count_callback, &num_cpls);
+	CU_ASSERT_FATAL(req != NULL);
+	req->cmd.opc = NVME_OPC_READ;
+	nvme_qpair_submit_request(&qpair, req);
+	CU_ASSERT(req->submit_tsc == 0);
+	ut_post_completion(&qpair, req, NVME_SC_SUCCESS);
+	CU_ASSERT(nvme_qpair_process_completions(&qpair, 0) == 1);
+	nvme_qpair_merge_latency_histogram(&qpair, NVME_OPC_READ, hist);
+	CU_ASSERT(histogram_count(hist) == 0);
+
+	CU_ASSERT(nvme_qpair_init_latency_tracking(&qpair) == 0);
+
+	req = nvme_allocate_request(NULL, 0, ut_count_callback, &num_cpls);
+	CU_ASSERT_FATAL(req != NULL);
+	req->cmd.opc = NVME_OPC_READ;
+	nvme_qpair_submit_request(&qpair, req);
+	submit_tsc = req->submit_tsc;
+	CU_ASSERT(submit_tsc != 0);
+
+	/* A retry keeps the original stamp and records nothing yet. */
+	ut_post_completion(&qpair, req, NVME_SC_ABORTED_BY_REQUEST);
+	CU_ASSERT(nvme_qpair_process_completions(&qpair, 0) == 1);
+	CU_ASSERT(req->submit_tsc == submit_tsc);
+	CU_ASSERT(qpair.latency_hist[NVME_OPC_READ] == NULL);
+
+	ut_post_completion(&qpair, req, NVME_SC_SUCCESS);
+	CU_ASSERT(nvme_qpair_process_completions(&qpair, 0) == 1);
+	CU_ASSERT(num_cpls == 2);
+
+	nvme_qpair_merge_latency_histogram(&qpair, NVME_OPC_READ, hist);
+	CU_ASSERT(histogram_count(hist) == 1);
+	nvme_qpair_merge_latency_histogram(&qpair, NVME_OPC_READ, hist);
+	CU_ASSERT(histogram_count(hist) == 2);
+
+	histogram_reset(hist);
+	nvme_qpair_merge_latency_histogram(&qpair, NVME_OPC_WRITE, hist);
+	CU_ASSERT(histogram_count(hist) == 0);
+
+	cleanup_submit_request_test(&qpair);
+	free(hist);
+}
+
+static void
+test_nvme_qpair_delayed_retry(void)
+{
+	struct nvme_qpair	qpair = {};
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	struct nvme_request	*req1, *req2;
+	int32_t			retry_count = nvme_retry_count;
+	int			num_cpls = 0;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+	ctrlr.opts.retry_backoff_us[NVME_RETRY_CLASS_NAMESPACE_NOT_READY] = 100 * 1000;
+	nvme_retry_count = 4;
+
+	req1 = nvme_allocate_request(NULL, 0, ut_count_callback, &num_cpls);
+	CU_ASSERT_FATAL(req1 != NULL);
+	nvme_qpair_submit_request(&qpair, req1);
+
+	/* Namespace not ready parks the request and frees its tracker. */
+	ut_post_completion(&qpair, req1, NVME_SC_NAMESPACE_NOT_READY);
+	CU_ASSERT(nvme_qpair_process_completions(&qpair, 0) == 1);
+	CU_ASSERT(num_cpls == 0);
+	CU_ASSERT(req1->retries == 1);
+	CU_ASSERT(qpair.num_delayed_reqs == 1);
+	CU_ASSERT(qpair.num_free_tr == qpair.num_trackers);
+	CU_ASSERT(req1->retry_due_us > nvme_get_time_us());
+
+	/* Not resubmitted before it is due. */
+	CU_ASSERT(nvme_qpair_process_completions(&qpair, 0) == 0);
+	CU_ASSERT(qpair.num_delayed_reqs == 1);
+	CU_ASSERT(qpair.num_free_tr == qpair.num_trackers);
+
+	req1->retry_due_us = 0;
+	CU_ASSERT(nvme_qpair_process_completions(&qpair, 0) == 0);
+	CU_ASSERT(qpair.num_delayed_reqs == 0);
+	CU_ASSERT(qpair.num_free_tr == qpair.num_trackers - 1);
+
+	/* The backoff doubles for the second retry, so req2 goes ahead of req1. */
+	ut_post_completion(&qpair, req1, NVME_SC_NAMESPACE_NOT_READY);
+	CU_ASSERT(nvme_qpair_process_completions(&qpair, 0) == 1);
+	CU_ASSERT(req1->retry_due_us > nvme_get_time_us() + 100 * 1000);
+
+	req2 = nvme_allocate_request(NULL, 0, ut_count_callback, &num_cpls);
+	CU_ASSERT_FATAL(req2 != NULL);
+	nvme_qpair_submit_request(&qpair, req2);
+	ut_post_completion(&qpair, req2, NVME_SC_NAMESPACE_NOT_READY);
+	CU_ASSERT(nvme_qpair_process_completions(&qpair, 0) == 1);
+	CU_ASSERT(qpair.num_delayed_reqs == 2);
+	CU_ASSERT(STAILQ_FIRST(&qpair.delayed_req) == req2);
+	CU_ASSERT(STAILQ_NEXT(req2, stailq) == req1);
+
+	/* Aborted commands keep the default of an immediate retry on the same tracker. */
+	req2->retry_due_us = 0;
+	CU_ASSERT(nvme_qpair_process_completions(&qpair, 0) == 0);
+	ut_post_completion(&qpair, req2, NVME_SC_ABORTED_BY_REQUEST);
+	CU_ASSERT(nvme_qpair_process_completions(&qpair, 0) == 1);
+	CU_ASSERT(qpair.num_delayed_reqs == 1);
+	CU_ASSERT(qpair.num_free_tr == qpair.num_trackers - 1);
+
+	/* Failing the qpair completes parked requests too. */
+	nvme_qpair_fail(&qpair);
+	CU_ASSERT(num_cpls == 2);
+	CU_ASSERT(qpair.num_delayed_reqs == 0);
+	CU_ASSERT(STAILQ_EMPTY(&qpair.delayed_req));
+
+	nvme_retry_count = retry_count;
+	cleanup_submit_request_test(&qpair);
+}
+
+struct ut_fused_result {
+	struct nvme_completion	cpl;
+	int			num_cpls;
+};
+
+static void
+ut_save_cpl(void *arg, const struct nvme_completion *cpl)
+{
+	struct ut_fused_result *result = arg;
+
+	result->cpl = *cpl;
+	result->num_cpls++;
+}
+
+/* Build a fused compare and write pair, as nvme_ns_cmd_compare_and_write() does. */
+static struct nvme_request *
+ut_build_fused(struct ut_fused_result *result)
+{
+	struct nvme_request	*parent, *child;
+	int			i;
+
+	parent = nvme_allocate_request(NULL, 0, ut_save_cpl, result);
+	CU_ASSERT_FATAL(parent != NULL);
+	STAILQ_INIT(&parent->children);
+	memset(&parent->parent_status, 0, sizeof(parent->parent_status));
+	for (i = 0; i < 2; i++) {
+		child = nvme_allocate_request(NULL, 0, ut_complete_child, NULL);
+		CU_ASSERT_FATAL(child != NULL);
+		child->cb_arg = child;
+		child->parent = parent;
+		child->cmd.opc = i == 0 ? NVME_OPC_COMPARE : NVME_OPC_WRITE;
+		child->cmd.fuse = i == 0 ? NVME_FUSE_FIRST : NVME_FUSE_SECOND;
+		parent->num_children++;
+		STAILQ_INSERT_TAIL(&parent->children, child, child_stailq);
+	}
+
+	return parent;
+}
+
+static void
+test_nvme_qpair_fused(void)
+{
+	struct nvme_qpair	qpair = {};
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	struct nvme_request	*req[32], *parent, *cmp, *write, *other;
+	struct ut_fused_result	result = {};
+	int			num_cpls = 0;
+	int			i;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+
+	/* Leave a single tracker free. */
+	for (i = 0; i < 31; i++) {
+		req[i] = nvme_allocate_request(NULL, 0, ut_count_callback, &num_cpls);
+		CU_ASSERT_FATAL(req[i] != NULL);
+		nvme_qpair_submit_request(&qpair, req[i]);
+	}
+	CU_ASSERT(qpair.num_free_tr == 1);
+
+	/* The pair waits as a unit, and later requests wait behind it. */
+	parent = ut_build_fused(&result);
+	cmp = STAILQ_FIRST(&parent->children);
+	write = STAILQ_NEXT(cmp, child_stailq);
+	nvme_qpair_submit_request(&qpair, parent);
+	CU_ASSERT(STAILQ_FIRST(&qpair.queued_req) == parent);
+	CU_ASSERT(qpair.sq_tail == 31);
+
+	other = nvme_allocate_request(NULL, 0, ut_count_callback, &num_cpls);
+	CU_ASSERT_FATAL(other != NULL);
+	nvme_qpair_submit_request(&qpair, other);
+	CU_ASSERT(STAILQ_NEXT(parent, stailq) == other);
+	CU_ASSERT(qpair.num_free_tr == 1);
+	CU_ASSERT(qpair.sq_tail == 31);
+
+	/* A second free tracker lets both commands go into adjacent slots. */
+	ut_post_completion(&qpair, req[0], NVME_SC_SUCCESS);
+	CU_ASSERT(nvme_qpair_process_completions(&qpair, 0) == 1);
+	CU_ASSERT(qpair.sq_tail == 33);
+	CU_ASSERT(qpair.cmd[31].opc == NVME_OPC_COMPARE);
+	CU_ASSERT(qpair.cmd[31].fuse == NVME_FUSE_FIRST);
+	CU_ASSERT(qpair.cmd[32].opc == NVME_OPC_WRITE);
+	CU_ASSERT(qpair.cmd[32].fuse == NVME_FUSE_SECOND);
+	CU_ASSERT(STAILQ_FIRST(&qpair.queued_req) == other);
+
+	ut_post_completion(&qpair, req[1], NVME_SC_SUCCESS);
+	CU_ASSERT(nvme_qpair_process_completions(&qpair, 0) == 1);
+	CU_ASSERT(STAILQ_EMPTY(&qpair.queued_req));
+	CU_ASSERT(qpair.sq_tail == 34);
+
+	/*
+	 * A miscompare aborts the write.  Neither is retried, and the caller
+	 *  sees the miscompare once.
+	 */
+	ut_post_completion(&qpair, write, NVME_SC_ABORTED_FAILED_FUSED);
+	CU_ASSERT(nvme_qpair_process_completions(&qpair, 0) == 1);
+	CU_ASSERT(result.num_cpls == 0);
+	ut_post_completion(&qpair, cmp, NVME_SC_COMPARE_FAILURE);
+	qpair.cpl[qpair.cq_head].status.sct = NVME_SCT_MEDIA_ERROR;
+	CU_ASSERT(nvme_qpair_process_completions(&qpair, 0) == 1);
+	CU_ASSERT(result.num_cpls == 1);
+	CU_ASSERT(result.cpl.status.sct == NVME_SCT_MEDIA_ERROR);
+	CU_ASSERT(result.cpl.status.sc == NVME_SC_COMPARE_FAILURE);
+	CU_ASSERT(qpair.sq_tail == 34);
+
+	/*
+	 * If the write's buffer cannot be translated, the compare is not
+	 *  submitted alone either.  The pair fails once, and gives back both
+	 *  trackers.
+	 */
+	memset(&result, 0, sizeof(result));
+	parent = ut_build_fused(&result);
+	write = STAILQ_NEXT(STAILQ_FIRST(&parent->children), child_stailq);
+	write->u.payload = outbuf;
+	write->payload_size = 512;
+	fail_vtophys = true;
+	nvme_qpair_submit_request(&qpair, parent);
+	fail_vtophys = false;
+	CU_ASSERT(result.num_cpls == 1);
+	CU_ASSERT(result.cpl.status.sc == NVME_SC_INVALID_FIELD);
+	CU_ASSERT(qpair.sq_tail == 34);
+	CU_ASSERT(qpair.num_free_tr == 2);
+
+	/* Failing the qpair completes a waiting pair once. */
+	memset(&result, 0, sizeof(result));
+	CU_ASSERT(qpair.num_free_tr == 2);
+	req[0] = nvme_allocate_request(NULL, 0, ut_count_callback, &num_cpls);
+	CU_ASSERT_FATAL(req[0] != NULL);
+	nvme_qpair_submit_request(&qpair, req[0]);
+	CU_ASSERT(qpair.num_free_tr == 1);
+	parent = ut_build_fused(&result);
+	nvme_qpair_submit_request(&qpair, parent);
+	CU_ASSERT(STAILQ_FIRST(&qpair.queued_req) == parent);
+
+	nvme_qpair_fail(&qpair);
+	CU_ASSERT(result.num_cpls == 1);
+	CU_ASSERT(result.cpl.status.sc == NVME_SC_ABORTED_BY_REQUEST);
+	CU_ASSERT(num_cpls == 33);
+
+	cleanup_submit_request_test(&qpair);
+}
+
+static void
+test_nvme_qpair_trace(void)
+{
+	struct nvme_qpair	qpair = {};
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	struct nvme_request	*req[33];
+	struct nvme_trace_ring	*ring;
+	struct nvme_trace_entry	*entry;
+	char			shm_name[64];
+	int			num_cpls = 0;
+	uint32_t		i;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+
+	snprintf(shm_name, sizeof(shm_name), "/nvme_qpair_ut.%d", (int)getpid());
+	CU_ASSERT_FATAL(nvme_trace_enable(shm_name, 1, 64) == 0);
+	ring = nvme_trace_get_ring(g_nvme_trace, 0);
+
+	/* One more request than there are trackers, so the last one is queued. */
+	for (i = 0; i < 33; i++) {
+		req[i] = nvme_allocate_request(NULL, 0, ut_count_callback, &num_cpls);
+		CU_ASSERT_FATAL(req[i] != NULL);
+		req[i]->cmd.opc = NVME_OPC_WRITE;
+		nvme_qpair_submit_request(&qpair, req[i]);
+	}
+	CU_ASSERT(ring->head == 33);
+	CU_ASSERT(ring->entries[0].type == NVME_TRACE_SUBMIT);
+	CU_ASSERT(ring->entries[0].cid == req[0]->cmd.cid);
+	CU_ASSERT(ring->entries[32].type == NVME_TRACE_QUEUE);
+	CU_ASSERT(ring->entries[32].cid == 0xFFFF);
+
+	/* A retry is followed by resubmission on the same cid. */
+	ut_post_completion(&qpair, req[0], NVME_SC_ABORTED_BY_REQUEST);
+	CU_ASSERT(nvme_qpair_process_completions(&qpair, 0) == 1);
+	CU_ASSERT(ring->head == 35);
+	entry = &ring->entries[33];
+	CU_ASSERT(entry->type == NVME_TRACE_RETRY);
+	CU_ASSERT(entry->status == NVME_SC_ABORTED_BY_REQUEST);
+	CU_ASSERT(ring->entries[34].type == NVME_TRACE_SUBMIT);
+	CU_ASSERT(ring->entries[34].cid == entry->cid);
+
+	/* Completion frees a tracker for the queued request. */
+	ut_post_completion(&qpair, req[0], NVME_SC_SUCCESS);
+	CU_ASSERT(nvme_qpair_process_completions(&qpair, 0) == 1);
+	CU_ASSERT(ring->head == 37);
+	CU_ASSERT(ring->entries[35].type == NVME_TRACE_COMPLETE);
+	CU_ASSERT(ring->entries[35].status == 0);
+	CU_ASSERT(ring->entries[36].type == NVME_TRACE_SUBMIT);
+	CU_ASSERT(ring->entries[36].cid == req[32]->cmd.cid);
+
+	nvme_trace_disable();
+	shm_unlink(shm_name);
+
+	nvme_qpair_fail(&qpair);
+	CU_ASSERT(num_cpls == 33);
+
+	cleanup_submit_request_test(&qpair);
+}
+
 static void test_nvme_qpair_destroy(void)
 {
 	struct nvme_qpair	qpair = {};
 	struct nvme_controller	ctrlr = {};
 	struct nvme_registers	regs = {};
-	struct nvme_tracker	*tr_temp;
-	uint64_t		phys_addr = 0;
+	struct nvme_request	*req;
 
 	memset(&ctrlr, 0, sizeof(ctrlr));
 	ctrlr.regs = &regs;
 
-	nvme_qpair_construct(&qpair, 1, 128, 32, &ctrlr);
+	nvme_qpair_construct(&qpair, 1, 128, 32, &ctrlr, NULL);
+	CU_ASSERT(qpair.num_free_tr == 32);
 	nvme_qpair_destroy(&qpair);
-	CU_ASSERT(LIST_EMPTY(&qpair.free_tr));
 
 
-	nvme_qpair_construct(&qpair, 0, 128, 32, &ctrlr);
-	tr_temp = nvme_malloc("nvme_tracker", sizeof(struct nvme_tracker),
-			      64, &phys_addr);
-	tr_temp->req = nvme_allocate_request(NULL, 0, expected_failure_callback, NULL);
-	CU_ASSERT_FATAL(tr_temp->req != NULL);
+	nvme_qpair_construct(&qpair, 0, 128, 32, &ctrlr, NULL);
+	req = nvme_allocate_request(NULL, 0, expected_failure_callback, NULL);
+	CU_ASSERT_FATAL(req != NULL);
 
-	tr_temp->req->cmd.opc = NVME_OPC_ASYNC_EVENT_REQUEST;
-	LIST_INSERT_HEAD(&qpair.outstanding_tr, tr_temp, list);
+	req->cmd.opc = NVME_OPC_ASYNC_EVENT_REQUEST;
+	ut_take_tracker(&qpair, req);
 
+	/* Destroying the admin queue completes the outstanding AER. */
 	nvme_qpair_destroy(&qpair);
-	CU_ASSERT(LIST_EMPTY(&qpair.outstanding_tr));
-	CU_ASSERT(LIST_EMPTY(&qpair.free_tr));
+	CU_ASSERT(qpair.num_free_tr == qpair.num_trackers);
+}
+
+static void test_nvme_qpair_tracker_reuse(void)
+{
+	struct nvme_qpair	qpair = {};
+	struct nvme_controller	ctrlr = {};
+	struct nvme_registers	regs = {};
+	uint16_t		i;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+
+	/* Trackers are handed out from a LIFO stack, lowest cid first. */
+	CU_ASSERT(qpair.num_free_tr == 32);
+	for (i = 0; i < 32; i++) {
+		CU_ASSERT(qpair.tr[i].cid == i);
+		CU_ASSERT(qpair.tr[i].req == NULL);
+		CU_ASSERT(qpair.tr[i].prp == &qpair.prp_list[i * NVME_MAX_PRP_LIST_ENTRIES]);
+	}
+
+	ut_insert_cq_entry(&qpair, 0);
+	ut_insert_cq_entry(&qpair, 1);
+	CU_ASSERT(qpair.cpl[0].cid == 0);
+	CU_ASSERT(qpair.cpl[1].cid == 1);
+	CU_ASSERT(qpair.num_free_tr == 30);
+
+	/* The most recently completed tracker is the first one reused. */
+	nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(qpair.num_free_tr == 32);
+	CU_ASSERT(qpair.tr[0].req == NULL);
+	CU_ASSERT(qpair.tr[1].req == NULL);
+	CU_ASSERT(qpair.free_cid[qpair.num_free_tr - 1] == 1);
+
+	cleanup_submit_request_test(&qpair);
 }
 
 static void test_nvme_completion_is_retry(void)
@@ -504,13 +1850,35 @@ int main(int argc, char **argv)
 		|| CU_add_test(suite, "test2", test2) == NULL
 		|| CU_add_test(suite, "test3", test3) == NULL
 		|| CU_add_test(suite, "test4", test4) == NULL
+		|| CU_add_test(suite, "nvme_qpair_plug", test_nvme_qpair_plug) == NULL
+		|| CU_add_test(suite, "nvme_qpair_shadow_doorbell", test_nvme_qpair_shadow_doorbell) == NULL
 		|| CU_add_test(suite, "ctrlr_failed", test_ctrlr_failed) == NULL
+		|| CU_add_test(suite, "ctrlr_failed_split", test_ctrlr_failed_split) == NULL
 		|| CU_add_test(suite, "struct_packing", struct_packing) == NULL
 		|| CU_add_test(suite, "nvme_qpair_fail", test_nvme_qpair_fail) == NULL
 		|| CU_add_test(suite, "nvme_qpair_process_completions", test_nvme_qpair_process_completions) == NULL
 		|| CU_add_test(suite, "nvme_qpair_process_completions_limit",
 			       test_nvme_qpair_process_completions_limit) == NULL
+		|| CU_add_test(suite, "nvme_qpair_process_completions_doorbell",
+			       test_nvme_qpair_process_completions_doorbell) == NULL
+		|| CU_add_test(suite, "nvme_qpair_batch_callback", test_nvme_qpair_batch_callback) == NULL
+		|| CU_add_test(suite, "nvme_qpair_shared_cq", test_nvme_qpair_shared_cq) == NULL
+		|| CU_add_test(suite, "nvme_qpair_poll", test_nvme_qpair_poll) == NULL
+		|| CU_add_test(suite, "nvme_qpair_poll_window", test_nvme_qpair_poll_window) == NULL
+		|| CU_add_test(suite, "nvme_qpair_interrupt", test_nvme_qpair_interrupt) == NULL
+		|| CU_add_test(suite, "nvme_mpsc_ring", test_nvme_mpsc_ring) == NULL
+		|| CU_add_test(suite, "nvme_qpair_proxy", test_nvme_qpair_proxy) == NULL
+		|| CU_add_test(suite, "nvme_qpair_proxy_threads", test_nvme_qpair_proxy_threads) == NULL
+		|| CU_add_test(suite, "nvme_qpair_timeout", test_nvme_qpair_timeout) == NULL
+		|| CU_add_test(suite, "nvme_qpair_stats", test_nvme_qpair_stats) == NULL
+		|| CU_add_test(suite, "histogram", test_histogram) == NULL
+		|| CU_add_test(suite, "nvme_qpair_latency_histogram",
+			       test_nvme_qpair_latency_histogram) == NULL
+		|| CU_add_test(suite, "nvme_qpair_delayed_retry", test_nvme_qpair_delayed_retry) == NULL
+		|| CU_add_test(suite, "nvme_qpair_fused", test_nvme_qpair_fused) == NULL
+		|| CU_add_test(suite, "nvme_qpair_trace", test_nvme_qpair_trace) == NULL
 		|| CU_add_test(suite, "nvme_qpair_destroy", test_nvme_qpair_destroy) == NULL
+		|| CU_add_test(suite, "nvme_qpair_tracker_reuse", test_nvme_qpair_tracker_reuse) == NULL
 		|| CU_add_test(suite, "nvme_completion_is_retry", test_nvme_completion_is_retry) == NULL
 		|| CU_add_test(suite, "get_status_string", test_get_status_string) == NULL
 	) {
@@ -0,0 +1,237 @@
+
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright(c) 2010-2015 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "CUnit/Basic.h"
+
+#include "nvme/nvme_trace.c"
+
+static char g_shm_name[64];
+
+struct ut_trace_io {
+	struct nvme_controller	ctrlr;
+	struct nvme_qpair	qpair;
+	struct nvme_request	req;
+};
+
+static void
+ut_trace_io_init(struct ut_trace_io *io, uint16_t qid)
+{
+	memset(io, 0, sizeof(*io));
+	io->ctrlr.trace_id = 3;
+	io->qpair.ctrlr = &io->ctrlr;
+	io->qpair.id = qid;
+	io->req.cmd.opc = NVME_OPC_READ;
+	io->req.cmd.cdw10 = 0x1000;
+	io->req.cmd.cdw11 = 0x2;
+	io->req.cmd.cdw12 = 7;
+}
+
+static struct nvme_trace_header *
+ut_map_trace(void)
+{
+	struct nvme_trace_header	*trace;
+	struct stat			st;
+	int				fd;
+
+	fd = shm_open(g_shm_name, O_RDONLY, 0);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return NULL;
+	}
+	trace = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (trace == MAP_FAILED) {
+		return NULL;
+	}
+	CU_ASSERT((size_t)st.st_size == nvme_trace_size(trace->num_rings, trace->num_entries));
+	return trace;
+}
+
+static void
+test_nvme_trace_enable(void)
+{
+	struct nvme_trace_header	*trace;
+
+	CU_ASSERT(nvme_trace_enable(NULL, 1, 16) == EINVAL);
+	CU_ASSERT(nvme_trace_enable(g_shm_name, 0, 16) == EINVAL);
+	CU_ASSERT(nvme_trace_enable(g_shm_name, 1, 0) == EINVAL);
+	CU_ASSERT(g_nvme_trace == NULL);
+
+	/* Ring sizes are rounded up to a power of two. */
+	CU_ASSERT(nvme_trace_enable(g_shm_name, 2, 5) == 0);
+	CU_ASSERT_FATAL(g_nvme_trace != NULL);
+	CU_ASSERT(g_nvme_trace->magic == NVME_TRACE_MAGIC);
+	CU_ASSERT(g_nvme_trace->version == NVME_TRACE_VERSION);
+	CU_ASSERT(g_nvme_trace->num_rings == 2);
+	CU_ASSERT(g_nvme_trace->num_entries == 8);
+	CU_ASSERT(g_nvme_trace->num_rings_used == 0);
+	CU_ASSERT(g_nvme_trace->tsc_hz == nvme_get_tsc_hz());
+
+	CU_ASSERT(nvme_trace_enable(g_shm_name, 2, 5) == EBUSY);
+
+	/* The shared memory object outlives tracing. */
+	nvme_trace_disable();
+	CU_ASSERT(g_nvme_trace == NULL);
+	trace = ut_map_trace();
+	CU_ASSERT_FATAL(trace != NULL);
+	CU_ASSERT(trace->magic == NVME_TRACE_MAGIC);
+	CU_ASSERT(trace->num_entries == 8);
+	munmap(trace, nvme_trace_size(trace->num_rings, trace->num_entries));
+
+	nvme_trace_disable();
+	shm_unlink(g_shm_name);
+}
+
+static void *
+ut_trace_thread(void *arg)
+{
+	struct ut_trace_io *io = arg;
+
+	nvme_trace_record(&io->qpair, &io->req, NVME_TRACE_SUBMIT, 1, 0);
+	return NULL;
+}
+
+static void
+test_nvme_trace_record(void)
+{
+	struct ut_trace_io		io;
+	struct nvme_trace_header	*trace;
+	struct nvme_trace_ring		*ring;
+	struct nvme_trace_entry		*entry;
+	pthread_t			thread;
+	uint16_t			i;
+
+	ut_trace_io_init(&io, 1);
+
+	/* Nothing is recorded while tracing is off. */
+	nvme_trace_record(&io.qpair, &io.req, NVME_TRACE_SUBMIT, 5, 0);
+
+	CU_ASSERT_FATAL(nvme_trace_enable(g_shm_name, 2, 4) == 0);
+	trace = ut_map_trace();
+	CU_ASSERT_FATAL(trace != NULL);
+
+	nvme_trace_record(&io.qpair, &io.req, NVME_TRACE_SUBMIT, 5, 0);
+	CU_ASSERT(trace->num_rings_used == 1);
+	ring = nvme_trace_get_ring(trace, 0);
+	CU_ASSERT(ring->head == 1);
+	CU_ASSERT(ring->thread_id == (uint32_t)syscall(SYS_gettid));
+	entry = &ring->entries[0];
+	CU_ASSERT(entry->tsc != 0);
+	CU_ASSERT(entry->type == NVME_TRACE_SUBMIT);
+	CU_ASSERT(entry->ctrlr_id == 3);
+	CU_ASSERT(entry->qid == 1);
+	CU_ASSERT(entry->cid == 5);
+	CU_ASSERT(entry->opc == NVME_OPC_READ);
+	CU_ASSERT(entry->lba == 0x200001000ULL);
+	CU_ASSERT(entry->num_blocks == 8);
+
+	/* The ring overwrites its oldest events. */
+	for (i = 1; i < 6; i++) {
+		nvme_trace_record(&io.qpair, &io.req, NVME_TRACE_COMPLETE, 5 + i, i);
+	}
+	CU_ASSERT(ring->head == 6);
+	CU_ASSERT(ring->entries[0].cid == 9);
+	CU_ASSERT(ring->entries[1].cid == 10);
+	CU_ASSERT(ring->entries[2].cid == 7);
+	CU_ASSERT(ring->entries[1].status == 5);
+
+	/* Admin and non-LBA commands carry no LBA range. */
+	ut_trace_io_init(&io, 0);
+	nvme_trace_record(&io.qpair, &io.req, NVME_TRACE_SUBMIT, 1, 0);
+	CU_ASSERT(ring->entries[2].qid == 0);
+	CU_ASSERT(ring->entries[2].lba == 0);
+	CU_ASSERT(ring->entries[2].num_blocks == 0);
+	ut_trace_io_init(&io, 1);
+	io.req.cmd.opc = NVME_OPC_FLUSH;
+	nvme_trace_record(&io.qpair, &io.req, NVME_TRACE_SUBMIT, 1, 0);
+	CU_ASSERT(ring->entries[3].num_blocks == 0);
+
+	/* Each thread claims its own ring; threads beyond the last ring are dropped. */
+	CU_ASSERT(pthread_create(&thread, NULL, ut_trace_thread, &io) == 0);
+	pthread_join(thread, NULL);
+	CU_ASSERT(trace->num_rings_used == 2);
+	CU_ASSERT(nvme_trace_get_ring(trace, 1)->head == 1);
+	CU_ASSERT(pthread_create(&thread, NULL, ut_trace_thread, &io) == 0);
+	pthread_join(thread, NULL);
+	CU_ASSERT(trace->num_rings_used == 3);
+	CU_ASSERT(ring->head == 8);
+	CU_ASSERT(nvme_trace_get_ring(trace, 1)->head == 1);
+
+	munmap(trace, nvme_trace_size(trace->num_rings, trace->num_entries));
+	nvme_trace_disable();
+
+	/* Rings claimed before are not reused once tracing is enabled again. */
+	CU_ASSERT_FATAL(nvme_trace_enable(g_shm_name, 1, 4) == 0);
+	nvme_trace_record(&io.qpair, &io.req, NVME_TRACE_SUBMIT, 1, 0);
+	CU_ASSERT(g_nvme_trace->num_rings_used == 1);
+	CU_ASSERT(nvme_trace_get_ring(g_nvme_trace, 0)->head == 1);
+	nvme_trace_disable();
+
+	shm_unlink(g_shm_name);
+}
+
+int main(int argc, char **argv)
+{
+	CU_pSuite	suite = NULL;
+	unsigned int	num_failures;
+
+	snprintf(g_shm_name, sizeof(g_shm_name), "/nvme_trace_ut.%d", (int)getpid());
+
+	if (CU_initialize_registry() != CUE_SUCCESS) {
+		return CU_get_error();
+	}
+
+	suite = CU_add_suite("nvme_trace", NULL, NULL);
+	if (suite == NULL) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	if (
+		CU_add_test(suite, "test nvme_trace enable/disable", test_nvme_trace_enable) == NULL
+		|| CU_add_test(suite, "test nvme_trace record", test_nvme_trace_record) == NULL
+	) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	num_failures = CU_get_number_of_failures();
+	CU_cleanup_registry();
+	return num_failures;
+}
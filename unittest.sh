@@ -8,4 +8,6 @@ test/lib/nvme/unit/nvme_c/nvme_ut
 test/lib/nvme/unit/nvme_ctrlr_c/nvme_ctrlr_ut
 test/lib/nvme/unit/nvme_ctrlr_cmd_c/nvme_ctrlr_cmd_ut
 test/lib/nvme/unit/nvme_ns_cmd_c/nvme_ns_cmd_ut
+test/lib/nvme/unit/nvme_ns_dealloc_c/nvme_ns_dealloc_ut
 test/lib/nvme/unit/nvme_qpair_c/nvme_qpair_ut
+test/lib/nvme/unit/nvme_trace_c/nvme_trace_ut